@@ -0,0 +1,146 @@
+/* #########################################################################
+        Stereo Calibration -- loads stereo rig intrinsics/extrinsics and
+            builds the undistort/rectify maps for them, once.
+
+        The file format is what OpenCV's stereo_calib sample writes
+        (intrinsics.yml + extrinsics.yml merged into one file works too):
+            M1, D1, M2, D2: camera matrices and distortion per camera
+            R, T: right camera pose relative to the left
+        Intrinsics get scaled if frames come in at a different size
+        than the calibration was done at.
+
+   ######################################################################### */
+
+#include "camera_calibration.h"
+
+using namespace std;
+using namespace xen_rift;
+using namespace cv;
+
+Stereo_Calibration::Stereo_Calibration() :
+    _calibrated(false),
+    _calib_size(640, 480),
+    _rect_size(0, 0)
+{
+    set_defaults();
+}
+
+void Stereo_Calibration::set_defaults(double focal_px, double baseline_m){
+    _calibrated = false;
+    _default_focal_px = focal_px;
+    _baseline_m = baseline_m;
+    _rect_size = Size(0, 0);
+}
+
+bool Stereo_Calibration::load(const string& filename){
+    FileStorage fs(filename, FileStorage::READ);
+    if (!fs.isOpened()){
+        printf("Stereo_Calibration: couldn't open %s, running uncalibrated.\n", filename.c_str());
+        return false;
+    }
+    Mat M1, D1, M2, D2, R, T;
+    fs["M1"] >> M1;
+    fs["D1"] >> D1;
+    fs["M2"] >> M2;
+    fs["D2"] >> D2;
+    fs["R"] >> R;
+    fs["T"] >> T;
+    if (M1.empty() || M2.empty() || R.empty() || T.empty()){
+        printf("Stereo_Calibration: %s is missing M1/M2/R/T, running uncalibrated.\n", filename.c_str());
+        return false;
+    }
+    if (D1.empty())
+        D1 = Mat::zeros(1, 5, CV_64FC1);
+    if (D2.empty())
+        D2 = Mat::zeros(1, 5, CV_64FC1);
+    if (!fs["image_width"].empty() && !fs["image_height"].empty())
+        _calib_size = Size((int) fs["image_width"], (int) fs["image_height"]);
+
+    M1.convertTo(_M[0], CV_64F);
+    M2.convertTo(_M[1], CV_64F);
+    D1.convertTo(_D[0], CV_64F);
+    D2.convertTo(_D[1], CV_64F);
+    R.convertTo(_R, CV_64F);
+    T.convertTo(_T, CV_64F);
+    _baseline_m = sqrt(_T.dot(_T));
+    _calibrated = true;
+    _rect_size = Size(0, 0);
+    printf("Stereo_Calibration: loaded %s (baseline %0.3f)\n", filename.c_str(), _baseline_m);
+    return true;
+}
+
+void Stereo_Calibration::build_rectification(Size size){
+    if (size == _rect_size)
+        return;
+    _rect_size = size;
+    if (!_calibrated)
+        return;
+
+    // bring the intrinsics to this image size
+    double sx = ((double)size.width) / _calib_size.width;
+    double sy = ((double)size.height) / _calib_size.height;
+    Mat M[2];
+    for (int i = 0; i < 2; i++){
+        M[i] = _M[i].clone();
+        M[i].at<double>(0, 0) *= sx;
+        M[i].at<double>(0, 2) *= sx;
+        M[i].at<double>(1, 1) *= sy;
+        M[i].at<double>(1, 2) *= sy;
+    }
+    Mat Q;
+    stereoRectify(M[0], _D[0], M[1], _D[1], size, _R, _T,
+        _R_rect[0], _R_rect[1], _P_rect[0], _P_rect[1], Q);
+    // fixed-point maps: the fastest form for cv::remap
+    for (int i = 0; i < 2; i++)
+        initUndistortRectifyMap(M[i], _D[i], _R_rect[i], _P_rect[i], size,
+            CV_16SC2, _map1[i], _map2[i]);
+}
+
+void Stereo_Calibration::rectify(int cam, const Mat& in, Mat& out){
+    build_rectification(in.size());
+    if (!_calibrated){
+        out = in;
+        return;
+    }
+    remap(in, out, _map1[cam], _map2[cam], INTER_LINEAR);
+}
+
+void Stereo_Calibration::get_float_maps(int cam, Size size, Mat& map_x, Mat& map_y){
+    build_rectification(size);
+    if (!_calibrated){
+        // identity lookup
+        map_x.create(size, CV_32FC1);
+        map_y.create(size, CV_32FC1);
+        for (int y = 0; y < size.height; y++){
+            float * mx = map_x.ptr<float>(y);
+            float * my = map_y.ptr<float>(y);
+            for (int x = 0; x < size.width; x++){
+                mx[x] = (float) x;
+                my[x] = (float) y;
+            }
+        }
+        return;
+    }
+    convertMaps(_map1[cam], _map2[cam], map_x, map_y, CV_32FC1);
+}
+
+double Stereo_Calibration::focal_px(Size size){
+    build_rectification(size);
+    if (!_calibrated)
+        return _default_focal_px * size.width / 640.0;
+    return _P_rect[0].at<double>(0, 0);
+}
+
+double Stereo_Calibration::cx(Size size){
+    build_rectification(size);
+    if (!_calibrated)
+        return size.width * 0.5;
+    return _P_rect[0].at<double>(0, 2);
+}
+
+double Stereo_Calibration::cy(Size size){
+    build_rectification(size);
+    if (!_calibrated)
+        return size.height * 0.5;
+    return _P_rect[0].at<double>(1, 2);
+}
@@ -0,0 +1,76 @@
+/* #########################################################################
+        Stereo Calibration -- loads stereo rig intrinsics/extrinsics and
+            builds the undistort/rectify maps for them, once.
+
+        Header.
+
+   ######################################################################### */
+
+#ifndef __XEN_CAMERA_CALIBRATION_H
+#define __XEN_CAMERA_CALIBRATION_H
+
+// Base system stuff
+#include <stdio.h>
+#include <stdlib.h>
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <string>
+
+#include "opencv/cv.h"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/calib3d/calib3d.hpp"
+
+namespace xen_rift {
+
+    class Stereo_Calibration {
+        public:
+            Stereo_Calibration();
+
+            // Loads an OpenCV stereo_calib style yaml/xml (M1 D1 M2 D2
+            //  R T, plus optional image_width / image_height the
+            //  intrinsics were taken at). On failure, keeps uncalibrated
+            //  defaults and returns false.
+            bool load(const std::string& filename);
+            // Uncalibrated guess: pinhole, no distortion, cameras side
+            //  by side baseline_m apart. Rectification is a no-op.
+            void set_defaults(double focal_px = 600.0, double baseline_m = 0.065);
+
+            // Rectify an image from camera 0 (left) or 1 (right). Maps
+            //  are (re)built only when the image size changes.
+            void rectify(int cam, const cv::Mat& in, cv::Mat& out);
+            // float x/y lookup maps for cam at image size, for anyone who
+            //  wants to do the remap themselves (e.g. on the GPU)
+            void get_float_maps(int cam, cv::Size size, cv::Mat& map_x, cv::Mat& map_y);
+
+            bool is_calibrated() { return _calibrated; }
+            // rectified pinhole params at the given image size
+            double focal_px(cv::Size size);
+            double cx(cv::Size size);
+            double cy(cv::Size size);
+            double baseline_m() { return _baseline_m; }
+
+        protected:
+            // rectification at a given image size
+            void build_rectification(cv::Size size);
+
+            bool _calibrated;
+            cv::Size _calib_size;
+            cv::Mat _M[2];
+            cv::Mat _D[2];
+            cv::Mat _R;
+            cv::Mat _T;
+            double _baseline_m;
+            double _default_focal_px;
+
+            // cached per-size results
+            cv::Size _rect_size;
+            cv::Mat _R_rect[2];
+            cv::Mat _P_rect[2];
+            cv::Mat _map1[2];
+            cv::Mat _map2[2];
+
+        private:
+    };
+}
+
+#endif //__XEN_CAMERA_CALIBRATION_H
@@ -0,0 +1,226 @@
+/* #########################################################################
+        Camera Pool -- opens cameras on a thread of its own and keeps
+            the last few used ones open, so switching what an eye is
+            looking at never waits on a driver.
+
+        Opening a camera (or closing one) can take the driver hundreds
+        of ms, so all of it happens on the pool's thread and the
+        render side only ever swaps pointers. Warm cameras are open
+        but nobody grabs them; the first few frames after one is
+        picked back up may be stale ones the driver kept, and sources
+        with threads of their own (MJPEG decoding) keep them running.
+
+   ######################################################################### */
+
+#include "camera_pool.h"
+
+using namespace std;
+using namespace xen_rift;
+
+Camera_Pool::Camera_Pool(camera_opener_t opener, void * arg, int max_warm) :
+    _opener(opener),
+    _opener_arg(arg),
+    _max_warm(max_warm > 0 ? max_warm : 0),
+    _thread_running(false),
+    _stopping(false)
+{
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+    if (pthread_create(&_thread, NULL, &Camera_Pool::opener_main, this))
+        printf("Camera_Pool: couldn't start opener thread\n");
+    else
+        _thread_running = true;
+}
+
+Camera_Pool::~Camera_Pool(){
+    pthread_mutex_lock(&_mutex);
+    _stopping = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+    if (_thread_running)
+        pthread_join(_thread, NULL);
+    for (map<int, pool_camera_t>::iterator it = _cameras.begin(); it != _cameras.end(); it++)
+        delete it->second.source;
+    for (size_t i = 0; i < _close_queue.size(); i++)
+        delete _close_queue[i];
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+}
+
+Camera_Pool::pool_camera_t& Camera_Pool::camera(int cam_num){
+    map<int, pool_camera_t>::iterator it = _cameras.find(cam_num);
+    if (it != _cameras.end())
+        return it->second;
+    pool_camera_t& cam = _cameras[cam_num];
+    cam.state = CAMERA_CLOSED;
+    cam.source = NULL;
+    cam.last_used_ms = 0.0;
+    cam.seen = false;
+    cam.wanted = false;
+    return cam;
+}
+
+void Camera_Pool::queue_open(int cam_num, bool urgent){
+    pool_camera_t& cam = camera(cam_num);
+    if (cam.state == CAMERA_IN_USE)
+        return;
+    if (urgent)
+        cam.wanted = true;
+    if (cam.state != CAMERA_CLOSED && cam.state != CAMERA_FAILED)
+        return;
+    cam.state = CAMERA_OPENING;
+    if (urgent)
+        _open_queue.push_front(cam_num);
+    else
+        _open_queue.push_back(cam_num);
+    pthread_cond_signal(&_cond);
+}
+
+void Camera_Pool::request(int cam_num){
+    pthread_mutex_lock(&_mutex);
+    pool_camera_t& cam = camera(cam_num);
+    if (cam.state == CAMERA_OPENING){
+        cam.wanted = true;
+        // already queued behind an enumeration, maybe; jump it
+        for (deque<int>::iterator it = _open_queue.begin(); it != _open_queue.end(); it++){
+            if (*it == cam_num){
+                _open_queue.erase(it);
+                _open_queue.push_front(cam_num);
+                break;
+            }
+        }
+    } else {
+        queue_open(cam_num, true);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+void Camera_Pool::enumerate(int count){
+    pthread_mutex_lock(&_mutex);
+    for (int i = 0; i < count; i++){
+        // failures from before aren't retried by a probe
+        if (camera(i).state == CAMERA_CLOSED && !camera(i).seen)
+            queue_open(i, false);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+Capture_Source * Camera_Pool::acquire(int cam_num){
+    Capture_Source * ret = NULL;
+    pthread_mutex_lock(&_mutex);
+    pool_camera_t& cam = camera(cam_num);
+    if (cam.state == CAMERA_READY){
+        cam.state = CAMERA_IN_USE;
+        cam.wanted = false;
+        ret = cam.source;
+    } else if (cam.state != CAMERA_IN_USE){
+        queue_open(cam_num, true);
+    }
+    pthread_mutex_unlock(&_mutex);
+    return ret;
+}
+
+void Camera_Pool::cancel(int cam_num){
+    pthread_mutex_lock(&_mutex);
+    camera(cam_num).wanted = false;
+    trim_warm();
+    pthread_mutex_unlock(&_mutex);
+}
+
+void Camera_Pool::release(int cam_num){
+    pthread_mutex_lock(&_mutex);
+    pool_camera_t& cam = camera(cam_num);
+    if (cam.state == CAMERA_IN_USE){
+        cam.state = CAMERA_READY;
+        cam.wanted = false;
+        cam.last_used_ms = get_time_ms();
+        trim_warm();
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+camera_state_t Camera_Pool::state(int cam_num){
+    pthread_mutex_lock(&_mutex);
+    camera_state_t ret = camera(cam_num).state;
+    pthread_mutex_unlock(&_mutex);
+    return ret;
+}
+
+vector<int> Camera_Pool::available(){
+    vector<int> ret;
+    pthread_mutex_lock(&_mutex);
+    for (map<int, pool_camera_t>::iterator it = _cameras.begin(); it != _cameras.end(); it++){
+        if (it->second.seen)
+            ret.push_back(it->first);
+    }
+    pthread_mutex_unlock(&_mutex);
+    return ret;
+}
+
+void Camera_Pool::trim_warm(){
+    while (true){
+        int warm = 0;
+        map<int, pool_camera_t>::iterator oldest = _cameras.end();
+        for (map<int, pool_camera_t>::iterator it = _cameras.begin(); it != _cameras.end(); it++){
+            if (it->second.state != CAMERA_READY || it->second.wanted)
+                continue;
+            warm++;
+            if (oldest == _cameras.end() || it->second.last_used_ms < oldest->second.last_used_ms)
+                oldest = it;
+        }
+        if (warm <= _max_warm)
+            return;
+        _close_queue.push_back(oldest->second.source);
+        oldest->second.source = NULL;
+        oldest->second.state = CAMERA_CLOSED;
+        pthread_cond_signal(&_cond);
+    }
+}
+
+void * Camera_Pool::opener_main(void * pool){
+    ((Camera_Pool *) pool)->opener_loop();
+    return NULL;
+}
+
+void Camera_Pool::opener_loop(){
+    pthread_mutex_lock(&_mutex);
+    while (!_stopping){
+        if (!_close_queue.empty()){
+            vector<Capture_Source *> closing;
+            closing.swap(_close_queue);
+            pthread_mutex_unlock(&_mutex);
+            for (size_t i = 0; i < closing.size(); i++)
+                delete closing[i];
+            pthread_mutex_lock(&_mutex);
+            continue;
+        }
+        if (_open_queue.empty()){
+            pthread_cond_wait(&_cond, &_mutex);
+            continue;
+        }
+        int cam_num = _open_queue.front();
+        _open_queue.pop_front();
+
+        // the slow part, unlocked
+        pthread_mutex_unlock(&_mutex);
+        double start = get_time_ms();
+        Capture_Source * source = _opener(_opener_arg, cam_num);
+        if (source && !source->is_open()){
+            delete source;
+            source = NULL;
+        }
+        printf("Camera_Pool: camera %d %s (%0.0fms)\n", cam_num,
+            source ? "open" : "failed to open", get_time_ms() - start);
+        pthread_mutex_lock(&_mutex);
+
+        pool_camera_t& cam = camera(cam_num);
+        cam.source = source;
+        cam.state = source ? CAMERA_READY : CAMERA_FAILED;
+        // fresh cameras count as just used
+        cam.last_used_ms = get_time_ms();
+        if (source)
+            cam.seen = true;
+        trim_warm();
+    }
+    pthread_mutex_unlock(&_mutex);
+}
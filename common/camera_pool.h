@@ -0,0 +1,114 @@
+/* #########################################################################
+        Camera Pool -- opens cameras on a thread of its own and keeps
+            the last few used ones open, so switching what an eye is
+            looking at never waits on a driver.
+
+        Header.
+
+   ######################################################################### */
+
+#ifndef __XEN_CAMERA_POOL_H
+#define __XEN_CAMERA_POOL_H
+
+// Base system stuff
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <deque>
+#include <vector>
+
+//pthread for the opener thread
+#include <pthread.h>
+
+#include "capture_source.h"
+#include "xen_utils.h"
+
+namespace xen_rift {
+
+    // opens camera number cam_num however the application likes; NULL
+    //  or a source that isn't is_open() on failure. Runs on the
+    //  pool's thread.
+    typedef Capture_Source * (*camera_opener_t)(void * arg, int cam_num);
+
+    typedef enum _camera_state_t {
+        // never asked for, or closed since
+        CAMERA_CLOSED=0,
+        // waiting for, or in, the opener
+        CAMERA_OPENING=1,
+        // open and in the pool
+        CAMERA_READY=2,
+        // handed out by acquire()
+        CAMERA_IN_USE=3,
+        // the opener couldn't; request() tries again
+        CAMERA_FAILED=4
+    } camera_state_t;
+
+    class Camera_Pool {
+        public:
+            // Keeps up to max_warm released cameras open, closing the
+            //  least recently used beyond that.
+            Camera_Pool(camera_opener_t opener, void * arg, int max_warm = 2);
+            // closes every camera, handed out or not
+            ~Camera_Pool();
+
+            // Start opening cam_num, if it isn't open or on its way.
+            //  Goes ahead of any enumeration still running, and is
+            //  kept open until acquired or cancel()ed.
+            void request(int cam_num);
+            // no longer waiting on cam_num; it's warm like any other
+            void cancel(int cam_num);
+            // Probes cameras 0 .. count - 1 in the background; the ones
+            //  that open stay warm (up to max_warm) and are listed by
+            //  available().
+            void enumerate(int count);
+
+            // The camera, if it's READY: it's the caller's until
+            //  release(). Never blocks; NULL (having requested it)
+            //  otherwise.
+            Capture_Source * acquire(int cam_num);
+            // hands an acquired camera back to be kept warm
+            void release(int cam_num);
+
+            camera_state_t state(int cam_num);
+            // every camera number that has opened at some point
+            std::vector<int> available();
+
+        protected:
+            typedef struct _pool_camera_t {
+                camera_state_t state;
+                Capture_Source * source;
+                // when it was last released, for picking what to close
+                double last_used_ms;
+                bool seen;
+                // requested and not yet acquired: never trimmed
+                bool wanted;
+            } pool_camera_t;
+
+            static void * opener_main(void * pool);
+            void opener_loop();
+            // caller holds _mutex
+            pool_camera_t& camera(int cam_num);
+            void queue_open(int cam_num, bool urgent);
+            void trim_warm();
+
+            camera_opener_t _opener;
+            void * _opener_arg;
+            int _max_warm;
+
+            std::map<int, pool_camera_t> _cameras;
+            std::deque<int> _open_queue;
+            // closed on the opener thread too; drivers can be slow
+            //  about that as well
+            std::vector<Capture_Source *> _close_queue;
+
+            pthread_t _thread;
+            bool _thread_running;
+            pthread_mutex_t _mutex;
+            pthread_cond_t _cond;
+            bool _stopping;
+
+        private:
+    };
+}
+
+#endif //__XEN_CAMERA_POOL_H
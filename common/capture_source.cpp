@@ -0,0 +1,85 @@
+/* #########################################################################
+        Capture Source -- common interface for anything that produces
+            camera frames (live webcams, recordings, ...), so the demos
+            don't care where frames come from.
+
+   ######################################################################### */
+
+#include "capture_source.h"
+
+using namespace std;
+using namespace xen_rift;
+using namespace cv;
+
+Cv_Capture_Source::Cv_Capture_Source(int cam_num, int width, int height,
+                                     int fps, int exposure, bool mjpeg) :
+    _cam_num(cam_num),
+    _timestamp_ms(0.0)
+{
+    _capture = cvCaptureFromCAM(cam_num);
+    if (!_capture){
+        printf("Cv_Capture_Source: couldn't open camera %d\n", cam_num);
+        return;
+    }
+    cvSetCaptureProperty(_capture, CV_CAP_PROP_EXPOSURE, exposure);
+    // before the size: uncompressed, USB 2 won't carry much over
+    //  640x480@30 per camera
+    if (mjpeg)
+        cvSetCaptureProperty(_capture, CV_CAP_PROP_FOURCC, CV_FOURCC('M', 'J', 'P', 'G'));
+    cvSetCaptureProperty(_capture, CV_CAP_PROP_FRAME_WIDTH, width);
+    cvSetCaptureProperty(_capture, CV_CAP_PROP_FRAME_HEIGHT, height);
+    cvSetCaptureProperty(_capture, CV_CAP_PROP_FPS, fps);
+}
+
+Cv_Capture_Source::~Cv_Capture_Source(){
+    if (_capture)
+        cvReleaseCapture( &_capture );
+}
+
+bool Cv_Capture_Source::grab(){
+    if (!_capture || !cvGrabFrame(_capture))
+        return false;
+    // no driver timestamp through this backend; grab returning is the
+    //  closest we get
+    _timestamp_ms = get_time_ms();
+    return true;
+}
+
+bool Cv_Capture_Source::retrieve(Mat& out){
+    if (!_capture)
+        return false;
+    IplImage * frame_ipl = cvRetrieveFrame( _capture );
+    // frame_ipl is owned by the capture and is reused by it on the
+    //  next grab, so no freeing here.
+    if (!frame_ipl)
+        return false;
+    out = Mat(frame_ipl);
+    return true;
+}
+
+void Cv_Capture_Source::set_exposure(int exposure){
+    if (_capture)
+        cvSetCaptureProperty(_capture, CV_CAP_PROP_EXPOSURE, exposure);
+}
+
+Video_File_Source::Video_File_Source(const string& filename) :
+    _video(filename),
+    _timestamp_ms(0.0)
+{
+    if (!_video.isOpened())
+        printf("Video_File_Source: couldn't open %s\n", filename.c_str());
+}
+
+bool Video_File_Source::grab(){
+    if (!_video.isOpened() || !_video.grab())
+        return false;
+    _timestamp_ms = _video.get(CV_CAP_PROP_POS_MSEC);
+    return true;
+}
+
+bool Video_File_Source::retrieve(Mat& out){
+    if (!_video.isOpened() || !_video.retrieve(_frame) || _frame.empty())
+        return false;
+    out = _frame;
+    return true;
+}
@@ -0,0 +1,107 @@
+/* #########################################################################
+        Capture Source -- common interface for anything that produces
+            camera frames (live webcams, recordings, ...), so the demos
+            don't care where frames come from.
+
+        Header.
+
+   ######################################################################### */
+
+#ifndef __XEN_CAPTURE_SOURCE_H
+#define __XEN_CAPTURE_SOURCE_H
+
+// Base system stuff
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+#include "opencv/cv.h"
+#include "opencv2/highgui/highgui.hpp"
+
+#include "xen_utils.h"
+
+namespace xen_rift {
+
+    typedef enum _pixel_format_t {
+        PIXEL_FORMAT_BGR=0,
+        // packed 4:2:2, Y0 U Y1 V
+        PIXEL_FORMAT_YUYV=1,
+        // one jpeg per frame
+        PIXEL_FORMAT_MJPEG=2
+    } pixel_format_t;
+
+    // a frame in whatever format the source got it in
+    typedef struct _raw_frame_t {
+        pixel_format_t format;
+        int width;
+        int height;
+        // bytes per row; 0 for compressed formats
+        int stride;
+        const unsigned char * data;
+        size_t size;
+    } raw_frame_t;
+
+    class Capture_Source {
+        public:
+            virtual ~Capture_Source() {}
+            // Pulls the next frame into the source. Returns false if no
+            //  new frame is available (yet).
+            virtual bool grab() = 0;
+            // BGR image of the last grabbed frame. May point into memory
+            //  owned by the source: treat it as read only, and valid
+            //  until the next grab.
+            virtual bool retrieve(cv::Mat& out) = 0;
+            // The last grabbed frame as the source has it, with no
+            //  conversion or copy, under the same rules as retrieve.
+            //  False if the source only does BGR through retrieve.
+            virtual bool retrieve_raw(raw_frame_t& out) { return false; }
+            // when the last grabbed frame was captured, in get_time_ms()
+            //  time
+            virtual double timestamp_ms() = 0;
+            virtual bool is_open() = 0;
+            virtual void set_exposure(int exposure) {}
+    };
+
+    // live camera through OpenCV's capture backend. mjpeg asks the
+    //  camera for compressed frames, which OpenCV decodes itself, on
+    //  the grabbing thread; there's no retrieve_raw, so
+    //  Mjpeg_Decode_Source can't take that over.
+    class Cv_Capture_Source : public Capture_Source {
+        public:
+            Cv_Capture_Source(int cam_num, int width = 640, int height = 480,
+                              int fps = 30, int exposure = -5, bool mjpeg = false);
+            ~Cv_Capture_Source();
+            bool grab();
+            bool retrieve(cv::Mat& out);
+            double timestamp_ms() { return _timestamp_ms; }
+            bool is_open() { return _capture != NULL; }
+            void set_exposure(int exposure);
+
+        protected:
+            CvCapture * _capture;
+            int _cam_num;
+            double _timestamp_ms;
+
+        private:
+    };
+
+    // a video file (anything OpenCV can decode), frames back to back
+    class Video_File_Source : public Capture_Source {
+        public:
+            Video_File_Source(const std::string& filename);
+            bool grab();
+            bool retrieve(cv::Mat& out);
+            // position in the file, not wall time
+            double timestamp_ms() { return _timestamp_ms; }
+            bool is_open() { return _video.isOpened(); }
+
+        protected:
+            cv::VideoCapture _video;
+            cv::Mat _frame;
+            double _timestamp_ms;
+
+        private:
+    };
+}
+
+#endif //__XEN_CAPTURE_SOURCE_H
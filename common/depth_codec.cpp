@@ -0,0 +1,199 @@
+/* #########################################################################
+        Depth Codec -- lossless compression for 16 bit depth frames,
+            quick enough to keep up with a Kinect many times over on
+            one core: each pixel is predicted from its decoded
+            neighbours, and what's left over is packed into byte
+            codes that favour small differences and runs of none.
+
+        Prediction is LOCO-I's median edge detector: from the pixels
+        left, above and above-left, it picks whichever of left or
+        above an edge between them favours, or the plane through all
+        three on smooth ground. Kinect depth is mostly smooth
+        surfaces, where that's within a step or two, and runs of "no
+        reading" (2047), where it's exact. Residuals (zigzagged, so
+        small either way is a small number) are coded a row at a
+        time as:
+            00nnnnnn            n+1 residuals of zero
+            01aaabbb            two residuals under 8
+            10rrrrrr            one under 64
+            110rrrrr rrrrrrrr   one under 8192
+            11100000 lo hi      the pixel itself, when nothing fits
+        A typical frame comes to a fifth or so of its raw size.
+
+   ######################################################################### */
+
+#include "depth_codec.h"
+
+using namespace std;
+using namespace xen_rift;
+
+static inline int predict_med(int left, int up, int up_left){
+    int hi = left > up ? left : up;
+    int lo = left < up ? left : up;
+    if (up_left >= hi)
+        return lo;
+    if (up_left <= lo)
+        return hi;
+    return left + up - up_left;
+}
+
+// prediction for pixel x of row, from what's already decoded
+static inline int predict(const unsigned short * row, const unsigned short * up, int x){
+    if (!up)
+        return x > 0 ? row[x-1] : 0;
+    if (x == 0)
+        return up[0];
+    return predict_med(row[x-1], up[x], up[x-1]);
+}
+
+static inline unsigned int zigzag(int d){
+    return d >= 0 ? (unsigned int) d << 1 : ((unsigned int) -d << 1) - 1;
+}
+
+static inline int unzigzag(unsigned int z){
+    return (int) (z >> 1) ^ -(int) (z & 1);
+}
+
+size_t xen_rift::depth_encode(const unsigned short * depth, int width, int height,
+                              vector<unsigned char>& out){
+    // three bytes a pixel, at worst
+    out.resize((size_t) width * height * 3 + 1);
+    unsigned char * p = &out[0];
+    vector<unsigned int> residuals(width);
+    for (int y = 0; y < height; y++){
+        const unsigned short * row = depth + (size_t) y * width;
+        const unsigned short * up = y > 0 ? row - width : NULL;
+        // the row's first pixel (and the whole first row) are the odd
+        //  ones out; keep them out of the loop
+        residuals[0] = zigzag(row[0] - predict(row, up, 0));
+        if (up){
+            for (int x = 1; x < width; x++)
+                residuals[x] = zigzag(row[x] - predict_med(row[x-1], up[x], up[x-1]));
+        } else {
+            for (int x = 1; x < width; x++)
+                residuals[x] = zigzag(row[x] - row[x-1]);
+        }
+
+        int x = 0;
+        while (x < width){
+            unsigned int r = residuals[x];
+            if (r == 0){
+                int n = 1;
+                while (x + n < width && n < 64 && residuals[x + n] == 0)
+                    n++;
+                *p++ = (unsigned char) (n - 1);
+                x += n;
+            } else if (r < 8 && x + 1 < width && residuals[x + 1] < 8){
+                *p++ = (unsigned char) (0x40 | (r << 3) | residuals[x + 1]);
+                x += 2;
+            } else if (r < 64){
+                *p++ = (unsigned char) (0x80 | r);
+                x++;
+            } else if (r < 8192){
+                *p++ = (unsigned char) (0xC0 | (r >> 8));
+                *p++ = (unsigned char) (r & 0xFF);
+                x++;
+            } else {
+                *p++ = 0xE0;
+                *p++ = (unsigned char) (row[x] & 0xFF);
+                *p++ = (unsigned char) (row[x] >> 8);
+                x++;
+            }
+        }
+    }
+    size_t size = p - &out[0];
+    out.resize(size);
+    return size;
+}
+
+bool xen_rift::depth_decode(const unsigned char * in, size_t size, unsigned short * out,
+                            int width, int height){
+    const unsigned char * p = in;
+    const unsigned char * end = in + size;
+    for (int y = 0; y < height; y++){
+        unsigned short * row = out + (size_t) y * width;
+        const unsigned short * up = y > 0 ? row - width : NULL;
+        int x = 0;
+        while (x < width){
+            if (p >= end)
+                return false;
+            unsigned int b = *p++;
+            if (b < 0x40){
+                int n = (int) b + 1;
+                if (x + n > width)
+                    return false;
+                for (int k = 0; k < n; k++, x++)
+                    row[x] = (unsigned short) predict(row, up, x);
+            } else if (b < 0x80){
+                if (x + 2 > width)
+                    return false;
+                row[x] = (unsigned short) (predict(row, up, x) + unzigzag((b >> 3) & 7));
+                x++;
+                row[x] = (unsigned short) (predict(row, up, x) + unzigzag(b & 7));
+                x++;
+            } else if (b < 0xC0){
+                row[x] = (unsigned short) (predict(row, up, x) + unzigzag(b & 0x3F));
+                x++;
+            } else if (b < 0xE0){
+                if (p >= end)
+                    return false;
+                unsigned int r = ((b & 0x1F) << 8) | *p++;
+                row[x] = (unsigned short) (predict(row, up, x) + unzigzag(r));
+                x++;
+            } else if (b == 0xE0){
+                if (p + 2 > end)
+                    return false;
+                row[x] = (unsigned short) (p[0] | (p[1] << 8));
+                p += 2;
+                x++;
+            } else {
+                return false;
+            }
+        }
+    }
+    return p == end;
+}
+
+void xen_rift::benchmark_depth_codec(int frames){
+    if (frames < 1)
+        frames = 1;
+    int width = 640, height = 480;
+    // a floor sloping away into a wall, a box on it casting a shadow
+    //  of no reading to one side, and a step of sensor noise here and
+    //  there; roughly what a Kinect sees of a room
+    vector<unsigned short> depth(width * height);
+    for (int v = 0; v < height; v++){
+        for (int u = 0; u < width; u++){
+            int d = v > height / 2 ? 1000 - (v - height / 2) : 1000;
+            if (u > 250 && u < 400 && v > 200 && v < 380)
+                d = 820;
+            else if (u >= 400 && u < 420 && v > 200 && v < 380)
+                d = 2047;
+            if (d != 2047 && rand() % 4 == 0)
+                d += rand() % 3 - 1;
+            depth[v * width + u] = (unsigned short) d;
+        }
+    }
+    vector<unsigned char> encoded;
+    vector<unsigned short> decoded(width * height);
+
+    printf("Depth codec: %dx%d, %d frames\n", width, height, frames);
+    double start = get_time_ms();
+    for (int i = 0; i < frames; i++)
+        depth_encode(&depth[0], width, height, encoded);
+    double encode_ms = (get_time_ms() - start) / frames;
+
+    bool ok = true;
+    start = get_time_ms();
+    for (int i = 0; i < frames; i++)
+        ok = depth_decode(&encoded[0], encoded.size(), &decoded[0], width, height) && ok;
+    double decode_ms = (get_time_ms() - start) / frames;
+    ok = ok && memcmp(&depth[0], &decoded[0], depth.size() * sizeof(unsigned short)) == 0;
+
+    double raw_bytes = depth.size() * sizeof(unsigned short);
+    printf("  encode: %0.3f ms/frame (%0.0f fps)\n", encode_ms, 1000.0 / encode_ms);
+    printf("  decode: %0.3f ms/frame (%0.0f fps)\n", decode_ms, 1000.0 / decode_ms);
+    printf("  %d bytes from %0.0f (%0.1f:1), 30 Hz: %0.2f MB/s; %s\n", (int) encoded.size(),
+        raw_bytes, raw_bytes / encoded.size(), encoded.size() * 30.0 / (1024.0 * 1024.0),
+        ok ? "lossless" : "ROUND TRIP FAILED");
+}
@@ -0,0 +1,41 @@
+/* #########################################################################
+        Depth Codec -- lossless compression for 16 bit depth frames,
+            quick enough to keep up with a Kinect many times over on
+            one core: each pixel is predicted from its decoded
+            neighbours, and what's left over is packed into byte
+            codes that favour small differences and runs of none.
+
+        Header.
+
+   ######################################################################### */
+
+#ifndef __XEN_DEPTH_CODEC_H
+#define __XEN_DEPTH_CODEC_H
+
+// Base system stuff
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "xen_utils.h"
+
+namespace xen_rift {
+
+    // Compresses a width x height frame, rows packed, into out
+    //  (replacing what's there). Every frame stands alone, so any one
+    //  can be decoded without the ones before it. Returns the
+    //  compressed size.
+    size_t depth_encode(const unsigned short * depth, int width, int height,
+                        std::vector<unsigned char>& out);
+    // The reverse, into width x height pixels at out. False, with out
+    //  partly written, if the data is corrupt or for a different size.
+    bool depth_decode(const unsigned char * in, size_t size, unsigned short * out,
+                      int width, int height);
+
+    // Times both ways on a made up Kinect-like frame, checks they
+    //  round trip, and prints the rates and the ratio.
+    void benchmark_depth_codec(int frames = 200);
+}
+
+#endif //__XEN_DEPTH_CODEC_H
@@ -0,0 +1,141 @@
+/* #########################################################################
+        Feature Tracker -- keypoints over a grayscale image stream,
+            detected on the full frame only now and then and followed
+            with pyramidal Lucas-Kanade in between.
+
+        Each frame's image pyramid is built once and kept, so the LK
+        step only builds the new frame's. Points that LK loses, or
+        that wander off the image, are dropped; once too few are left
+        (or enough frames have passed for drift to matter) the next
+        frame is a full detection.
+
+   ######################################################################### */
+
+#include "feature_tracker.h"
+
+using namespace std;
+using namespace xen_rift;
+using namespace cv;
+
+const char * xen_rift::feature_detector_name(feature_detector_t detector){
+    switch (detector){
+        case FEATURE_DETECTOR_FAST: return "FAST";
+        case FEATURE_DETECTOR_ORB: return "ORB";
+        default: return "STAR";
+    }
+}
+
+void xen_rift::detect_features(feature_detector_t detector, const Mat& image,
+                               vector<KeyPoint>& keypoints, int max_features){
+    keypoints.clear();
+    if (detector == FEATURE_DETECTOR_FAST){
+        FastFeatureDetector fast(20, true);
+        fast.detect(image, keypoints);
+    } else if (detector == FEATURE_DETECTOR_ORB){
+        // ORB does its own best-n selection
+        OrbFeatureDetector orb(max_features > 0 ? max_features : 500);
+        orb.detect(image, keypoints);
+    } else {
+        StarFeatureDetector star;
+        star.detect(image, keypoints);
+    }
+    if (max_features > 0)
+        KeyPointsFilter::retainBest(keypoints, max_features);
+}
+
+Feature_Tracker::Feature_Tracker(feature_detector_t detector, int redetect_every,
+                                 float min_track_fraction, int max_features,
+                                 int pyramid_levels, int window) :
+    _detector(detector),
+    _redetect_every(redetect_every > 0 ? redetect_every : 1),
+    _min_track_fraction(min_track_fraction),
+    _max_features(max_features),
+    _levels(pyramid_levels),
+    _window(window, window),
+    _primed(false),
+    _force_detect(true),
+    _last_seq(0),
+    _frames_since_detect(0),
+    _detected_count(0),
+    _last_was_detection(false),
+    _last_detect_ms(0.0),
+    _last_track_ms(0.0)
+{
+}
+
+void Feature_Tracker::reset(){
+    _primed = false;
+    _force_detect = true;
+    _keypoints.clear();
+    _points.clear();
+    _pyramid.clear();
+    _prev_pyramid.clear();
+}
+
+void Feature_Tracker::set_detector(feature_detector_t detector){
+    if (detector != _detector)
+        _force_detect = true;
+    _detector = detector;
+}
+
+void Feature_Tracker::update(const Mat& gray, unsigned long frame_seq){
+    if (_primed && frame_seq == _last_seq)
+        return;
+    _last_seq = frame_seq;
+
+    // keep last frame's pyramid for LK, and build this one's into the
+    //  other set of buffers
+    _prev_pyramid.swap(_pyramid);
+    double start = get_time_ms();
+    buildOpticalFlowPyramid(gray, _pyramid, _window, _levels);
+
+    bool have_previous = _primed && !_prev_pyramid.empty() &&
+        _prev_pyramid[0].size() == _pyramid[0].size();
+    if (have_previous && !_force_detect && !_points.empty()){
+        track();
+        _last_track_ms = get_time_ms() - start;
+    }
+    _frames_since_detect++;
+
+    bool too_few = _points.size() < _detected_count * _min_track_fraction;
+    if (!have_previous || _force_detect || too_few ||
+            _frames_since_detect >= _redetect_every){
+        start = get_time_ms();
+        detect(gray);
+        _last_detect_ms = get_time_ms() - start;
+        _last_was_detection = true;
+    } else {
+        _last_was_detection = false;
+    }
+    _primed = true;
+}
+
+void Feature_Tracker::detect(const Mat& gray){
+    detect_features(_detector, gray, _keypoints, _max_features);
+    _points.resize(_keypoints.size());
+    for (size_t i = 0; i < _keypoints.size(); i++)
+        _points[i] = _keypoints[i].pt;
+    _detected_count = _keypoints.size();
+    _frames_since_detect = 0;
+    _force_detect = false;
+}
+
+void Feature_Tracker::track(){
+    calcOpticalFlowPyrLK(_prev_pyramid, _pyramid, _points, _next_points, _status,
+                         _error, _window, _levels);
+    float w = (float) _pyramid[0].cols;
+    float h = (float) _pyramid[0].rows;
+    // compact survivors in place; keypoints keep their size / response
+    size_t kept = 0;
+    for (size_t i = 0; i < _points.size(); i++){
+        Point2f p = _next_points[i];
+        if (!_status[i] || p.x < 0 || p.y < 0 || p.x >= w || p.y >= h)
+            continue;
+        _keypoints[kept] = _keypoints[i];
+        _keypoints[kept].pt = p;
+        _points[kept] = p;
+        kept++;
+    }
+    _keypoints.resize(kept);
+    _points.resize(kept);
+}
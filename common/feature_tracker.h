@@ -0,0 +1,101 @@
+/* #########################################################################
+        Feature Tracker -- keypoints over a grayscale image stream,
+            detected on the full frame only now and then and followed
+            with pyramidal Lucas-Kanade in between.
+
+        Header.
+
+   ######################################################################### */
+
+#ifndef __XEN_FEATURE_TRACKER_H
+#define __XEN_FEATURE_TRACKER_H
+
+// Base system stuff
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "opencv/cv.h"
+#include "opencv2/features2d/features2d.hpp"
+#include "opencv2/video/tracking.hpp"
+
+#include "xen_utils.h"
+
+namespace xen_rift {
+
+    typedef enum _feature_detector_t {
+        FEATURE_DETECTOR_STAR=0,
+        FEATURE_DETECTOR_FAST=1,
+        FEATURE_DETECTOR_ORB=2,
+        NUM_FEATURE_DETECTORS=3
+    } feature_detector_t;
+
+    const char * feature_detector_name(feature_detector_t detector);
+    // Runs detector over image. max_features > 0 keeps only the
+    //  strongest that many.
+    void detect_features(feature_detector_t detector, const cv::Mat& image,
+                         std::vector<cv::KeyPoint>& keypoints, int max_features = 0);
+
+    class Feature_Tracker {
+        public:
+            // Full detection every redetect_every frames, or sooner once
+            //  fewer than min_track_fraction of the last detection's
+            //  points are still being tracked.
+            Feature_Tracker(feature_detector_t detector = FEATURE_DETECTOR_STAR,
+                            int redetect_every = 10, float min_track_fraction = 0.5f,
+                            int max_features = 300, int pyramid_levels = 3,
+                            int window = 21);
+
+            // Advances by one 8-bit grayscale frame. Calls with a
+            //  frame_seq equal to the last one are ignored.
+            void update(const cv::Mat& gray, unsigned long frame_seq);
+            // forget everything; the next frame is a full detection
+            void reset();
+
+            std::vector<cv::KeyPoint>& get_keypoints() { return _keypoints; }
+            // whether the last update was a full detection
+            bool last_was_detection() { return _last_was_detection; }
+            // ms spent in the most recent detection / track step
+            double last_detect_ms() { return _last_detect_ms; }
+            double last_track_ms() { return _last_track_ms; }
+
+            // takes effect at the next update, which redetects
+            void set_detector(feature_detector_t detector);
+            feature_detector_t get_detector() { return _detector; }
+
+        protected:
+            void detect(const cv::Mat& gray);
+            void track();
+
+            feature_detector_t _detector;
+            int _redetect_every;
+            float _min_track_fraction;
+            int _max_features;
+            int _levels;
+            cv::Size _window;
+
+            // this frame's pyramid, and the last one's, which is only
+            //  ever built once: tracking swaps it over
+            std::vector<cv::Mat> _pyramid;
+            std::vector<cv::Mat> _prev_pyramid;
+
+            std::vector<cv::KeyPoint> _keypoints;
+            std::vector<cv::Point2f> _points;
+            std::vector<cv::Point2f> _next_points;
+            std::vector<uchar> _status;
+            std::vector<float> _error;
+
+            bool _primed;
+            bool _force_detect;
+            unsigned long _last_seq;
+            int _frames_since_detect;
+            size_t _detected_count;
+            bool _last_was_detection;
+            double _last_detect_ms;
+            double _last_track_ms;
+
+        private:
+    };
+}
+
+#endif //__XEN_FEATURE_TRACKER_H
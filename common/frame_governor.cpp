@@ -0,0 +1,229 @@
+/* #########################################################################
+        Frame Governor -- keeps optional per-frame work inside a time
+            budget by degrading it, cheapest-to-lose first, and
+            bringing it back once there's room again.
+
+        Goes down a step when the smoothed work has been over budget
+        for a few frames running, and up a step only after a good
+        while under 80% of it, and then only if the step's last known
+        cost says it'll still fit under 90%. After any change it waits
+        for the average to settle. The gap between the two is what
+        keeps it from flapping.
+
+   ######################################################################### */
+
+#include "frame_governor.h"
+
+using namespace std;
+using namespace xen_rift;
+
+// smoothing of per-frame and per-run costs
+static const double EMA_ALPHA = 0.1;
+static const int OVER_FRAMES = 5;
+static const int UNDER_FRAMES = 45;
+static const int HOLD_FRAMES = 20;
+static const double RESTORE_BELOW = 0.8;
+static const double RESTORE_FIT = 0.9;
+
+static const char * level_names[NUM_GOVERNOR_LEVELS] = {
+    "full", "half", "slow", "off"
+};
+
+Frame_Governor::Frame_Governor(double budget_ms) :
+    _budget_ms(budget_ms),
+    _enabled(true),
+    _work_ms(0.0),
+    _have_work(false),
+    _over_frames(0),
+    _under_frames(0),
+    _hold_frames(0)
+{
+}
+
+int Frame_Governor::add_task(const char * name, int priority){
+    governor_task_t task;
+    task.name = name;
+    task.priority = priority;
+    task.wanted = false;
+    task.level = GOVERNOR_FULL;
+    for (int i = 0; i < NUM_GOVERNOR_LEVELS; i++)
+        task.run_ms[i] = -1.0;
+    _tasks.push_back(task);
+    return (int) _tasks.size() - 1;
+}
+
+void Frame_Governor::set_wanted(int task, bool wanted){
+    governor_task_t& t = _tasks[task];
+    if (!wanted)
+        t.level = GOVERNOR_FULL;
+    t.wanted = wanted;
+}
+
+void Frame_Governor::report(int task, double ms){
+    governor_task_t& t = _tasks[task];
+    double& run = t.run_ms[t.level];
+    run = run < 0.0 ? ms : run + EMA_ALPHA * (ms - run);
+}
+
+governor_level_t Frame_Governor::level(int task){
+    return _tasks[task].level;
+}
+
+int Frame_Governor::downscale(int task){
+    return _tasks[task].level >= GOVERNOR_HALF_RES ? 2 : 1;
+}
+
+bool Frame_Governor::should_run(int task, unsigned long seq){
+    governor_level_t l = _tasks[task].level;
+    if (l == GOVERNOR_OFF)
+        return false;
+    if (l == GOVERNOR_LOW_RATE)
+        return seq % GOVERNOR_RATE_DIVISOR == 0;
+    return true;
+}
+
+void Frame_Governor::set_enabled(bool enabled){
+    _enabled = enabled;
+    if (!enabled){
+        for (size_t i = 0; i < _tasks.size(); i++)
+            _tasks[i].level = GOVERNOR_FULL;
+    }
+    _over_frames = _under_frames = 0;
+    _hold_frames = HOLD_FRAMES;
+}
+
+double Frame_Governor::frame_cost(governor_task_t& task, int level){
+    if (level == GOVERNOR_OFF)
+        return 0.0;
+    double run = task.run_ms[level];
+    if (run < 0.0){
+        // never run like this: guess from the neighbouring level
+        if (level == GOVERNOR_HALF_RES && task.run_ms[GOVERNOR_FULL] >= 0.0)
+            run = task.run_ms[GOVERNOR_FULL] / 4.0;
+        else if (level == GOVERNOR_HALF_RES && task.run_ms[GOVERNOR_LOW_RATE] >= 0.0)
+            run = task.run_ms[GOVERNOR_LOW_RATE];
+        else if (level == GOVERNOR_LOW_RATE)
+            run = frame_cost(task, GOVERNOR_HALF_RES);
+        else if (level == GOVERNOR_FULL && task.run_ms[GOVERNOR_HALF_RES] >= 0.0)
+            run = task.run_ms[GOVERNOR_HALF_RES] * 4.0;
+        else
+            run = 0.0;
+    }
+    if (level == GOVERNOR_LOW_RATE)
+        run /= GOVERNOR_RATE_DIVISOR;
+    return run;
+}
+
+double Frame_Governor::step_up_cost(governor_task_t& task){
+    // The finer level's own figure is from whenever it last ran, and
+    //  the scene may have got cheaper since; the current level's is
+    //  fresh. Nothing's measured while off, so that has to go on the
+    //  old figure.
+    double run = task.run_ms[task.level];
+    if (task.level == GOVERNOR_HALF_RES && run >= 0.0)
+        return run * 4.0;
+    if (task.level == GOVERNOR_LOW_RATE && run >= 0.0)
+        return run;
+    return frame_cost(task, task.level - 1);
+}
+
+bool Frame_Governor::degrade(){
+    // lowest priority first, then whichever costs most right now
+    int pick = -1;
+    for (size_t i = 0; i < _tasks.size(); i++){
+        governor_task_t& t = _tasks[i];
+        if (!t.wanted || t.level == GOVERNOR_OFF)
+            continue;
+        if (pick < 0 || t.priority < _tasks[pick].priority ||
+                (t.priority == _tasks[pick].priority &&
+                 frame_cost(t, t.level) > frame_cost(_tasks[pick], _tasks[pick].level)))
+            pick = (int) i;
+    }
+    if (pick < 0)
+        return false;
+    governor_task_t& t = _tasks[pick];
+    t.level = (governor_level_t) (t.level + 1);
+    printf("Frame_Governor: %0.1fms over %0.1fms budget, %s -> %s\n", _work_ms,
+        _budget_ms, t.name.c_str(), level_names[t.level]);
+    return true;
+}
+
+bool Frame_Governor::restore(){
+    // highest priority first
+    int pick = -1;
+    for (size_t i = 0; i < _tasks.size(); i++){
+        governor_task_t& t = _tasks[i];
+        if (!t.wanted || t.level == GOVERNOR_FULL)
+            continue;
+        if (pick < 0 || t.priority > _tasks[pick].priority)
+            pick = (int) i;
+    }
+    if (pick < 0)
+        return false;
+    governor_task_t& t = _tasks[pick];
+    double predicted = _work_ms - frame_cost(t, t.level) + step_up_cost(t);
+    if (predicted > _budget_ms * RESTORE_FIT)
+        return false;
+    t.level = (governor_level_t) (t.level - 1);
+    printf("Frame_Governor: %0.1fms of %0.1fms budget, %s -> %s\n", _work_ms,
+        _budget_ms, t.name.c_str(), level_names[t.level]);
+    return true;
+}
+
+void Frame_Governor::end_frame(double work_ms){
+    if (!_have_work){
+        _work_ms = work_ms;
+        _have_work = true;
+    } else {
+        _work_ms += EMA_ALPHA * (work_ms - _work_ms);
+    }
+    if (!_enabled)
+        return;
+    if (_hold_frames > 0){
+        _hold_frames--;
+        return;
+    }
+
+    if (_work_ms > _budget_ms){
+        _over_frames++;
+        _under_frames = 0;
+    } else if (_work_ms < _budget_ms * RESTORE_BELOW){
+        _under_frames++;
+        _over_frames = 0;
+    } else {
+        _over_frames = _under_frames = 0;
+    }
+
+    bool changed = false;
+    if (_over_frames >= OVER_FRAMES)
+        changed = degrade();
+    else if (_under_frames >= UNDER_FRAMES)
+        changed = restore();
+    if (changed){
+        _over_frames = _under_frames = 0;
+        _hold_frames = HOLD_FRAMES;
+    }
+}
+
+int Frame_Governor::degradation(){
+    int steps = 0;
+    for (size_t i = 0; i < _tasks.size(); i++){
+        if (_tasks[i].wanted)
+            steps += _tasks[i].level;
+    }
+    return steps;
+}
+
+string Frame_Governor::summary(){
+    string out;
+    for (size_t i = 0; i < _tasks.size(); i++){
+        if (!_tasks[i].wanted || _tasks[i].level == GOVERNOR_FULL)
+            continue;
+        if (!out.empty())
+            out += ", ";
+        out += _tasks[i].name + " " + level_names[_tasks[i].level];
+    }
+    if (out.empty())
+        out = "full";
+    return out;
+}
@@ -0,0 +1,112 @@
+/* #########################################################################
+        Frame Governor -- keeps optional per-frame work inside a time
+            budget by degrading it, cheapest-to-lose first, and
+            bringing it back once there's room again.
+
+        Header.
+
+   ######################################################################### */
+
+#ifndef __XEN_FRAME_GOVERNOR_H
+#define __XEN_FRAME_GOVERNOR_H
+
+// Base system stuff
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <string>
+
+#include "xen_utils.h"
+
+namespace xen_rift {
+
+    // How far a task has been turned down. Each step includes the
+    //  ones before it.
+    typedef enum _governor_level_t {
+        GOVERNOR_FULL=0,
+        // run at half resolution (a quarter of the pixels)
+        GOVERNOR_HALF_RES=1,
+        // and only every GOVERNOR_RATE_DIVISOR frames, reusing the
+        //  last result in between
+        GOVERNOR_LOW_RATE=2,
+        GOVERNOR_OFF=3,
+        NUM_GOVERNOR_LEVELS=4
+    } governor_level_t;
+
+    #define GOVERNOR_RATE_DIVISOR 3
+
+    class Frame_Governor {
+        public:
+            // budget_ms: what the governed work, all told, gets per
+            //  display frame
+            Frame_Governor(double budget_ms = 8.0);
+
+            // Tasks with lower priority are turned down first (all the
+            //  way off before the next is touched) and back up last.
+            //  Returns the task's id; ids count up from 0.
+            int add_task(const char * name, int priority);
+
+            // Whether the user has the task on at all this frame. Tasks
+            //  that aren't are left out, and start at full when they
+            //  come back.
+            void set_wanted(int task, bool wanted);
+            // ms one run of the task took, at the level it ran at
+            void report(int task, double ms);
+            // ms all the governed work took this display frame; once a
+            //  frame, after everything's reported, this is where levels
+            //  change
+            void end_frame(double work_ms);
+
+            governor_level_t level(int task);
+            // divides the image size by this (1 or 2)
+            int downscale(int task);
+            // false on frames a low rate task should reuse its last
+            //  result; seq is whatever counts the task's input frames
+            bool should_run(int task, unsigned long seq);
+
+            void set_budget_ms(double budget_ms) { _budget_ms = budget_ms; }
+            double budget_ms() { return _budget_ms; }
+            // off: everything goes back to full and stays there
+            void set_enabled(bool enabled);
+            bool enabled() { return _enabled; }
+
+            // total steps down, across wanted tasks
+            int degradation();
+            // "canny off, features half", or "full"
+            std::string summary();
+
+        protected:
+            typedef struct _governor_task_t {
+                std::string name;
+                int priority;
+                bool wanted;
+                governor_level_t level;
+                // per-run cost, smoothed, at each level; < 0 until seen
+                double run_ms[NUM_GOVERNOR_LEVELS];
+            } governor_task_t;
+
+            // what the task costs per display frame at level
+            double frame_cost(governor_task_t& task, int level);
+            // what it'd cost a level up, going by what it costs now
+            double step_up_cost(governor_task_t& task);
+            bool degrade();
+            bool restore();
+
+            std::vector<governor_task_t> _tasks;
+            double _budget_ms;
+            bool _enabled;
+            // smoothed work per frame
+            double _work_ms;
+            bool _have_work;
+            // consecutive frames over budget / with room to spare
+            int _over_frames;
+            int _under_frames;
+            // frames to leave things alone after a change, for the
+            //  average to catch up
+            int _hold_frames;
+
+        private:
+    };
+}
+
+#endif //__XEN_FRAME_GOVERNOR_H
@@ -0,0 +1,112 @@
+/* #########################################################################
+        Head Pose -- a short history of where the head was pointing,
+            so things that happened a little while ago (a camera
+            frame being exposed, say) can be matched up with the
+            orientation they happened at.
+
+   ######################################################################### */
+
+#include "head_pose.h"
+
+using namespace std;
+using namespace xen_rift;
+
+orientation_t xen_rift::orientation_identity(){
+    orientation_t q;
+    q.x = q.y = q.z = 0.0f;
+    q.w = 1.0f;
+    return q;
+}
+
+orientation_t xen_rift::orientation_delta(const orientation_t& a, const orientation_t& b){
+    // conj(a) = (-a.xyz, a.w)
+    orientation_t q;
+    q.w = a.w*b.w + a.x*b.x + a.y*b.y + a.z*b.z;
+    q.x = a.w*b.x - a.x*b.w - a.y*b.z + a.z*b.y;
+    q.y = a.w*b.y + a.x*b.z - a.y*b.w - a.z*b.x;
+    q.z = a.w*b.z - a.x*b.y + a.y*b.x - a.z*b.w;
+    return q;
+}
+
+float xen_rift::orientation_angle(const orientation_t& q){
+    float w = fabs(q.w);
+    if (w > 1.0f)
+        w = 1.0f;
+    return 2.0f * acos(w);
+}
+
+// normalized lerp; plenty over the few ms between samples
+static orientation_t nlerp(const orientation_t& a, const orientation_t& b, float t){
+    // q and -q are the same rotation; go the short way round
+    float dot = a.x*b.x + a.y*b.y + a.z*b.z + a.w*b.w;
+    float s = dot < 0.0f ? -t : t;
+    orientation_t q;
+    q.x = a.x*(1.0f - t) + b.x*s;
+    q.y = a.y*(1.0f - t) + b.y*s;
+    q.z = a.z*(1.0f - t) + b.z*s;
+    q.w = a.w*(1.0f - t) + b.w*s;
+    float len = sqrt(q.x*q.x + q.y*q.y + q.z*q.z + q.w*q.w);
+    if (len > 0.0f){
+        q.x /= len; q.y /= len; q.z /= len; q.w /= len;
+    }
+    return q;
+}
+
+Head_Pose_History::Head_Pose_History(int capacity, double min_interval_ms) :
+    _capacity(capacity > 1 ? capacity : 2),
+    _min_interval_ms(min_interval_ms),
+    _next(0)
+{
+}
+
+Head_Pose_History::pose_sample_t& Head_Pose_History::sample(int i){
+    return _samples[(_next + i) % _samples.size()];
+}
+
+void Head_Pose_History::add(double t_ms, const orientation_t& q){
+    int n = (int) _samples.size();
+    if (n > 0 && t_ms - sample(n - 1).t_ms < _min_interval_ms)
+        return;
+    pose_sample_t s;
+    s.t_ms = t_ms;
+    s.q = q;
+    if (n < _capacity){
+        _samples.push_back(s);
+    } else {
+        _samples[_next] = s;
+        _next = (_next + 1) % _capacity;
+    }
+}
+
+void Head_Pose_History::clear(){
+    _samples.clear();
+    _next = 0;
+}
+
+bool Head_Pose_History::orientation_at(double t_ms, orientation_t& out,
+                                       double max_extrapolate_ms){
+    int n = (int) _samples.size();
+    if (n == 0 || t_ms < sample(0).t_ms)
+        return false;
+    if (t_ms >= sample(n - 1).t_ms){
+        if (t_ms - sample(n - 1).t_ms > max_extrapolate_ms)
+            return false;
+        out = sample(n - 1).q;
+        return true;
+    }
+    // first sample after t_ms
+    int lo = 0, hi = n - 1;
+    while (hi - lo > 1){
+        int mid = (lo + hi) / 2;
+        if (sample(mid).t_ms <= t_ms)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    pose_sample_t& a = sample(lo);
+    pose_sample_t& b = sample(hi);
+    double span = b.t_ms - a.t_ms;
+    float t = span > 0.0 ? (float) ((t_ms - a.t_ms) / span) : 0.0f;
+    out = nlerp(a.q, b.q, t);
+    return true;
+}
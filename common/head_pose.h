@@ -0,0 +1,72 @@
+/* #########################################################################
+        Head Pose -- a short history of where the head was pointing,
+            so things that happened a little while ago (a camera
+            frame being exposed, say) can be matched up with the
+            orientation they happened at.
+
+        Header.
+
+   ######################################################################### */
+
+#ifndef __XEN_HEAD_POSE_H
+#define __XEN_HEAD_POSE_H
+
+// Base system stuff
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "xen_utils.h"
+
+namespace xen_rift {
+
+    // Unit quaternion, laid out like ovrQuatf so either can be handed
+    //  to quat_to_matrix
+    typedef struct _orientation_t {
+        float x, y, z, w;
+    } orientation_t;
+
+    orientation_t orientation_identity();
+    // conj(a) * b: the rotation taking a's frame to b's
+    orientation_t orientation_delta(const orientation_t& a, const orientation_t& b);
+    // angle of the rotation, in radians
+    float orientation_angle(const orientation_t& q);
+
+    class Head_Pose_History {
+        public:
+            // keeps the last capacity samples; with one every
+            //  min_interval_ms at most, the default covers a second
+            Head_Pose_History(int capacity = 512, double min_interval_ms = 2.0);
+
+            // samples must come in time order; ones closer than
+            //  min_interval_ms to the last are ignored
+            void add(double t_ms, const orientation_t& q);
+            void clear();
+
+            // Orientation at t_ms, interpolated between the samples
+            //  either side. Past the newest sample the newest is used,
+            //  for up to max_extrapolate_ms; false if t_ms is older
+            //  than anything kept, or too new.
+            bool orientation_at(double t_ms, orientation_t& out,
+                                double max_extrapolate_ms = 50.0);
+
+        protected:
+            typedef struct _pose_sample_t {
+                double t_ms;
+                orientation_t q;
+            } pose_sample_t;
+
+            // i-th oldest sample
+            pose_sample_t& sample(int i);
+
+            std::vector<pose_sample_t> _samples;
+            int _capacity;
+            double _min_interval_ms;
+            // oldest sample, once the ring is full
+            int _next;
+
+        private:
+    };
+}
+
+#endif //__XEN_HEAD_POSE_H
@@ -11,22 +11,129 @@
    ######################################################################### */ 
 
 #include "kinect.h"
+#include <emmintrin.h>
 using namespace std;
 using namespace xen_rift;
 using namespace Eigen;
 using namespace cv;
 
 
+/* #########################################################################
+
+                             Frame_Triple_Buffer
+
+   ######################################################################### */
+#define TRIPLE_BUFFER_FRESH 4
+
+// swaps value into target, fenced both ways, and returns what was there
+static inline long exchange_slot(volatile long * target, long value){
+#ifdef _WIN32
+    return InterlockedExchange(target, value);
+#else
+    return __atomic_exchange_n(target, value, __ATOMIC_ACQ_REL);
+#endif
+}
+
+Frame_Triple_Buffer::Frame_Triple_Buffer(int rows, int cols, int type) :
+    _back(0),
+    _front(1),
+    _middle(2),
+    _published(0),
+    _dropped(0)
+{
+    for (int i = 0; i < 3; i++){
+        _slots[i] = Mat::zeros(rows, cols, type);
+        _timestamps[i] = 0;
+    }
+}
+
+void Frame_Triple_Buffer::publish(uint32_t timestamp){
+    _timestamps[_back] = timestamp;
+    long old = exchange_slot(&_middle, _back | TRIPLE_BUFFER_FRESH);
+    if (old & TRIPLE_BUFFER_FRESH)
+        _dropped++;
+    _published++;
+    _back = old & 3;
+}
+
+bool Frame_Triple_Buffer::acquire(){
+    if (!(_middle & TRIPLE_BUFFER_FRESH))
+        return false;
+    _front = exchange_slot(&_middle, _front) & 3;
+    return true;
+}
+
+/* #########################################################################
+
+                                Kinect_Source
+
+   ######################################################################### */
+Kinect_Source::Kinect_Source() :
+    _video(480, 640, CV_8UC3),
+    _depth(480, 640, CV_16UC1),
+    _recorder(NULL)
+{
+    pthread_mutex_init(&_recorder_mutex, NULL);
+}
+
+Kinect_Source::~Kinect_Source(){
+    pthread_mutex_destroy(&_recorder_mutex);
+}
+
+bool Kinect_Source::getVideo(Mat& output, uint32_t * timestamp) {
+    if (!_video.acquire())
+        return false;
+    output = _video.front();
+    if (timestamp)
+        *timestamp = _video.front_timestamp();
+    return true;
+}
+
+bool Kinect_Source::getDepth(Mat& output, uint32_t * timestamp) {
+    if (!_depth.acquire())
+        return false;
+    output = _depth.front();
+    if (timestamp)
+        *timestamp = _depth.front_timestamp();
+    return true;
+}
+
+void Kinect_Source::set_recorder(Stereo_Recorder * recorder){
+    pthread_mutex_lock(&_recorder_mutex);
+    _recorder = recorder;
+    pthread_mutex_unlock(&_recorder_mutex);
+}
+
+void Kinect_Source::publish_video(uint32_t timestamp){
+    // published first, so recording doesn't hold it up; the slot's
+    //  only read from here on
+    Mat frame = _video.back();
+    _video.publish(timestamp);
+    pthread_mutex_lock(&_recorder_mutex);
+    if (_recorder){
+        cvtColor(frame, _record_bgr, CV_RGB2BGR);
+        _recorder->write_frame(KINECT_REC_VIDEO_STREAM, _record_bgr, get_time_ms(), timestamp);
+    }
+    pthread_mutex_unlock(&_recorder_mutex);
+}
+
+void Kinect_Source::publish_depth(uint32_t timestamp){
+    Mat frame = _depth.back();
+    _depth.publish(timestamp);
+    pthread_mutex_lock(&_recorder_mutex);
+    if (_recorder)
+        _recorder->write_frame(KINECT_REC_DEPTH_STREAM, frame, get_time_ms(), timestamp);
+    pthread_mutex_unlock(&_recorder_mutex);
+}
+
+/* #########################################################################
+
+                              XenFreenectDevice
+
+   ######################################################################### */
 XenFreenectDevice::XenFreenectDevice(freenect_context *_ctx, int _index): 
         Freenect::FreenectDevice(_ctx, _index), 
-        m_buffer_depth(FREENECT_DEPTH_11BIT),
-        m_buffer_rgb(FREENECT_VIDEO_RGB),
-        m_gamma(2048), 
-        m_new_rgb_frame(false), 
-        m_new_depth_frame(false),
-        depthMat(Size(640,480),CV_16UC1), 
-        rgbMat(Size(640,480),CV_8UC3,Scalar(0)), 
-        ownMat(Size(640,480),CV_8UC3,Scalar(0))
+        m_gamma(2048)
 {
     for( unsigned int i = 0 ; i < 2048 ; i++) {
         float v = i/2048.0;
@@ -37,45 +144,1166 @@ XenFreenectDevice::XenFreenectDevice(freenect_context *_ctx, int _index):
 
 // Do not call directly even in child
 void XenFreenectDevice::VideoCallback(void* _rgb, uint32_t timestamp) {
-    std::cout << "RGB callback" << std::endl;
-    m_rgb_mutex.lock();
-    uint8_t* rgb = static_cast<uint8_t*>(_rgb);
-    rgbMat.data = rgb;
-    m_new_rgb_frame = true;
-    m_rgb_mutex.unlock();
-};
+    // the driver's buffer is only ours until we return; straight into
+    //  the free slot, which no one else is looking at
+    Mat& slot = video_back();
+    memcpy(slot.data, _rgb, slot.step * slot.rows);
+    publish_video(timestamp);
+}
 // Do not call directly even in child
 void XenFreenectDevice::DepthCallback(void* _depth, uint32_t timestamp) {
-    std::cout << "Depth callback" << std::endl;
-    m_depth_mutex.lock();
-    uint16_t* depth = static_cast<uint16_t*>(_depth);
-    depthMat.data = (uchar*) depth;
-    m_new_depth_frame = true;
-    m_depth_mutex.unlock();
-}
-
-bool XenFreenectDevice::getVideo(Mat& output) {
-    m_rgb_mutex.lock();
-    if(m_new_rgb_frame) {
-        cv::cvtColor(rgbMat, output, CV_RGB2BGR);
-        m_new_rgb_frame = false;
-        m_rgb_mutex.unlock();
+    Mat& slot = depth_back();
+    memcpy(slot.data, _depth, slot.step * slot.rows);
+    publish_depth(timestamp);
+}
+
+/* #########################################################################
+
+                             Kinect_Replay_Device
+
+   ######################################################################### */
+Kinect_Replay_Device::Kinect_Replay_Device(const string& filename, bool loop) :
+    _loop(loop),
+    _thread_running(false),
+    _stopping(false),
+    _start_ms(0.0)
+{
+    pthread_mutex_init(&_mutex, NULL);
+    if (!_replay.open(filename))
+        return;
+    if (_replay.num_streams() <= KINECT_REC_VIDEO_STREAM ||
+            _replay.stream_encoding(KINECT_REC_DEPTH_STREAM) != REC_ENCODING_DEPTH){
+        printf("Kinect_Replay_Device: %s isn't a Kinect recording\n", filename.c_str());
+        _replay.close();
+        return;
+    }
+    _start_ms = get_time_ms();
+    if (pthread_create(&_thread, NULL, &Kinect_Replay_Device::thread_main, this))
+        printf("Kinect_Replay_Device: couldn't start its thread\n");
+    else
+        _thread_running = true;
+}
+
+Kinect_Replay_Device::~Kinect_Replay_Device(){
+    pthread_mutex_lock(&_mutex);
+    _stopping = true;
+    pthread_mutex_unlock(&_mutex);
+    if (_thread_running)
+        pthread_join(_thread, NULL);
+    pthread_mutex_destroy(&_mutex);
+}
+
+void Kinect_Replay_Device::seek(double position_ms){
+    if (position_ms < 0.0)
+        position_ms = 0.0;
+    if (position_ms > _replay.duration_ms())
+        position_ms = _replay.duration_ms();
+    pthread_mutex_lock(&_mutex);
+    _start_ms = get_time_ms() - position_ms;
+    pthread_mutex_unlock(&_mutex);
+}
+
+double Kinect_Replay_Device::position_ms(){
+    pthread_mutex_lock(&_mutex);
+    double position = get_time_ms() - _start_ms;
+    pthread_mutex_unlock(&_mutex);
+    double duration = _replay.duration_ms();
+    if (_loop && duration > 0.0)
+        return fmod(position, duration);
+    return position < duration ? position : duration;
+}
+
+void * Kinect_Replay_Device::thread_main(void * device){
+    ((Kinect_Replay_Device *) device)->thread_loop();
+    return NULL;
+}
+
+void Kinect_Replay_Device::thread_loop(){
+    int last[2] = {-1, -1};
+    while (true){
+        pthread_mutex_lock(&_mutex);
+        bool stopping = _stopping;
+        pthread_mutex_unlock(&_mutex);
+        if (stopping)
+            break;
+        // each stream's newest frame as of where playback is; anything
+        //  else changed means a new one's due, or a seek or loop moved
+        //  us
+        double target = _replay.first_timestamp_ms() + position_ms();
+        int streams[2] = {KINECT_REC_DEPTH_STREAM, KINECT_REC_VIDEO_STREAM};
+        for (int s = 0; s < 2; s++){
+            int i = _replay.find_frame(streams[s], target);
+            if (i >= 0 && i != last[s]){
+                deliver(streams[s], i);
+                last[s] = i;
+            }
+        }
+        sleep_ms(2);
+    }
+}
+
+bool Kinect_Replay_Device::deliver(int stream, int i){
+    unsigned char * payload;
+    rec_frame_header_t * fh = _replay.get_frame(stream, i, &payload);
+    if (!fh)
+        return false;
+    if (stream == KINECT_REC_DEPTH_STREAM){
+        Mat& slot = depth_back();
+        if (fh->encoding != REC_ENCODING_DEPTH || (int) fh->width != slot.cols ||
+                (int) fh->height != slot.rows ||
+                !depth_decode(payload, fh->size, slot.ptr<unsigned short>(0), slot.cols,
+                              slot.rows)){
+            printf("Kinect_Replay_Device: bad depth frame %d\n", i);
+            return false;
+        }
+        publish_depth(fh->source_timestamp);
         return true;
-    } else {
-        m_rgb_mutex.unlock();
+    }
+
+    Mat bgr;
+    if (fh->encoding == REC_ENCODING_RAW_BGR){
+        bgr = Mat(fh->height, fh->width, CV_8UC3, payload, fh->step);
+    } else if (fh->encoding == REC_ENCODING_MJPEG){
+        _decoded = imdecode(Mat(1, fh->size, CV_8UC1, payload), CV_LOAD_IMAGE_COLOR);
+        bgr = _decoded;
+    }
+    Mat& slot = video_back();
+    if (bgr.cols != slot.cols || bgr.rows != slot.rows){
+        printf("Kinect_Replay_Device: bad video frame %d\n", i);
         return false;
     }
+    // freenect hands out RGB
+    cvtColor(bgr, slot, CV_BGR2RGB);
+    publish_video(fh->source_timestamp);
+    return true;
 }
 
-bool XenFreenectDevice::getDepth(Mat& output) {
-    m_depth_mutex.lock();
-    if(m_new_depth_frame) {
-        depthMat.copyTo(output);
-        m_new_depth_frame = false;
-        m_depth_mutex.unlock();
-        return true;
+/* #########################################################################
+
+                                Kinect_Stream
+
+   ######################################################################### */
+Kinect_Stream::Kinect_Stream(int index, double stall_ms) :
+    _index(index),
+    _stall_ms(stall_ms),
+    _thread_running(false),
+    _stopping(false),
+    _want_open(false),
+    _open_failed(false),
+    _opened(NULL),
+    _context(NULL),
+    _opened_replay(false),
+    _recordings(0),
+    _device(NULL),
+    _device_replay(false),
+    _device_recording(false),
+    _last_arrival_ms(0.0),
+    _rate_start_ms(0.0)
+{
+    for (int i = 0; i < 2; i++){
+        _seen[i] = 0;
+        _rate_start_count[i] = 0;
+        _fps[i] = 0.0;
+    }
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+    if (pthread_create(&_thread, NULL, &Kinect_Stream::thread_main, this))
+        printf("Kinect_Stream: couldn't start its thread\n");
+    else
+        _thread_running = true;
+}
+
+Kinect_Stream::~Kinect_Stream(){
+    pthread_mutex_lock(&_mutex);
+    _stopping = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+    // closes the device on its way out
+    if (_thread_running)
+        pthread_join(_thread, NULL);
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+}
+
+void Kinect_Stream::start(){
+    pthread_mutex_lock(&_mutex);
+    _want_open = true;
+    _open_failed = false;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+}
+
+void Kinect_Stream::stop(){
+    pthread_mutex_lock(&_mutex);
+    _want_open = false;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+    // the stream's thread won't close it until we've let go
+    _device = NULL;
+    _fps[0] = _fps[1] = 0.0;
+}
+
+void Kinect_Stream::set_replay(const string& filename){
+    pthread_mutex_lock(&_mutex);
+    _replay_file = filename;
+    pthread_mutex_unlock(&_mutex);
+}
+
+void Kinect_Stream::set_record(const string& filename){
+    pthread_mutex_lock(&_mutex);
+    _record_file = filename;
+    pthread_mutex_unlock(&_mutex);
+}
+
+void Kinect_Stream::poll(){
+    double now = get_time_ms();
+    if (!_device){
+        pthread_mutex_lock(&_mutex);
+        if (_want_open){
+            _device = _opened;
+            _device_replay = _opened_replay;
+            _device_recording = _recorder.is_open();
+        }
+        pthread_mutex_unlock(&_mutex);
+        if (!_device)
+            return;
+        _seen[0] = _rate_start_count[0] = _device->depth_frames().published();
+        _seen[1] = _rate_start_count[1] = _device->video_frames().published();
+        _last_arrival_ms = _rate_start_ms = now;
+    }
+    long depth = _device->depth_frames().published();
+    long video = _device->video_frames().published();
+    if (depth != _seen[0])
+        _last_arrival_ms = now;
+    _seen[0] = depth;
+    _seen[1] = video;
+    if (now - _rate_start_ms >= 1000.0){
+        double secs = (now - _rate_start_ms) / 1000.0;
+        _fps[0] = (depth - _rate_start_count[0]) / secs;
+        _fps[1] = (video - _rate_start_count[1]) / secs;
+        _rate_start_count[0] = depth;
+        _rate_start_count[1] = video;
+        _rate_start_ms = now;
+    }
+}
+
+kinect_state_t Kinect_Stream::state(){
+    if (_device)
+        return get_time_ms() - _last_arrival_ms > _stall_ms ? KINECT_STALLED : KINECT_STREAMING;
+    pthread_mutex_lock(&_mutex);
+    kinect_state_t ret = !_want_open ? KINECT_OFF :
+                         _open_failed ? KINECT_FAILED : KINECT_OPENING;
+    pthread_mutex_unlock(&_mutex);
+    return ret;
+}
+
+string Kinect_Stream::status(){
+    char tmp[64];
+    string ret;
+    switch (state()){
+        case KINECT_OPENING: return string("K: opening");
+        case KINECT_FAILED: return string("K: failed");
+        case KINECT_STALLED:
+            ret = "K: stalled";
+            break;
+        case KINECT_STREAMING:
+            // rates come a second in
+            if (_fps[0] == 0.0 && _fps[1] == 0.0){
+                ret = "K: ON";
+            } else {
+                sprintf(tmp, "K: %0.0f/%0.0f fps", _fps[0], _fps[1]);
+                ret = tmp;
+            }
+            break;
+        default: return string("K: OFF");
+    }
+    if (_device_replay)
+        ret += " replay";
+    if (_device_recording)
+        ret += " REC";
+    return ret;
+}
+
+bool Kinect_Stream::get_depth(Mat& output, uint32_t * timestamp){
+    return _device && _device->getDepth(output, timestamp);
+}
+
+bool Kinect_Stream::get_video(Mat& output, uint32_t * timestamp){
+    return _device && _device->getVideo(output, timestamp);
+}
+
+void * Kinect_Stream::thread_main(void * stream){
+    ((Kinect_Stream *) stream)->thread_loop();
+    return NULL;
+}
+
+void Kinect_Stream::thread_loop(){
+    pthread_mutex_lock(&_mutex);
+    while (true){
+        bool want = _want_open && !_stopping;
+        if (want && !_opened && !_open_failed){
+            pthread_mutex_unlock(&_mutex);
+            Kinect_Source * device = open_device();
+            pthread_mutex_lock(&_mutex);
+            _opened = device;
+            _open_failed = device == NULL;
+        } else if (!want && _opened){
+            Kinect_Source * device = _opened;
+            _opened = NULL;
+            pthread_mutex_unlock(&_mutex);
+            close_device(device);
+            pthread_mutex_lock(&_mutex);
+        } else if (_stopping){
+            break;
+        } else {
+            pthread_cond_wait(&_cond, &_mutex);
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+    // stops freenect's event thread
+    delete _context;
+    _context = NULL;
+}
+
+Kinect_Source * Kinect_Stream::open_device(){
+    pthread_mutex_lock(&_mutex);
+    string replay_file = _replay_file;
+    string record_file = _record_file;
+    pthread_mutex_unlock(&_mutex);
+
+    Kinect_Source * device;
+    if (!replay_file.empty()){
+        Kinect_Replay_Device * replay = new Kinect_Replay_Device(replay_file);
+        if (!replay->is_open()){
+            delete replay;
+            return NULL;
+        }
+        printf("Kinect_Stream: replaying %s in place of kinect %d\n", replay_file.c_str(),
+            _index);
+        device = replay;
     } else {
-        m_depth_mutex.unlock();
-        return false;
+        device = open_sensor();
+        if (!device)
+            return NULL;
+    }
+    _opened_replay = !replay_file.empty();
+
+    if (!record_file.empty()){
+        // a reopen gets a file of its own: name-1.ext, name-2.ext, ...
+        if (record_file != _recorded_file){
+            _recorded_file = record_file;
+            _recordings = 0;
+        }
+        if (_recordings > 0){
+            size_t dot = record_file.find_last_of('.');
+            size_t slash = record_file.find_last_of("/\\");
+            if (dot == string::npos || (slash != string::npos && dot < slash))
+                dot = record_file.size();
+            char seq[16];
+            sprintf(seq, "-%d", _recordings);
+            record_file.insert(dot, seq);
+        }
+        _recordings++;
     }
-}
\ No newline at end of file
+    if (!record_file.empty() && _recorder.open(record_file, 2, REC_ENCODING_DEPTH)){
+        _recorder.set_stream_encoding(KINECT_REC_VIDEO_STREAM, REC_ENCODING_MJPEG);
+        device->set_recorder(&_recorder);
+    }
+    return device;
+}
+
+XenFreenectDevice * Kinect_Stream::open_sensor(){
+    XenFreenectDevice * device = NULL;
+    try {
+        // its own event thread starts with it
+        if (!_context)
+            _context = new Freenect::Freenect();
+        if (_context->deviceCount() <= _index){
+            printf("Kinect_Stream: no kinect %d connected\n", _index);
+            return NULL;
+        }
+        device = &_context->createDevice<XenFreenectDevice>(_index);
+        device->startDepth();
+        device->startVideo();
+    } catch (std::exception& e){
+        printf("Kinect_Stream: couldn't open kinect %d: %s\n", _index, e.what());
+        if (device)
+            _context->deleteDevice(_index);
+        return NULL;
+    }
+    printf("Kinect_Stream: kinect %d open\n", _index);
+    return device;
+}
+
+void Kinect_Stream::close_device(Kinect_Source * device){
+    device->set_recorder(NULL);
+    if (_opened_replay){
+        delete device;
+    } else {
+        XenFreenectDevice * sensor = static_cast<XenFreenectDevice *>(device);
+        try {
+            sensor->stopVideo();
+            sensor->stopDepth();
+        } catch (std::exception& e){
+            // gone already, most likely
+            printf("Kinect_Stream: stopping kinect %d: %s\n", _index, e.what());
+        }
+        _context->deleteDevice(_index);
+    }
+    // writes the index, now nothing more's coming
+    _recorder.close();
+}
+
+/* #########################################################################
+
+                                Depth_To_Xyz
+
+   ######################################################################### */
+// raw 11 bit to 1 / meters, from the same sources as the intrinsics
+static const float depth_a = -0.0030711f;
+static const float depth_b = 3.3309495f;
+
+Depth_To_Xyz::Depth_To_Xyz(int width, int height, float fx, float fy, float cx, float cy) :
+    _width(width),
+    _height(height),
+    _fx(fx),
+    _fy(fy),
+    _cx(cx),
+    _cy(cy),
+    _ray_x(width),
+    _ray_y(height),
+    _depth(NULL),
+    _out(NULL)
+{
+    for (int i = 0; i < 2048; i++){
+        float inv = depth_a * i + depth_b;
+        // 2047 is the sensor's "no reading"; past ~1084 the fit goes
+        //  negative, which is nonsense too
+        _meters[i] = (i < 2047 && inv > 0.0f) ? 1.0f / inv : 0.0f;
+    }
+    for (int u = 0; u < width; u++)
+        _ray_x[u] = (u - cx) / fx;
+    // y up
+    for (int v = 0; v < height; v++)
+        _ray_y[v] = -(v - cy) / fy;
+}
+
+void Depth_To_Xyz::allocate(kinect_xyz_t& out){
+    out.x.create(_height, _width, CV_32FC1);
+    out.y.create(_height, _width, CV_32FC1);
+    out.z.create(_height, _width, CV_32FC1);
+}
+
+void Depth_To_Xyz::convert(const unsigned short * depth, kinect_xyz_t& out, bool threaded){
+    allocate(out);
+    _depth = depth;
+    _out = &out;
+    if (threaded)
+        get_shared_thread_pool()->parallel_for(_height, convert_band, this, 16);
+    else
+        convert_rows(0, _height);
+}
+
+void Depth_To_Xyz::convert_band(void * self, int start, int end){
+    ((Depth_To_Xyz *) self)->convert_rows(start, end);
+}
+
+void Depth_To_Xyz::convert_rows(int y0, int y1){
+    const float * ray_x = &_ray_x[0];
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    for (int y = y0; y < y1; y++){
+        const unsigned short * raw = _depth + y * _width;
+        float * xs = _out->x.ptr<float>(y);
+        float * ys = _out->y.ptr<float>(y);
+        float * zs = _out->z.ptr<float>(y);
+        // lookups first, into z: there's no SSE2 gather
+        for (int x = 0; x < _width; x++)
+            zs[x] = _meters[raw[x] & 2047];
+        const __m128 ray_y = _mm_set1_ps(_ray_y[y]);
+        int x = 0;
+        for (; x + 4 <= _width; x += 4){
+            __m128 d = _mm_loadu_ps(zs + x);
+            _mm_storeu_ps(xs + x, _mm_mul_ps(d, _mm_loadu_ps(ray_x + x)));
+            _mm_storeu_ps(ys + x, _mm_mul_ps(d, ray_y));
+            _mm_storeu_ps(zs + x, _mm_xor_ps(d, sign));
+        }
+        for (; x < _width; x++){
+            float d = zs[x];
+            xs[x] = d * ray_x[x];
+            ys[x] = d * _ray_y[y];
+            zs[x] = -d;
+        }
+    }
+}
+
+void Depth_To_Xyz::convert_reference(const unsigned short * depth, kinect_xyz_t& out){
+    allocate(out);
+    for (int v = 0; v < _height; v++){
+        float * xs = out.x.ptr<float>(v);
+        float * ys = out.y.ptr<float>(v);
+        float * zs = out.z.ptr<float>(v);
+        for (int u = 0; u < _width; u++){
+            int raw = depth[v * _width + u];
+            float inv = depth_a * raw + depth_b;
+            if (raw >= 2047 || inv <= 0.0f){
+                xs[u] = ys[u] = zs[u] = 0.0f;
+                continue;
+            }
+            float d = 1.0f / inv;
+            xs[u] = (u - _cx) / _fx * d;
+            ys[u] = -(v - _cy) / _fy * d;
+            zs[u] = -d;
+        }
+    }
+}
+
+// largest difference between two results, over all three planes
+static double max_xyz_difference(kinect_xyz_t& a, kinect_xyz_t& b){
+    double worst = norm(a.x, b.x, NORM_INF);
+    double d = norm(a.y, b.y, NORM_INF);
+    worst = d > worst ? d : worst;
+    d = norm(a.z, b.z, NORM_INF);
+    return d > worst ? d : worst;
+}
+
+void xen_rift::benchmark_depth_to_xyz(int frames){
+    if (frames < 1)
+        frames = 1;
+    int width = 640, height = 480;
+    // a slope from near to far, with speckles of no reading like a
+    //  real frame's edges and shadows
+    vector<unsigned short> depth(width * height);
+    for (int v = 0; v < height; v++){
+        for (int u = 0; u < width; u++){
+            if (rand() % 10 == 0)
+                depth[v * width + u] = 2047;
+            else
+                depth[v * width + u] = (unsigned short) (500 + (u + v) % 550);
+        }
+    }
+    Depth_To_Xyz converter(width, height);
+    kinect_xyz_t reference, out;
+
+    printf("Depth_To_Xyz: %dx%d, %d frames, %d threads\n", width, height, frames,
+        get_shared_thread_pool()->num_threads());
+    double start = get_time_ms();
+    for (int i = 0; i < frames; i++)
+        converter.convert_reference(&depth[0], reference);
+    double reference_ms = (get_time_ms() - start) / frames;
+    printf("  a pixel at a time: %0.3f ms/frame\n", reference_ms);
+
+    start = get_time_ms();
+    for (int i = 0; i < frames; i++)
+        converter.convert(&depth[0], out, false);
+    double single_ms = (get_time_ms() - start) / frames;
+    printf("  table + SSE, 1 thread: %0.3f ms/frame (%0.1fx), max diff %g m\n", single_ms,
+        reference_ms / single_ms, max_xyz_difference(reference, out));
+
+    start = get_time_ms();
+    for (int i = 0; i < frames; i++)
+        converter.convert(&depth[0], out, true);
+    double threaded_ms = (get_time_ms() - start) / frames;
+    printf("  table + SSE, threaded: %0.3f ms/frame (%0.1fx), max diff %g m\n", threaded_ms,
+        reference_ms / threaded_ms, max_xyz_difference(reference, out));
+}
+
+/* #########################################################################
+
+                                Depth_Filter
+
+   ######################################################################### */
+// Meters to RGB pixels, projectively: Kinect_Point_Cloud's
+//  metric_to_rgb, row major. From a combination of nicolas burrus's
+//  calibration post and some python code.
+//  -- freenect examples
+static const float metric_to_rgb[4][4] = {
+    { 5.34866271e+02f,  -4.70724694e+00f,  -3.19670762e+02f,  -6.98445586e+00f},
+    { 3.89654806e+00f,  -5.28843603e+02f,  -2.60999685e+02f,   3.31139785e+00f},
+    { 0.00000000e+00f,   0.00000000e+00f,   0.00000000e+00f,   0.00000000e+00f},
+    { 1.74704200e-02f,  -1.22753400e-02f,  -9.99772000e-01f,   1.09167360e-02f}
+};
+// 3x3 spatial weights: a gaussian of one pixel
+static const float filter_edge_weight = 0.6065f;
+static const float filter_corner_weight = 0.3679f;
+// Padded depth where there's no reading. Far enough below any reading
+//  that a neighbour's weight from it is nothing, so the 3x3 needn't
+//  mask them out; below zero, so one compare still finds them.
+static const float filter_no_reading = -1e9f;
+
+Depth_Filter::Depth_Filter(int width, int height) :
+    _width(width),
+    _height(height),
+    // room for a whole number of SSE vectors a row, then the border
+    _stride(((width + 3) & ~3) + 2),
+    _average(_stride * height, 0.0f),
+    _age(_stride * height, 0.0f),
+    _depth(NULL),
+    _rgb(NULL),
+    _out(NULL),
+    _filter_ms(0.0)
+{
+    _config.spatial = true;
+    _config.depth_sigma = 3.0f;
+    _config.guide_sigma = 20.0f;
+    _config.temporal = true;
+    _config.alpha = 0.4f;
+    _config.motion_threshold = 8.0f;
+    _config.hold_frames = 2;
+    _config.fill_holes = true;
+    _config.max_hole = 8;
+
+    // 2047 is the sensor's "no reading"; past ~1084 the fit goes
+    //  negative
+    _raw_limit = 0;
+    while (_raw_limit < 2047 && depth_a * _raw_limit + depth_b > 0.0f)
+        _raw_limit++;
+    // Depth_To_Xyz's default intrinsics. A depth pixel is at
+    //  z * (rx, ry, -1), so each RGB coordinate is z times a sum of a
+    //  column and a row term, plus an offset.
+    static const int rgb_rows[3] = {0, 1, 3};
+    for (int k = 0; k < 3; k++){
+        const float * m = metric_to_rgb[rgb_rows[k]];
+        _rgb_col[k].resize(_stride);
+        _rgb_row[k].resize(height);
+        for (int u = 0; u < _stride; u++)
+            _rgb_col[k][u] = m[0] * (u - 339.5f) / 594.21f;
+        for (int v = 0; v < height; v++)
+            _rgb_row[k][v] = -m[1] * (v - 242.7f) / 591.04f - m[2];
+        _rgb_offset[k] = m[3];
+    }
+}
+
+void Depth_Filter::reset(){
+    std::fill(_average.begin(), _average.end(), 0.0f);
+    std::fill(_age.begin(), _age.end(), 0.0f);
+}
+
+void Depth_Filter::apply(const unsigned short * depth, const unsigned char * rgb, Mat& out){
+    double start = get_time_ms();
+    out.create(_height, _width, CV_16UC1);
+    _depth = depth;
+    _rgb = _config.spatial ? rgb : NULL;
+    _out = &out;
+    get_shared_thread_pool()->parallel_for(_height, filter_band, this, 16);
+    _depth = NULL;
+    _rgb = NULL;
+    _out = NULL;
+    _filter_ms = get_time_ms() - start;
+}
+
+void Depth_Filter::filter_band(void * self, int start, int end){
+    ((Depth_Filter *) self)->filter_rows(start, end);
+}
+
+static inline __m128 select_ps(__m128 mask, __m128 a, __m128 b){
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+void Depth_Filter::prepare_row(int y, float * depth, float * guide){
+    if (y < 0 || y >= _height){
+        std::fill(depth, depth + _width, filter_no_reading);
+        return;
+    }
+    const __m128i zero_i = _mm_setzero_si128();
+    const __m128i raw_mask = _mm_set1_epi32(2047);
+    const __m128i raw_limit = _mm_set1_epi32(_raw_limit);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 two = _mm_set1_ps(2.0f);
+    const __m128 no_reading = _mm_set1_ps(filter_no_reading);
+    const __m128 width = _mm_set1_ps((float) _width);
+    const __m128i max_u = _mm_set1_epi32(_width);
+    const __m128i max_v = _mm_set1_epi32(_height);
+    const __m128i none = _mm_set1_epi32(-1);
+    // the guide's four byte reads would run one byte off the end of
+    //  the frame at its last pixel, so that one's left out
+    const __m128i last_pixel = _mm_set1_epi32(_width * _height - 1);
+    const __m128i luma_weights = _mm_setr_epi16(77, 150, 29, 0, 77, 150, 29, 0);
+    const unsigned short * raw = _depth + y * _width;
+    int x = 0;
+    for (; x + 4 <= _width; x += 4){
+        __m128i r = _mm_and_si128(
+            _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *) (raw + x)), zero_i),
+            raw_mask);
+        __m128 valid = _mm_castsi128_ps(_mm_cmplt_epi32(r, raw_limit));
+        _mm_storeu_ps(depth + x, select_ps(valid, _mm_cvtepi32_ps(r), no_reading));
+    }
+    for (; x < _width; x++){
+        int r = raw[x] & 2047;
+        depth[x] = r < _raw_limit ? (float) r : filter_no_reading;
+    }
+    if (!_rgb)
+        return;
+
+    // offset * inverse distance is offset * (depth_a * raw +
+    //  depth_b); the depth_b part goes in with the row
+    const __m128 row_x = _mm_set1_ps(_rgb_row[0][y] + _rgb_offset[0] * depth_b);
+    const __m128 row_y = _mm_set1_ps(_rgb_row[1][y] + _rgb_offset[1] * depth_b);
+    const __m128 row_w = _mm_set1_ps(_rgb_row[2][y] + _rgb_offset[2] * depth_b);
+    const __m128 per_raw_x = _mm_set1_ps(_rgb_offset[0] * depth_a);
+    const __m128 per_raw_y = _mm_set1_ps(_rgb_offset[1] * depth_a);
+    const __m128 per_raw_w = _mm_set1_ps(_rgb_offset[2] * depth_a);
+    for (x = 0; x < _width; x += 4){
+        __m128 d = _mm_loadu_ps(depth + x);
+        __m128 cx = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(&_rgb_col[0][x]), row_x),
+                               _mm_mul_ps(per_raw_x, d));
+        __m128 cy = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(&_rgb_col[1][x]), row_y),
+                               _mm_mul_ps(per_raw_y, d));
+        __m128 cw = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(&_rgb_col[2][x]), row_w),
+                               _mm_mul_ps(per_raw_w, d));
+        // reciprocal estimate and a Newton step: plenty for a pixel
+        //  index, and far cheaper than a divide
+        __m128 inv_w = _mm_rcp_ps(cw);
+        inv_w = _mm_mul_ps(inv_w, _mm_sub_ps(two, _mm_mul_ps(cw, inv_w)));
+        __m128i u = _mm_cvttps_epi32(_mm_mul_ps(cx, inv_w));
+        __m128i v = _mm_cvttps_epi32(_mm_mul_ps(cy, inv_w));
+        // no 32 bit multiply in SSE2; a frame's pixel count is
+        //  exact in a float
+        __m128i pixel = _mm_cvttps_epi32(_mm_add_ps(
+            _mm_mul_ps(_mm_cvtepi32_ps(v), width), _mm_cvtepi32_ps(u)));
+        __m128i inside = _mm_and_si128(
+            _mm_and_si128(_mm_cmpgt_epi32(u, none), _mm_cmplt_epi32(u, max_u)),
+            _mm_and_si128(_mm_cmpgt_epi32(v, none), _mm_cmplt_epi32(v, max_v)));
+        inside = _mm_and_si128(inside, _mm_cmplt_epi32(pixel, last_pixel));
+        inside = _mm_and_si128(inside, _mm_castps_si128(_mm_cmpgt_ps(d, zero)));
+        // byte offsets, pixel 0's for the ones outside
+        __m128i offset = _mm_and_si128(inside,
+            _mm_add_epi32(pixel, _mm_add_epi32(pixel, pixel)));
+
+        // No SSE2 gather, so each pixel's R G B (and the next
+        //  one's R) is fetched on its own; the luma is then four
+        //  at a time
+        int offsets[4];
+        int rgbx[4];
+        _mm_storeu_si128((__m128i *) offsets, offset);
+        for (int i = 0; i < 4; i++)
+            memcpy(&rgbx[i], _rgb + offsets[i], 4);
+        // built from registers; four stores read back as one load
+        //  would stall
+        __m128i bytes = _mm_setr_epi32(rgbx[0], rgbx[1], rgbx[2], rgbx[3]);
+        __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(bytes, zero_i), luma_weights);
+        __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(bytes, zero_i), luma_weights);
+        // each pixel's R + G terms and B term, side by side
+        __m128 rg = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi),
+                                   _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 b = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi),
+                                  _MM_SHUFFLE(3, 1, 3, 1));
+        __m128i luma = _mm_srli_epi32(_mm_add_epi32(_mm_castps_si128(rg),
+                                                    _mm_castps_si128(b)), 8);
+        _mm_storeu_ps(guide + x, _mm_and_ps(_mm_cvtepi32_ps(luma), _mm_castsi128_ps(inside)));
+    }
+}
+
+// A neighbour's weight is spatial / ((1 + dd^2 / depth_sigma^2) (1 +
+//  dg^2 / guide_sigma^2)), or just the first factor unguided.
+//  inv_spatial is 1 / spatial and inv_spatial_depth that over
+//  depth_sigma^2, so it comes to one reciprocal. 32 bit MSVC won't
+//  take more than three __m128s by value, hence the references.
+static inline __m128 depth_falloff(const __m128& d, const __m128& center,
+                                   const __m128& inv_spatial, const __m128& inv_spatial_depth){
+    __m128 dd = _mm_sub_ps(d, center);
+    return _mm_add_ps(inv_spatial, _mm_mul_ps(_mm_mul_ps(dd, dd), inv_spatial_depth));
+}
+
+// Adds a neighbour's weight and weighted depth to the 3x3 sums. One
+//  with no reading is filter_no_reading, whose weight comes to
+//  nothing.
+static inline void add_tap(const __m128& d, const __m128& falloff, __m128& sum_w, __m128& sum_wd){
+    __m128 w = _mm_rcp_ps(falloff);
+    sum_w = _mm_add_ps(sum_w, w);
+    sum_wd = _mm_add_ps(sum_wd, _mm_mul_ps(w, d));
+}
+
+static inline void bilateral_tap(const float * depth, const __m128& center,
+                                 const __m128& inv_spatial, const __m128& inv_spatial_depth,
+                                 __m128& sum_w, __m128& sum_wd){
+    __m128 d = _mm_loadu_ps(depth);
+    add_tap(d, depth_falloff(d, center, inv_spatial, inv_spatial_depth), sum_w, sum_wd);
+}
+
+static inline void guided_tap(const float * depth, const float * guide,
+                              const __m128& center, const __m128& center_guide,
+                              const __m128& inv_spatial, const __m128& inv_spatial_depth,
+                              const __m128& guide_scale, __m128& sum_w, __m128& sum_wd){
+    __m128 d = _mm_loadu_ps(depth);
+    __m128 dg = _mm_sub_ps(_mm_loadu_ps(guide), center_guide);
+    __m128 guide_falloff = _mm_add_ps(_mm_set1_ps(1.0f),
+                                      _mm_mul_ps(_mm_mul_ps(dg, dg), guide_scale));
+    add_tap(d, _mm_mul_ps(depth_falloff(d, center, inv_spatial, inv_spatial_depth),
+                          guide_falloff), sum_w, sum_wd);
+}
+
+// sum_wd / sum_w. sum_w is at least the centre's 1, and an estimate
+//  and a Newton step is well under a raw unit off.
+static inline __m128 weighted_mean(const __m128& sum_w, const __m128& sum_wd){
+    __m128 inv_w = _mm_rcp_ps(sum_w);
+    inv_w = _mm_mul_ps(inv_w, _mm_sub_ps(_mm_set1_ps(2.0f), _mm_mul_ps(sum_w, inv_w)));
+    return _mm_mul_ps(sum_wd, inv_w);
+}
+
+// The 3x3 around depth[1][0], four pixels; depth[0] and depth[2] are
+//  the rows above and below. The centre counts 1.
+static inline __m128 bilateral_3x3(const float * const * depth,
+                                   const __m128& edge, const __m128& edge_depth,
+                                   const __m128& corner, const __m128& corner_depth){
+    __m128 center = _mm_loadu_ps(depth[1]);
+    __m128 sum_w = _mm_set1_ps(1.0f);
+    __m128 sum_wd = center;
+    bilateral_tap(depth[0] - 1, center, corner, corner_depth, sum_w, sum_wd);
+    bilateral_tap(depth[0], center, edge, edge_depth, sum_w, sum_wd);
+    bilateral_tap(depth[0] + 1, center, corner, corner_depth, sum_w, sum_wd);
+    bilateral_tap(depth[1] - 1, center, edge, edge_depth, sum_w, sum_wd);
+    bilateral_tap(depth[1] + 1, center, edge, edge_depth, sum_w, sum_wd);
+    bilateral_tap(depth[2] - 1, center, corner, corner_depth, sum_w, sum_wd);
+    bilateral_tap(depth[2], center, edge, edge_depth, sum_w, sum_wd);
+    bilateral_tap(depth[2] + 1, center, corner, corner_depth, sum_w, sum_wd);
+    return weighted_mean(sum_w, sum_wd);
+}
+
+// the same, guided
+static inline __m128 guided_bilateral_3x3(const float * const * depth, const float * const * guide,
+                                          const __m128& edge, const __m128& edge_depth,
+                                          const __m128& corner, const __m128& corner_depth,
+                                          const __m128& guide_scale){
+    __m128 center = _mm_loadu_ps(depth[1]);
+    __m128 center_guide = _mm_loadu_ps(guide[1]);
+    __m128 sum_w = _mm_set1_ps(1.0f);
+    __m128 sum_wd = center;
+    guided_tap(depth[0] - 1, guide[0] - 1, center, center_guide, corner, corner_depth,
+               guide_scale, sum_w, sum_wd);
+    guided_tap(depth[0], guide[0], center, center_guide, edge, edge_depth,
+               guide_scale, sum_w, sum_wd);
+    guided_tap(depth[0] + 1, guide[0] + 1, center, center_guide, corner, corner_depth,
+               guide_scale, sum_w, sum_wd);
+    guided_tap(depth[1] - 1, guide[1] - 1, center, center_guide, edge, edge_depth,
+               guide_scale, sum_w, sum_wd);
+    guided_tap(depth[1] + 1, guide[1] + 1, center, center_guide, edge, edge_depth,
+               guide_scale, sum_w, sum_wd);
+    guided_tap(depth[2] - 1, guide[2] - 1, center, center_guide, corner, corner_depth,
+               guide_scale, sum_w, sum_wd);
+    guided_tap(depth[2], guide[2], center, center_guide, edge, edge_depth,
+               guide_scale, sum_w, sum_wd);
+    guided_tap(depth[2] + 1, guide[2] + 1, center, center_guide, corner, corner_depth,
+               guide_scale, sum_w, sum_wd);
+    return weighted_mean(sum_w, sum_wd);
+}
+
+void Depth_Filter::filter_rows(int y0, int y1){
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    const float depth_scale = 1.0f / (_config.depth_sigma * _config.depth_sigma);
+    const __m128 edge = _mm_set1_ps(1.0f / filter_edge_weight);
+    const __m128 edge_depth = _mm_set1_ps(depth_scale / filter_edge_weight);
+    const __m128 corner = _mm_set1_ps(1.0f / filter_corner_weight);
+    const __m128 corner_depth = _mm_set1_ps(depth_scale / filter_corner_weight);
+    const __m128 guide_scale = _mm_set1_ps(1.0f / (_config.guide_sigma * _config.guide_sigma));
+    const bool guided = _rgb != NULL;
+    const __m128 alpha = _mm_set1_ps(_config.alpha);
+    const __m128 motion = _mm_set1_ps(_config.motion_threshold);
+    const __m128 hold = _mm_set1_ps((float) _config.hold_frames);
+    const __m128 age_cap = _mm_set1_ps((float) _config.hold_frames + 1.0f);
+    const __m128 invalid = _mm_set1_ps(2047.0f);
+    vector<unsigned short> row(_stride);
+
+    // above, this and below, for this band's own use; each row moves up
+    //  one as the band moves down, and the one that drops off the top
+    //  gets the next row below
+    vector<float> depth_rows(3 * _stride, filter_no_reading);
+    vector<float> guide_rows(3 * _stride, 0.0f);
+    float * depth_row[3];
+    float * guide_row[3];
+    for (int k = 0; k < 3; k++){
+        depth_row[k] = &depth_rows[k * _stride + 1];
+        guide_row[k] = &guide_rows[k * _stride + 1];
+    }
+    prepare_row(y0 - 1, depth_row[0], guide_row[0]);
+    prepare_row(y0, depth_row[1], guide_row[1]);
+
+    for (int y = y0; y < y1; y++){
+        prepare_row(y + 1, depth_row[2], guide_row[2]);
+        float * average = &_average[y * _stride];
+        float * age = &_age[y * _stride];
+        for (int x = 0; x < _width; x += 4){
+            const float * depth[3] = {depth_row[0] + x, depth_row[1] + x, depth_row[2] + x};
+            const float * guide[3] = {guide_row[0] + x, guide_row[1] + x, guide_row[2] + x};
+            __m128 center = _mm_loadu_ps(depth[1]);
+            __m128 valid = _mm_cmpgt_ps(center, zero);
+            __m128 filtered = center;
+            if (_config.spatial){
+                if (guided)
+                    filtered = guided_bilateral_3x3(depth, guide, edge, edge_depth,
+                                                    corner, corner_depth, guide_scale);
+                else
+                    filtered = bilateral_3x3(depth, edge, edge_depth, corner, corner_depth);
+                // a pixel with no reading stays without one; filling is
+                //  hole filling's job
+                filtered = _mm_and_ps(filtered, valid);
+            }
+
+            __m128 result = filtered;
+            if (_config.temporal){
+                __m128 previous = _mm_loadu_ps(average + x);
+                __m128 moved = _mm_cmpgt_ps(_mm_and_ps(_mm_sub_ps(filtered, previous), abs_mask),
+                                            motion);
+                __m128 restart = _mm_or_ps(_mm_cmple_ps(previous, zero), moved);
+                __m128 blended = _mm_add_ps(previous,
+                                            _mm_mul_ps(alpha, _mm_sub_ps(filtered, previous)));
+                // dropouts keep the average for a few frames
+                __m128 frames = _mm_min_ps(_mm_add_ps(_mm_loadu_ps(age + x), one), age_cap);
+                frames = _mm_and_ps(frames, _mm_cmpeq_ps(valid, zero));
+                result = select_ps(valid, select_ps(restart, filtered, blended), previous);
+                result = _mm_and_ps(result, _mm_cmple_ps(frames, hold));
+                _mm_storeu_ps(average + x, result);
+                _mm_storeu_ps(age + x, frames);
+            }
+
+            __m128i out = _mm_cvtps_epi32(select_ps(_mm_cmpgt_ps(result, zero), result, invalid));
+            _mm_storel_epi64((__m128i *) &row[x], _mm_packs_epi32(out, out));
+        }
+        if (_config.fill_holes)
+            fill_row(&row[0]);
+        memcpy(_out->ptr<unsigned short>(y), &row[0], _width * sizeof(unsigned short));
+
+        float * top_depth = depth_row[0];
+        float * top_guide = guide_row[0];
+        for (int k = 0; k < 2; k++){
+            depth_row[k] = depth_row[k + 1];
+            guide_row[k] = guide_row[k + 1];
+        }
+        depth_row[2] = top_depth;
+        guide_row[2] = top_guide;
+    }
+}
+
+void Depth_Filter::fill_row(unsigned short * row){
+    const __m128i invalid = _mm_set1_epi16(2047);
+    int x = 0;
+    while (x < _width){
+        // most of a row has readings; skip it eight at a time
+        if (x + 8 <= _width){
+            __m128i v = _mm_loadu_si128((const __m128i *) (row + x));
+            if (!_mm_movemask_epi8(_mm_cmpeq_epi16(v, invalid))){
+                x += 8;
+                continue;
+            }
+        }
+        if (row[x] != 2047){
+            x++;
+            continue;
+        }
+        int start = x;
+        while (x < _width && row[x] == 2047)
+            x++;
+        // The farther side: a Kinect hole beside an edge is mostly
+        //  shadow, background the projector couldn't reach. Runs
+        //  touching the frame's edge have only one side to go on, so
+        //  they're left.
+        if (start > 0 && x < _width && x - start <= _config.max_hole){
+            unsigned short fill = row[start - 1] > row[x] ? row[start - 1] : row[x];
+            for (int i = start; i < x; i++)
+                row[i] = fill;
+        }
+    }
+}
+
+/* #########################################################################
+
+                             Depth_Filter_Thread
+
+   ######################################################################### */
+Depth_Filter_Thread::Depth_Filter_Thread(int width, int height) :
+    _width(width),
+    _height(height),
+    _thread_running(false),
+    _stopping(false),
+    _reset_requested(false),
+    _pending_depth(width * height),
+    _pending_rgb(width * height * 3),
+    _pending_guided(false),
+    _pending_fresh(false),
+    _ready_fresh(false),
+    _filter_ms(0.0),
+    _filter(width, height),
+    _working_depth(width * height),
+    _working_rgb(width * height * 3)
+{
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+    if (pthread_create(&_thread, NULL, &Depth_Filter_Thread::thread_main, this))
+        printf("Depth_Filter_Thread: couldn't start its thread\n");
+    else
+        _thread_running = true;
+}
+
+Depth_Filter_Thread::~Depth_Filter_Thread(){
+    pthread_mutex_lock(&_mutex);
+    _stopping = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+    if (_thread_running)
+        pthread_join(_thread, NULL);
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+}
+
+void Depth_Filter_Thread::submit(const unsigned short * depth, const unsigned char * rgb){
+    if (!depth)
+        return;
+    pthread_mutex_lock(&_mutex);
+    memcpy(&_pending_depth[0], depth, _pending_depth.size() * sizeof(unsigned short));
+    _pending_guided = rgb != NULL;
+    if (rgb)
+        memcpy(&_pending_rgb[0], rgb, _pending_rgb.size());
+    _pending_fresh = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+}
+
+bool Depth_Filter_Thread::get(Mat& out){
+    pthread_mutex_lock(&_mutex);
+    bool fresh = _ready_fresh;
+    if (fresh){
+        _ready.copyTo(out);
+        _ready_fresh = false;
+    }
+    pthread_mutex_unlock(&_mutex);
+    return fresh;
+}
+
+void Depth_Filter_Thread::reset(){
+    pthread_mutex_lock(&_mutex);
+    _reset_requested = true;
+    _pending_fresh = false;
+    _ready_fresh = false;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+}
+
+double Depth_Filter_Thread::filter_ms(){
+    pthread_mutex_lock(&_mutex);
+    double ret = _filter_ms;
+    pthread_mutex_unlock(&_mutex);
+    return ret;
+}
+
+void * Depth_Filter_Thread::thread_main(void * filter){
+    ((Depth_Filter_Thread *) filter)->thread_loop();
+    return NULL;
+}
+
+void Depth_Filter_Thread::thread_loop(){
+    while (true){
+        pthread_mutex_lock(&_mutex);
+        while (!_stopping && !_pending_fresh && !_reset_requested)
+            pthread_cond_wait(&_cond, &_mutex);
+        if (_stopping){
+            pthread_mutex_unlock(&_mutex);
+            break;
+        }
+        bool do_reset = _reset_requested;
+        _reset_requested = false;
+        bool have_frame = _pending_fresh;
+        bool guided = _pending_guided;
+        if (have_frame){
+            // trade buffers, so submit() can fill the old ones
+            _pending_depth.swap(_working_depth);
+            if (guided)
+                _pending_rgb.swap(_working_rgb);
+            _pending_fresh = false;
+        }
+        pthread_mutex_unlock(&_mutex);
+
+        if (do_reset)
+            _filter.reset();
+        if (!have_frame)
+            continue;
+        _filter.apply(&_working_depth[0], guided ? &_working_rgb[0] : NULL, _filtered);
+
+        pthread_mutex_lock(&_mutex);
+        // a reset since this frame started throws it away
+        if (!_reset_requested){
+            Mat tmp = _ready;
+            _ready = _filtered;
+            _filtered = tmp;
+            _ready_fresh = true;
+            _filter_ms = _filter.filter_ms();
+        }
+        pthread_mutex_unlock(&_mutex);
+    }
+}
+
+void xen_rift::benchmark_depth_filter(int frames){
+    if (frames < 1)
+        frames = 1;
+    int width = 640, height = 480;
+    // a wall with a box in front of it, a shadow of no reading beside
+    //  the box, a unit of flicker on every other pixel and speckles of
+    //  dropout; the RGB has the box a different color from the wall
+    vector<unsigned short> truth(width * height);
+    vector<unsigned char> rgb(width * height * 3);
+    for (int v = 0; v < height; v++){
+        for (int u = 0; u < width; u++){
+            bool box = u > 250 && u < 400 && v > 200 && v < 380;
+            truth[v * width + u] = (unsigned short) (box ? 700 : 850 + v / 8);
+            unsigned char * p = &rgb[(v * width + u) * 3];
+            p[0] = box ? 200 : 60;
+            p[1] = box ? 60 : 120;
+            p[2] = 90;
+        }
+    }
+    vector<vector<unsigned short> > noisy(8, truth);
+    for (size_t f = 0; f < noisy.size(); f++){
+        for (int v = 0; v < height; v++){
+            for (int u = 0; u < width; u++){
+                unsigned short& d = noisy[f][v * width + u];
+                if (u >= 400 && u < 406 && v > 200 && v < 380)
+                    d = 2047;
+                else if (rand() % 50 == 0)
+                    d = 2047;
+                else
+                    d = (unsigned short) (d + rand() % 3 - 1);
+            }
+        }
+    }
+
+    // what the whole filter gets of a 30 fps frame
+    const double budget_ms = 2.0;
+    Depth_Filter filter(width, height);
+    Mat out;
+    printf("Depth_Filter: %dx%d, %d frames, %d pool threads on %d cores\n", width, height,
+        frames, get_shared_thread_pool()->num_threads(), get_num_cores());
+    const char * names[4] = {"bilateral", "guided bilateral", "temporal", "everything, guided"};
+    for (int stage = 0; stage < 4; stage++){
+        depth_filter_config_t& config = filter.config();
+        config.spatial = stage != 2;
+        config.temporal = stage >= 2;
+        config.fill_holes = stage == 3;
+        const unsigned char * guide = (stage == 1 || stage == 3) ? &rgb[0] : NULL;
+        filter.reset();
+        double total_ms = 0.0, worst_ms = 0.0;
+        for (int i = 0; i < frames; i++){
+            filter.apply(&noisy[i % noisy.size()][0], guide, out);
+            total_ms += filter.filter_ms();
+            if (filter.filter_ms() > worst_ms)
+                worst_ms = filter.filter_ms();
+        }
+        // how far from the truth it ends up, over pixels that read
+        double error = 0.0;
+        int holes = 0, counted = 0;
+        const unsigned short * result = out.ptr<unsigned short>(0);
+        for (int i = 0; i < width * height; i++){
+            if (result[i] == 2047){
+                holes++;
+            } else {
+                error += fabs((double) result[i] - truth[i]);
+                counted++;
+            }
+        }
+        printf("  %s: %0.3f ms/frame (worst %0.3f), mean error %0.3f raw, %d holes\n",
+            names[stage], total_ms / frames, worst_ms, counted ? error / counted : 0.0,
+            holes);
+        if (stage == 3)
+            printf("  budget %0.1f ms: %s\n", budget_ms,
+                total_ms / frames <= budget_ms ? "met" : "NOT met");
+    }
+}
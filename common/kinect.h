@@ -21,6 +21,8 @@
 #include <cmath>
 #include <vector>
 #include <time.h>
+#include <string>
+#include <stdexcept>
 #include "../include/GL/glew.h"
 #include "../include/gl_helper.h"
 #include <gl/gl.h>
@@ -40,30 +42,449 @@
 #include "Eigen/Geometry"
 
 #include "xen_utils.h"
+#include "thread_pool.h"
+#include "stereo_recording.h"
 
 namespace xen_rift {
 
+    // Metric point per depth pixel, as three planes (x, y, z) of
+    //  CV_32FC1. Meters, Kinect looking down -z with y up, as drawn
+    //  by Kinect_Point_Cloud; all three are 0 where there's no reading.
+    typedef struct _kinect_xyz_t {
+        cv::Mat x;
+        cv::Mat y;
+        cv::Mat z;
+    } kinect_xyz_t;
 
-    class XenFreenectDevice : public Freenect::FreenectDevice {
+    // Raw 11 bit depth frames to kinect_xyz_t. Everything per pixel
+    //  that doesn't depend on the frame is worked out up front: a
+    //  2048 entry raw-to-meters table, like XenFreenectDevice's gamma
+    //  table, and the ray through each column and row. What's left is
+    //  a lookup and two multiplies a pixel, done four at a time in
+    //  row bands on the shared thread pool.
+    class Depth_To_Xyz {
+        public:
+            // Intrinsics default to the freenect examples' numbers
+            //  (ros kinect_node wiki, nicolas burrus' posts), as in
+            //  Kinect_Point_Cloud.
+            Depth_To_Xyz(int width = 640, int height = 480,
+                         float fx = 594.21f, float fy = 591.04f,
+                         float cx = 339.5f, float cy = 242.7f);
+
+            // depth is width x height FREENECT_DEPTH_11BIT
+            void convert(const unsigned short * depth, kinect_xyz_t& out,
+                         bool threaded = true);
+            // The same thing a pixel at a time, with a divide each, for
+            //  checking convert() against
+            void convert_reference(const unsigned short * depth, kinect_xyz_t& out);
+            // meters straight out from the sensor; 0 for no reading
+            float meters(unsigned short raw) { return _meters[raw & 2047]; }
+
+        protected:
+            static void convert_band(void * self, int start, int end);
+            void convert_rows(int y0, int y1);
+            void allocate(kinect_xyz_t& out);
+
+            int _width;
+            int _height;
+            float _fx, _fy, _cx, _cy;
+            float _meters[2048];
+            // x / depth for each column, y / depth for each row
+            std::vector<float> _ray_x;
+            std::vector<float> _ray_y;
+
+            // current convert()
+            const unsigned short * _depth;
+            kinect_xyz_t * _out;
+
+        private:
+    };
+
+    // Times Depth_To_Xyz on a made up frame, a pixel at a time against
+    //  one thread and then every thread, and prints the results.
+    void benchmark_depth_to_xyz(int frames = 200);
+
+    typedef struct _depth_filter_config_t {
+        // 3x3 bilateral, guided by the RGB frame when there is one
+        bool spatial;
+        // raw depth difference at which a neighbour's weight halves
+        float depth_sigma;
+        // and luma difference (0-255), for the guide
+        float guide_sigma;
+        // running average of each pixel over frames
+        bool temporal;
+        // new frame's share of the average
+        float alpha;
+        // raw depth change that counts as movement, and restarts the
+        //  average rather than smearing into it
+        float motion_threshold;
+        // frames a pixel that stops reading keeps its average
+        int hold_frames;
+        // fill runs of no reading along a row, up to max_hole wide,
+        //  from the farther side
+        bool fill_holes;
+        int max_hole;
+    } depth_filter_config_t;
+
+    // Cleans up raw Kinect depth before it's drawn, meshed or fused:
+    //  an edge-preserving spatial filter, a temporal average that
+    //  resets where things move, and hole filling, in that order.
+    //  Everything stays in raw units, which go as inverse distance:
+    //  the sensor's noise is about the same number of them near or
+    //  far, so one set of thresholds does for the whole range.
+    //
+    //  Weights are 1 / (1 + (diff / sigma)^2) rather than gaussians:
+    //  the same shape where it matters, and there's no SSE2 exp or
+    //  gather to do a table with. The guide is the RGB frame
+    //  reprojected onto the depth pixels with Kinect_Point_Cloud's
+    //  calibration, so its edges line up with depth's. Four pixels at
+    //  a time with SSE2, in row bands on the shared thread pool.
+    class Depth_Filter {
+        public:
+            Depth_Filter(int width = 640, int height = 480);
+
+            depth_filter_config_t& config() { return _config; }
+            // depth is width x height FREENECT_DEPTH_11BIT; rgb the
+            //  FREENECT_VIDEO_RGB frame to guide by, or NULL. out is
+            //  (re)allocated to width x height CV_16UC1 and gets the
+            //  filtered frame, with 2047 where there's still no
+            //  reading.
+            void apply(const unsigned short * depth, const unsigned char * rgb, cv::Mat& out);
+            // forget the temporal average, e.g. after a cut in replay
+            void reset();
+            double filter_ms() { return _filter_ms; }
+
+        protected:
+            static void filter_band(void * self, int start, int end);
+            // Row y's raw depth (a large negative value for no reading)
+            //  and guide luma, into a padded row; off the frame, all
+            //  no reading
+            void prepare_row(int y, float * depth, float * guide);
+            void filter_rows(int y0, int y1);
+            void fill_row(unsigned short * row);
+
+            int _width;
+            int _height;
+            depth_filter_config_t _config;
+            // raw values below this are readings; inverse distance
+            //  falls as raw rises, so everything past is nonsense
+            int _raw_limit;
+            // RGB pixel of a depth pixel: z * (col + row) + offset for
+            //  x, y and w, then x / w and y / w. Multiplied through by
+            //  1 / z, which is linear in raw, that's (col + row) +
+            //  offset * inverse distance, with no table lookup.
+            std::vector<float> _rgb_col[3];
+            std::vector<float> _rgb_row[3];
+            float _rgb_offset[3];
+
+            // Prepared rows have a border of no reading either side, so
+            //  the 3x3 needs no edge cases, and room for a whole number
+            //  of SSE vectors. A band prepares each row just before it's
+            //  filtered, into three it cycles through, so they're still
+            //  in cache.
+            int _stride;
+            // the temporal average, and frames since each pixel last
+            //  read
+            std::vector<float> _average;
+            std::vector<float> _age;
+
+            // current apply()
+            const unsigned short * _depth;
+            const unsigned char * _rgb;
+            cv::Mat * _out;
+            double _filter_ms;
+
+        private:
+    };
+
+    // A Depth_Filter on a thread of its own, so the render thread only
+    //  copies frames in and out. What comes out is a frame or so
+    //  behind what goes in.
+    class Depth_Filter_Thread {
+        public:
+            Depth_Filter_Thread(int width = 640, int height = 480);
+            ~Depth_Filter_Thread();
+
+            // Copies a depth frame and the RGB frame to guide it by (or
+            //  NULL), as Depth_Filter::apply takes them, to be
+            //  filtered. One the thread hasn't started on yet is
+            //  replaced.
+            void submit(const unsigned short * depth, const unsigned char * rgb);
+            // Copies the newest filtered frame into out; false if
+            //  there's been none since the last call.
+            bool get(cv::Mat& out);
+            // forgets the temporal average and any frames in flight
+            void reset();
+            // the last frame's
+            double filter_ms();
+
+        protected:
+            static void * thread_main(void * filter);
+            void thread_loop();
+
+            int _width;
+            int _height;
+            pthread_t _thread;
+            bool _thread_running;
+            pthread_mutex_t _mutex;
+            pthread_cond_t _cond;
+
+            // under _mutex
+            bool _stopping;
+            bool _reset_requested;
+            std::vector<unsigned short> _pending_depth;
+            std::vector<unsigned char> _pending_rgb;
+            bool _pending_guided;
+            bool _pending_fresh;
+            cv::Mat _ready;
+            bool _ready_fresh;
+            double _filter_ms;
+
+            // filter thread only
+            Depth_Filter _filter;
+            std::vector<unsigned short> _working_depth;
+            std::vector<unsigned char> _working_rgb;
+            cv::Mat _filtered;
+
+        private:
+    };
+
+    // Times Depth_Filter on a made up noisy frame, each stage and all
+    //  together, and prints the results.
+    void benchmark_depth_filter(int frames = 200);
+
+
+    // One stream's frames, handed from the thread that fills them to
+    //  the one that reads them without either waiting on the other.
+    //  Of three slots the writer owns one, the reader owns one, and
+    //  the third holds the newest finished frame; handing over is one
+    //  atomic swap with that third slot, by either side.
+    class Frame_Triple_Buffer {
+        public:
+            Frame_Triple_Buffer(int rows, int cols, int type);
+
+            // Writer: the slot to fill, then publish() it. Whatever
+            //  was published before and never read is dropped.
+            cv::Mat& back() { return _slots[_back]; }
+            void publish(uint32_t timestamp);
+
+            // Reader: takes the newest frame, if there's been one
+            //  since the last call. front() is then that frame, and
+            //  the writer leaves it alone until the next acquire().
+            bool acquire();
+            const cv::Mat& front() { return _slots[_front]; }
+            uint32_t front_timestamp() { return _timestamps[_front]; }
+
+            // frames published, and published but replaced before
+            //  anyone took them
+            long published() { return _published; }
+            long dropped() { return _dropped; }
+
+        protected:
+            cv::Mat _slots[3];
+            uint32_t _timestamps[3];
+            int _back;
+            int _front;
+            // index of the slot in between, | TRIPLE_BUFFER_FRESH if
+            //  the reader hasn't had it
+            volatile long _middle;
+            volatile long _published;
+            volatile long _dropped;
+
+        private:
+    };
+
+    // streams of a Kinect recording
+    #define KINECT_REC_DEPTH_STREAM 0
+    #define KINECT_REC_VIDEO_STREAM 1
+
+    // Where Kinect frames come from, as far as the rest of the code is
+    //  concerned: the live sensor (XenFreenectDevice) or a recording
+    //  of one (Kinect_Replay_Device). Whichever it is fills the
+    //  buffers from a thread of its own.
+    class Kinect_Source {
+        public:
+            Kinect_Source();
+            virtual ~Kinect_Source();
+
+            // The newest RGB (CV_8UC3) / 11 bit depth (CV_16UC1) frame,
+            //  if there's been one since the last call. output shares
+            //  the source's buffer, which is left alone until the next
+            //  call from the same thread: read it, don't keep it or
+            //  write to it. Neither copies or locks.
+            bool getVideo(cv::Mat& output, uint32_t * timestamp = NULL);
+            bool getDepth(cv::Mat& output, uint32_t * timestamp = NULL);
+            Frame_Triple_Buffer& video_frames() { return _video; }
+            Frame_Triple_Buffer& depth_frames() { return _depth; }
+
+            // While set, every frame also goes to recorder: depth as
+            //  KINECT_REC_DEPTH_STREAM, RGB (as BGR) as
+            //  KINECT_REC_VIDEO_STREAM. NULL stops; once it returns,
+            //  the recorder won't be handed anything more.
+            void set_recorder(Stereo_Recorder * recorder);
+
+        protected:
+            // the filling thread's side: the slot to fill, then
+            //  publish_*() it
+            cv::Mat& video_back() { return _video.back(); }
+            cv::Mat& depth_back() { return _depth.back(); }
+            void publish_video(uint32_t timestamp);
+            void publish_depth(uint32_t timestamp);
+
+            Frame_Triple_Buffer _video;
+            Frame_Triple_Buffer _depth;
+            pthread_mutex_t _recorder_mutex;
+            Stereo_Recorder * _recorder;
+            cv::Mat _record_bgr;
+
+        private:
+    };
+
+    class XenFreenectDevice : public Freenect::FreenectDevice, public Kinect_Source {
         public:
             XenFreenectDevice(freenect_context *_ctx, int _index);
+            // Do not call directly even in child
             void VideoCallback(void* _rgb, uint32_t timestamp);
             // Do not call directly even in child
             void DepthCallback(void* _depth, uint32_t timestamp);
-            bool getVideo(cv::Mat& output);
-            bool getDepth(cv::Mat& output);
-
         private:
-            std::vector<uint8_t> m_buffer_depth;
-            std::vector<uint8_t> m_buffer_rgb;
             std::vector<uint16_t> m_gamma;
-            cv::Mat depthMat;
-            cv::Mat rgbMat;
-            cv::Mat ownMat;
-            Mutex m_rgb_mutex;
-            Mutex m_depth_mutex;
-            bool m_new_rgb_frame;
-            bool m_new_depth_frame;
+    };
+
+    // Plays a Kinect recording (as Kinect_Source records them) as if
+    //  the Kinect were plugged in: frames arrive from its own thread at
+    //  the rate they were recorded, with their recorded timestamps.
+    class Kinect_Replay_Device : public Kinect_Source {
+        public:
+            // loop: start over at the end; otherwise stop, like a
+            //  Kinect that's gone quiet
+            Kinect_Replay_Device(const std::string& filename, bool loop = true);
+            ~Kinect_Replay_Device();
+            bool is_open() { return _thread_running; }
+
+            // ms from the start of the recording
+            void seek(double position_ms);
+            double position_ms();
+            double duration_ms() { return _replay.duration_ms(); }
+
+        protected:
+            static void * thread_main(void * device);
+            void thread_loop();
+            // decode frame i of a stream into its buffer and publish it
+            bool deliver(int stream, int i);
+
+            Stereo_Replay _replay;
+            bool _loop;
+            pthread_t _thread;
+            bool _thread_running;
+            pthread_mutex_t _mutex;
+            // under _mutex
+            bool _stopping;
+            // get_time_ms() at which playback was (or would have been)
+            //  at the start of the recording
+            double _start_ms;
+            cv::Mat _decoded;
+
+        private:
+    };
+
+    typedef enum _kinect_state_t {
+        KINECT_OFF=0,
+        KINECT_OPENING=1,
+        KINECT_STREAMING=2,
+        // open, but no depth for a while: unplugged, or USB trouble
+        KINECT_STALLED=3,
+        // couldn't open; start() again to retry
+        KINECT_FAILED=4
+    } kinect_state_t;
+
+    // One Kinect, opened and closed on a thread of its own; freenect's
+    //  event thread then fills XenFreenectDevice's buffers. Nothing
+    //  here ever waits on the sensor, so it's safe to drive from the
+    //  render loop. Everything but the constructor is for one thread
+    //  (the render thread) to call. It can play a recording in place
+    //  of the sensor, and record whatever it opens.
+    class Kinect_Stream {
+        public:
+            // stall_ms: no depth for this long counts as stalled
+            Kinect_Stream(int index = 0, double stall_ms = 500.0);
+            ~Kinect_Stream();
+
+            // Both return at once; the device follows on the stream's
+            //  thread.
+            void start();
+            void stop();
+            // From the next start(): play this Kinect recording instead
+            //  of opening the sensor ("" for the sensor again), and /
+            //  or record what's opened to this file ("" for none). The
+            //  first start() records to it, later ones (and reopens
+            //  after a stall) to name-1.ext, name-2.ext, ..., so
+            //  nothing recorded is overwritten. Depth is compressed
+            //  losslessly, RGB as jpeg.
+            void set_replay(const std::string& filename);
+            void set_record(const std::string& filename);
+
+            // Once a display frame: picks up the device once it's open,
+            //  and works out the stream's health from what's arrived.
+            void poll();
+            kinect_state_t state();
+            // "K: OFF", "K: 30/30 fps" (depth / RGB), "K: stalled", ...
+            std::string status();
+            double depth_fps() { return _fps[0]; }
+            double video_fps() { return _fps[1]; }
+
+            // As Kinect_Source's getDepth / getVideo; false when
+            //  there's nothing new or no device
+            bool get_depth(cv::Mat& output, uint32_t * timestamp = NULL);
+            bool get_video(cv::Mat& output, uint32_t * timestamp = NULL);
+
+        protected:
+            static void * thread_main(void * stream);
+            void thread_loop();
+            // run on the stream's thread, without the lock
+            XenFreenectDevice * open_sensor();
+            Kinect_Source * open_device();
+            void close_device(Kinect_Source * device);
+
+            int _index;
+            double _stall_ms;
+            pthread_t _thread;
+            bool _thread_running;
+            pthread_mutex_t _mutex;
+            pthread_cond_t _cond;
+
+            // under _mutex
+            bool _stopping;
+            bool _want_open;
+            bool _open_failed;
+            std::string _replay_file;
+            std::string _record_file;
+            // open and streaming, as far as the stream's thread is
+            //  concerned
+            Kinect_Source * _opened;
+            Freenect::Freenect * _context;
+            // set along with _opened: what it really is
+            bool _opened_replay;
+            // stream's thread only, but open or closed only while
+            //  _opened is NULL
+            Stereo_Recorder _recorder;
+            // stream's thread only: the record file the last recording
+            //  was named after, and how many have been
+            std::string _recorded_file;
+            int _recordings;
+
+            // render thread only: the device it reads from, and its
+            //  health
+            Kinect_Source * _device;
+            bool _device_replay;
+            bool _device_recording;
+            long _seen[2];
+            double _last_arrival_ms;
+            double _rate_start_ms;
+            long _rate_start_count[2];
+            double _fps[2];
+
+        private:
     };
 
 }
@@ -0,0 +1,455 @@
+/* #########################################################################
+        Kinect Cloud -- draws a Kinect depth frame as a point cloud
+            with the work on the GPU: raw depth goes up as a 16 bit
+            texture, and the vertex shader unprojects it and looks up
+            each point's color in the registered RGB frame.
+
+        The vertex buffer only ever holds pixel coordinates, so it's
+        built once; a frame costs one PBO upload of depth (and one of
+        RGB, when there's a new one).
+
+        The mesh modes draw through the same vertices and shaders,
+        with an index buffer from Kinect_Grid_Mesher, rebuilt and
+        reuploaded each depth frame. Where they tear at
+        discontinuities is worked out on the CPU rather than in a
+        geometry shader, which GLSL 1.20 doesn't have; deciding per
+        triangle needs all three depths at once, and the quadtree
+        can't be done per vertex at all. With decimation on, a room
+        typically draws in a fraction of the grid's ~600k triangles.
+
+   ######################################################################### */
+
+#include "kinect_cloud.h"
+
+using namespace std;
+using namespace xen_rift;
+
+// Raw (u, v, depth, 1) to meters, projectively: out w is 1 / z.
+//  These numbers come from a combination of the ros kinect_node wiki,
+//  and nicolas burrus' posts.
+//  -- freenect examples
+static const float fx = 594.21f;
+static const float fy = 591.04f;
+static const float cx = 339.5f;
+static const float cy = 242.7f;
+static const GLfloat depth_to_metric[16] = {
+    1/fx,     0,  0, 0,
+    0,    -1/fy,  0, 0,
+    0,       0,  0, -0.0030711f,
+    -cx/fx, cy/fy, -1, 3.3309495f
+};
+// Meters to RGB pixels, projectively. From a combination of nicolas
+//  burrus's calibration post and some python code.
+//  -- freenect examples
+static const GLfloat metric_to_rgb[16] = {
+    5.34866271e+02f,   3.89654806e+00f,   0.00000000e+00f,   1.74704200e-02f,
+    -4.70724694e+00f,  -5.28843603e+02f,   0.00000000e+00f,  -1.22753400e-02f,
+    -3.19670762e+02f,  -2.60999685e+02f,   0.00000000e+00f,  -9.99772000e-01f,
+    -6.98445586e+00f,   3.31139785e+00f,   0.00000000e+00f,   1.09167360e-02f
+};
+
+GLuint Kinect_Point_Cloud::_program = 0;
+bool Kinect_Point_Cloud::_program_failed = false;
+
+/* #########################################################################
+
+                              Kinect_Grid_Mesher
+
+   ######################################################################### */
+Kinect_Grid_Mesher::Kinect_Grid_Mesher(int width, int height) :
+    _width(width),
+    _height(height),
+    _max_jump(0.05f),
+    _flat_tolerance(2.0f),
+    _decimate(false),
+    _depth(NULL),
+    _leaf((width - 1) * (height - 1), 1),
+    _strips((height - 1 + KINECT_MESH_BLOCK - 1) / KINECT_MESH_BLOCK),
+    _num_indices(0),
+    _build_ms(0.0)
+{
+    for (int i = 0; i < 2048; i++){
+        // out w of depth_to_metric; past ~1084 it goes negative
+        float inv = i * depth_to_metric[11] + depth_to_metric[15];
+        _meters[i] = (i < KINECT_DEPTH_INVALID && inv > 0.0f) ? 1.0f / inv : 0.0f;
+    }
+}
+
+void Kinect_Grid_Mesher::build(const unsigned short * depth){
+    double start = get_time_ms();
+    _depth = depth;
+    Thread_Pool * pool = get_shared_thread_pool();
+    // every strip's leaves have to be settled before any strip emits:
+    //  fans look across strip edges
+    if (_decimate)
+        pool->parallel_for((int) _strips.size(), leaf_band, this, 1);
+    pool->parallel_for((int) _strips.size(), emit_band, this, 1);
+    _num_indices = 0;
+    for (size_t i = 0; i < _strips.size(); i++)
+        _num_indices += (int) _strips[i].size();
+    _depth = NULL;
+    _build_ms = get_time_ms() - start;
+}
+
+void Kinect_Grid_Mesher::leaf_band(void * self, int start, int end){
+    Kinect_Grid_Mesher * mesher = (Kinect_Grid_Mesher *) self;
+    int cells_wide = mesher->_width - 1;
+    for (int strip = start; strip < end; strip++){
+        for (int x = 0; x < cells_wide; x += KINECT_MESH_BLOCK)
+            mesher->subdivide(x, strip * KINECT_MESH_BLOCK, KINECT_MESH_BLOCK);
+    }
+}
+
+void Kinect_Grid_Mesher::subdivide(int x, int y, int size){
+    // cells of 2 would be drawn with as many triangles as their four
+    //  full resolution cells, so 4 is as small as merging goes
+    if (size >= 4 && x + size <= _width - 1 && y + size <= _height - 1 && flat(x, y, size)){
+        set_leaf(x, y, size, size);
+    } else if (size > 4){
+        int half = size / 2;
+        subdivide(x, y, half);
+        subdivide(x + half, y, half);
+        subdivide(x, y + half, half);
+        subdivide(x + half, y + half, half);
+    } else {
+        set_leaf(x, y, size, 1);
+    }
+}
+
+bool Kinect_Grid_Mesher::flat(int x, int y, int size){
+    const unsigned short * d = _depth + y * _width + x;
+    int d00 = d[0], d10 = d[size], d01 = d[size * _width], d11 = d[size * _width + size];
+    // a plane steep enough to be torn at full resolution shouldn't be
+    //  papered over here: the corners may spread no more than size
+    //  full resolution steps would
+    float lo = _meters[d00], hi = _meters[d00];
+    float corners[3] = {_meters[d10], _meters[d01], _meters[d11]};
+    for (int k = 0; k < 3; k++){
+        lo = corners[k] < lo ? corners[k] : lo;
+        hi = corners[k] > hi ? corners[k] : hi;
+    }
+    if (lo <= 0.0f || hi - lo > _max_jump * size * lo)
+        return false;
+    // bilinear through the corners, everything scaled by size^2 to stay
+    //  in integers
+    int tolerance = (int) (_flat_tolerance * size * size);
+    for (int j = 0; j <= size; j++){
+        const unsigned short * row = d + j * _width;
+        int left = (size - j) * d00 + j * d01;
+        int right = (size - j) * d10 + j * d11;
+        for (int i = 0; i <= size; i++){
+            if (_meters[row[i]] == 0.0f)
+                return false;
+            int fit = (size - i) * left + i * right;
+            int diff = row[i] * size * size - fit;
+            if (diff > tolerance || diff < -tolerance)
+                return false;
+        }
+    }
+    return true;
+}
+
+void Kinect_Grid_Mesher::set_leaf(int x, int y, int size, int leaf){
+    int cells_wide = _width - 1;
+    int x1 = x + size < cells_wide ? x + size : cells_wide;
+    int y1 = y + size < _height - 1 ? y + size : _height - 1;
+    for (int j = y; j < y1; j++)
+        memset(&_leaf[j * cells_wide + x], leaf, x1 - x);
+}
+
+int Kinect_Grid_Mesher::edge_step(int x, int y, int size, int side){
+    int cells_wide = _width - 1;
+    int cells_high = _height - 1;
+    int step = size;
+    // 0 top, 1 right, 2 bottom, 3 left
+    if (side == 0 || side == 2){
+        int row = side == 0 ? y - 1 : y + size;
+        if (row < 0 || row >= cells_high)
+            return step;
+        for (int i = x; i < x + size; i++)
+            step = _leaf[row * cells_wide + i] < step ? _leaf[row * cells_wide + i] : step;
+    } else {
+        int col = side == 3 ? x - 1 : x + size;
+        if (col < 0 || col >= cells_wide)
+            return step;
+        for (int j = y; j < y + size; j++)
+            step = _leaf[j * cells_wide + col] < step ? _leaf[j * cells_wide + col] : step;
+    }
+    return step;
+}
+
+void Kinect_Grid_Mesher::emit_band(void * self, int start, int end){
+    Kinect_Grid_Mesher * mesher = (Kinect_Grid_Mesher *) self;
+    int cells_wide = mesher->_width - 1;
+    int cells_high = mesher->_height - 1;
+    for (int strip = start; strip < end; strip++){
+        vector<unsigned int>& out = mesher->_strips[strip];
+        out.clear();
+        int y0 = strip * KINECT_MESH_BLOCK;
+        int y1 = y0 + KINECT_MESH_BLOCK < cells_high ? y0 + KINECT_MESH_BLOCK : cells_high;
+        for (int y = y0; y < y1; y++){
+            if (!mesher->_decimate){
+                for (int x = 0; x < cells_wide; x++)
+                    mesher->emit_cell(x, y, out);
+                continue;
+            }
+            const unsigned char * leaf = &mesher->_leaf[y * cells_wide];
+            int x = 0;
+            while (x < cells_wide){
+                int size = leaf[x];
+                if (size == 1){
+                    mesher->emit_cell(x, y, out);
+                    x++;
+                } else {
+                    // leaves are aligned to their size, so this is the
+                    //  top row of the cell or one it covers
+                    if (y % size == 0)
+                        mesher->emit_fan(x, y, size, out);
+                    x += size;
+                }
+            }
+        }
+    }
+}
+
+void Kinect_Grid_Mesher::emit_cell(int x, int y, vector<unsigned int>& out){
+    unsigned int i00 = y * _width + x;
+    unsigned int i10 = i00 + 1;
+    unsigned int i01 = i00 + _width;
+    unsigned int i11 = i01 + 1;
+    float z00 = _meters[_depth[i00]], z10 = _meters[_depth[i10]];
+    float z01 = _meters[_depth[i01]], z11 = _meters[_depth[i11]];
+    // split along whichever diagonal is the smaller step, so a crease
+    //  follows the surface rather than cutting across it
+    if (fabs(z00 - z11) <= fabs(z10 - z01)){
+        if (connected(z00, z10, z11)){
+            out.push_back(i00); out.push_back(i10); out.push_back(i11);
+        }
+        if (connected(z00, z11, z01)){
+            out.push_back(i00); out.push_back(i11); out.push_back(i01);
+        }
+    } else {
+        if (connected(z00, z10, z01)){
+            out.push_back(i00); out.push_back(i10); out.push_back(i01);
+        }
+        if (connected(z10, z11, z01)){
+            out.push_back(i10); out.push_back(i11); out.push_back(i01);
+        }
+    }
+}
+
+void Kinect_Grid_Mesher::emit_fan(int x, int y, int size, vector<unsigned int>& out){
+    unsigned int center = (y + size / 2) * _width + x + size / 2;
+    // the ring, clockwise from the top left corner: every pixel a
+    //  neighbour's triangles could end at is on it
+    unsigned int ring[4 * KINECT_MESH_BLOCK + 1];
+    int n = 0;
+    int step = edge_step(x, y, size, 0);
+    for (int i = 0; i < size; i += step)
+        ring[n++] = y * _width + x + i;
+    step = edge_step(x, y, size, 1);
+    for (int j = 0; j < size; j += step)
+        ring[n++] = (y + j) * _width + x + size;
+    step = edge_step(x, y, size, 2);
+    for (int i = size; i > 0; i -= step)
+        ring[n++] = (y + size) * _width + x + i;
+    step = edge_step(x, y, size, 3);
+    for (int j = size; j > 0; j -= step)
+        ring[n++] = (y + j) * _width + x;
+    ring[n] = ring[0];
+    for (int k = 0; k < n; k++){
+        out.push_back(center);
+        out.push_back(ring[k]);
+        out.push_back(ring[k+1]);
+    }
+}
+
+void xen_rift::benchmark_kinect_mesh(int frames){
+    if (frames < 1)
+        frames = 1;
+    int width = 640, height = 480;
+    // a floor and a back wall, a box standing in front with a shadow
+    //  of no reading down one side, and a step of noise here and there
+    vector<unsigned short> depth(width * height);
+    for (int v = 0; v < height; v++){
+        for (int u = 0; u < width; u++){
+            int d = v > 300 ? 900 - (v - 300) / 2 : 900;
+            if (u > 250 && u < 400 && v > 200 && v < 380)
+                d = 700 + (u - 250) / 10;
+            else if (u >= 400 && u < 415 && v > 200 && v < 380)
+                d = KINECT_DEPTH_INVALID;
+            if (d != KINECT_DEPTH_INVALID && rand() % 8 == 0)
+                d += rand() % 3 - 1;
+            depth[v * width + u] = (unsigned short) d;
+        }
+    }
+    Kinect_Grid_Mesher mesher(width, height);
+    int cells = (width - 1) * (height - 1) * 2;
+
+    printf("Kinect_Grid_Mesher: %dx%d, %d frames, %d threads\n", width, height, frames,
+        get_shared_thread_pool()->num_threads());
+    for (int decimate = 0; decimate < 2; decimate++){
+        mesher.set_decimate(decimate != 0);
+        double start = get_time_ms();
+        for (int i = 0; i < frames; i++)
+            mesher.build(&depth[0]);
+        double ms = (get_time_ms() - start) / frames;
+        printf("  %s: %0.3f ms/frame, %d triangles (%0.1f%% of the grid)\n",
+            decimate ? "decimated" : "full", ms, mesher.num_indices() / 3,
+            100.0 * mesher.num_indices() / 3 / cells);
+    }
+}
+
+/* #########################################################################
+
+                              Kinect_Point_Cloud
+
+   ######################################################################### */
+Kinect_Point_Cloud::Kinect_Point_Cloud(int width, int height) :
+    _width(width),
+    _height(height),
+    _pixel_buffer(0),
+    _has_depth(false),
+    _has_rgb(false),
+    _mode(KINECT_CLOUD_POINTS),
+    _mesher(width, height),
+    _index_buffer(0),
+    _mesh_indices(0),
+    _mesh_ready(false)
+{
+}
+
+void Kinect_Point_Cloud::set_mode(kinect_cloud_mode_t mode){
+    _mode = mode;
+    _mesher.set_decimate(mode == KINECT_CLOUD_MESH_DECIMATED);
+    // the next depth frame builds one, in the new mode
+    _mesh_ready = false;
+}
+
+string Kinect_Point_Cloud::status(){
+    if (_mode == KINECT_CLOUD_POINTS || !_mesh_ready)
+        return string();
+    char tmp[64];
+    sprintf(tmp, "M: %dk tris, %0.1fms", _mesh_indices / 3000, _mesher.build_ms());
+    return string(tmp);
+}
+
+void Kinect_Point_Cloud::upload_depth(const unsigned short * depth){
+    _depth.upload((const unsigned char *) depth, _width, _height,
+                  _width * sizeof(unsigned short), GL_LUMINANCE, GL_UNSIGNED_SHORT);
+    if (!_has_depth){
+        // depths are read exactly, one per vertex; blending neighbours
+        //  would invent points between near and far
+        glBindTexture(GL_TEXTURE_2D, _depth.texture());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    _has_depth = true;
+
+    if (_mode == KINECT_CLOUD_POINTS)
+        return;
+    _mesher.build(depth);
+    if (!_index_buffer)
+        glGenBuffers(1, &_index_buffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _index_buffer);
+    // orphaned and refilled strip by strip
+    _mesh_indices = _mesher.num_indices();
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, _mesh_indices * sizeof(GLuint), NULL,
+                 GL_STREAM_DRAW);
+    size_t offset = 0;
+    for (int i = 0; i < _mesher.num_strips(); i++){
+        const vector<unsigned int>& strip = _mesher.strip(i);
+        if (strip.empty())
+            continue;
+        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, offset * sizeof(GLuint),
+                        strip.size() * sizeof(GLuint), &strip[0]);
+        offset += strip.size();
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    _mesh_ready = true;
+}
+
+void Kinect_Point_Cloud::upload_rgb(const unsigned char * rgb){
+    _rgb.upload(rgb, _width, _height, _width * 3, GL_RGB);
+    _has_rgb = true;
+}
+
+bool Kinect_Point_Cloud::build_program(){
+    if (_program)
+        return true;
+    if (_program_failed)
+        return false;
+    GLuint vshader, fshader;
+    load_shaders("../resources/shaders/kinect_cloud.vert", &vshader,
+                 "../resources/shaders/kinect_cloud.frag", &fshader);
+    _program = glCreateProgram();
+    glAttachShader(_program, vshader);
+    glAttachShader(_program, fshader);
+    glLinkProgram(_program);
+    GLint linked = 0;
+    glGetProgramiv(_program, GL_LINK_STATUS, &linked);
+    if (!linked){
+        printf("Kinect_Point_Cloud: couldn't link the point cloud shaders\n");
+        glDeleteProgram(_program);
+        _program = 0;
+        _program_failed = true;
+        return false;
+    }
+    return true;
+}
+
+void Kinect_Point_Cloud::draw(float point_size){
+    if (!_has_depth || !build_program())
+        return;
+    if (!_pixel_buffer){
+        vector<GLshort> pixels(_width * _height * 2);
+        for (int v = 0; v < _height; v++){
+            for (int u = 0; u < _width; u++){
+                pixels[2*(v*_width + u)] = (GLshort) u;
+                pixels[2*(v*_width + u)+1] = (GLshort) v;
+            }
+        }
+        glGenBuffers(1, &_pixel_buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, _pixel_buffer);
+        glBufferData(GL_ARRAY_BUFFER, pixels.size() * sizeof(GLshort), &pixels[0],
+                     GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    glUseProgram(_program);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, _rgb.texture());
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, _depth.texture());
+    glUniform1i(glGetUniformLocation(_program, "depth"), 0);
+    glUniform1i(glGetUniformLocation(_program, "rgb"), 1);
+    glUniform1i(glGetUniformLocation(_program, "has_rgb"), _has_rgb);
+    glUniform2f(glGetUniformLocation(_program, "size"), (float) _width, (float) _height);
+    glUniformMatrix4fv(glGetUniformLocation(_program, "depth_to_metric"), 1, GL_FALSE,
+                       depth_to_metric);
+    glUniformMatrix4fv(glGetUniformLocation(_program, "metric_to_rgb"), 1, GL_FALSE,
+                       metric_to_rgb);
+
+    glPointSize(point_size);
+    glBindBuffer(GL_ARRAY_BUFFER, _pixel_buffer);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(2, GL_SHORT, 0, 0);
+    if (_mode != KINECT_CLOUD_POINTS && _mesh_ready){
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _index_buffer);
+        glDrawElements(GL_TRIANGLES, _mesh_indices, GL_UNSIGNED_INT, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    } else {
+        // every pixel is its own vertex, in order, so there's nothing
+        //  for an index buffer to do
+        glDrawArrays(GL_POINTS, 0, _width * _height);
+    }
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glPointSize(1.0f);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glUseProgram(0);
+}
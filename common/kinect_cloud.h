@@ -0,0 +1,182 @@
+/* #########################################################################
+        Kinect Cloud -- draws a Kinect depth frame as a point cloud
+            with the work on the GPU: raw depth goes up as a 16 bit
+            texture, and the vertex shader unprojects it and looks up
+            each point's color in the registered RGB frame. Or, as a
+            surface: the depth grid triangulated, torn where depth
+            jumps, and optionally thinned out where it's flat.
+
+        Header.
+
+   ######################################################################### */
+
+#ifndef __XEN_KINECT_CLOUD_H
+#define __XEN_KINECT_CLOUD_H
+
+// Base system stuff
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <string>
+#include "../include/GL/glew.h"
+#include "../include/gl_helper.h"
+#include <gl/gl.h>
+
+#include "yuv_texture.h"
+#include "xen_utils.h"
+#include "thread_pool.h"
+
+namespace xen_rift {
+
+    // raw 11 bit depth at or above this is "no reading"
+    #define KINECT_DEPTH_INVALID 2047
+    // Kinect_Grid_Mesher's largest decimated cell, in pixels; also
+    //  the height of the row strips it works in
+    #define KINECT_MESH_BLOCK 16
+
+    typedef enum _kinect_cloud_mode_t {
+        KINECT_CLOUD_POINTS=0,
+        // the depth grid as triangles, broken at depth discontinuities
+        KINECT_CLOUD_MESH=1,
+        // as MESH, with flat stretches merged into bigger cells
+        KINECT_CLOUD_MESH_DECIMATED=2
+    } kinect_cloud_mode_t;
+
+    // Triangulates an organized depth frame on the CPU, into indices
+    //  of its pixels (v * width + u), so the GPU side can keep on
+    //  unprojecting them from the depth texture. Each grid cell is
+    //  two triangles, split along its nearer diagonal; a triangle is
+    //  left out if a corner has no reading or its depths spread too
+    //  far, which is what a jump from a foreground edge to the
+    //  background looks like.
+    //
+    //  Decimation builds a quadtree over KINECT_MESH_BLOCK pixel
+    //  blocks: a cell is kept whole if every pixel in it is within a
+    //  tolerance of the bilinear fit of its corners. Raw Kinect depth
+    //  goes as inverse distance, so any plane is linear in it and
+    //  walls, floors and tables come out as a few big cells. A merged
+    //  cell is drawn as a fan from its center through its edge pixels
+    //  at its finest neighbour's spacing, so there are no T-junction
+    //  cracks.
+    //
+    //  Both passes run in row strips on the shared thread pool.
+    class Kinect_Grid_Mesher {
+        public:
+            Kinect_Grid_Mesher(int width = 640, int height = 480);
+
+            // An edge is a discontinuity if its depths differ by more
+            //  than this times the nearer one
+            void set_max_jump(float ratio) { _max_jump = ratio; }
+            float max_jump() { return _max_jump; }
+            // in raw depth units; how far from flat a merged cell may
+            //  be
+            void set_flat_tolerance(float raw) { _flat_tolerance = raw; }
+            void set_decimate(bool decimate) { _decimate = decimate; }
+            bool decimate() { return _decimate; }
+
+            // depth is width x height FREENECT_DEPTH_11BIT
+            void build(const unsigned short * depth);
+
+            // the last build's indices, three a triangle, in strips
+            //  top to bottom
+            int num_strips() { return (int) _strips.size(); }
+            const std::vector<unsigned int>& strip(int i) { return _strips[i]; }
+            int num_indices() { return _num_indices; }
+            double build_ms() { return _build_ms; }
+
+        protected:
+            static void leaf_band(void * self, int start, int end);
+            static void emit_band(void * self, int start, int end);
+            void subdivide(int x, int y, int size);
+            bool flat(int x, int y, int size);
+            void set_leaf(int x, int y, int size, int leaf);
+            // finest leaf along one side of (x, y, size), from the
+            //  cells just outside it
+            int edge_step(int x, int y, int size, int side);
+            void emit_cell(int x, int y, std::vector<unsigned int>& out);
+            void emit_fan(int x, int y, int size, std::vector<unsigned int>& out);
+            bool connected(float a, float b, float c) {
+                float lo = a < b ? a : b;
+                lo = lo < c ? lo : c;
+                float hi = a > b ? a : b;
+                hi = hi > c ? hi : c;
+                return lo > 0.0f && hi - lo <= _max_jump * lo;
+            }
+
+            int _width;
+            int _height;
+            float _max_jump;
+            float _flat_tolerance;
+            bool _decimate;
+            // raw to meters; 0 for no reading
+            float _meters[2048];
+
+            // current build()
+            const unsigned short * _depth;
+            // quadtree leaf size covering each grid cell, (width-1) x
+            //  (height-1); 1 is full resolution
+            std::vector<unsigned char> _leaf;
+            // one per KINECT_MESH_BLOCK rows of cells
+            std::vector<std::vector<unsigned int> > _strips;
+            int _num_indices;
+            double _build_ms;
+
+        private:
+    };
+
+    // Times Kinect_Grid_Mesher on a made up frame, full resolution
+    //  and decimated, and prints rates and triangle counts.
+    void benchmark_kinect_mesh(int frames = 200);
+
+    class Kinect_Point_Cloud {
+        public:
+            Kinect_Point_Cloud(int width = 640, int height = 480);
+
+            // Points by default. The mesh modes triangulate each depth
+            //  frame as it's uploaded.
+            void set_mode(kinect_cloud_mode_t mode);
+            kinect_cloud_mode_t mode() { return _mode; }
+            Kinect_Grid_Mesher& mesher() { return _mesher; }
+            // "M: 212k tris, 3.1ms" in the mesh modes, else empty
+            std::string status();
+
+            // one FREENECT_DEPTH_11BIT frame, width x height
+            void upload_depth(const unsigned short * depth);
+            // the FREENECT_VIDEO_RGB frame to color it with
+            void upload_rgb(const unsigned char * rgb);
+            bool has_depth() { return _has_depth; }
+
+            // One point per depth pixel with a reading (or the mesh
+            //  through them), in meters, Kinect looking down -z from
+            //  the current modelview origin. White until there's been
+            //  an RGB frame.
+            void draw(float point_size = 2.0f);
+
+        protected:
+            // shared by every instance; built on first use
+            static bool build_program();
+            static GLuint _program;
+            static bool _program_failed;
+
+            int _width;
+            int _height;
+            // every pixel's (u, v), built once: the depth texture
+            //  supplies the rest
+            GLuint _pixel_buffer;
+            Stream_Texture _depth;
+            Stream_Texture _rgb;
+            bool _has_depth;
+            bool _has_rgb;
+
+            kinect_cloud_mode_t _mode;
+            Kinect_Grid_Mesher _mesher;
+            // the mesher's output for the depth texture's frame
+            GLuint _index_buffer;
+            int _mesh_indices;
+            bool _mesh_ready;
+
+        private:
+    };
+}
+
+#endif //__XEN_KINECT_CLOUD_H
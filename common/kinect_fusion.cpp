@@ -0,0 +1,486 @@
+/* #########################################################################
+        Kinect Fusion -- builds up a model of the room from Kinect
+            depth as it moves about: each frame is lined up against
+            what the model says the Kinect should be seeing, then
+            folded into a Tsdf_Volume, whose changed blocks are
+            remeshed for drawing.
+
+        Tracking is point-to-plane ICP with projective association,
+        at half resolution: each of this frame's points, moved by the
+        current guess at the pose, is projected into the model's last
+        raycast, and the point there (if it's close, and faces about
+        the same way) is its match. Each step linearizes the small
+        rotation and solves the 6x6 normal equations; the sums behind
+        them are gathered a row at a time on the shared thread pool.
+        Everything else runs on the fusion thread, newest frame
+        first: a frame that arrives while one is being worked on
+        replaces whatever was waiting.
+
+        Much reference to:
+            Newcombe et al., "KinectFusion: Real-time dense surface
+                mapping and tracking", ISMAR 2011
+            Low, "Linear least-squares optimization for point-to-plane
+                ICP surface registration", UNC TR04-004, 2004
+
+   ######################################################################### */
+
+#include "kinect_fusion.h"
+
+using namespace std;
+using namespace xen_rift;
+using namespace cv;
+using namespace Eigen;
+
+static const int ICP_ITERATIONS = 10;
+// fewer matches than this and the pose isn't trusted
+static const int ICP_MIN_CORRESPONDENCES = 1000;
+// matches further apart or turned further than this are rejected
+static const float ICP_MAX_DISTANCE = 0.1f;
+static const float ICP_MIN_NORMAL_DOT = 0.866f;
+// more than this between frames is a bad fit, not a fast Kinect
+static const float ICP_MAX_TRANSLATION = 0.15f;
+static const float ICP_MAX_ROTATION = 0.35f;
+// upper half of JtJ, Jtr, count
+#define ICP_SUMS 28
+// Every visible block changes every frame, so remeshing each frame
+//  would mean reuploading most of the model each time; dirty blocks
+//  pile up until it's been this long instead.
+static const double MESH_INTERVAL_MS = 250.0;
+
+Kinect_Fusion::Kinect_Fusion(float voxel_size, float truncation) :
+    _thread_running(false),
+    _stopping(false),
+    _reset_requested(false),
+    _pending_fresh(false),
+    _state(FUSION_IDLE),
+    _tracked_seq(0),
+    _clear_meshes(false),
+    _pool(),
+    _volume(voxel_size, truncation),
+    _have_model(false),
+    _last_mesh_ms(0.0)
+{
+    memset(&_stats, 0, sizeof(_stats));
+    _cam = kinect_depth_camera(1);
+    _cam_half = kinect_depth_camera(2);
+    _pose.setIdentity();
+    _model_pose.setIdentity();
+    _shared_pose.setIdentity();
+    _tracked_pose.setIdentity();
+    _volume.set_thread_pool(&_pool);
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+    if (pthread_create(&_thread, NULL, &Kinect_Fusion::thread_main, this))
+        printf("Kinect_Fusion: couldn't start its thread\n");
+    else
+        _thread_running = true;
+}
+
+Kinect_Fusion::~Kinect_Fusion(){
+    pthread_mutex_lock(&_mutex);
+    _stopping = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+    if (_thread_running)
+        pthread_join(_thread, NULL);
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+    for (map<int, fusion_vbo_t>::iterator it = _vbos.begin(); it != _vbos.end(); it++)
+        glDeleteBuffers(1, &it->second.buffer);
+}
+
+void Kinect_Fusion::submit_depth(const Mat& raw){
+    if (raw.empty() || raw.type() != CV_16UC1 || raw.cols != _cam.width ||
+            raw.rows != _cam.height)
+        return;
+    pthread_mutex_lock(&_mutex);
+    if (_pending_fresh)
+        _stats.skipped++;
+    raw.copyTo(_pending);
+    _pending_fresh = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+}
+
+void Kinect_Fusion::reset(){
+    pthread_mutex_lock(&_mutex);
+    _reset_requested = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+}
+
+fusion_state_t Kinect_Fusion::state(){
+    pthread_mutex_lock(&_mutex);
+    fusion_state_t ret = _state;
+    pthread_mutex_unlock(&_mutex);
+    return ret;
+}
+
+fusion_stats_t Kinect_Fusion::stats(){
+    pthread_mutex_lock(&_mutex);
+    fusion_stats_t ret = _stats;
+    pthread_mutex_unlock(&_mutex);
+    return ret;
+}
+
+Matrix4f Kinect_Fusion::pose(){
+    pthread_mutex_lock(&_mutex);
+    Matrix4f ret = _shared_pose;
+    pthread_mutex_unlock(&_mutex);
+    return ret;
+}
+
+bool Kinect_Fusion::tracked_frame(Mat& raw, Matrix4f& pose, unsigned long& seq){
+    pthread_mutex_lock(&_mutex);
+    bool fresh = _tracked_seq != 0 && _tracked_seq != seq;
+    if (fresh){
+        _tracked.copyTo(raw);
+        pose = _tracked_pose;
+        seq = _tracked_seq;
+    }
+    pthread_mutex_unlock(&_mutex);
+    return fresh;
+}
+
+string Kinect_Fusion::status(){
+    fusion_stats_t s = stats();
+    fusion_state_t st = state();
+    char tmp[100];
+    if (st == FUSION_IDLE)
+        sprintf(tmp, "F: waiting");
+    else if (st == FUSION_LOST)
+        sprintf(tmp, "F: lost");
+    else
+        sprintf(tmp, "F: %d blocks, %0.0fms", s.blocks,
+            s.track_ms + s.integrate_ms + s.raycast_ms + s.mesh_ms);
+    return string(tmp);
+}
+
+/* #########################################################################
+
+                                fusion thread
+
+   ######################################################################### */
+void * Kinect_Fusion::thread_main(void * fusion){
+    ((Kinect_Fusion *) fusion)->thread_loop();
+    return NULL;
+}
+
+void Kinect_Fusion::thread_loop(){
+    while (true){
+        pthread_mutex_lock(&_mutex);
+        while (!_stopping && !_pending_fresh && !_reset_requested)
+            pthread_cond_wait(&_cond, &_mutex);
+        if (_stopping){
+            pthread_mutex_unlock(&_mutex);
+            break;
+        }
+        bool do_reset = _reset_requested;
+        _reset_requested = false;
+        bool have_frame = _pending_fresh;
+        if (have_frame){
+            // trade buffers, so submit_depth() can fill the old one
+            Mat tmp = _pending;
+            _pending = _working;
+            _working = tmp;
+            _pending_fresh = false;
+        }
+        pthread_mutex_unlock(&_mutex);
+
+        if (do_reset){
+            _volume.reset();
+            _pose.setIdentity();
+            _have_model = false;
+            pthread_mutex_lock(&_mutex);
+            _meshes.clear();
+            _clear_meshes = true;
+            _state = FUSION_IDLE;
+            memset(&_stats, 0, sizeof(_stats));
+            _shared_pose.setIdentity();
+            pthread_mutex_unlock(&_mutex);
+        }
+        if (have_frame)
+            process(_working);
+    }
+}
+
+void Kinect_Fusion::process(const Mat& raw){
+    double t0 = get_time_ms();
+    make_maps(raw);
+    bool tracked = !_have_model || track();
+    double t1 = get_time_ms();
+
+    vector<tsdf_mesh_t> meshes;
+    double t2 = t1, t3 = t1, t4 = t1;
+    if (tracked){
+        _volume.integrate(_depth, _cam, _pose);
+        t2 = get_time_ms();
+        // next frame is tracked against this
+        _volume.raycast(_cam_half, _pose, _model_points, _model_normals);
+        _model_pose = _pose;
+        _have_model = true;
+        t3 = t4 = get_time_ms();
+        if (t3 - _last_mesh_ms >= MESH_INTERVAL_MS){
+            _volume.extract_meshes(meshes);
+            t4 = _last_mesh_ms = get_time_ms();
+        }
+    }
+
+    pthread_mutex_lock(&_mutex);
+    _state = tracked ? FUSION_TRACKING : FUSION_LOST;
+    if (tracked){
+        _stats.frames++;
+        _shared_pose = _pose;
+        raw.copyTo(_tracked);
+        _tracked_pose = _pose;
+        _tracked_seq++;
+    } else {
+        _stats.lost++;
+    }
+    _stats.track_ms = t1 - t0;
+    _stats.integrate_ms = t2 - t1;
+    _stats.raycast_ms = t3 - t2;
+    _stats.mesh_ms = t4 - t3;
+    _stats.blocks = _volume.num_blocks();
+    for (size_t i = 0; i < meshes.size(); i++)
+        _meshes[meshes[i].block].swap(meshes[i].vertices);
+    pthread_mutex_unlock(&_mutex);
+}
+
+void Kinect_Fusion::make_maps(const Mat& raw){
+    _depth.create(_cam.height, _cam.width, CV_32FC1);
+    for (int v = 0; v < _cam.height; v++){
+        const unsigned short * in = raw.ptr<unsigned short>(v);
+        float * out = _depth.ptr<float>(v);
+        for (int u = 0; u < _cam.width; u++)
+            out[u] = _to_meters.meters(in[u]);
+    }
+
+    // every other pixel, unprojected
+    _depth_half.create(_cam_half.height, _cam_half.width, CV_32FC1);
+    _vertices.create(_cam_half.height, _cam_half.width, CV_32FC3);
+    for (int v = 0; v < _cam_half.height; v++){
+        const float * in = _depth.ptr<float>(2*v);
+        float * d = _depth_half.ptr<float>(v);
+        float * p = _vertices.ptr<float>(v);
+        for (int u = 0; u < _cam_half.width; u++){
+            d[u] = in[2*u];
+            p[3*u] = (u - _cam_half.cx) / _cam_half.fx * d[u];
+            p[3*u+1] = -(v - _cam_half.cy) / _cam_half.fy * d[u];
+            p[3*u+2] = -d[u];
+        }
+    }
+
+    // normals from the neighbours right and below, toward the camera;
+    //  none across a depth jump
+    _normals.create(_cam_half.height, _cam_half.width, CV_32FC3);
+    _normals.setTo(Scalar(0, 0, 0));
+    for (int v = 0; v + 1 < _cam_half.height; v++){
+        const float * d = _depth_half.ptr<float>(v);
+        const float * d_below = _depth_half.ptr<float>(v + 1);
+        const float * p = _vertices.ptr<float>(v);
+        const float * p_below = _vertices.ptr<float>(v + 1);
+        float * n = _normals.ptr<float>(v);
+        for (int u = 0; u + 1 < _cam_half.width; u++){
+            if (d[u] <= 0.0f || d[u+1] <= 0.0f || d_below[u] <= 0.0f)
+                continue;
+            if (fabs(d[u+1] - d[u]) > 0.05f || fabs(d_below[u] - d[u]) > 0.05f)
+                continue;
+            Vector3f c(p[3*u], p[3*u+1], p[3*u+2]);
+            Vector3f right = Vector3f(p[3*u+3], p[3*u+4], p[3*u+5]) - c;
+            Vector3f down = Vector3f(p_below[3*u], p_below[3*u+1], p_below[3*u+2]) - c;
+            Vector3f normal = right.cross(down);
+            float len = normal.norm();
+            if (len <= 0.0f)
+                continue;
+            normal /= len;
+            if (normal.dot(c) > 0.0f)
+                normal = -normal;
+            n[3*u] = normal.x();
+            n[3*u+1] = normal.y();
+            n[3*u+2] = normal.z();
+        }
+    }
+}
+
+/* #########################################################################
+
+                                  tracking
+
+   ######################################################################### */
+bool Kinect_Fusion::track(){
+    Matrix4f start = _pose;
+    int rows = _cam_half.height;
+    _icp_sums.resize(rows * ICP_SUMS);
+    Matrix3f model_rotation = _model_pose.block<3,3>(0,0);
+    _icp_model_rotation = model_rotation.transpose();
+    _icp_model_translation = -(_icp_model_rotation * _model_pose.block<3,1>(0,3));
+
+    int iterations = 0, correspondences = 0;
+    for (; iterations < ICP_ITERATIONS; iterations++){
+        _icp_rotation = _pose.block<3,3>(0,0);
+        _icp_translation = _pose.block<3,1>(0,3);
+        _pool.parallel_for(rows, icp_band, this, 8);
+
+        double sums[ICP_SUMS];
+        memset(sums, 0, sizeof(sums));
+        for (int v = 0; v < rows; v++){
+            const double * row = &_icp_sums[v * ICP_SUMS];
+            for (int i = 0; i < ICP_SUMS; i++)
+                sums[i] += row[i];
+        }
+        correspondences = (int) sums[ICP_SUMS - 1];
+        if (correspondences < ICP_MIN_CORRESPONDENCES)
+            break;
+        Matrix<double, 6, 6> a;
+        Matrix<double, 6, 1> b;
+        int k = 0;
+        for (int i = 0; i < 6; i++){
+            for (int j = i; j < 6; j++){
+                a(i, j) = a(j, i) = sums[k];
+                k++;
+            }
+        }
+        for (int i = 0; i < 6; i++)
+            b(i) = sums[21 + i];
+        Matrix<double, 6, 1> x = a.ldlt().solve(-b);
+
+        // x is a small rotation (about world axes) then a translation,
+        //  applied after the current pose
+        Vector3f omega((float) x(0), (float) x(1), (float) x(2));
+        Vector3f tau((float) x(3), (float) x(4), (float) x(5));
+        Matrix3f step = Matrix3f::Identity();
+        float angle = omega.norm();
+        if (angle > 0.0f)
+            step = AngleAxisf(angle, omega / angle).toRotationMatrix();
+        Matrix3f r = step * _pose.block<3,3>(0,0);
+        Vector3f t = step * _pose.block<3,1>(0,3) + tau;
+        _pose.block<3,3>(0,0) = r;
+        _pose.block<3,1>(0,3) = t;
+        if (x.norm() < 1e-5)
+            break;
+    }
+
+    pthread_mutex_lock(&_mutex);
+    _stats.icp_iterations = iterations;
+    _stats.correspondences = correspondences;
+    pthread_mutex_unlock(&_mutex);
+
+    // too little to go on, or it wandered off somewhere implausible
+    Matrix4f moved = start.inverse() * _pose;
+    float moved_angle = AngleAxisf(Matrix3f(moved.block<3,3>(0,0))).angle();
+    if (correspondences < ICP_MIN_CORRESPONDENCES ||
+            moved.block<3,1>(0,3).norm() > ICP_MAX_TRANSLATION ||
+            moved_angle > ICP_MAX_ROTATION){
+        _pose = start;
+        return false;
+    }
+    return true;
+}
+
+void Kinect_Fusion::icp_band(void * self, int start, int end){
+    for (int v = start; v < end; v++)
+        ((Kinect_Fusion *) self)->icp_row(v);
+}
+
+void Kinect_Fusion::icp_row(int v){
+    double * sums = &_icp_sums[v * ICP_SUMS];
+    memset(sums, 0, ICP_SUMS * sizeof(double));
+    const tsdf_camera_t& cam = _cam_half;
+    const float * vertices = _vertices.ptr<float>(v);
+    const float * normals = _normals.ptr<float>(v);
+    for (int u = 0; u < cam.width; u++){
+        const float * n_cam = normals + 3*u;
+        if (n_cam[0] == 0.0f && n_cam[1] == 0.0f && n_cam[2] == 0.0f)
+            continue;
+        const float * p_cam = vertices + 3*u;
+        Vector3f p = _icp_rotation * Vector3f(p_cam[0], p_cam[1], p_cam[2]) + _icp_translation;
+
+        // where the model's raycast saw it
+        Vector3f pm = _icp_model_rotation * p + _icp_model_translation;
+        float d = -pm.z();
+        if (d <= 0.0f)
+            continue;
+        int mu = (int) (cam.cx + cam.fx * pm.x() / d + 0.5f);
+        int mv = (int) (cam.cy - cam.fy * pm.y() / d + 0.5f);
+        if (mu < 0 || mv < 0 || mu >= cam.width || mv >= cam.height)
+            continue;
+        const float * nm = _model_normals.ptr<float>(mv) + 3*mu;
+        if (nm[0] == 0.0f && nm[1] == 0.0f && nm[2] == 0.0f)
+            continue;
+        const float * qm = _model_points.ptr<float>(mv) + 3*mu;
+        Vector3f n(nm[0], nm[1], nm[2]);
+        Vector3f diff = p - Vector3f(qm[0], qm[1], qm[2]);
+        if (diff.squaredNorm() > ICP_MAX_DISTANCE * ICP_MAX_DISTANCE)
+            continue;
+        Vector3f n_world = _icp_rotation * Vector3f(n_cam[0], n_cam[1], n_cam[2]);
+        if (n_world.dot(n) < ICP_MIN_NORMAL_DOT)
+            continue;
+
+        // residual n.(p - q); d/d(omega) is p x n, d/d(tau) is n
+        double r = n.dot(diff);
+        Vector3f pxn = p.cross(n);
+        double j[6] = {pxn.x(), pxn.y(), pxn.z(), n.x(), n.y(), n.z()};
+        int k = 0;
+        for (int a = 0; a < 6; a++){
+            for (int b = a; b < 6; b++){
+                sums[k] += j[a] * j[b];
+                k++;
+            }
+        }
+        for (int a = 0; a < 6; a++)
+            sums[21 + a] += j[a] * r;
+        sums[ICP_SUMS - 1] += 1.0;
+    }
+}
+
+/* #########################################################################
+
+                                   drawing
+
+   ######################################################################### */
+void Kinect_Fusion::draw(){
+    map<int, vector<float> > meshes;
+    pthread_mutex_lock(&_mutex);
+    bool clear = _clear_meshes;
+    _clear_meshes = false;
+    meshes.swap(_meshes);
+    pthread_mutex_unlock(&_mutex);
+
+    if (clear){
+        for (map<int, fusion_vbo_t>::iterator it = _vbos.begin(); it != _vbos.end(); it++)
+            glDeleteBuffers(1, &it->second.buffer);
+        _vbos.clear();
+    }
+    for (map<int, vector<float> >::iterator it = meshes.begin(); it != meshes.end(); it++){
+        map<int, fusion_vbo_t>::iterator vbo = _vbos.find(it->first);
+        if (it->second.empty()){
+            if (vbo != _vbos.end()){
+                glDeleteBuffers(1, &vbo->second.buffer);
+                _vbos.erase(vbo);
+            }
+            continue;
+        }
+        if (vbo == _vbos.end()){
+            fusion_vbo_t created;
+            glGenBuffers(1, &created.buffer);
+            vbo = _vbos.insert(make_pair(it->first, created)).first;
+        }
+        vbo->second.vertices = (int) it->second.size() / 6;
+        glBindBuffer(GL_ARRAY_BUFFER, vbo->second.buffer);
+        glBufferData(GL_ARRAY_BUFFER, it->second.size() * sizeof(float), &it->second[0],
+                     GL_STATIC_DRAW);
+    }
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    for (map<int, fusion_vbo_t>::iterator it = _vbos.begin(); it != _vbos.end(); it++){
+        glBindBuffer(GL_ARRAY_BUFFER, it->second.buffer);
+        glVertexPointer(3, GL_FLOAT, 6 * sizeof(float), 0);
+        glColorPointer(3, GL_FLOAT, 6 * sizeof(float), (const GLvoid *) (3 * sizeof(float)));
+        glDrawArrays(GL_TRIANGLES, 0, it->second.vertices);
+    }
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
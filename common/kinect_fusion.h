@@ -0,0 +1,184 @@
+/* #########################################################################
+        Kinect Fusion -- builds up a model of the room from Kinect
+            depth as it moves about: each frame is lined up against
+            what the model says the Kinect should be seeing, then
+            folded into a Tsdf_Volume, whose changed blocks are
+            remeshed for drawing.
+
+        Header.
+
+   ######################################################################### */
+
+#ifndef __XEN_KINECT_FUSION_H
+#define __XEN_KINECT_FUSION_H
+
+// Base system stuff
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <map>
+#include <string>
+#include "../include/GL/glew.h"
+#include "../include/gl_helper.h"
+#include <gl/gl.h>
+
+//pthread for the fusion thread
+#include <pthread.h>
+
+#include "opencv/cv.h"
+
+#include "Eigen/Dense"
+#include "Eigen/Geometry"
+
+#include "xen_utils.h"
+#include "kinect.h"
+#include "thread_pool.h"
+#include "tsdf_volume.h"
+
+namespace xen_rift {
+
+    typedef enum _fusion_state_t {
+        // no model yet; the next frame starts one
+        FUSION_IDLE=0,
+        FUSION_TRACKING=1,
+        // the last frame couldn't be lined up with the model, so it was
+        //  left out; the next is tried from the last good pose
+        FUSION_LOST=2
+    } fusion_state_t;
+
+    typedef struct _fusion_stats_t {
+        // integrated into the model
+        long frames;
+        // couldn't be tracked
+        long lost;
+        // submitted, but replaced by a newer frame before the fusion
+        //  thread got to them
+        long skipped;
+        // last frame's
+        int icp_iterations;
+        int correspondences;
+        double track_ms;
+        double integrate_ms;
+        double raycast_ms;
+        // 0 on frames that weren't meshed
+        double mesh_ms;
+        int blocks;
+    } fusion_stats_t;
+
+    // The pipeline runs on a thread of its own; the render thread
+    //  hands it depth and draws whatever mesh it's finished so far.
+    //  The world frame is the Kinect's at the first frame, so the
+    //  model draws where Kinect_Point_Cloud would have drawn that
+    //  frame.
+    class Kinect_Fusion {
+        public:
+            // as Tsdf_Volume's
+            Kinect_Fusion(float voxel_size = 0.01f, float truncation = 0.03f);
+            ~Kinect_Fusion();
+
+            // A raw 11 bit depth frame, 640x480 CV_16UC1; copied. One
+            //  the fusion thread hasn't started on yet is replaced.
+            void submit_depth(const cv::Mat& raw);
+            // throw the model away and start again from the next frame
+            void reset();
+
+            fusion_state_t state();
+            fusion_stats_t stats();
+            // camera to world, as of the last tracked frame
+            Eigen::Matrix4f pose();
+            // The last tracked frame, as submitted, and its camera to
+            //  world pose. False if none has been tracked since the one
+            //  numbered seq (0 to start); otherwise seq becomes its
+            //  number. Frames that were lost are never handed out.
+            bool tracked_frame(cv::Mat& raw, Eigen::Matrix4f& pose, unsigned long& seq);
+            // "F: 812 blocks, 41ms", "F: lost", ...
+            std::string status();
+
+            // GL thread only: uploads the blocks remeshed since last
+            //  time, then draws the whole model, shaded, in world
+            //  coordinates from the current modelview
+            void draw();
+
+            EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+        protected:
+            static void * thread_main(void * fusion);
+            void thread_loop();
+            void process(const cv::Mat& raw);
+            // _depth, _depth_half, then the vertex and normal maps
+            void make_maps(const cv::Mat& raw);
+            // Point-to-plane ICP of the vertex map against the last
+            //  raycast; moves _pose. False if it wouldn't settle.
+            bool track();
+            static void icp_band(void * self, int start, int end);
+            void icp_row(int v);
+
+            // one block's mesh on the GPU
+            typedef struct _fusion_vbo_t {
+                GLuint buffer;
+                int vertices;
+            } fusion_vbo_t;
+
+            pthread_t _thread;
+            bool _thread_running;
+            pthread_mutex_t _mutex;
+            pthread_cond_t _cond;
+
+            // under _mutex
+            bool _stopping;
+            bool _reset_requested;
+            cv::Mat _pending;
+            bool _pending_fresh;
+            fusion_state_t _state;
+            fusion_stats_t _stats;
+            Eigen::Matrix4f _shared_pose;
+            // the last tracked frame and its pose, for tracked_frame()
+            cv::Mat _tracked;
+            Eigen::Matrix4f _tracked_pose;
+            unsigned long _tracked_seq;
+            // remeshed blocks not yet uploaded, by block; an empty one
+            //  is a block whose surface went away
+            std::map<int, std::vector<float> > _meshes;
+            // GL side should drop everything it has
+            bool _clear_meshes;
+
+            // fusion thread only
+            // Fusion's own workers. A frame's integrate / raycast / ICP
+            //  keep a pool busy for most of its length, and a pool runs
+            //  one parallel_for at a time, so on the shared one the
+            //  render thread's filters would queue up behind them.
+            Thread_Pool _pool;
+            Tsdf_Volume _volume;
+            Depth_To_Xyz _to_meters;
+            tsdf_camera_t _cam;
+            tsdf_camera_t _cam_half;
+            cv::Mat _working;
+            // meters: full resolution to integrate, half to track
+            cv::Mat _depth;
+            cv::Mat _depth_half;
+            // this frame, camera coordinates, half resolution
+            cv::Mat _vertices;
+            cv::Mat _normals;
+            // the model raycast from _model_pose, world coordinates
+            cv::Mat _model_points;
+            cv::Mat _model_normals;
+            Eigen::Matrix4f _model_pose;
+            Eigen::Matrix4f _pose;
+            bool _have_model;
+            double _last_mesh_ms;
+            // icp_row's inputs and its per-row sums: the upper half of
+            //  JtJ (21), Jtr (6), then the count
+            Eigen::Matrix3f _icp_rotation;
+            Eigen::Vector3f _icp_translation;
+            Eigen::Matrix3f _icp_model_rotation;
+            Eigen::Vector3f _icp_model_translation;
+            std::vector<double> _icp_sums;
+
+            // GL thread only
+            std::map<int, fusion_vbo_t> _vbos;
+
+        private:
+    };
+}
+
+#endif //__XEN_KINECT_FUSION_H
@@ -0,0 +1,466 @@
+/* #########################################################################
+        Kinect Manager -- runs several Kinects at once, each on a
+            thread of its own that turns its depth into world space
+            through that Kinect's extrinsics, and merges the newest
+            frames that arrived close enough together into one point
+            cloud, so a room can be covered from more than one side.
+
+        The device threads do the per-frame work -- polling, depth to
+        meters, the rigid transform, packing out pixels with no
+        reading -- so the render thread's share of a merge is picking
+        frames and one copy of each into the merged buffer. Frames are
+        handed over by swapping buffers, not copying them.
+
+        Every Kinect gets its own freenect context (by way of
+        Kinect_Stream), and with it its own USB event thread. Several
+        Kinects on one USB controller will usually not all get their
+        bandwidth; give each its own.
+
+   ######################################################################### */
+
+#include "kinect_manager.h"
+
+using namespace std;
+using namespace xen_rift;
+using namespace cv;
+using namespace Eigen;
+
+// a tint per Kinect, round and round
+static const float device_tints[6][3] = {
+    {1.0f, 1.0f, 1.0f},
+    {1.0f, 0.6f, 0.6f},
+    {0.6f, 1.0f, 0.6f},
+    {0.6f, 0.6f, 1.0f},
+    {1.0f, 1.0f, 0.5f},
+    {0.5f, 1.0f, 1.0f}
+};
+
+Kinect_Manager::Kinect_Manager(int num_devices, double max_skew_ms, int point_step,
+                               int max_queued) :
+    _max_skew_ms(max_skew_ms),
+    _point_step(point_step < 1 ? 1 : point_step),
+    _max_queued(max_queued < 1 ? 1 : max_queued),
+    _stopping(false),
+    _running(false),
+    _last_merged_ms(0.0),
+    _skew_total_ms(0.0),
+    _buffer(0),
+    _buffer_dirty(false)
+{
+    memset(&_stats, 0, sizeof(_stats));
+    pthread_mutex_init(&_mutex, NULL);
+    for (int i = 0; i < num_devices; i++){
+        kinect_device_t * device = new kinect_device_t;
+        device->manager = this;
+        device->index = i;
+        device->thread_running = false;
+        device->stream = new Kinect_Stream(i);
+        device->to_xyz = new Depth_To_Xyz();
+        device->work.arrival_ms = 0.0;
+        device->work.timestamp = 0;
+        device->want_running = false;
+        Map<Matrix4f>(device->extrinsics) = Matrix4f::Identity();
+        memset(&device->stats, 0, sizeof(device->stats));
+        device->picked.arrival_ms = 0.0;
+        device->picked.timestamp = 0;
+        device->first = device->count = 0;
+        _devices.push_back(device);
+    }
+    for (int i = 0; i < num_devices; i++){
+        if (pthread_create(&_devices[i]->thread, NULL, &Kinect_Manager::device_main,
+                           _devices[i]))
+            printf("Kinect_Manager: couldn't start kinect %d's thread\n", i);
+        else
+            _devices[i]->thread_running = true;
+    }
+}
+
+Kinect_Manager::~Kinect_Manager(){
+    pthread_mutex_lock(&_mutex);
+    _stopping = true;
+    pthread_mutex_unlock(&_mutex);
+    for (size_t i = 0; i < _devices.size(); i++){
+        if (_devices[i]->thread_running)
+            pthread_join(_devices[i]->thread, NULL);
+        // closes the kinect, if it's open
+        delete _devices[i]->stream;
+        delete _devices[i]->to_xyz;
+        delete _devices[i];
+    }
+    pthread_mutex_destroy(&_mutex);
+    if (_buffer)
+        glDeleteBuffers(1, &_buffer);
+}
+
+void Kinect_Manager::start(){
+    pthread_mutex_lock(&_mutex);
+    for (size_t i = 0; i < _devices.size(); i++)
+        _devices[i]->want_running = true;
+    pthread_mutex_unlock(&_mutex);
+    _running = true;
+}
+
+void Kinect_Manager::stop(){
+    pthread_mutex_lock(&_mutex);
+    for (size_t i = 0; i < _devices.size(); i++){
+        _devices[i]->want_running = false;
+        _devices[i]->queue.clear();
+    }
+    pthread_mutex_unlock(&_mutex);
+    _running = false;
+    _merged.clear();
+    for (size_t i = 0; i < _devices.size(); i++)
+        _devices[i]->count = 0;
+}
+
+void Kinect_Manager::set_replay(int device, const string& filename){
+    if (device < 0 || device >= num_devices())
+        return;
+    pthread_mutex_lock(&_mutex);
+    _devices[device]->replay_file = filename;
+    pthread_mutex_unlock(&_mutex);
+}
+
+void Kinect_Manager::set_record(int device, const string& filename){
+    if (device < 0 || device >= num_devices())
+        return;
+    pthread_mutex_lock(&_mutex);
+    _devices[device]->record_file = filename;
+    pthread_mutex_unlock(&_mutex);
+}
+
+void Kinect_Manager::set_extrinsics(int device, const Matrix4f& kinect_to_world){
+    if (device < 0 || device >= num_devices())
+        return;
+    pthread_mutex_lock(&_mutex);
+    Map<Matrix4f>(_devices[device]->extrinsics) = kinect_to_world;
+    pthread_mutex_unlock(&_mutex);
+}
+
+Matrix4f Kinect_Manager::extrinsics(int device){
+    if (device < 0 || device >= num_devices())
+        return Matrix4f::Identity();
+    pthread_mutex_lock(&_mutex);
+    Matrix4f ret = Map<Matrix4f>(_devices[device]->extrinsics);
+    pthread_mutex_unlock(&_mutex);
+    return ret;
+}
+
+bool Kinect_Manager::load_extrinsics(const string& filename){
+    FileStorage fs(filename, FileStorage::READ);
+    if (!fs.isOpened()){
+        printf("Kinect_Manager: couldn't open %s, kinects left where they were.\n",
+            filename.c_str());
+        return false;
+    }
+    int found = 0;
+    for (int i = 0; i < num_devices(); i++){
+        char name[32];
+        sprintf(name, "kinect_%d", i);
+        Mat m;
+        fs[name] >> m;
+        if (m.empty())
+            continue;
+        if (m.rows != 4 || m.cols != 4){
+            printf("Kinect_Manager: %s in %s isn't 4x4\n", name, filename.c_str());
+            continue;
+        }
+        m.convertTo(m, CV_32F);
+        Matrix4f kinect_to_world;
+        for (int r = 0; r < 4; r++)
+            for (int c = 0; c < 4; c++)
+                kinect_to_world(r, c) = m.at<float>(r, c);
+        set_extrinsics(i, kinect_to_world);
+        found++;
+    }
+    printf("Kinect_Manager: extrinsics for %d of %d kinects from %s\n", found, num_devices(),
+        filename.c_str());
+    return true;
+}
+
+bool Kinect_Manager::save_extrinsics(const string& filename){
+    FileStorage fs(filename, FileStorage::WRITE);
+    if (!fs.isOpened()){
+        printf("Kinect_Manager: couldn't write %s\n", filename.c_str());
+        return false;
+    }
+    for (int i = 0; i < num_devices(); i++){
+        char name[32];
+        sprintf(name, "kinect_%d", i);
+        Matrix4f kinect_to_world = extrinsics(i);
+        Mat m(4, 4, CV_32F);
+        for (int r = 0; r < 4; r++)
+            for (int c = 0; c < 4; c++)
+                m.at<float>(r, c) = kinect_to_world(r, c);
+        fs << string(name) << m;
+    }
+    return true;
+}
+
+/* #########################################################################
+
+                               device threads
+
+   ######################################################################### */
+void * Kinect_Manager::device_main(void * device){
+    kinect_device_t * self = (kinect_device_t *) device;
+    self->manager->device_loop(self);
+    return NULL;
+}
+
+void Kinect_Manager::device_loop(kinect_device_t * device){
+    Kinect_Stream * stream = device->stream;
+    bool started = false;
+    Mat depth;
+    float kinect_to_world[16];
+    while (true){
+        pthread_mutex_lock(&_mutex);
+        bool stopping = _stopping;
+        bool want_running = device->want_running;
+        string replay_file = device->replay_file;
+        string record_file = device->record_file;
+        memcpy(kinect_to_world, device->extrinsics, sizeof(kinect_to_world));
+        pthread_mutex_unlock(&_mutex);
+        if (stopping)
+            break;
+        if (want_running != started){
+            if (want_running){
+                stream->set_replay(replay_file);
+                stream->set_record(record_file);
+                stream->start();
+            } else {
+                stream->stop();
+            }
+            started = want_running;
+        }
+
+        stream->poll();
+        uint32_t timestamp = 0;
+        bool fresh = started && stream->get_depth(depth, &timestamp);
+        double arrival_ms = get_time_ms();
+        if (fresh){
+            device->to_xyz->convert((const unsigned short *) depth.data, device->xyz, false);
+            to_world(device, kinect_to_world);
+            device->work.arrival_ms = arrival_ms;
+            device->work.timestamp = timestamp;
+        }
+
+        pthread_mutex_lock(&_mutex);
+        kinect_device_stats_t& stats = device->stats;
+        stats.state = stream->state();
+        stats.depth_fps = stream->depth_fps();
+        stats.video_fps = stream->video_fps();
+        if (fresh && device->want_running){
+            stats.frames++;
+            stats.points = (int) device->work.points.size() / 3;
+            stats.convert_ms = get_time_ms() - arrival_ms;
+            device->queue.push_back(kinect_world_frame_t());
+            kinect_world_frame_t& queued = device->queue.back();
+            queued.points.swap(device->work.points);
+            queued.arrival_ms = device->work.arrival_ms;
+            queued.timestamp = device->work.timestamp;
+            // nothing's merging them; don't pile up frames. The oldest
+            //  one's buffer is the next one's.
+            while ((int) device->queue.size() > _max_queued){
+                device->work.points.swap(device->queue.front().points);
+                device->queue.pop_front();
+                stats.dropped++;
+            }
+        }
+        pthread_mutex_unlock(&_mutex);
+        if (!fresh)
+            sleep_ms(2);
+    }
+    if (started)
+        stream->stop();
+}
+
+void Kinect_Manager::to_world(kinect_device_t * device, const float * m){
+    const kinect_xyz_t& xyz = device->xyz;
+    int step = _point_step;
+    int most = ((xyz.z.rows + step - 1) / step) * ((xyz.z.cols + step - 1) / step);
+    vector<float>& points = device->work.points;
+    points.resize(most * 3);
+    float * out = points.empty() ? NULL : &points[0];
+    int n = 0;
+    for (int v = 0; v < xyz.z.rows; v += step){
+        const float * xs = xyz.x.ptr<float>(v);
+        const float * ys = xyz.y.ptr<float>(v);
+        const float * zs = xyz.z.ptr<float>(v);
+        for (int u = 0; u < xyz.z.cols; u += step){
+            float z = zs[u];
+            if (z == 0.0f)
+                continue;
+            float x = xs[u], y = ys[u];
+            // column major, as Eigen keeps it
+            out[0] = m[0] * x + m[4] * y + m[8] * z + m[12];
+            out[1] = m[1] * x + m[5] * y + m[9] * z + m[13];
+            out[2] = m[2] * x + m[6] * y + m[10] * z + m[14];
+            out += 3;
+            n++;
+        }
+    }
+    points.resize(n * 3);
+}
+
+/* #########################################################################
+
+                                  merging
+
+   ######################################################################### */
+bool Kinect_Manager::update(){
+    if (!_running)
+        return false;
+    double start = get_time_ms();
+    pthread_mutex_lock(&_mutex);
+    // The newest frame the slowest streaming Kinect has: every other
+    //  one has something at least that new, so a full set can be
+    //  lined up around it. Anything not streaming is left out of the
+    //  choice, or one unplugged Kinect would hold up the rest.
+    double reference = 0.0;
+    bool any = false;
+    for (size_t i = 0; i < _devices.size(); i++){
+        kinect_device_t * device = _devices[i];
+        if (device->stats.state != KINECT_STREAMING)
+            continue;
+        double latest = device->queue.empty() ? device->picked.arrival_ms :
+                                                device->queue.back().arrival_ms;
+        if (latest <= 0.0)
+            continue;
+        if (!any || latest < reference)
+            reference = latest;
+        any = true;
+    }
+    if (!any || reference <= _last_merged_ms){
+        pthread_mutex_unlock(&_mutex);
+        return false;
+    }
+
+    double earliest = reference, latest = reference;
+    for (size_t i = 0; i < _devices.size(); i++){
+        kinect_device_t * device = _devices[i];
+        deque<kinect_world_frame_t>& queue = device->queue;
+        // too old to go with this merge, so too old for any later one
+        while (!queue.empty() && queue.front().arrival_ms < reference - _max_skew_ms){
+            queue.pop_front();
+            device->stats.dropped++;
+        }
+        // nearest the reference, of what's queued and what it's already
+        //  showing
+        int best = -1;
+        double best_gap = fabs(device->picked.arrival_ms - reference);
+        if (device->picked.arrival_ms <= 0.0 || best_gap > _max_skew_ms)
+            best_gap = _max_skew_ms + 1.0;
+        for (size_t k = 0; k < queue.size(); k++){
+            double gap = fabs(queue[k].arrival_ms - reference);
+            if (gap <= _max_skew_ms && gap < best_gap){
+                best = (int) k;
+                best_gap = gap;
+            }
+        }
+        if (best >= 0){
+            device->picked.points.swap(queue[best].points);
+            device->picked.arrival_ms = queue[best].arrival_ms;
+            device->picked.timestamp = queue[best].timestamp;
+            // passed over; anything newer waits for a later merge
+            device->stats.dropped += (unsigned long) best;
+            queue.erase(queue.begin(), queue.begin() + best + 1);
+        } else if (best_gap > _max_skew_ms){
+            device->count = 0;
+            if (device->stats.state == KINECT_STREAMING)
+                device->stats.missed++;
+            continue;
+        }
+        device->count = (int) device->picked.points.size() / 3;
+        if (device->picked.arrival_ms < earliest)
+            earliest = device->picked.arrival_ms;
+        if (device->picked.arrival_ms > latest)
+            latest = device->picked.arrival_ms;
+    }
+    pthread_mutex_unlock(&_mutex);
+    _last_merged_ms = reference;
+
+    int total = 0;
+    for (size_t i = 0; i < _devices.size(); i++){
+        _devices[i]->first = total;
+        total += _devices[i]->count;
+    }
+    _merged.resize(total * 3);
+    for (size_t i = 0; i < _devices.size(); i++){
+        if (_devices[i]->count > 0)
+            memcpy(&_merged[_devices[i]->first * 3], &_devices[i]->picked.points[0],
+                   _devices[i]->count * 3 * sizeof(float));
+    }
+    _buffer_dirty = true;
+
+    double skew = latest - earliest;
+    _stats.merges++;
+    _stats.points = total;
+    _stats.merge_ms = get_time_ms() - start;
+    _stats.last_skew_ms = skew;
+    _skew_total_ms += skew;
+    _stats.mean_skew_ms = _skew_total_ms / _stats.merges;
+    if (skew > _stats.max_skew_ms)
+        _stats.max_skew_ms = skew;
+    return true;
+}
+
+void Kinect_Manager::draw(float point_size){
+    if (_merged.empty())
+        return;
+    if (!_buffer)
+        glGenBuffers(1, &_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, _buffer);
+    if (_buffer_dirty){
+        glBufferData(GL_ARRAY_BUFFER, _merged.size() * sizeof(float), &_merged[0],
+                     GL_STREAM_DRAW);
+        _buffer_dirty = false;
+    }
+    glPointSize(point_size);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 0, 0);
+    for (size_t i = 0; i < _devices.size(); i++){
+        if (_devices[i]->count == 0)
+            continue;
+        glColor3fv(device_tints[i % 6]);
+        glDrawArrays(GL_POINTS, _devices[i]->first, _devices[i]->count);
+    }
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glPointSize(1.0f);
+    glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+}
+
+kinect_device_stats_t Kinect_Manager::device_stats(int device){
+    kinect_device_stats_t ret;
+    memset(&ret, 0, sizeof(ret));
+    if (device < 0 || device >= num_devices())
+        return ret;
+    pthread_mutex_lock(&_mutex);
+    ret = _devices[device]->stats;
+    pthread_mutex_unlock(&_mutex);
+    return ret;
+}
+
+string Kinect_Manager::status(){
+    if (!_running)
+        return string("K: OFF");
+    char tmp[64];
+    string ret;
+    sprintf(tmp, "K: %d kinects,", num_devices());
+    ret = tmp;
+    // depth fps each, or why not
+    for (int i = 0; i < num_devices(); i++){
+        kinect_device_stats_t stats = device_stats(i);
+        if (stats.state == KINECT_STREAMING)
+            sprintf(tmp, "%s%0.0f", i ? "/" : " ", stats.depth_fps);
+        else
+            sprintf(tmp, "%s%s", i ? "/" : " ",
+                stats.state == KINECT_STALLED ? "stalled" :
+                stats.state == KINECT_FAILED ? "failed" : "..");
+        ret += tmp;
+    }
+    sprintf(tmp, " fps, %dk pts, skew %0.0fms", _stats.points / 1000, _stats.last_skew_ms);
+    ret += tmp;
+    return ret;
+}
@@ -0,0 +1,182 @@
+/* #########################################################################
+        Kinect Manager -- runs several Kinects at once, each on a
+            thread of its own that turns its depth into world space
+            through that Kinect's extrinsics, and merges the newest
+            frames that arrived close enough together into one point
+            cloud, so a room can be covered from more than one side.
+
+        Header.
+
+   ######################################################################### */
+
+#ifndef __XEN_KINECT_MANAGER_H
+#define __XEN_KINECT_MANAGER_H
+
+// Base system stuff
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <deque>
+#include <string>
+#include "../include/GL/glew.h"
+#include "../include/gl_helper.h"
+#include <gl/gl.h>
+
+//pthread for the device threads
+#include <pthread.h>
+
+#include "opencv/cv.h"
+
+#include "Eigen/Dense"
+#include "Eigen/Geometry"
+
+#include "xen_utils.h"
+#include "kinect.h"
+
+namespace xen_rift {
+
+    // one Kinect's depth frame as world points, from its thread
+    typedef struct _kinect_world_frame_t {
+        // x, y, z of every point with a reading, meters
+        std::vector<float> points;
+        // get_time_ms() when its thread picked it up
+        double arrival_ms;
+        // the Kinect's own, which no other Kinect's clock agrees with
+        uint32_t timestamp;
+    } kinect_world_frame_t;
+
+    typedef struct _kinect_device_stats_t {
+        kinect_state_t state;
+        double depth_fps;
+        double video_fps;
+        // depth frames turned into world points
+        unsigned long frames;
+        // of those, never merged: a newer one came first, or the
+        //  queue filled
+        unsigned long dropped;
+        // merges it was left out of, for want of a frame within
+        //  max_skew_ms of the others
+        unsigned long missed;
+        // last frame's
+        int points;
+        double convert_ms;
+    } kinect_device_stats_t;
+
+    typedef struct _kinect_merge_stats_t {
+        unsigned long merges;
+        int points;
+        double merge_ms;
+        // spread of arrival times among the frames merged
+        double last_skew_ms;
+        double mean_skew_ms;
+        double max_skew_ms;
+    } kinect_merge_stats_t;
+
+    // Each Kinect gets a Kinect_Stream and a thread that owns it: the
+    //  thread starts and stops it, polls it, and converts each new
+    //  depth frame with a Depth_To_Xyz of its own, keeping every
+    //  point_step'th pixel each way. Kinect clocks aren't shared, so
+    //  frames are lined up by when their threads picked them up. Apart
+    //  from the constructor, for the render thread only.
+    class Kinect_Manager {
+        public:
+            Kinect_Manager(int num_devices, double max_skew_ms = 20.0, int point_step = 2,
+                           int max_queued = 4);
+            ~Kinect_Manager();
+
+            int num_devices() { return (int) _devices.size(); }
+            // Both return at once; the devices follow on their threads.
+            void start();
+            void stop();
+            bool running() { return _running; }
+            // as Kinect_Stream's, for one device, from its next start
+            void set_replay(int device, const std::string& filename);
+            void set_record(int device, const std::string& filename);
+
+            // Kinect to world, applied to its points from its next
+            //  frame; identity to start with
+            void set_extrinsics(int device, const Eigen::Matrix4f& kinect_to_world);
+            Eigen::Matrix4f extrinsics(int device);
+            // kinect_0, kinect_1, ... as 4x4 matrices in an OpenCV
+            //  FileStorage file; devices the file doesn't mention are
+            //  left as they are
+            bool load_extrinsics(const std::string& filename);
+            bool save_extrinsics(const std::string& filename);
+
+            // Once a display frame: takes the newest frame of the
+            //  Kinect that's furthest behind, each other Kinect's frame
+            //  nearest it within max_skew_ms, and merges them, so a
+            //  merge never mixes moments further apart than that. A
+            //  Kinect with nothing near enough is left out (and counted
+            //  as missed); one that isn't streaming doesn't hold the
+            //  others up. False if there's no newer set than last time;
+            //  the last merge stays.
+            bool update();
+            // the merged cloud: x, y, z a point, world coordinates
+            const std::vector<float>& points() { return _merged; }
+            // GL thread: the merged cloud as points from the current
+            //  modelview, each Kinect's in a tint of its own so overlap
+            //  (and bad extrinsics) show
+            void draw(float point_size = 2.0f);
+
+            kinect_device_stats_t device_stats(int device);
+            kinect_merge_stats_t merge_stats() { return _stats; }
+            // "K: 2 kinects, 30/30 fps, 153k pts, skew 4ms"
+            std::string status();
+
+        protected:
+            typedef struct _kinect_device_t {
+                Kinect_Manager * manager;
+                int index;
+                pthread_t thread;
+                bool thread_running;
+                // the device's thread only
+                Kinect_Stream * stream;
+                Depth_To_Xyz * to_xyz;
+                kinect_xyz_t xyz;
+                kinect_world_frame_t work;
+
+                // under the manager's _mutex
+                bool want_running;
+                std::string replay_file;
+                std::string record_file;
+                float extrinsics[16];
+                std::deque<kinect_world_frame_t> queue;
+                kinect_device_stats_t stats;
+
+                // render thread only: its frame in the last merge, and
+                //  where its points start and end in _merged
+                kinect_world_frame_t picked;
+                int first;
+                int count;
+            } kinect_device_t;
+
+            static void * device_main(void * device);
+            void device_loop(kinect_device_t * device);
+            // into device->work: a world point per point_step'th pixel
+            //  with a reading
+            void to_world(kinect_device_t * device, const float * kinect_to_world);
+
+            std::vector<kinect_device_t *> _devices;
+            double _max_skew_ms;
+            int _point_step;
+            int _max_queued;
+            pthread_mutex_t _mutex;
+
+            // under _mutex
+            bool _stopping;
+
+            // render thread only
+            bool _running;
+            double _last_merged_ms;
+            std::vector<float> _merged;
+            kinect_merge_stats_t _stats;
+            double _skew_total_ms;
+            GLuint _buffer;
+            bool _buffer_dirty;
+
+        private:
+    };
+}
+
+#endif //__XEN_KINECT_MANAGER_H
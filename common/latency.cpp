@@ -0,0 +1,215 @@
+/* #########################################################################
+        Latency -- how old a camera frame is by the time it's on the
+            display: per-stage stamps for every frame, kept as
+            distributions, plus a blinking-pattern probe that measures
+            the whole loop, glass to glass.
+
+   ######################################################################### */
+
+#include "latency.h"
+#include <algorithm>
+
+using namespace std;
+using namespace xen_rift;
+using namespace cv;
+
+/* #########################################################################
+
+                             Latency_Distribution
+
+   ######################################################################### */
+Latency_Distribution::Latency_Distribution(int capacity) :
+    _capacity(capacity > 0 ? capacity : 1),
+    _next(0)
+{
+}
+
+void Latency_Distribution::add(double ms){
+    if ((int) _samples.size() < _capacity){
+        _samples.push_back(ms);
+    } else {
+        _samples[_next] = ms;
+        _next = (_next + 1) % _capacity;
+    }
+}
+
+void Latency_Distribution::clear(){
+    _samples.clear();
+    _next = 0;
+}
+
+double Latency_Distribution::mean(){
+    if (_samples.empty())
+        return 0.0;
+    double sum = 0.0;
+    for (size_t i = 0; i < _samples.size(); i++)
+        sum += _samples[i];
+    return sum / _samples.size();
+}
+
+double Latency_Distribution::maximum(){
+    if (_samples.empty())
+        return 0.0;
+    return *max_element(_samples.begin(), _samples.end());
+}
+
+double Latency_Distribution::percentile(double p){
+    if (_samples.empty())
+        return 0.0;
+    vector<double> sorted(_samples);
+    size_t i = (size_t) (p / 100.0 * (sorted.size() - 1) + 0.5);
+    if (i >= sorted.size())
+        i = sorted.size() - 1;
+    nth_element(sorted.begin(), sorted.begin() + i, sorted.end());
+    return sorted[i];
+}
+
+string Latency_Distribution::summary(const char * name){
+    char tmp[200];
+    sprintf(tmp, "%s: n %d, mean %0.1f, p50 %0.1f, p90 %0.1f, p99 %0.1f, max %0.1f ms",
+        name, count(), mean(), percentile(50), percentile(90), percentile(99), maximum());
+    return string(tmp);
+}
+
+/* #########################################################################
+
+                               Latency_Tracker
+
+   ######################################################################### */
+static const char * latency_stage_names[NUM_LATENCY_STAGES] = {
+    "capture", "grab", "filter", "upload", "end frame"
+};
+
+const char * xen_rift::latency_stage_name(int stage){
+    if (stage < 0 || stage >= NUM_LATENCY_STAGES)
+        return "?";
+    return latency_stage_names[stage];
+}
+
+Latency_Tracker::Latency_Tracker(int capacity) :
+    _total(capacity)
+{
+    for (int i = 0; i < NUM_LATENCY_STAGES; i++)
+        _stages[i] = Latency_Distribution(capacity);
+}
+
+void Latency_Tracker::add_frame(const frame_latency_t& frame){
+    double first = 0.0;
+    double last = 0.0;
+    for (int i = 0; i < NUM_LATENCY_STAGES; i++){
+        double t = frame.stamp_ms[i];
+        if (t <= 0.0)
+            continue;
+        if (last > 0.0)
+            _stages[i].add(t - last);
+        else
+            first = t;
+        last = t;
+    }
+    if (first > 0.0 && last > first)
+        _total.add(last - first);
+}
+
+void Latency_Tracker::clear(){
+    for (int i = 0; i < NUM_LATENCY_STAGES; i++)
+        _stages[i].clear();
+    _total.clear();
+}
+
+string Latency_Tracker::report(){
+    string out;
+    char name[64];
+    for (int i = 1; i < NUM_LATENCY_STAGES; i++){
+        if (_stages[i].count() == 0)
+            continue;
+        sprintf(name, "  -> %s", latency_stage_names[i]);
+        out += _stages[i].summary(name) + "\n";
+    }
+    out += _total.summary("  total") + "\n";
+    return out;
+}
+
+/* #########################################################################
+
+                             Blink_Latency_Probe
+
+   ######################################################################### */
+Blink_Latency_Probe::Blink_Latency_Probe(double period_ms, double min_delta,
+                                         double timeout_ms) :
+    _period_ms(period_ms),
+    _min_delta(min_delta),
+    _timeout_ms(timeout_ms),
+    _active(false),
+    _lit(false),
+    _level(0.0),
+    _have_level(false),
+    _baseline(0.0),
+    _next_flip_ms(0.0),
+    _flip_pending(false),
+    _flip_shown_ms(0.0),
+    _watching(false),
+    _seen(false),
+    _results(256),
+    _misses(0)
+{
+}
+
+void Blink_Latency_Probe::start(){
+    _active = true;
+    _lit = false;
+    _have_level = false;
+    _flip_pending = _watching = _seen = false;
+    // let the camera settle on dark first
+    _next_flip_ms = get_time_ms() + _period_ms;
+}
+
+void Blink_Latency_Probe::stop(){
+    _active = false;
+}
+
+void Blink_Latency_Probe::begin_frame(){
+    if (!_active || _flip_pending || _watching || _seen || !_have_level)
+        return;
+    if (get_time_ms() < _next_flip_ms)
+        return;
+    _lit = !_lit;
+    _baseline = _level;
+    _flip_pending = true;
+}
+
+void Blink_Latency_Probe::observe(const Mat& gray){
+    if (!_active || gray.empty())
+        return;
+    // middle quarter; the pattern needn't fill the camera's view
+    Rect mid(gray.cols / 4, gray.rows / 4, gray.cols / 2, gray.rows / 2);
+    _level = mean(gray(mid))[0];
+    _have_level = true;
+    if (!_watching)
+        return;
+    double change = _lit ? _level - _baseline : _baseline - _level;
+    if (change >= _min_delta){
+        _watching = false;
+        _seen = true;
+    }
+}
+
+void Blink_Latency_Probe::frame_shown(double end_frame_ms){
+    if (!_active)
+        return;
+    if (_seen){
+        // this EndFrame carried the first camera frame showing the flip
+        _results.add(end_frame_ms - _flip_shown_ms);
+        _seen = false;
+        _next_flip_ms = end_frame_ms + _period_ms;
+    } else if (_watching && end_frame_ms - _flip_shown_ms > _timeout_ms){
+        // camera can't see it, or the contrast is too low
+        _misses++;
+        _watching = false;
+        _next_flip_ms = end_frame_ms + _period_ms;
+    }
+    if (_flip_pending){
+        _flip_pending = false;
+        _flip_shown_ms = end_frame_ms;
+        _watching = true;
+    }
+}
@@ -0,0 +1,156 @@
+/* #########################################################################
+        Latency -- how old a camera frame is by the time it's on the
+            display: per-stage stamps for every frame, kept as
+            distributions, plus a blinking-pattern probe that measures
+            the whole loop, glass to glass.
+
+        Header.
+
+   ######################################################################### */
+
+#ifndef __XEN_LATENCY_H
+#define __XEN_LATENCY_H
+
+// Base system stuff
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <string>
+
+#include "opencv/cv.h"
+
+#include "xen_utils.h"
+
+namespace xen_rift {
+
+    // The most recent capacity samples of some duration, in ms.
+    //  Percentiles are worked out on demand.
+    class Latency_Distribution {
+        public:
+            Latency_Distribution(int capacity = 1024);
+            void add(double ms);
+            void clear();
+
+            int count() { return (int) _samples.size(); }
+            double mean();
+            double maximum();
+            // p in [0, 100]
+            double percentile(double p);
+            // "name: n 300, mean 41.2, p50 40.1, p90 48.0, p99 60.3, max 71.0 ms"
+            std::string summary(const char * name);
+
+        protected:
+            std::vector<double> _samples;
+            int _capacity;
+            // oldest sample, once the ring is full
+            int _next;
+
+        private:
+    };
+
+    // Points a camera frame passes on its way to the display
+    typedef enum _latency_stage_t {
+        // the source's capture timestamp
+        LATENCY_STAGE_CAPTURE=0,
+        // handed to us by grab()
+        LATENCY_STAGE_GRAB=1,
+        // filter chain done
+        LATENCY_STAGE_FILTER=2,
+        // in its texture
+        LATENCY_STAGE_UPLOAD=3,
+        // ovrHmd_EndFrame returned with it in the eye buffers
+        LATENCY_STAGE_END_FRAME=4,
+        NUM_LATENCY_STAGES=5
+    } latency_stage_t;
+
+    const char * latency_stage_name(int stage);
+
+    // get_time_ms() stamps of one frame; 0 where a stage didn't happen
+    typedef struct _frame_latency_t {
+        double stamp_ms[NUM_LATENCY_STAGES];
+    } frame_latency_t;
+
+    class Latency_Tracker {
+        public:
+            Latency_Tracker(int capacity = 1024);
+
+            // A frame that's reached the display. Each stage's
+            //  distribution gets the time since the last stage that was
+            //  stamped; the total runs from the first.
+            void add_frame(const frame_latency_t& frame);
+            void clear();
+
+            Latency_Distribution& stage(int stage) { return _stages[stage]; }
+            Latency_Distribution& total() { return _total; }
+            // one line per stage, then the total
+            std::string report();
+
+        protected:
+            Latency_Distribution _stages[NUM_LATENCY_STAGES];
+            Latency_Distribution _total;
+
+        private:
+    };
+
+    // End-to-end calibration: flips a patch of the display between
+    //  black and white, watches a camera that can see the display
+    //  (through a mirror, say) for the flip, and times from the
+    //  EndFrame that first showed the flip to the EndFrame that first
+    //  showed a camera frame with it in. That's the whole loop:
+    //  display, camera, and everything of ours in between.
+    class Blink_Latency_Probe {
+        public:
+            // period_ms: at least this long between flips. min_delta:
+            //  change in mean brightness (0-255) that counts as seeing
+            //  a flip. timeout_ms: give up on a flip after this long.
+            Blink_Latency_Probe(double period_ms = 500.0, double min_delta = 20.0,
+                                double timeout_ms = 1000.0);
+
+            void start();
+            void stop();
+            bool active() { return _active; }
+
+            // Call at the top of a display pass; flips the pattern when
+            //  it's time.
+            void begin_frame();
+            // what to draw this pass
+            bool lit() { return _lit; }
+            // a new frame from the camera watching the display, 8-bit
+            //  gray; only the middle of it is looked at
+            void observe(const cv::Mat& gray);
+            // call once EndFrame has returned
+            void frame_shown(double end_frame_ms);
+
+            Latency_Distribution& results() { return _results; }
+            int misses() { return _misses; }
+
+        protected:
+            double _period_ms;
+            double _min_delta;
+            double _timeout_ms;
+            bool _active;
+            bool _lit;
+
+            // brightness of the latest camera frame
+            double _level;
+            bool _have_level;
+            // brightness when the flip went up, to compare against
+            double _baseline;
+
+            double _next_flip_ms;
+            // flipped, but not yet through an EndFrame
+            bool _flip_pending;
+            double _flip_shown_ms;
+            // on the display; watching the camera for it
+            bool _watching;
+            // camera saw it; next EndFrame completes the measurement
+            bool _seen;
+
+            Latency_Distribution _results;
+            int _misses;
+
+        private:
+    };
+}
+
+#endif //__XEN_LATENCY_H
@@ -0,0 +1,226 @@
+/* #########################################################################
+        MJPEG Decode -- puts a compressed camera's jpeg decoding on its
+            own thread, so two cameras running MJPEG (to fit higher
+            resolutions down USB) decode in parallel with each other
+            and with rendering.
+
+   ######################################################################### */
+
+#include "mjpeg_decode.h"
+
+#ifdef XEN_USE_TURBOJPEG
+#include "turbojpeg.h"
+#endif
+
+using namespace std;
+using namespace xen_rift;
+using namespace cv;
+
+Mjpeg_Decode_Source::Mjpeg_Decode_Source(Capture_Source * source, int scale_denom) :
+    _source(source),
+    _scale_denom(1),
+    _passthrough(false),
+    _tj(NULL),
+    _worker_running(false),
+    _stopping(false),
+    _pending_ts(0.0),
+    _has_pending(false),
+    _front(0),
+    _ready(1),
+    _back(2),
+    _fresh(false),
+    _skipped(0),
+    _failed(0),
+    _decode_ms(0.0)
+{
+    if (scale_denom == 2 || scale_denom == 4 || scale_denom == 8)
+        _scale_denom = scale_denom;
+    for (int i = 0; i < 3; i++)
+        _frame_ts[i] = 0.0;
+#ifdef XEN_USE_TURBOJPEG
+    _tj = tjInitDecompress();
+    if (!_tj)
+        printf("Mjpeg_Decode_Source: turbojpeg init failed, using OpenCV\n");
+#endif
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+    if (pthread_create(&_worker, NULL, &Mjpeg_Decode_Source::worker_main, this))
+        printf("Mjpeg_Decode_Source: couldn't start decode thread\n");
+    else
+        _worker_running = true;
+}
+
+Mjpeg_Decode_Source::~Mjpeg_Decode_Source(){
+    if (_worker_running){
+        pthread_mutex_lock(&_mutex);
+        _stopping = true;
+        pthread_cond_signal(&_cond);
+        pthread_mutex_unlock(&_mutex);
+        pthread_join(_worker, NULL);
+    }
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+#ifdef XEN_USE_TURBOJPEG
+    if (_tj)
+        tjDestroy((tjhandle) _tj);
+#endif
+    delete _source;
+}
+
+bool Mjpeg_Decode_Source::grab(){
+    if (_source->grab()){
+        raw_frame_t raw;
+        if (!_worker_running || !_source->retrieve_raw(raw) ||
+                raw.format != PIXEL_FORMAT_MJPEG){
+            _passthrough = true;
+            return true;
+        }
+        _passthrough = false;
+        // the source takes its buffer back on the next grab
+        _incoming.assign(raw.data, raw.data + raw.size);
+        pthread_mutex_lock(&_mutex);
+        if (_has_pending)
+            _skipped++;
+        _pending.swap(_incoming);
+        _pending_ts = _source->timestamp_ms();
+        _has_pending = true;
+        pthread_cond_signal(&_cond);
+        pthread_mutex_unlock(&_mutex);
+    } else if (_passthrough){
+        return false;
+    }
+
+    pthread_mutex_lock(&_mutex);
+    bool fresh = _fresh;
+    if (fresh){
+        int tmp = _front;
+        _front = _ready;
+        _ready = tmp;
+        _fresh = false;
+    }
+    pthread_mutex_unlock(&_mutex);
+    return fresh;
+}
+
+bool Mjpeg_Decode_Source::retrieve(Mat& out){
+    if (_passthrough)
+        return _source->retrieve(out);
+    // _front is only touched by grab, on this thread
+    if (_frames[_front].empty())
+        return false;
+    out = _frames[_front];
+    return true;
+}
+
+bool Mjpeg_Decode_Source::retrieve_raw(raw_frame_t& out){
+    if (_passthrough)
+        return _source->retrieve_raw(out);
+    Mat& frame = _frames[_front];
+    if (frame.empty())
+        return false;
+    out.format = PIXEL_FORMAT_BGR;
+    out.width = frame.cols;
+    out.height = frame.rows;
+    out.stride = (int) frame.step;
+    out.data = frame.data;
+    out.size = frame.step * frame.rows;
+    return true;
+}
+
+double Mjpeg_Decode_Source::timestamp_ms(){
+    if (_passthrough)
+        return _source->timestamp_ms();
+    return _frame_ts[_front];
+}
+
+int Mjpeg_Decode_Source::frames_skipped(){
+    pthread_mutex_lock(&_mutex);
+    int ret = _skipped;
+    pthread_mutex_unlock(&_mutex);
+    return ret;
+}
+
+int Mjpeg_Decode_Source::frames_failed(){
+    pthread_mutex_lock(&_mutex);
+    int ret = _failed;
+    pthread_mutex_unlock(&_mutex);
+    return ret;
+}
+
+double Mjpeg_Decode_Source::decode_ms(){
+    pthread_mutex_lock(&_mutex);
+    double ret = _decode_ms;
+    pthread_mutex_unlock(&_mutex);
+    return ret;
+}
+
+void * Mjpeg_Decode_Source::worker_main(void * self){
+    Mjpeg_Decode_Source * src = (Mjpeg_Decode_Source *) self;
+    vector<unsigned char> jpeg;
+    while (true){
+        pthread_mutex_lock(&src->_mutex);
+        while (!src->_has_pending && !src->_stopping)
+            pthread_cond_wait(&src->_cond, &src->_mutex);
+        if (src->_stopping){
+            pthread_mutex_unlock(&src->_mutex);
+            break;
+        }
+        jpeg.swap(src->_pending);
+        double ts = src->_pending_ts;
+        src->_has_pending = false;
+        // _back is ours alone until we swap it back
+        int back = src->_back;
+        pthread_mutex_unlock(&src->_mutex);
+
+        double start = get_time_ms();
+        bool ok = src->decode(jpeg, src->_frames[back]);
+        double took = get_time_ms() - start;
+
+        pthread_mutex_lock(&src->_mutex);
+        src->_decode_ms = took;
+        if (ok){
+            src->_frame_ts[back] = ts;
+            src->_back = src->_ready;
+            src->_ready = back;
+            src->_fresh = true;
+        } else {
+            src->_failed++;
+        }
+        pthread_mutex_unlock(&src->_mutex);
+    }
+    return NULL;
+}
+
+bool Mjpeg_Decode_Source::decode(const vector<unsigned char>& jpeg, Mat& out){
+    if (jpeg.empty())
+        return false;
+#ifdef XEN_USE_TURBOJPEG
+    if (_tj){
+        tjhandle tj = (tjhandle) _tj;
+        int width, height, subsamp;
+        if (tjDecompressHeader2(tj, (unsigned char *) &jpeg[0], (unsigned long) jpeg.size(),
+                                &width, &height, &subsamp) < 0)
+            return false;
+        tjscalingfactor factor;
+        factor.num = 1;
+        factor.denom = _scale_denom;
+        int w = TJSCALED(width, factor);
+        int h = TJSCALED(height, factor);
+        // no-op once the size settles
+        out.create(h, w, CV_8UC3);
+        return tjDecompress2(tj, (unsigned char *) &jpeg[0], (unsigned long) jpeg.size(),
+                             out.data, w, (int) out.step, h, TJPF_BGR,
+                             TJFLAG_FASTDCT) == 0;
+    }
+#endif
+    Mat buf(1, (int) jpeg.size(), CV_8UC1, (void *) &jpeg[0]);
+    Mat decoded = imdecode(buf, CV_LOAD_IMAGE_COLOR);
+    if (decoded.empty())
+        return false;
+    if (_scale_denom > 1)
+        resize(decoded, out, cv::Size(decoded.cols / _scale_denom, decoded.rows / _scale_denom),
+               0, 0, INTER_AREA);
+    else
+        out = decoded;
+    return true;
+}
@@ -0,0 +1,103 @@
+/* #########################################################################
+        MJPEG Decode -- puts a compressed camera's jpeg decoding on its
+            own thread, so two cameras running MJPEG (to fit higher
+            resolutions down USB) decode in parallel with each other
+            and with rendering.
+
+        Header.
+
+   ######################################################################### */
+
+#ifndef __XEN_MJPEG_DECODE_H
+#define __XEN_MJPEG_DECODE_H
+
+// Base system stuff
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+//pthread for the decode worker
+#include <pthread.h>
+
+#include "opencv/cv.h"
+#include "opencv2/highgui/highgui.hpp"
+
+#include "capture_source.h"
+#include "xen_utils.h"
+
+namespace xen_rift {
+
+    // Wraps a source that hands out PIXEL_FORMAT_MJPEG through
+    //  retrieve_raw. Each grab passes the newest jpeg to a worker
+    //  thread; a grab returns true once the worker has finished a
+    //  newer frame than the last one handed out. Frames from sources
+    //  that turn out not to be MJPEG pass straight through. Only
+    //  replays hand out jpegs today; live cameras are still decoded
+    //  by OpenCV's capture.
+    //
+    //  Built with XEN_USE_TURBOJPEG, decoding is libjpeg-turbo's, and
+    //  scale_denom (1, 2, 4 or 8) shrinks frames in the DCT, almost for
+    //  free. Otherwise it's OpenCV's imdecode and a resize.
+    class Mjpeg_Decode_Source : public Capture_Source {
+        public:
+            // takes ownership of source
+            Mjpeg_Decode_Source(Capture_Source * source, int scale_denom = 1);
+            ~Mjpeg_Decode_Source();
+
+            bool grab();
+            bool retrieve(cv::Mat& out);
+            // the decoded BGR frame
+            bool retrieve_raw(raw_frame_t& out);
+            double timestamp_ms();
+            bool is_open() { return _source->is_open(); }
+            void set_exposure(int exposure) { _source->set_exposure(exposure); }
+
+            // jpegs replaced by a newer one before the worker got to them
+            int frames_skipped();
+            int frames_failed();
+            // how long the last decode took
+            double decode_ms();
+
+        protected:
+            static void * worker_main(void * self);
+            bool decode(const std::vector<unsigned char>& jpeg, cv::Mat& out);
+
+            Capture_Source * _source;
+            int _scale_denom;
+            // the last grab was of a frame that wasn't jpeg
+            bool _passthrough;
+            // tjhandle, when built with turbojpeg
+            void * _tj;
+
+            pthread_t _worker;
+            bool _worker_running;
+            pthread_mutex_t _mutex;
+            pthread_cond_t _cond;
+            bool _stopping;
+
+            // newest jpeg not yet taken by the worker
+            std::vector<unsigned char> _pending;
+            double _pending_ts;
+            bool _has_pending;
+            // filled outside the lock, then swapped with _pending
+            std::vector<unsigned char> _incoming;
+
+            // Triple buffered: the worker decodes into _back, then swaps
+            //  it with _ready; grab swaps _ready with _front, which is
+            //  what retrieve hands out.
+            cv::Mat _frames[3];
+            double _frame_ts[3];
+            int _front;
+            int _ready;
+            int _back;
+            bool _fresh;
+
+            int _skipped;
+            int _failed;
+            double _decode_ms;
+
+        private:
+    };
+}
+
+#endif //__XEN_MJPEG_DECODE_H
@@ -0,0 +1,1156 @@
+/* #########################################################################
+        Point Octree -- keeps point clouds far bigger than fit on the
+            GPU (a session's worth of accumulated Kinect scans) in a
+            level of detail octree on disk, and draws as much of it
+            as a point budget allows, nearest and largest on screen
+            first, streaming nodes in from the file as they're needed.
+
+        The file is the points, node by node, then the node table.
+        Every point is in exactly one node: each node keeps the first
+        point to land in each cell of a 32^3 grid over its box, and
+        hands the rest down to its children, so a node's points are a
+        thinned out copy of its whole subtree, and drawing the nodes
+        from the root down fills in detail without drawing anything
+        twice. Anything drawn is drawn from its own GPU buffer, which
+        stays until the GPU budget needs the room.
+
+        Building never needs more than one chunk in memory. A pass
+        over the collected points counts them into a coarse grid; the
+        biggest boxes of that grid with few enough points become
+        chunks, and a second pass sorts the points into them. Each
+        chunk's subtree is then built alone, holding back its root's
+        points, which the nodes above the chunks sample from in turn.
+
+        Much reference to:
+            Schuetz, "Potree: Rendering Large Point Clouds in Web
+                Browsers", TU Wien diploma thesis, 2016
+            Wimmer and Scheiblauer, "Instant Points: Fast Rendering of
+                Unprocessed Point Clouds", SPBG 2006
+
+   ######################################################################### */
+
+#include "point_octree.h"
+
+#include <float.h>
+#include <queue>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace xen_rift;
+using namespace Eigen;
+
+// the counting grid is 2^PLAN_LEVELS cells across the root
+static const int PLAN_LEVELS = 5;
+// duplicate points would otherwise split forever
+static const int MAX_DEPTH = 20;
+// points read from the spill at a time
+static const int SPILL_BLOCK = 65536;
+// points held per chunk while sorting the spill into chunks
+static const int SORT_BUFFER = 1024;
+// mapped nodes waiting for the render thread, at most; bounds how
+//  much address space the loader ties up
+static const int MAX_READY = 32;
+
+static bool seek_to(FILE * file, uint64_t offset){
+#ifdef _WIN32
+    return _fseeki64(file, (__int64) offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t) offset, SEEK_SET) == 0;
+#endif
+}
+
+// blue at the floor, through green, to red at head height, repeating
+//  every three meters
+static void height_color(float y, uint8_t * rgba){
+    float t = y / 3.0f + 0.5f;
+    t -= floorf(t);
+    float r = t > 0.5f ? (t - 0.5f) * 2.0f : 0.0f;
+    float g = 1.0f - fabsf(t - 0.5f) * 2.0f;
+    float b = t < 0.5f ? 1.0f - t * 2.0f : 0.0f;
+    rgba[0] = (uint8_t) (55.0f + 200.0f * r);
+    rgba[1] = (uint8_t) (55.0f + 200.0f * g);
+    rgba[2] = (uint8_t) (55.0f + 200.0f * b);
+    rgba[3] = 255;
+}
+
+// which of the n^3 cells across a box p falls in, x major
+static inline int grid_cell(const octree_point_t& p, const float * center, float half_size,
+                            int n){
+    float scale = n / (2.0f * half_size);
+    int x = (int) ((p.x - center[0] + half_size) * scale);
+    int y = (int) ((p.y - center[1] + half_size) * scale);
+    int z = (int) ((p.z - center[2] + half_size) * scale);
+    x = x < 0 ? 0 : x >= n ? n - 1 : x;
+    y = y < 0 ? 0 : y >= n ? n - 1 : y;
+    z = z < 0 ? 0 : z >= n ? n - 1 : z;
+    return (x * n + y) * n + z;
+}
+
+static inline int octant(const octree_point_t& p, const float * center){
+    return (p.x >= center[0] ? 4 : 0) | (p.y >= center[1] ? 2 : 0) | (p.z >= center[2] ? 1 : 0);
+}
+
+/* #########################################################################
+
+                             Point_Octree_Builder
+
+   ######################################################################### */
+Point_Octree_Builder::Point_Octree_Builder(int chunk_points, int leaf_points) :
+    _chunk_points(chunk_points),
+    _leaf_points(leaf_points),
+    _spill(NULL),
+    _num_points(0),
+    _thread_running(false),
+    _building(false),
+    _built(false),
+    _out(NULL),
+    _out_offset(0),
+    _root_half(0.0f)
+{
+    for (int k = 0; k < 3; k++){
+        _min[k] = FLT_MAX;
+        _max[k] = -FLT_MAX;
+        _root_center[k] = 0.0f;
+    }
+    pthread_mutex_init(&_mutex, NULL);
+}
+
+Point_Octree_Builder::~Point_Octree_Builder(){
+    // a build under way is let finish, or its files would be left
+    //  half written
+    if (_thread_running)
+        pthread_join(_thread, NULL);
+    remove_spill();
+    pthread_mutex_destroy(&_mutex);
+}
+
+void Point_Octree_Builder::remove_spill(){
+    if (_spill){
+        fclose(_spill);
+        _spill = NULL;
+    }
+    if (!_spill_name.empty())
+        remove(_spill_name.c_str());
+    _spill_name.clear();
+}
+
+bool Point_Octree_Builder::begin(const string& filename){
+    if (building()){
+        printf("Point_Octree_Builder: still building %s\n", _filename.c_str());
+        return false;
+    }
+    if (_thread_running){
+        pthread_join(_thread, NULL);
+        _thread_running = false;
+    }
+    remove_spill();
+    _filename = filename;
+    _spill_name = filename + ".spill";
+    _spill = fopen(_spill_name.c_str(), "wb");
+    if (!_spill){
+        printf("Point_Octree_Builder: couldn't open %s\n", _spill_name.c_str());
+        _spill_name.clear();
+        return false;
+    }
+    _num_points = 0;
+    for (int k = 0; k < 3; k++){
+        _min[k] = FLT_MAX;
+        _max[k] = -FLT_MAX;
+    }
+    return true;
+}
+
+void Point_Octree_Builder::add(const float * xyz, int count, const unsigned char * rgb){
+    if (!_spill)
+        return;
+    octree_point_t block[1024];
+    int n = 0;
+    for (int i = 0; i < count; i++){
+        const float * p = xyz + i * 3;
+        // NaN compares false with everything
+        if (!(p[0] == p[0] && p[1] == p[1] && p[2] == p[2]))
+            continue;
+        octree_point_t& out = block[n++];
+        out.x = p[0];
+        out.y = p[1];
+        out.z = p[2];
+        if (rgb){
+            out.rgba[0] = rgb[i * 3];
+            out.rgba[1] = rgb[i * 3 + 1];
+            out.rgba[2] = rgb[i * 3 + 2];
+            out.rgba[3] = 255;
+        } else {
+            height_color(p[1], out.rgba);
+        }
+        for (int k = 0; k < 3; k++){
+            if (p[k] < _min[k]) _min[k] = p[k];
+            if (p[k] > _max[k]) _max[k] = p[k];
+        }
+        if (n == 1024){
+            fwrite(block, sizeof(octree_point_t), n, _spill);
+            _num_points += n;
+            n = 0;
+        }
+    }
+    if (n > 0){
+        fwrite(block, sizeof(octree_point_t), n, _spill);
+        _num_points += n;
+    }
+}
+
+string Point_Octree_Builder::status(){
+    bool is_building = building();
+    if (!_spill && !is_building)
+        return string();
+    char tmp[64];
+    sprintf(tmp, "O: %s, %0.1fM pts", is_building ? "building" : "scanning",
+        _num_points / 1000000.0);
+    return string(tmp);
+}
+
+int Point_Octree_Builder::new_node(const float * center, float half_size, int depth){
+    octree_node_t node;
+    memset(&node, 0, sizeof(node));
+    for (int k = 0; k < 3; k++)
+        node.center[k] = center[k];
+    node.half_size = half_size;
+    node.spacing = 2.0f * half_size / XEN_OCTREE_GRID;
+    for (int i = 0; i < 8; i++)
+        node.children[i] = -1;
+    node.depth = depth;
+    _nodes.push_back(node);
+    return (int) _nodes.size() - 1;
+}
+
+void Point_Octree_Builder::cell_center(int level, int x, int y, int z, float * center,
+                                       float& half_size){
+    float size = 2.0f * _root_half / (1 << level);
+    int cell[3] = {x, y, z};
+    for (int k = 0; k < 3; k++)
+        center[k] = _root_center[k] - _root_half + (cell[k] + 0.5f) * size;
+    half_size = size * 0.5f;
+}
+
+bool Point_Octree_Builder::write_points(int node, const octree_point_t * pts, size_t count){
+    _nodes[node].offset = _out_offset;
+    _nodes[node].count = (uint32_t) count;
+    if (count == 0)
+        return true;
+    if (fwrite(pts, sizeof(octree_point_t), count, _out) != count)
+        return false;
+    _out_offset += count * sizeof(octree_point_t);
+    return true;
+}
+
+bool Point_Octree_Builder::finish(){
+    if (!_spill)
+        return false;
+    fclose(_spill);
+    _spill = NULL;
+    return build();
+}
+
+bool Point_Octree_Builder::finish_async(){
+    if (!_spill || _thread_running)
+        return false;
+    // closed here, so add()s from now on are turned away on this
+    //  thread rather than racing the build
+    fclose(_spill);
+    _spill = NULL;
+    pthread_mutex_lock(&_mutex);
+    _building = true;
+    _built = false;
+    pthread_mutex_unlock(&_mutex);
+    if (pthread_create(&_thread, NULL, &Point_Octree_Builder::thread_main, this)){
+        printf("Point_Octree_Builder: couldn't start its thread; building here\n");
+        bool ok = build();
+        pthread_mutex_lock(&_mutex);
+        _building = false;
+        _built = ok;
+        pthread_mutex_unlock(&_mutex);
+        return true;
+    }
+    _thread_running = true;
+    return true;
+}
+
+void * Point_Octree_Builder::thread_main(void * builder){
+    Point_Octree_Builder * self = (Point_Octree_Builder *) builder;
+    bool ok = self->build();
+    pthread_mutex_lock(&self->_mutex);
+    self->_building = false;
+    self->_built = ok;
+    pthread_mutex_unlock(&self->_mutex);
+    return NULL;
+}
+
+bool Point_Octree_Builder::building(){
+    pthread_mutex_lock(&_mutex);
+    bool ret = _building;
+    pthread_mutex_unlock(&_mutex);
+    return ret;
+}
+
+bool Point_Octree_Builder::built(){
+    pthread_mutex_lock(&_mutex);
+    bool ret = _built;
+    pthread_mutex_unlock(&_mutex);
+    return ret;
+}
+
+bool Point_Octree_Builder::build(){
+    if (_num_points == 0){
+        printf("Point_Octree_Builder: no points for %s\n", _filename.c_str());
+        remove_spill();
+        return false;
+    }
+    double start = get_time_ms();
+
+    // the root's a cube around everything, a hair bigger so the
+    //  furthest points don't land on its far faces
+    float extent = 0.0f;
+    for (int k = 0; k < 3; k++){
+        _root_center[k] = (_min[k] + _max[k]) * 0.5f;
+        extent = _max[k] - _min[k] > extent ? _max[k] - _min[k] : extent;
+    }
+    _root_half = extent * 0.5f * 1.001f + 0.001f;
+
+    // count into the planning grid
+    int n = 1 << PLAN_LEVELS;
+    _cell_counts.assign(n * n * n, 0);
+    FILE * spill = fopen(_spill_name.c_str(), "rb");
+    if (!spill){
+        printf("Point_Octree_Builder: couldn't reopen %s\n", _spill_name.c_str());
+        remove_spill();
+        return false;
+    }
+    vector<octree_point_t> block(SPILL_BLOCK);
+    size_t got;
+    while ((got = fread(&block[0], sizeof(octree_point_t), SPILL_BLOCK, spill)) > 0){
+        for (size_t i = 0; i < got; i++)
+            _cell_counts[grid_cell(block[i], _root_center, _root_half, n)]++;
+    }
+
+    // upper nodes and chunks
+    _nodes.clear();
+    _pending.clear();
+    _plan.clear();
+    _chunk_plan.clear();
+    _chunk_count.clear();
+    _cell_chunks.assign(n * n * n, -1);
+    plan(0, 0, 0, 0);
+    _chunk_first.resize(_chunk_count.size());
+    uint64_t first = 0;
+    for (size_t c = 0; c < _chunk_count.size(); c++){
+        _chunk_first[c] = first;
+        first += _chunk_count[c];
+    }
+
+    _out = fopen(_filename.c_str(), "wb");
+    string sorted_name = _filename + ".sorted";
+    FILE * sorted = fopen(sorted_name.c_str(), "w+b");
+    bool ok = _out && sorted;
+    if (!ok)
+        printf("Point_Octree_Builder: couldn't open %s\n", _out ? sorted_name.c_str() :
+            _filename.c_str());
+    octree_file_header_t header;
+    memset(&header, 0, sizeof(header));
+    if (ok){
+        // filled in at the end
+        fwrite(&header, sizeof(header), 1, _out);
+        _out_offset = sizeof(header);
+        rewind(spill);
+        ok = distribute(spill, sorted);
+    }
+    fclose(spill);
+    for (size_t c = 0; ok && c < _chunk_plan.size(); c++)
+        ok = build_chunk(sorted, (int) c);
+    if (ok){
+        finish_upper(0);
+        // whatever the root kept
+        int root = _plan[0].node;
+        vector<octree_point_t>& kept = _pending[root];
+        ok = write_points(root, kept.empty() ? NULL : &kept[0], kept.size());
+        _pending.clear();
+    }
+    if (ok){
+        memcpy(header.magic, XEN_OCTREE_MAGIC, 8);
+        header.version = XEN_OCTREE_VERSION;
+        header.num_nodes = (uint32_t) _nodes.size();
+        header.num_points = _num_points;
+        header.nodes_offset = _out_offset;
+        for (int k = 0; k < 3; k++)
+            header.center[k] = _root_center[k];
+        header.half_size = _root_half;
+        ok = fwrite(&_nodes[0], sizeof(octree_node_t), _nodes.size(), _out) == _nodes.size();
+        ok = ok && seek_to(_out, 0) && fwrite(&header, sizeof(header), 1, _out) == 1;
+        if (!ok)
+            printf("Point_Octree_Builder: couldn't write %s\n", _filename.c_str());
+    }
+    if (_out)
+        fclose(_out);
+    _out = NULL;
+    if (sorted)
+        fclose(sorted);
+    remove(sorted_name.c_str());
+    remove_spill();
+    if (ok)
+        printf("Point_Octree_Builder: %s, %0.1fM points in %d nodes (%d chunks), %0.0f MB, "
+            "%0.1f s\n", _filename.c_str(), _num_points / 1000000.0, (int) _nodes.size(),
+            (int) _chunk_plan.size(), _out_offset / (1024.0 * 1024.0),
+            (get_time_ms() - start) / 1000.0);
+    _nodes.clear();
+    _plan.clear();
+    _cell_counts.clear();
+    _cell_chunks.clear();
+    return ok;
+}
+
+int Point_Octree_Builder::plan(int level, int x, int y, int z){
+    int n = 1 << PLAN_LEVELS;
+    int span = n >> level;
+    uint64_t count = 0;
+    for (int i = x * span; i < (x + 1) * span; i++)
+        for (int j = y * span; j < (y + 1) * span; j++)
+            for (int k = z * span; k < (z + 1) * span; k++)
+                count += _cell_counts[(i * n + j) * n + k];
+    if (count == 0)
+        return -1;
+
+    float center[3], half_size;
+    cell_center(level, x, y, z, center, half_size);
+    plan_node_t entry;
+    entry.node = new_node(center, half_size, level);
+    entry.level = level;
+    entry.cell[0] = x;
+    entry.cell[1] = y;
+    entry.cell[2] = z;
+    entry.chunk = -1;
+    for (int i = 0; i < 8; i++)
+        entry.children[i] = -1;
+    int index = (int) _plan.size();
+    _plan.push_back(entry);
+
+    // the finest cells are a chunk however many they hold; it's just
+    //  more memory for that one
+    if (count <= (uint64_t) _chunk_points || level == PLAN_LEVELS){
+        int chunk = (int) _chunk_plan.size();
+        _plan[index].chunk = chunk;
+        _chunk_plan.push_back(index);
+        _chunk_count.push_back(count);
+        for (int i = x * span; i < (x + 1) * span; i++)
+            for (int j = y * span; j < (y + 1) * span; j++)
+                for (int k = z * span; k < (z + 1) * span; k++)
+                    _cell_chunks[(i * n + j) * n + k] = chunk;
+        return index;
+    }
+    for (int i = 0; i < 8; i++){
+        int child = plan(level + 1, x * 2 + ((i >> 2) & 1), y * 2 + ((i >> 1) & 1),
+                         z * 2 + (i & 1));
+        _plan[index].children[i] = child;
+        if (child >= 0)
+            _nodes[_plan[index].node].children[i] = _plan[child].node;
+    }
+    return index;
+}
+
+bool Point_Octree_Builder::distribute(FILE * spill, FILE * sorted){
+    int n = 1 << PLAN_LEVELS;
+    int chunks = (int) _chunk_plan.size();
+    vector< vector<octree_point_t> > buffers(chunks);
+    vector<uint64_t> written(chunks, 0);
+    vector<octree_point_t> block(SPILL_BLOCK);
+    size_t got;
+    bool ok = true;
+    while (ok && (got = fread(&block[0], sizeof(octree_point_t), SPILL_BLOCK, spill)) > 0){
+        for (size_t i = 0; ok && i < got; i++){
+            int c = _cell_chunks[grid_cell(block[i], _root_center, _root_half, n)];
+            vector<octree_point_t>& buffer = buffers[c];
+            buffer.push_back(block[i]);
+            if ((int) buffer.size() < SORT_BUFFER)
+                continue;
+            ok = seek_to(sorted, (_chunk_first[c] + written[c]) * sizeof(octree_point_t)) &&
+                fwrite(&buffer[0], sizeof(octree_point_t), buffer.size(), sorted) == buffer.size();
+            written[c] += buffer.size();
+            buffer.clear();
+        }
+    }
+    for (int c = 0; ok && c < chunks; c++){
+        if (buffers[c].empty())
+            continue;
+        ok = seek_to(sorted, (_chunk_first[c] + written[c]) * sizeof(octree_point_t)) &&
+            fwrite(&buffers[c][0], sizeof(octree_point_t), buffers[c].size(), sorted) ==
+                buffers[c].size();
+    }
+    if (!ok)
+        printf("Point_Octree_Builder: couldn't sort the points into chunks; out of disk?\n");
+    return ok;
+}
+
+bool Point_Octree_Builder::build_chunk(FILE * sorted, int chunk){
+    size_t count = (size_t) _chunk_count[chunk];
+    vector<octree_point_t> pts(count);
+    if (!seek_to(sorted, _chunk_first[chunk] * sizeof(octree_point_t)) ||
+            fread(&pts[0], sizeof(octree_point_t), count, sorted) != count){
+        printf("Point_Octree_Builder: couldn't read back chunk %d\n", chunk);
+        return false;
+    }
+    const plan_node_t& entry = _plan[_chunk_plan[chunk]];
+    const octree_node_t& root = _nodes[entry.node];
+    float center[3] = {root.center[0], root.center[1], root.center[2]};
+    build_node(pts, 0, count, center, root.half_size, entry.level, entry.node, true);
+    return !ferror(_out);
+}
+
+size_t Point_Octree_Builder::sample(octree_point_t * pts, size_t count, const float * center,
+                                    float half_size, bool fresh){
+    int n = XEN_OCTREE_GRID;
+    if (fresh || _occupied.empty())
+        _occupied.assign(n * n * n, 0);
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++){
+        int cell = grid_cell(pts[i], center, half_size, n);
+        if (_occupied[cell])
+            continue;
+        _occupied[cell] = 1;
+        std::swap(pts[i], pts[kept]);
+        kept++;
+    }
+    return kept;
+}
+
+int Point_Octree_Builder::build_node(vector<octree_point_t>& pts, size_t begin, size_t end,
+                                     const float * center_in, float half_size, int depth,
+                                     int node, bool defer){
+    // center_in may be in _nodes, which new_node moves
+    float center[3] = {center_in[0], center_in[1], center_in[2]};
+    size_t count = end - begin;
+    octree_point_t * p = count ? &pts[begin] : NULL;
+    size_t kept = count;
+    if (count > (size_t) _leaf_points && depth < MAX_DEPTH)
+        kept = sample(p, count, center, half_size);
+    if (defer)
+        _pending[node].assign(p, p + kept);
+    else
+        write_points(node, p, kept);
+    if (kept == count)
+        return node;
+
+    // the rest, by octant
+    size_t counts[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    for (size_t i = kept; i < count; i++)
+        counts[octant(p[i], center)]++;
+    {
+        size_t starts[8];
+        starts[0] = 0;
+        for (int o = 1; o < 8; o++)
+            starts[o] = starts[o-1] + counts[o-1];
+        vector<octree_point_t> sorted(count - kept);
+        for (size_t i = kept; i < count; i++)
+            sorted[starts[octant(p[i], center)]++] = p[i];
+        memcpy(p + kept, &sorted[0], sorted.size() * sizeof(octree_point_t));
+    }
+
+    float child_half = half_size * 0.5f;
+    size_t at = begin + kept;
+    for (int o = 0; o < 8; o++){
+        if (!counts[o])
+            continue;
+        float child_center[3] = {
+            center[0] + (o & 4 ? child_half : -child_half),
+            center[1] + (o & 2 ? child_half : -child_half),
+            center[2] + (o & 1 ? child_half : -child_half)};
+        int child = new_node(child_center, child_half, depth + 1);
+        _nodes[node].children[o] = child;
+        build_node(pts, at, at + counts[o], child_center, child_half, depth + 1, child, false);
+        at += counts[o];
+    }
+    return node;
+}
+
+void Point_Octree_Builder::finish_upper(int plan_index){
+    plan_node_t entry = _plan[plan_index];
+    // a chunk's root, whose points are already waiting
+    if (entry.chunk >= 0)
+        return;
+    for (int i = 0; i < 8; i++)
+        if (entry.children[i] >= 0)
+            finish_upper(entry.children[i]);
+
+    // one grid over this node, filled from each child in turn; what
+    //  a child doesn't give up is its own
+    const octree_node_t& node = _nodes[entry.node];
+    float center[3] = {node.center[0], node.center[1], node.center[2]};
+    float half_size = node.half_size;
+    vector<octree_point_t> kept;
+    bool fresh = true;
+    for (int i = 0; i < 8; i++){
+        if (entry.children[i] < 0)
+            continue;
+        int child = _plan[entry.children[i]].node;
+        vector<octree_point_t>& theirs = _pending[child];
+        size_t given = 0;
+        if (!theirs.empty()){
+            given = sample(&theirs[0], theirs.size(), center, half_size, fresh);
+            fresh = false;
+            kept.insert(kept.end(), theirs.begin(), theirs.begin() + given);
+        }
+        write_points(child, given < theirs.size() ? &theirs[given] : NULL, theirs.size() - given);
+        _pending.erase(child);
+    }
+    _pending[entry.node].swap(kept);
+}
+
+/* #########################################################################
+
+                                 Point_Octree
+
+   ######################################################################### */
+Point_Octree::Point_Octree(int point_budget, int gpu_budget, int upload_budget) :
+    _point_budget(point_budget),
+    _gpu_budget(gpu_budget),
+    _upload_budget(upload_budget),
+    _min_node_pixels(96.0f),
+#ifdef _WIN32
+    _file_handle(INVALID_HANDLE_VALUE),
+    _mapping_handle(NULL),
+#else
+    _fd(-1),
+#endif
+    _file_size(0),
+    _thread_running(false),
+    _stopping(false),
+    _mapping(false),
+    _loads(0),
+    _frame(0)
+{
+    memset(&_header, 0, sizeof(_header));
+    memset(&_stats, 0, sizeof(_stats));
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    _map_granularity = info.dwAllocationGranularity;
+#else
+    _map_granularity = (size_t) sysconf(_SC_PAGESIZE);
+#endif
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+    if (pthread_create(&_thread, NULL, &Point_Octree::thread_main, this))
+        printf("Point_Octree: couldn't start its loader thread\n");
+    else
+        _thread_running = true;
+}
+
+Point_Octree::~Point_Octree(){
+    close();
+    pthread_mutex_lock(&_mutex);
+    _stopping = true;
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_mutex);
+    if (_thread_running)
+        pthread_join(_thread, NULL);
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+}
+
+bool Point_Octree::open(const string& filename){
+    close();
+#ifdef _WIN32
+    _file_handle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+    if (_file_handle == INVALID_HANDLE_VALUE){
+        printf("Point_Octree: couldn't open %s\n", filename.c_str());
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(_file_handle, &size))
+        _file_size = (uint64_t) size.QuadPart;
+    if (_file_size > 0)
+        _mapping_handle = CreateFileMapping(_file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+#else
+    _fd = ::open(filename.c_str(), O_RDONLY);
+    if (_fd < 0){
+        printf("Point_Octree: couldn't open %s\n", filename.c_str());
+        return false;
+    }
+    struct stat st;
+    if (fstat(_fd, &st) == 0)
+        _file_size = (uint64_t) st.st_size;
+#endif
+    void * view = NULL;
+    size_t view_size = 0;
+    const octree_file_header_t * header = NULL;
+    if (_file_size >= sizeof(octree_file_header_t))
+        header = (const octree_file_header_t *) map_range(0, sizeof(octree_file_header_t),
+                                                          view, view_size);
+    bool ok = header && memcmp(header->magic, XEN_OCTREE_MAGIC, 8) == 0 &&
+        header->version == XEN_OCTREE_VERSION && header->num_nodes > 0 &&
+        header->nodes_offset + (uint64_t) header->num_nodes * sizeof(octree_node_t) <= _file_size;
+    if (ok)
+        _header = *header;
+    if (view)
+        unmap_node(view, view_size);
+    if (!ok){
+        printf("Point_Octree: %s isn't an octree file, or is cut short\n", filename.c_str());
+        close();
+        return false;
+    }
+
+    // the node table's small enough to keep
+    const octree_node_t * nodes = (const octree_node_t *) map_range(_header.nodes_offset,
+        _header.num_nodes * sizeof(octree_node_t), view, view_size);
+    if (!nodes){
+        printf("Point_Octree: couldn't map %s\n", filename.c_str());
+        close();
+        return false;
+    }
+    _nodes.assign(nodes, nodes + _header.num_nodes);
+    unmap_node(view, view_size);
+
+    octree_gpu_t empty;
+    empty.buffer = 0;
+    empty.resident = false;
+    empty.used = 0;
+    _gpu.assign(_nodes.size(), empty);
+    _is_wanted.assign(_nodes.size(), 0);
+    printf("Point_Octree: %s, %0.1fM points in %d nodes\n", filename.c_str(),
+        _header.num_points / 1000000.0, (int) _nodes.size());
+    return true;
+}
+
+void Point_Octree::close(){
+    // let the loader finish whatever it's mapping, and give it
+    //  nothing more
+    pthread_mutex_lock(&_mutex);
+    _queue.clear();
+    while (_mapping)
+        pthread_cond_wait(&_cond, &_mutex);
+    for (size_t i = 0; i < _ready.size(); i++)
+        unmap_node(_ready[i].view, _ready[i].view_size);
+    _ready.clear();
+    _in_flight.clear();
+    pthread_mutex_unlock(&_mutex);
+
+    for (size_t i = 0; i < _gpu.size(); i++)
+        if (_gpu[i].resident)
+            glDeleteBuffers(1, &_gpu[i].buffer);
+    _gpu.clear();
+    _lru.clear();
+    _nodes.clear();
+    _wanted.clear();
+    _is_wanted.clear();
+    memset(&_header, 0, sizeof(_header));
+    _stats.resident_nodes = 0;
+    _stats.resident_points = 0;
+    _stats.nodes_drawn = 0;
+    _stats.points_drawn = 0;
+#ifdef _WIN32
+    if (_mapping_handle)
+        CloseHandle(_mapping_handle);
+    if (_file_handle != INVALID_HANDLE_VALUE)
+        CloseHandle(_file_handle);
+    _mapping_handle = NULL;
+    _file_handle = INVALID_HANDLE_VALUE;
+#else
+    if (_fd >= 0)
+        ::close(_fd);
+    _fd = -1;
+#endif
+    _file_size = 0;
+}
+
+void * Point_Octree::map_range(uint64_t offset, size_t size, void *& view, size_t& view_size){
+    // views start on the allocation granularity
+    uint64_t base = offset - offset % _map_granularity;
+    size_t skip = (size_t) (offset - base);
+    view_size = size + skip;
+    view = NULL;
+#ifdef _WIN32
+    if (_mapping_handle)
+        view = MapViewOfFile(_mapping_handle, FILE_MAP_READ, (DWORD) (base >> 32),
+                             (DWORD) (base & 0xFFFFFFFF), view_size);
+#else
+    if (_fd >= 0){
+        view = mmap(NULL, view_size, PROT_READ, MAP_PRIVATE, _fd, (off_t) base);
+        if (view == MAP_FAILED)
+            view = NULL;
+    }
+#endif
+    return view ? (unsigned char *) view + skip : NULL;
+}
+
+const octree_point_t * Point_Octree::map_node(int node, void *& view, size_t& view_size){
+    const octree_node_t& n = _nodes[node];
+    view = NULL;
+    view_size = 0;
+    if (n.count == 0 || n.offset + (uint64_t) n.count * sizeof(octree_point_t) > _file_size)
+        return NULL;
+    const octree_point_t * points = (const octree_point_t *) map_range(n.offset,
+        n.count * sizeof(octree_point_t), view, view_size);
+    if (!points)
+        return NULL;
+#ifndef _WIN32
+    madvise(view, view_size, MADV_WILLNEED);
+#endif
+    // a read a page, so the faults are ours and not the upload's
+    const volatile unsigned char * bytes = (const volatile unsigned char *) view;
+    unsigned char sum = 0;
+    for (size_t i = 0; i < view_size; i += 4096)
+        sum += bytes[i];
+    sum += bytes[view_size - 1];
+    (void) sum;
+    return points;
+}
+
+void Point_Octree::unmap_node(void * view, size_t view_size){
+    if (!view)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(view);
+#else
+    munmap(view, view_size);
+#endif
+}
+
+void * Point_Octree::thread_main(void * octree){
+    ((Point_Octree *) octree)->thread_loop();
+    return NULL;
+}
+
+void Point_Octree::thread_loop(){
+    pthread_mutex_lock(&_mutex);
+    while (true){
+        while (!_stopping && (_queue.empty() || (int) _ready.size() >= MAX_READY))
+            pthread_cond_wait(&_cond, &_mutex);
+        if (_stopping)
+            break;
+        int node = _queue.front();
+        _queue.erase(_queue.begin());
+        if (_in_flight.count(node))
+            continue;
+        _in_flight.insert(node);
+        _mapping = true;
+        pthread_mutex_unlock(&_mutex);
+
+        octree_loaded_t loaded;
+        loaded.node = node;
+        loaded.points = map_node(node, loaded.view, loaded.view_size);
+
+        pthread_mutex_lock(&_mutex);
+        _mapping = false;
+        if (loaded.points){
+            _ready.push_back(loaded);
+            _loads++;
+        } else {
+            printf("Point_Octree: couldn't map node %d\n", node);
+            _in_flight.erase(node);
+        }
+        // close() may be waiting on the mapping
+        pthread_cond_broadcast(&_cond);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+void Point_Octree::begin_frame(){
+    if (!is_open())
+        return;
+    _frame++;
+
+    // take what's mapped, up to the upload budget
+    vector<octree_loaded_t> ready;
+    pthread_mutex_lock(&_mutex);
+    int points = 0;
+    size_t taken = 0;
+    while (taken < _ready.size() && points < _upload_budget){
+        points += _nodes[_ready[taken].node].count;
+        taken++;
+    }
+    ready.assign(_ready.begin(), _ready.begin() + taken);
+    _ready.erase(_ready.begin(), _ready.begin() + taken);
+    pthread_mutex_unlock(&_mutex);
+    for (size_t i = 0; i < ready.size(); i++)
+        upload(ready[i]);
+
+    // least recently drawn out, but nothing drawn last frame
+    while (_stats.resident_points > _gpu_budget && !_lru.empty() &&
+            _gpu[_lru.back()].used + 1 < _frame)
+        evict(_lru.back());
+
+    // what the eyes wanted, biggest first, less what just came in
+    sort(_wanted.begin(), _wanted.end());
+    vector<int> queue;
+    for (int i = (int) _wanted.size() - 1; i >= 0; i--){
+        int node = _wanted[i].second;
+        _is_wanted[node] = 0;
+        if (!_gpu[node].resident)
+            queue.push_back(node);
+    }
+    _wanted.clear();
+
+    pthread_mutex_lock(&_mutex);
+    for (size_t i = 0; i < ready.size(); i++)
+        _in_flight.erase(ready[i].node);
+    _queue.swap(queue);
+    _stats.loading = (int) (_queue.size() + _in_flight.size());
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_mutex);
+}
+
+void Point_Octree::upload(const octree_loaded_t& loaded){
+    octree_gpu_t& gpu = _gpu[loaded.node];
+    int count = _nodes[loaded.node].count;
+    if (!gpu.resident){
+        glGenBuffers(1, &gpu.buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, gpu.buffer);
+        glBufferData(GL_ARRAY_BUFFER, count * sizeof(octree_point_t), loaded.points,
+                     GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        gpu.resident = true;
+        _lru.push_front(loaded.node);
+        gpu.lru = _lru.begin();
+        gpu.used = _frame;
+        _stats.resident_nodes++;
+        _stats.resident_points += count;
+    }
+    unmap_node(loaded.view, loaded.view_size);
+}
+
+void Point_Octree::evict(int node){
+    octree_gpu_t& gpu = _gpu[node];
+    glDeleteBuffers(1, &gpu.buffer);
+    gpu.buffer = 0;
+    gpu.resident = false;
+    _lru.erase(gpu.lru);
+    _stats.resident_nodes--;
+    _stats.resident_points -= _nodes[node].count;
+    _stats.evictions++;
+}
+
+void Point_Octree::touch(int node){
+    octree_gpu_t& gpu = _gpu[node];
+    gpu.used = _frame;
+    _lru.splice(_lru.begin(), _lru, gpu.lru);
+}
+
+// false if the node's bounding sphere is outside the frustum; else how
+//  many pixels across it is
+static bool node_on_screen(const octree_node_t& node, const Matrix4f& modelview,
+                           const Vector4f * planes, float scale, float& pixels){
+    Vector4f center(node.center[0], node.center[1], node.center[2], 1.0f);
+    float radius = node.half_size * 1.7320508f;
+    for (int i = 0; i < 6; i++)
+        if (planes[i].dot(center) < -radius)
+            return false;
+    float distance = (modelview * center).head<3>().norm();
+    pixels = distance > radius ? 2.0f * radius / distance * scale : FLT_MAX;
+    return true;
+}
+
+void Point_Octree::select(const float * modelview, const float * projection,
+                          int viewport_height, bool loaded_only, vector<int>& nodes,
+                          vector<float>& pixels){
+    nodes.clear();
+    pixels.clear();
+    if (!is_open())
+        return;
+    Matrix4f mv = Map<const Matrix4f>(modelview);
+    Matrix4f clip = Map<const Matrix4f>(projection) * mv;
+    // frustum planes from the rows of clip, inside positive, scaled so
+    //  a point's value is its distance
+    Vector4f planes[6];
+    for (int i = 0; i < 3; i++){
+        planes[i * 2] = clip.row(3).transpose() + clip.row(i).transpose();
+        planes[i * 2 + 1] = clip.row(3).transpose() - clip.row(i).transpose();
+    }
+    for (int i = 0; i < 6; i++)
+        planes[i] /= planes[i].head<3>().norm();
+    // pixels across a unit-wide thing a unit away
+    float scale = projection[5] * viewport_height * 0.5f;
+
+    // biggest first; the root however small
+    priority_queue<pair<float, int> > open;
+    float size;
+    if (node_on_screen(_nodes[0], mv, planes, scale, size))
+        open.push(make_pair(size, 0));
+    int points = 0;
+    while (!open.empty() && points < _point_budget){
+        pair<float, int> top = open.top();
+        open.pop();
+        const octree_node_t& node = _nodes[top.second];
+        nodes.push_back(top.second);
+        pixels.push_back(top.first);
+        points += node.count;
+        if (loaded_only && node.count > 0 && !_gpu[top.second].resident)
+            continue;
+        for (int i = 0; i < 8; i++){
+            int child = node.children[i];
+            if (child >= 0 && node_on_screen(_nodes[child], mv, planes, scale, size) &&
+                    size >= _min_node_pixels)
+                open.push(make_pair(size, child));
+        }
+    }
+}
+
+void Point_Octree::draw(float point_size){
+    if (!is_open())
+        return;
+    GLfloat modelview[16], projection[16];
+    GLint viewport[4];
+    glGetFloatv(GL_MODELVIEW_MATRIX, modelview);
+    glGetFloatv(GL_PROJECTION_MATRIX, projection);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    double start = get_time_ms();
+    select(modelview, projection, viewport[3], true, _selected, _selected_pixels);
+    _stats.select_ms = get_time_ms() - start;
+
+    _stats.nodes_drawn = 0;
+    _stats.points_drawn = 0;
+    glPointSize(point_size);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    for (size_t i = 0; i < _selected.size(); i++){
+        int node = _selected[i];
+        int count = _nodes[node].count;
+        if (count == 0)
+            continue;
+        if (!_gpu[node].resident){
+            // either eye's wanting it is enough
+            if (!_is_wanted[node]){
+                _is_wanted[node] = 1;
+                _wanted.push_back(make_pair(_selected_pixels[i], node));
+            }
+            continue;
+        }
+        touch(node);
+        glBindBuffer(GL_ARRAY_BUFFER, _gpu[node].buffer);
+        glVertexPointer(3, GL_FLOAT, sizeof(octree_point_t), 0);
+        glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(octree_point_t), (const GLvoid *) 12);
+        glDrawArrays(GL_POINTS, 0, count);
+        _stats.nodes_drawn++;
+        _stats.points_drawn += count;
+    }
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glPointSize(1.0f);
+}
+
+octree_stats_t Point_Octree::stats(){
+    octree_stats_t ret = _stats;
+    pthread_mutex_lock(&_mutex);
+    ret.loads = _loads;
+    pthread_mutex_unlock(&_mutex);
+    return ret;
+}
+
+string Point_Octree::status(){
+    if (!is_open())
+        return string();
+    char tmp[100];
+    sprintf(tmp, "O: %0.1fM/%0.0fM pts, %d nodes, %d loading",
+        _stats.points_drawn / 1000000.0, _header.num_points / 1000000.0,
+        _stats.nodes_drawn, _stats.loading);
+    return string(tmp);
+}
+
+/* #########################################################################
+
+                                   benchmark
+
+   ######################################################################### */
+// a point somewhere on the walls, floor, ceiling or a table of a 6m
+//  by 3m by 6m room, with a centimeter or so of noise
+static void room_point(float * p){
+    float u = rand() / (float) RAND_MAX, v = rand() / (float) RAND_MAX;
+    int surface = rand() % 7;
+    switch (surface){
+        case 0: p[0] = u * 6.0f - 3.0f; p[1] = -1.5f; p[2] = v * 6.0f - 3.0f; break;
+        case 1: p[0] = u * 6.0f - 3.0f; p[1] = 1.5f; p[2] = v * 6.0f - 3.0f; break;
+        case 2: p[0] = -3.0f; p[1] = u * 3.0f - 1.5f; p[2] = v * 6.0f - 3.0f; break;
+        case 3: p[0] = 3.0f; p[1] = u * 3.0f - 1.5f; p[2] = v * 6.0f - 3.0f; break;
+        case 4: p[0] = u * 6.0f - 3.0f; p[1] = v * 3.0f - 1.5f; p[2] = -3.0f; break;
+        case 5: p[0] = u * 6.0f - 3.0f; p[1] = v * 3.0f - 1.5f; p[2] = 3.0f; break;
+        default: p[0] = u * 1.5f - 0.75f; p[1] = -0.75f; p[2] = v - 1.5f; break;
+    }
+    for (int k = 0; k < 3; k++)
+        p[k] += (rand() % 21 - 10) * 0.001f;
+}
+
+void xen_rift::benchmark_point_octree(int millions){
+    if (millions < 1)
+        millions = 1;
+    string filename = "point_octree_benchmark.xoct";
+    int total = millions * 1000000;
+    printf("Point octree: %dM points on a made up room\n", millions);
+
+    Point_Octree_Builder builder;
+    if (!builder.begin(filename))
+        return;
+    vector<float> xyz(100000 * 3);
+    double start = get_time_ms();
+    for (int added = 0; added < total; added += 100000){
+        for (int i = 0; i < 100000; i++)
+            room_point(&xyz[i * 3]);
+        builder.add(&xyz[0], 100000);
+    }
+    double add_ms = get_time_ms() - start;
+    start = get_time_ms();
+    bool ok = builder.finish();
+    double build_ms = get_time_ms() - start;
+    if (!ok)
+        return;
+    printf("  collect: %0.0f ms, build: %0.0f ms (%0.1fM points/s)\n", add_ms, build_ms,
+        total / build_ms / 1000.0);
+
+    Point_Octree octree;
+    if (!octree.open(filename)){
+        remove(filename.c_str());
+        return;
+    }
+    // standing in the middle of the room, looking round it; a 90
+    //  degree eye 1080 pixels high
+    float projection[16] = {1, 0, 0, 0,  0, 1, 0, 0,  0, 0, -1.002f, -1,  0, 0, -0.2002f, 0};
+    vector<int> nodes;
+    vector<float> pixels;
+    for (int view = 0; view < 4; view++){
+        Matrix4f modelview = Matrix4f::Identity();
+        modelview.topLeftCorner<3,3>() = AngleAxisf(view * (float) M_PI * 0.5f,
+                                                    Vector3f::UnitY()).toRotationMatrix();
+        start = get_time_ms();
+        for (int i = 0; i < 100; i++)
+            octree.select(modelview.data(), projection, 1080, false, nodes, pixels);
+        double select_ms = (get_time_ms() - start) / 100;
+        int points = 0;
+        for (size_t i = 0; i < nodes.size(); i++)
+            points += octree.node(nodes[i]).count;
+        printf("  view %d: %d nodes, %0.2fM points, select %0.3f ms\n", view,
+            (int) nodes.size(), points / 1000000.0, select_ms);
+    }
+
+    // and mapping them in, as the loader would; cold only the first
+    //  time round, whatever the OS has cached
+    start = get_time_ms();
+    double bytes = 0;
+    int mapped = 0;
+    for (size_t i = 0; i < nodes.size(); i++){
+        void * view;
+        size_t view_size;
+        if (octree.map_node(nodes[i], view, view_size)){
+            bytes += view_size;
+            mapped++;
+            octree.unmap_node(view, view_size);
+        }
+    }
+    double map_ms = get_time_ms() - start;
+    printf("  map in %d nodes: %0.1f ms (%0.0f MB/s)\n", mapped, map_ms,
+        bytes / (1024.0 * 1024.0) / (map_ms / 1000.0));
+    octree.close();
+    remove(filename.c_str());
+}
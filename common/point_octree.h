@@ -0,0 +1,343 @@
+/* #########################################################################
+        Point Octree -- keeps point clouds far bigger than fit on the
+            GPU (a session's worth of accumulated Kinect scans) in a
+            level of detail octree on disk, and draws as much of it
+            as a point budget allows, nearest and largest on screen
+            first, streaming nodes in from the file as they're needed.
+
+        Header.
+
+   ######################################################################### */
+
+#ifndef __XEN_POINT_OCTREE_H
+#define __XEN_POINT_OCTREE_H
+
+// Base system stuff
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include "../include/GL/glew.h"
+#include "../include/gl_helper.h"
+#include <gl/gl.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+//pthread for the loader thread
+#include <pthread.h>
+
+#include "Eigen/Dense"
+#include "Eigen/Geometry"
+
+#include "xen_utils.h"
+
+namespace xen_rift {
+
+    #define XEN_OCTREE_MAGIC "XENOCT01"
+    #define XEN_OCTREE_VERSION 1
+    // each node keeps one point per cell of a grid this many cells
+    //  across its box, so its points are about box / grid apart
+    #define XEN_OCTREE_GRID 32
+
+    #pragma pack(push, 1)
+    typedef struct _octree_point_t {
+        float x, y, z;
+        uint8_t rgba[4];
+    } octree_point_t;
+
+    typedef struct _octree_file_header_t {
+        char magic[8];
+        uint32_t version;
+        uint32_t num_nodes;
+        uint64_t num_points;
+        // of the node table, which follows the points; the root is
+        //  its first entry
+        uint64_t nodes_offset;
+        // root cube
+        float center[3];
+        float half_size;
+        uint8_t reserved[32];
+    } octree_file_header_t;
+
+    typedef struct _octree_node_t {
+        float center[3];
+        float half_size;
+        // about how far apart its points are
+        float spacing;
+        // node table indices; -1 for none
+        int32_t children[8];
+        // of its points in the file, and how many. Each point is in
+        //  exactly one node, so drawing a node and its ancestors
+        //  draws them once each, ever finer.
+        uint64_t offset;
+        uint32_t count;
+        uint32_t depth;
+    } octree_node_t;
+    #pragma pack(pop)
+
+    // Collects points as they come (spilled to a file next to the
+    //  output, so a session needn't fit in memory), then builds the
+    //  octree file from them out of core: the points are bucketed
+    //  into chunks that each fit in memory, each chunk's subtree is
+    //  built on its own, and the levels above the chunks are sampled
+    //  from the chunks' roots.
+    class Point_Octree_Builder {
+        public:
+            // chunk_points: most points built in memory at once.
+            //  leaf_points: nodes with this many or fewer keep them all.
+            Point_Octree_Builder(int chunk_points = 2000000, int leaf_points = 16384);
+            ~Point_Octree_Builder();
+
+            // starts collecting for filename, throwing away anything
+            //  collected before; false while a build's under way
+            bool begin(const std::string& filename);
+            // count points, x, y, z each, world coordinates; rgb 3
+            //  bytes a point, or NULL to color them by height
+            void add(const float * xyz, int count, const unsigned char * rgb = NULL);
+            // Builds the file, deletes the spill and stops collecting.
+            //  Blocks; seconds for tens of millions of points.
+            bool finish();
+            // Stops collecting and runs finish() on a thread of its
+            //  own, so the caller can carry on drawing. False if there
+            //  was nothing to finish.
+            bool finish_async();
+            // finish_async()'s build hasn't finished yet
+            bool building();
+            // once building() is false: whether it built the file
+            bool built();
+            bool collecting() { return _spill != NULL; }
+            uint64_t num_points() { return _num_points; }
+            // "O: scanning, 3.2M pts", "O: building, 3.2M pts"
+            std::string status();
+
+        protected:
+            // a node above (or at the root of) a chunk, during finish()
+            typedef struct _plan_node_t {
+                int node;
+                int level;
+                int cell[3];
+                // -1 if this is an upper node, else its chunk
+                int chunk;
+                int children[8];
+            } plan_node_t;
+
+            static void * thread_main(void * builder);
+            // finish(), once the spill's closed
+            bool build();
+            int plan(int level, int x, int y, int z);
+            // the spill, by chunk
+            bool distribute(FILE * spill, FILE * sorted);
+            bool build_chunk(FILE * sorted, int chunk);
+            // the node for [begin, end) of pts, which it may reorder;
+            //  a deferred node's own points are left in _pending for
+            //  the levels above it to sample from
+            int build_node(std::vector<octree_point_t>& pts, size_t begin, size_t end,
+                           const float * center, float half_size, int depth, int node,
+                           bool defer);
+            // moves the points of [begin, end) that fall in an empty
+            //  cell of the node's grid to the front; returns how many.
+            //  fresh clears the grid first.
+            size_t sample(octree_point_t * pts, size_t count, const float * center,
+                          float half_size, bool fresh = true);
+            // upper nodes, children first: samples children's pending
+            //  points into the node's, writes the children's rest
+            void finish_upper(int plan_index);
+            bool write_points(int node, const octree_point_t * pts, size_t count);
+            int new_node(const float * center, float half_size, int depth);
+            void cell_center(int level, int x, int y, int z, float * center, float& half_size);
+            void remove_spill();
+
+            int _chunk_points;
+            int _leaf_points;
+            std::string _filename;
+            std::string _spill_name;
+            FILE * _spill;
+            uint64_t _num_points;
+            float _min[3];
+            float _max[3];
+
+            pthread_t _thread;
+            bool _thread_running;
+            pthread_mutex_t _mutex;
+            // under _mutex
+            bool _building;
+            bool _built;
+
+            // finish() only
+            FILE * _out;
+            uint64_t _out_offset;
+            float _root_center[3];
+            float _root_half;
+            // counts per cell of the finest planning grid, then which
+            //  chunk each cell's points go to
+            std::vector<uint32_t> _cell_counts;
+            std::vector<int> _cell_chunks;
+            std::vector<plan_node_t> _plan;
+            // per chunk: its plan entry, and where its points are in the
+            //  sorted spill
+            std::vector<int> _chunk_plan;
+            std::vector<uint64_t> _chunk_first;
+            std::vector<uint64_t> _chunk_count;
+            std::vector<octree_node_t> _nodes;
+            // by node, points not yet written
+            std::map<int, std::vector<octree_point_t> > _pending;
+            std::vector<unsigned char> _occupied;
+
+        private:
+    };
+
+    typedef struct _octree_stats_t {
+        // last draw()
+        int nodes_drawn;
+        int points_drawn;
+        double select_ms;
+        // on the GPU
+        int resident_nodes;
+        int resident_points;
+        // wanted, but not there yet
+        int loading;
+        unsigned long loads;
+        unsigned long evictions;
+    } octree_stats_t;
+
+    // Draws an octree file. Nodes are picked per eye, biggest on screen
+    //  first, until the point budget's spent or what's left would be
+    //  smaller on screen than min_node_pixels; a node only counts if
+    //  its parent does. Picked nodes that aren't on the GPU are asked
+    //  of the loader thread, which maps their part of the file and
+    //  touches it in, so the render thread's upload never waits on the
+    //  disk. GPU buffers are kept up to a budget, least recently drawn
+    //  out first. All but the constructor are for the GL thread.
+    class Point_Octree {
+        public:
+            // point_budget: most points drawn an eye. gpu_budget: most
+            //  points kept on the GPU. upload_budget: most uploaded a
+            //  frame.
+            Point_Octree(int point_budget = 3000000, int gpu_budget = 12000000,
+                         int upload_budget = 500000);
+            ~Point_Octree();
+
+            bool open(const std::string& filename);
+            void close();
+            bool is_open() { return !_nodes.empty(); }
+            uint64_t num_points() { return _header.num_points; }
+            int num_nodes() { return (int) _nodes.size(); }
+            const octree_node_t& node(int i) { return _nodes[i]; }
+
+            // a node is drawn while its box is at least this many
+            //  pixels across
+            void set_min_node_pixels(float pixels) { _min_node_pixels = pixels; }
+            void set_point_budget(int points) { _point_budget = points; }
+
+            // Once a display frame, before the eyes: uploads what's
+            //  loaded, evicts past the GPU budget, and hands the loader
+            //  what the eyes wanted last frame.
+            void begin_frame();
+            // Picks and draws nodes for the current modelview,
+            //  projection and viewport; once an eye.
+            void draw(float point_size = 2.0f);
+            // draw()'s pick without GL, for column major modelview and
+            //  projection matrices and a viewport this many pixels
+            //  high: nodes, biggest first, and how many pixels across
+            //  each is. loaded_only stops at nodes that aren't on the
+            //  GPU yet, as draw() does; their children can't be drawn.
+            void select(const float * modelview, const float * projection, int viewport_height,
+                        bool loaded_only, std::vector<int>& nodes, std::vector<float>& pixels);
+
+            // loader thread: maps a node's points and touches them in;
+            //  NULL for a node with none. Public for
+            //  benchmark_point_octree.
+            const octree_point_t * map_node(int node, void *& view, size_t& view_size);
+            void unmap_node(void * view, size_t view_size);
+
+            octree_stats_t stats();
+            // "O: 2.1M/31M pts, 212 nodes, 9 loading"
+            std::string status();
+
+        protected:
+            // a node mapped in by the loader, for the render thread to
+            //  upload and unmap
+            typedef struct _octree_loaded_t {
+                int node;
+                void * view;
+                size_t view_size;
+                const octree_point_t * points;
+            } octree_loaded_t;
+
+            typedef struct _octree_gpu_t {
+                GLuint buffer;
+                bool resident;
+                // last frame it was drawn
+                unsigned long used;
+                std::list<int>::iterator lru;
+            } octree_gpu_t;
+
+            void * map_range(uint64_t offset, size_t size, void *& view, size_t& view_size);
+            static void * thread_main(void * octree);
+            void thread_loop();
+            void upload(const octree_loaded_t& loaded);
+            void evict(int node);
+            // marks it drawn this frame: to the front of _lru
+            void touch(int node);
+
+            int _point_budget;
+            int _gpu_budget;
+            int _upload_budget;
+            float _min_node_pixels;
+
+            octree_file_header_t _header;
+            std::vector<octree_node_t> _nodes;
+        #ifdef _WIN32
+            HANDLE _file_handle;
+            HANDLE _mapping_handle;
+        #else
+            int _fd;
+        #endif
+            uint64_t _file_size;
+            size_t _map_granularity;
+
+            pthread_t _thread;
+            bool _thread_running;
+            pthread_mutex_t _mutex;
+            pthread_cond_t _cond;
+
+            // under _mutex
+            bool _stopping;
+            // the loader's mapping a node, so the file has to stay open
+            bool _mapping;
+            // biggest on screen first
+            std::vector<int> _queue;
+            std::vector<octree_loaded_t> _ready;
+            // in _ready or being mapped
+            std::set<int> _in_flight;
+            unsigned long _loads;
+
+            // GL thread only
+            std::vector<octree_gpu_t> _gpu;
+            // most recently drawn first
+            std::list<int> _lru;
+            unsigned long _frame;
+            // this frame's wants from both eyes, node and size on screen
+            std::vector<std::pair<float, int> > _wanted;
+            std::vector<unsigned char> _is_wanted;
+            std::vector<int> _selected;
+            std::vector<float> _selected_pixels;
+            octree_stats_t _stats;
+
+        private:
+    };
+
+    // Builds an octree of millions of points on a made up room into a
+    //  temporary file, then times picking nodes from a few viewpoints
+    //  and mapping them in, and prints the results.
+    void benchmark_point_octree(int millions = 5);
+}
+
+#endif //__XEN_POINT_OCTREE_H
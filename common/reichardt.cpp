@@ -0,0 +1,169 @@
+/* #########################################################################
+        Reichardt Array -- correlation-type elementary motion detector
+            over a grayscale image stream.
+
+        Every pixel pairs with its right and lower neighbour to form two
+        half-detectors. Each arm is delayed by a first-order low-pass
+        kept from frame to frame, and the mirror-symmetric products are
+        subtracted:
+            R_x = LP(I(x)) * I(x+1) - I(x) * LP(I(x+1))
+        (same for y). |R| is then smoothed over time and scaled to an
+        8-bit magnitude image. Nothing is recomputed from scratch: one
+        frame costs one pass over the image.
+
+        Rows are split into bands on the shared thread pool; within a
+        row, four pixels go at a time through SSE2.
+
+        Much reference to:
+            Borst & Egelhaaf, "Principles of visual motion detection",
+                TINS 1989
+
+   ######################################################################### */
+
+#include "reichardt.h"
+#include <emmintrin.h>
+
+using namespace std;
+using namespace xen_rift;
+using namespace cv;
+
+Reichardt_Array::Reichardt_Array(float tau_frames, float gain, float smoothing) :
+    _width(0),
+    _height(0),
+    _gain(gain),
+    _smoothing(smoothing),
+    _lp_read(0),
+    _primed(false),
+    _last_seq(0),
+    _last_update_ms(0.0)
+{
+    if (tau_frames < 1.0f)
+        tau_frames = 1.0f;
+    _alpha = 1.0f / tau_frames;
+}
+
+void Reichardt_Array::reset(){
+    _primed = false;
+}
+
+void Reichardt_Array::update(const Mat& gray, unsigned long frame_seq){
+    if (gray.empty() || gray.type() != CV_8UC1)
+        return;
+    if (_primed && frame_seq == _last_seq)
+        return;
+    double start_ms = get_time_ms();
+
+    if (gray.cols != _width || gray.rows != _height){
+        _width = gray.cols;
+        _height = gray.rows;
+        _lp[0].resize(_width*_height);
+        _lp[1].resize(_width*_height);
+        _response.resize(_width*_height);
+        _magnitude = Mat::zeros(_height, _width, CV_8UC1);
+        _primed = false;
+    }
+
+    _gray = gray;
+    _last_seq = frame_seq;
+    if (!_primed){
+        // start the delay arms at the current image, i.e. no motion
+        for (int y = 0; y < _height; y++){
+            const uchar * g = _gray.ptr<uchar>(y);
+            float * lp = &_lp[_lp_read][y*_width];
+            for (int x = 0; x < _width; x++)
+                lp[x] = g[x] * (1.0f/255.0f);
+        }
+        memset(&_response[0], 0, sizeof(float)*_response.size());
+        _magnitude.setTo(Scalar(0));
+        _primed = true;
+    } else {
+        get_shared_thread_pool()->parallel_for(_height, update_band, this, 16);
+        _lp_read = 1 - _lp_read;
+    }
+    _last_update_ms = get_time_ms() - start_ms;
+}
+
+void Reichardt_Array::update_band(void * self, int start, int end){
+    ((Reichardt_Array *) self)->update_rows(start, end);
+}
+
+// four 8-bit pixels -> four floats in [0, 1]
+static inline __m128 load4_u8(const uchar * p){
+    int v;
+    memcpy(&v, p, 4);
+    __m128i zero = _mm_setzero_si128();
+    __m128i i = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero), zero);
+    return _mm_mul_ps(_mm_cvtepi32_ps(i), _mm_set1_ps(1.0f/255.0f));
+}
+
+// four floats in [0, 255] -> four 8-bit pixels
+static inline void store4_u8(uchar * p, __m128 v){
+    __m128i i = _mm_cvtps_epi32(v);
+    i = _mm_packs_epi32(i, i);
+    i = _mm_packus_epi16(i, i);
+    int out = _mm_cvtsi128_si32(i);
+    memcpy(p, &out, 4);
+}
+
+void Reichardt_Array::update_rows(int y0, int y1){
+    const float * lp_in = &_lp[_lp_read][0];
+    float * lp_out = &_lp[1-_lp_read][0];
+    float * resp_all = &_response[0];
+    const float inv255 = 1.0f/255.0f;
+    const float alpha = _alpha;
+    const float smoothing = _smoothing;
+    const float scale = _gain;
+
+    const __m128 v_alpha = _mm_set1_ps(alpha);
+    const __m128 v_smoothing = _mm_set1_ps(smoothing);
+    const __m128 v_scale = _mm_set1_ps(scale);
+    const __m128 v_max = _mm_set1_ps(255.0f);
+
+    for (int y = y0; y < y1; y++){
+        // bottom row pairs with itself: no vertical response there
+        int yn = (y+1 < _height) ? y+1 : y;
+        const uchar * g0 = _gray.ptr<uchar>(y);
+        const uchar * g1 = _gray.ptr<uchar>(yn);
+        const float * lp0 = lp_in + y*_width;
+        const float * lp1 = lp_in + yn*_width;
+        float * lpw = lp_out + y*_width;
+        float * resp = resp_all + y*_width;
+        uchar * out = _magnitude.ptr<uchar>(y);
+
+        int x = 0;
+        for (; x + 5 <= _width; x += 4){
+            __m128 a = load4_u8(g0 + x);
+            __m128 bx = load4_u8(g0 + x + 1);
+            __m128 by = load4_u8(g1 + x);
+            __m128 la = _mm_loadu_ps(lp0 + x);
+            __m128 lbx = _mm_loadu_ps(lp0 + x + 1);
+            __m128 lby = _mm_loadu_ps(lp1 + x);
+
+            __m128 rx = _mm_sub_ps(_mm_mul_ps(la, bx), _mm_mul_ps(a, lbx));
+            __m128 ry = _mm_sub_ps(_mm_mul_ps(la, by), _mm_mul_ps(a, lby));
+            __m128 m = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(rx, rx), _mm_mul_ps(ry, ry)));
+
+            __m128 r = _mm_loadu_ps(resp + x);
+            r = _mm_add_ps(r, _mm_mul_ps(v_smoothing, _mm_sub_ps(m, r)));
+            _mm_storeu_ps(resp + x, r);
+            store4_u8(out + x, _mm_min_ps(_mm_mul_ps(r, v_scale), v_max));
+
+            _mm_storeu_ps(lpw + x, _mm_add_ps(la, _mm_mul_ps(v_alpha, _mm_sub_ps(a, la))));
+        }
+        // leftovers, and the right column that has no right neighbour
+        for (; x < _width; x++){
+            int xn = (x+1 < _width) ? x+1 : x;
+            float a = g0[x] * inv255;
+            float bx = g0[xn] * inv255;
+            float by = g1[x] * inv255;
+            float la = lp0[x];
+            float rx = la*bx - a*lp0[xn];
+            float ry = la*by - a*lp1[x];
+            float m = sqrtf(rx*rx + ry*ry);
+            resp[x] += smoothing * (m - resp[x]);
+            float o = resp[x] * scale;
+            out[x] = (uchar) (o > 255.0f ? 255.0f : o);
+            lpw[x] = la + alpha * (a - la);
+        }
+    }
+}
@@ -0,0 +1,79 @@
+/* #########################################################################
+        Reichardt Array -- correlation-type elementary motion detector
+            over a grayscale image stream.
+
+        Header.
+
+   ######################################################################### */
+
+#ifndef __XEN_REICHARDT_H
+#define __XEN_REICHARDT_H
+
+// Base system stuff
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <vector>
+
+#include "opencv/cv.h"
+
+#include "thread_pool.h"
+#include "xen_utils.h"
+
+namespace xen_rift {
+
+    class Reichardt_Array {
+        public:
+            // tau_frames: time constant of the delay (low-pass) arm, in
+            //  frames. gain: scale from correlator output to 8-bit.
+            //  smoothing: 0..1 weight of the newest response in the
+            //  displayed magnitude.
+            Reichardt_Array(float tau_frames = 2.0f, float gain = 10000.0f,
+                            float smoothing = 0.5f);
+
+            // Advances the detector by one 8-bit grayscale frame. Calls
+            //  with a frame_seq equal to the last one are ignored, so a
+            //  frame can be offered more than once safely.
+            void update(const cv::Mat& gray, unsigned long frame_seq);
+            // forget all temporal state; the next frame re-primes
+            void reset();
+
+            // 8-bit flow magnitude as of the last update (CV_8UC1)
+            cv::Mat& get_magnitude() { return _magnitude; }
+            bool has_output() { return _primed; }
+            double last_update_ms() { return _last_update_ms; }
+
+            void set_gain(float gain) { _gain = gain; }
+            float get_gain() { return _gain; }
+
+        protected:
+            static void update_band(void * self, int start, int end);
+            void update_rows(int y0, int y1);
+
+            int _width;
+            int _height;
+            float _alpha;
+            float _gain;
+            float _smoothing;
+
+            // delayed (low-passed) arm of every detector. Double
+            //  buffered: bands read their neighbours' previous state
+            //  from _lp[_lp_read] while writing their own into the other.
+            std::vector<float> _lp[2];
+            int _lp_read;
+            // temporally smoothed response magnitude
+            std::vector<float> _response;
+
+            cv::Mat _gray;
+            cv::Mat _magnitude;
+            bool _primed;
+            unsigned long _last_seq;
+            double _last_update_ms;
+
+        private:
+    };
+}
+
+#endif //__XEN_REICHARDT_H
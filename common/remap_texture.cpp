@@ -0,0 +1,124 @@
+/* #########################################################################
+        Remap Texture -- a camera's undistort / rectify lookup, built
+            once and kept on the GPU, so frames are corrected by the
+            shader that draws them instead of by cv::remap.
+
+   ######################################################################### */
+
+#include "remap_texture.h"
+
+using namespace std;
+using namespace xen_rift;
+using namespace cv;
+
+GLuint Remap_Texture::_program = 0;
+bool Remap_Texture::_program_failed = false;
+
+Remap_Texture::Remap_Texture() :
+    _texture(0),
+    _size(0, 0),
+    _calib(NULL),
+    _cam(-1)
+{
+}
+
+Remap_Texture::~Remap_Texture(){
+    if (_texture)
+        glDeleteTextures(1, &_texture);
+}
+
+bool Remap_Texture::update(Stereo_Calibration * calib, int cam, Size size){
+    if (calib == _calib && cam == _cam && size == _size && valid())
+        return true;
+    Mat map_x, map_y;
+    calib->get_float_maps(cam, size, map_x, map_y);
+    if (!set_maps(map_x, map_y))
+        return false;
+    _calib = calib;
+    _cam = cam;
+    return true;
+}
+
+bool Remap_Texture::set_maps(const Mat& map_x, const Mat& map_y){
+    if (map_x.empty() || map_x.type() != CV_32FC1 || map_y.type() != CV_32FC1 ||
+            map_x.size() != map_y.size()){
+        printf("Remap_Texture: need two CV_32FC1 maps of the same size\n");
+        return false;
+    }
+    int w = map_x.cols, h = map_x.rows;
+    // pixel coords to texcoords of the pixel centres, x and y
+    //  interleaved for a two channel texture
+    Mat lookup(h, w, CV_32FC2);
+    for (int y = 0; y < h; y++){
+        const float * mx = map_x.ptr<float>(y);
+        const float * my = map_y.ptr<float>(y);
+        float * out = lookup.ptr<float>(y);
+        for (int x = 0; x < w; x++){
+            out[2*x] = (mx[x] + 0.5f) / w;
+            out[2*x+1] = (my[x] + 0.5f) / h;
+        }
+    }
+    if (!_texture)
+        glGenTextures(1, &_texture);
+    glBindTexture(GL_TEXTURE_2D, _texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    // full float: 16 bit texcoords would be a tenth of a pixel off
+    //  across an HD frame
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE_ALPHA32F_ARB, w, h, 0,
+                 GL_LUMINANCE_ALPHA, GL_FLOAT, lookup.ptr());
+    glBindTexture(GL_TEXTURE_2D, 0);
+    _size = Size(w, h);
+    // hand made maps aren't tied to a calibration
+    _calib = NULL;
+    _cam = -1;
+    return true;
+}
+
+bool Remap_Texture::build_program(){
+    if (_program)
+        return true;
+    if (_program_failed)
+        return false;
+    GLuint vshader, fshader;
+    load_shaders("../resources/shaders/yuv_passthrough.vert", &vshader,
+                 "../resources/shaders/remap_passthrough.frag", &fshader);
+    _program = glCreateProgram();
+    glAttachShader(_program, vshader);
+    glAttachShader(_program, fshader);
+    glLinkProgram(_program);
+    GLint linked = 0;
+    glGetProgramiv(_program, GL_LINK_STATUS, &linked);
+    if (!linked){
+        printf("Remap_Texture: couldn't link the remap shaders\n");
+        glDeleteProgram(_program);
+        _program = 0;
+        _program_failed = true;
+        return false;
+    }
+    return true;
+}
+
+void Remap_Texture::bind(){
+    glActiveTexture(GL_TEXTURE0 + REMAP_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, _texture);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void Remap_Texture::begin(GLuint image, bool modulate){
+    if (!build_program() || !valid())
+        return;
+    glUseProgram(_program);
+    bind();
+    glBindTexture(GL_TEXTURE_2D, image);
+    glUniform1i(glGetUniformLocation(_program, "image"), 0);
+    glUniform1i(glGetUniformLocation(_program, "remap"), REMAP_TEXTURE_UNIT);
+    glUniform1i(glGetUniformLocation(_program, "modulate"), modulate);
+}
+
+void Remap_Texture::end(){
+    glUseProgram(0);
+}
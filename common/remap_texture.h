@@ -0,0 +1,73 @@
+/* #########################################################################
+        Remap Texture -- a camera's undistort / rectify lookup, built
+            once and kept on the GPU, so frames are corrected by the
+            shader that draws them instead of by cv::remap.
+
+        Header.
+
+   ######################################################################### */
+
+#ifndef __XEN_REMAP_TEXTURE_H
+#define __XEN_REMAP_TEXTURE_H
+
+// Base system stuff
+#include <stdio.h>
+#include <stdlib.h>
+#include "../include/GL/glew.h"
+#include "../include/gl_helper.h"
+#include <gl/gl.h>
+
+#include "opencv/cv.h"
+
+#include "camera_calibration.h"
+#include "xen_utils.h"
+
+namespace xen_rift {
+
+    // Texture unit the lookup is bound to while drawing; the image
+    //  being corrected has units below it.
+    #define REMAP_TEXTURE_UNIT 2
+
+    // Float texture the size of the image: each texel holds where, in
+    //  normalized texcoords, the output pixel there comes from.
+    class Remap_Texture {
+        public:
+            Remap_Texture();
+            ~Remap_Texture();
+
+            // Lookup for camera cam of calib at image size. Only
+            //  rebuilt when one of those changes, so it's fine to call
+            //  every frame.
+            bool update(Stereo_Calibration * calib, int cam, cv::Size size);
+            // any CV_32FC1 pixel maps, as from initUndistortRectifyMap
+            bool set_maps(const cv::Mat& map_x, const cv::Mat& map_y);
+            bool valid() { return _texture != 0 && _size.width > 0; }
+            GLuint texture() { return _texture; }
+
+            // Binds the lookup to REMAP_TEXTURE_UNIT, for shaders that
+            //  do their own sampling (see Yuv_Frame_Texture).
+            void bind();
+            // Draws image through the lookup: draw the quad with
+            //  texcoords 0..1, then end(). modulate multiplies by the
+            //  current color, as GL_MODULATE would; otherwise the
+            //  texel replaces it.
+            void begin(GLuint image, bool modulate = false);
+            void end();
+
+        protected:
+            // shared by every instance; built on first use
+            static bool build_program();
+            static GLuint _program;
+            static bool _program_failed;
+
+            GLuint _texture;
+            cv::Size _size;
+            // what update() last built from
+            Stereo_Calibration * _calib;
+            int _cam;
+
+        private:
+    };
+}
+
+#endif //__XEN_REMAP_TEXTURE_H
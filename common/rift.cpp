@@ -36,6 +36,8 @@ using namespace OVR;
 
 Rift::Rift(bool verbose) {
 
+    _end_frame_ms = 0.0;
+    _eye_orientation[0] = _eye_orientation[1] = orientation_identity();
     ovr_Initialize();
     if (!(_hmd = ovrHmd_Create(0))) {
       fprintf(stderr, "failed to open Oculus HMD, falling back to virtual debug HMD\n");
@@ -269,6 +271,7 @@ void Rift::motion(int x, int y) {
 
 void Rift::onIdle() {
     QueryPerformanceCounter(&_currtime);
+    sample_head_pose();
 
     float dt = float((unsigned long)(_currtime.QuadPart) - (unsigned long)(_lasttime.QuadPart));
     _lasttime = _currtime;
@@ -290,6 +293,17 @@ void Rift::onIdle() {
     */ 
 }
 
+/* record where the head is pointing right now */
+void Rift::sample_head_pose(){
+    ovrTrackingState state = ovrHmd_GetTrackingState(_hmd, ovr_GetTimeInSeconds());
+    if (!(state.StatusFlags & ovrStatus_OrientationTracked))
+        return;
+    ovrQuatf q = state.HeadPose.ThePose.Orientation;
+    orientation_t o;
+    o.x = q.x; o.y = q.y; o.z = q.z; o.w = q.w;
+    _head_history.add(get_time_ms(), o);
+}
+
 void Rift::render(Vector3f EyePos, Vector3f EyeRot, void (*draw_scene)(void)){
 
  int i;
@@ -305,6 +319,7 @@ void Rift::render(Vector3f EyePos, Vector3f EyeRot, void (*draw_scene)(void)){
  Vector3f forward = rollPitchYaw.Transform(ForwardVector);
  Matrix4f View = Matrix4f::LookAtRH(EyePos, EyePos + forward, up); 
 
+ sample_head_pose();
  /* the drawing starts with a call to ovrHmd_BeginFrame */
  ovrHmd_BeginFrame(_hmd, 0);
 
@@ -337,6 +352,10 @@ void Rift::render(Vector3f EyePos, Vector3f EyeRot, void (*draw_scene)(void)){
       * SDK, about the position and orientation of the user's head in the world.
       */
      pose[eye] = ovrHmd_GetEyePose(_hmd, eye);
+     _eye_orientation[eye].x = pose[eye].Orientation.x;
+     _eye_orientation[eye].y = pose[eye].Orientation.y;
+     _eye_orientation[eye].z = pose[eye].Orientation.z;
+     _eye_orientation[eye].w = pose[eye].Orientation.w;
      glMatrixMode(GL_MODELVIEW);
      glLoadIdentity();
      
@@ -375,6 +394,8 @@ void Rift::render(Vector3f EyePos, Vector3f EyeRot, void (*draw_scene)(void)){
  glViewport(0, 0, _win_width, _win_height);
 
  ovrHmd_EndFrame(_hmd, pose, &_fb_ovr_tex[0].Texture);
+ // presented (or at least queued for the next vsync) as of here
+ _end_frame_ms = get_time_ms();
 
  assert(glGetError() == GL_NO_ERROR);
  //glutSwapBuffers();  
@@ -33,6 +33,7 @@
 #include <../src/OVR_CAPI.h>
 #include <../src/OVR_CAPI_GL.h>
 #include "xen_utils.h"
+#include "head_pose.h"
 
 #include <windows.h>
 
@@ -63,6 +64,24 @@ namespace xen_rift {
 			void onIdle( void );
 			void render(OVR::Vector3f EyePos, OVR::Vector3f EyeRot, void (*draw_scene)(void));
 			char which_eye(){ return _which_eye; }
+			// eye offset from the head center for the eye being drawn;
+			// only valid within a draw_scene call.
+			ovrVector3f which_eye_view_adjust(){
+				return _eye_rdesc[_which_eye == 'l' ? ovrEye_Left : ovrEye_Right].ViewAdjust;
+			}
+			// head orientation this eye is being drawn for (the SDK's
+			//  prediction for when it'll be on screen); only valid
+			//  within a draw_scene call.
+			orientation_t which_eye_orientation(){
+				return _eye_orientation[_which_eye == 'l' ? ovrEye_Left : ovrEye_Right];
+			}
+			// where the head was pointing at get_time_ms() time t_ms, from
+			//  tracking sampled at every onIdle / render
+			bool head_orientation_at(double t_ms, orientation_t& out){
+				return _head_history.orientation_at(t_ms, out);
+			}
+			// get_time_ms() as the last render's ovrHmd_EndFrame returned
+			double last_end_frame_ms(){ return _end_frame_ms; }
 		protected:
 			// which eye is in use right now? only active
 			// and valid within a draw_scene call.
@@ -86,6 +105,12 @@ namespace xen_rift {
 		    // timekeeping
 		    LARGE_INTEGER _lasttime;
 		    LARGE_INTEGER _currtime;
+		    double _end_frame_ms;
+
+		    // tracking history, for matching poses to camera frames
+		    void sample_head_pose();
+		    Head_Pose_History _head_history;
+		    orientation_t _eye_orientation[2];
 
 			// verbose?
 			bool _verbose;
@@ -0,0 +1,401 @@
+/* #########################################################################
+        Stereo Depth -- census-transform block matching between the two
+            passthrough cameras, producing disparity, depth and a
+            colored point cloud.
+
+        Pipeline per frame pair:
+            -rectify both frames with the calibration's cached maps
+            -grayscale, then pyrDown to the working level
+            -5x5 census transform (24 bits / pixel), row bands on the
+                thread pool
+            -block matching: Hamming cost between census words, summed
+                over a (2r+1)^2 window and winner-take-all over the
+                disparity range, with parabolic sub-pixel refinement.
+                Row bands on the thread pool; each band keeps running
+                column sums so a new row costs one add and one subtract
+                per (x, d). Hamming, column sums and the WTA all run
+                four pixels at a time through SSE2.
+            -triangulate valid pixels into depth and a point cloud
+
+        Much reference to:
+            Zabih & Woodfill, "Non-parametric local transforms for
+                computing visual correspondence", ECCV 1994
+
+   ######################################################################### */
+
+#include "stereo_depth.h"
+#include <emmintrin.h>
+
+using namespace std;
+using namespace xen_rift;
+using namespace cv;
+
+// census words hold this many comparison bits
+#define CENSUS_BITS 24
+
+Stereo_Depth::Stereo_Depth(Stereo_Calibration * calib, int num_disparities,
+                           int window_radius, int level) :
+    _calib(calib),
+    _window_radius(window_radius),
+    _level(level),
+    _max_mean_cost(0.35f),
+    _width(0),
+    _height(0),
+    _work_focal(1.0f),
+    _work_baseline(0.065f)
+{
+    _num_disparities = (num_disparities + 3) & ~3;
+    if (_num_disparities < 4)
+        _num_disparities = 4;
+    if (_level < 0)
+        _level = 0;
+}
+
+void Stereo_Depth::set_level(int level){
+    if (level < 0)
+        level = 0;
+    _level = level;
+}
+
+void Stereo_Depth::compute(const Mat& left, const Mat& right){
+    if (left.empty() || right.empty() || left.size() != right.size())
+        return;
+    double start_ms = get_time_ms();
+
+    // rectify, then gray and down to the working level
+    Mat rect[2];
+    _calib->rectify(0, left, rect[0]);
+    _calib->rectify(1, right, rect[1]);
+    for (int i = 0; i < 2; i++){
+        Mat g;
+        cvtColor(rect[i], g, CV_BGR2GRAY);
+        for (int l = 0; l < _level; l++){
+            Mat down;
+            pyrDown(g, down);
+            g = down;
+        }
+        _gray[i] = g;
+    }
+    Mat c = rect[0];
+    for (int l = 0; l < _level; l++){
+        Mat down;
+        pyrDown(c, down);
+        c = down;
+    }
+    _color_left = c;
+
+    _width = _gray[0].cols;
+    _height = _gray[0].rows;
+    _census[0].resize(_width*_height);
+    _census[1].resize(_width*_height);
+    _disparity.create(_height, _width, CV_32FC1);
+    _depth.create(_height, _width, CV_32FC1);
+
+    float scale = 1.0f / (float)(1 << _level);
+    _work_focal = (float) _calib->focal_px(left.size()) * scale;
+    _work_baseline = (float) _calib->baseline_m();
+
+    Thread_Pool * pool = get_shared_thread_pool();
+    pool->parallel_for(_height, census_band, this, 8);
+    pool->parallel_for(_height, match_band, this, 16);
+    build_cloud();
+
+    // bookkeeping for this resolution
+    double end_ms = get_time_ms();
+    double took = end_ms - start_ms;
+    map<int, stereo_stats_t>::iterator it = _stats.find(_level);
+    if (it == _stats.end()){
+        stereo_stats_t s;
+        s.width = _width;
+        s.height = _height;
+        s.frames = 0;
+        s.mean_ms = took;
+        s.max_ms = took;
+        s.mean_interval_ms = 0.0;
+        s.last_start_ms = start_ms;
+        _stats[_level] = s;
+        it = _stats.find(_level);
+    }
+    stereo_stats_t& s = it->second;
+    if (s.frames > 0){
+        double interval = start_ms - s.last_start_ms;
+        s.mean_interval_ms = (s.frames == 1) ? interval : 0.9*s.mean_interval_ms + 0.1*interval;
+        s.mean_ms = 0.9*s.mean_ms + 0.1*took;
+    }
+    if (took > s.max_ms)
+        s.max_ms = took;
+    s.last_ms = took;
+    s.last_start_ms = start_ms;
+    s.frames++;
+}
+
+stereo_stats_t * Stereo_Depth::get_current_stats(){
+    map<int, stereo_stats_t>::iterator it = _stats.find(_level);
+    if (it == _stats.end())
+        return NULL;
+    return &(it->second);
+}
+
+string Stereo_Depth::get_stats_string(){
+    string out;
+    char tmp[200];
+    for (map<int, stereo_stats_t>::iterator it = _stats.begin(); it != _stats.end(); it++){
+        stereo_stats_t& s = it->second;
+        double fps = s.mean_interval_ms > 0.0 ? 1000.0 / s.mean_interval_ms : 0.0;
+        double mdisp = ((double)s.width) * s.height * _num_disparities / (s.mean_ms * 1000.0);
+        sprintf(tmp, "%dx%d: latency %0.2fms (max %0.2f), %0.1f fps, %0.1f Mdisp/s over %d frames\n",
+            s.width, s.height, s.mean_ms, s.max_ms, fps, mdisp, s.frames);
+        out += tmp;
+    }
+    return out;
+}
+
+/* #########################################################################
+                                census
+   ######################################################################### */
+void Stereo_Depth::census_band(void * self, int start, int end){
+    ((Stereo_Depth *) self)->census_rows(start, end);
+}
+
+void Stereo_Depth::census_rows(int y0, int y1){
+    for (int i = 0; i < 2; i++){
+        const Mat& g = _gray[i];
+        unsigned int * out_all = &_census[i][0];
+        for (int y = y0; y < y1; y++){
+            unsigned int * out = out_all + y*_width;
+            bool interior_row = (y >= 2 && y < _height - 2);
+            const uchar * rows[5];
+            for (int dy = -2; dy <= 2; dy++){
+                int yy = y + dy;
+                yy = yy < 0 ? 0 : (yy >= _height ? _height - 1 : yy);
+                rows[dy+2] = g.ptr<uchar>(yy);
+            }
+            for (int x = 0; x < _width; x++){
+                uchar center = rows[2][x];
+                unsigned int bits = 0;
+                if (interior_row && x >= 2 && x < _width - 2){
+                    for (int dy = 0; dy < 5; dy++){
+                        const uchar * r = rows[dy] + x - 2;
+                        for (int dx = 0; dx < 5; dx++){
+                            if (dy == 2 && dx == 2)
+                                continue;
+                            bits = (bits << 1) | (r[dx] < center ? 1 : 0);
+                        }
+                    }
+                } else {
+                    for (int dy = 0; dy < 5; dy++){
+                        for (int dx = -2; dx <= 2; dx++){
+                            if (dy == 2 && dx == 0)
+                                continue;
+                            int xx = x + dx;
+                            xx = xx < 0 ? 0 : (xx >= _width ? _width - 1 : xx);
+                            bits = (bits << 1) | (rows[dy][xx] < center ? 1 : 0);
+                        }
+                    }
+                }
+                out[x] = bits;
+            }
+        }
+    }
+}
+
+/* #########################################################################
+                                matching
+   ######################################################################### */
+void Stereo_Depth::match_band(void * self, int start, int end){
+    ((Stereo_Depth *) self)->match_rows(start, end);
+}
+
+// population count of four 32-bit lanes
+static inline __m128i popcount_epi32(__m128i v){
+    const __m128i m1 = _mm_set1_epi32(0x55555555);
+    const __m128i m2 = _mm_set1_epi32(0x33333333);
+    const __m128i m4 = _mm_set1_epi32(0x0f0f0f0f);
+    v = _mm_sub_epi32(v, _mm_and_si128(_mm_srli_epi32(v, 1), m1));
+    v = _mm_add_epi32(_mm_and_si128(v, m2), _mm_and_si128(_mm_srli_epi32(v, 2), m2));
+    v = _mm_and_si128(_mm_add_epi32(v, _mm_srli_epi32(v, 4)), m4);
+    v = _mm_add_epi32(v, _mm_srli_epi32(v, 8));
+    v = _mm_add_epi32(v, _mm_srli_epi32(v, 16));
+    return _mm_and_si128(v, _mm_set1_epi32(0x3f));
+}
+
+static inline int popcount32(unsigned int v){
+    v = v - ((v >> 1) & 0x55555555);
+    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+    v = (v + (v >> 4)) & 0x0f0f0f0f;
+    v = v + (v >> 8);
+    v = v + (v >> 16);
+    return v & 0x3f;
+}
+
+// adds (sign > 0) or removes one row's matching cost to the column sums
+static void accumulate_row_cost(int * colsum, const unsigned int * cl, const unsigned int * cr,
+                                int width, int num_disp, int sign){
+    for (int d = 0; d < num_disp; d++){
+        int * cs = colsum + d*width;
+        int x = 0;
+        // no match possible left of d: worst cost
+        for (; x < d && x < width; x++)
+            cs[x] += sign * CENSUS_BITS;
+        for (; x + 4 <= width; x += 4){
+            __m128i a = _mm_loadu_si128((const __m128i *)(cl + x));
+            __m128i b = _mm_loadu_si128((const __m128i *)(cr + x - d));
+            __m128i cost = popcount_epi32(_mm_xor_si128(a, b));
+            __m128i sum = _mm_loadu_si128((const __m128i *)(cs + x));
+            sum = (sign > 0) ? _mm_add_epi32(sum, cost) : _mm_sub_epi32(sum, cost);
+            _mm_storeu_si128((__m128i *)(cs + x), sum);
+        }
+        for (; x < width; x++)
+            cs[x] += sign * popcount32(cl[x] ^ cr[x - d]);
+    }
+}
+
+void Stereo_Depth::match_rows(int y0, int y1){
+    const int W = _width;
+    const int H = _height;
+    const int D = _num_disparities;
+    const int r = _window_radius;
+    const int area = (2*r+1)*(2*r+1);
+    const int max_cost = (int)(_max_mean_cost * CENSUS_BITS * area);
+
+    vector<int> colsum(D*W, 0);
+    vector<int> agg(D*W, 0);
+    vector<int> best_cost(W);
+    vector<int> best_d(W);
+    const unsigned int * cl_all = &_census[0][0];
+    const unsigned int * cr_all = &_census[1][0];
+
+    // prime the column sums with the window around y0 (edges clamp)
+    for (int yy = y0 - r; yy <= y0 + r; yy++){
+        int yc = yy < 0 ? 0 : (yy >= H ? H - 1 : yy);
+        accumulate_row_cost(&colsum[0], cl_all + yc*W, cr_all + yc*W, W, D, 1);
+    }
+
+    for (int y = y0; y < y1; y++){
+        if (y > y0){
+            int y_in = y + r;
+            int y_out = y - r - 1;
+            y_in = y_in >= H ? H - 1 : y_in;
+            y_out = y_out < 0 ? 0 : y_out;
+            accumulate_row_cost(&colsum[0], cl_all + y_in*W, cr_all + y_in*W, W, D, 1);
+            accumulate_row_cost(&colsum[0], cl_all + y_out*W, cr_all + y_out*W, W, D, -1);
+        }
+
+        // horizontal box over the column sums
+        for (int d = 0; d < D; d++){
+            const int * cs = &colsum[d*W];
+            int * ag = &agg[d*W];
+            int s = 0;
+            for (int k = -r; k <= r; k++)
+                s += cs[k < 0 ? 0 : (k >= W ? W - 1 : k)];
+            for (int x = 0; x < W; x++){
+                ag[x] = s;
+                int x_in = x + r + 1;
+                int x_out = x - r;
+                s += cs[x_in >= W ? W - 1 : x_in] - cs[x_out < 0 ? 0 : x_out];
+            }
+        }
+
+        // winner take all, four columns at a time
+        int x = 0;
+        for (; x + 4 <= W; x += 4){
+            __m128i best = _mm_set1_epi32(0x7fffffff);
+            __m128i bestd = _mm_setzero_si128();
+            for (int d = 0; d < D; d++){
+                __m128i c = _mm_loadu_si128((const __m128i *)(&agg[d*W + x]));
+                __m128i lt = _mm_cmplt_epi32(c, best);
+                best = _mm_or_si128(_mm_and_si128(lt, c), _mm_andnot_si128(lt, best));
+                bestd = _mm_or_si128(_mm_and_si128(lt, _mm_set1_epi32(d)), _mm_andnot_si128(lt, bestd));
+            }
+            _mm_storeu_si128((__m128i *)(&best_cost[x]), best);
+            _mm_storeu_si128((__m128i *)(&best_d[x]), bestd);
+        }
+        for (; x < W; x++){
+            int b = 0x7fffffff, bd = 0;
+            for (int d = 0; d < D; d++){
+                if (agg[d*W + x] < b){
+                    b = agg[d*W + x];
+                    bd = d;
+                }
+            }
+            best_cost[x] = b;
+            best_d[x] = bd;
+        }
+
+        // sub-pixel refinement, validity, depth
+        float * disp = _disparity.ptr<float>(y);
+        float * depth = _depth.ptr<float>(y);
+        for (x = 0; x < W; x++){
+            int d = best_d[x];
+            if (d <= 0 || d >= D - 1 || best_cost[x] > max_cost || x - d < 0){
+                disp[x] = -1.0f;
+                depth[x] = 0.0f;
+                continue;
+            }
+            float c0 = (float) agg[(d-1)*W + x];
+            float c1 = (float) best_cost[x];
+            float c2 = (float) agg[(d+1)*W + x];
+            float denom = c0 - 2.0f*c1 + c2;
+            float offset = denom > 0.0f ? 0.5f * (c0 - c2) / denom : 0.0f;
+            float dd = d + offset;
+            disp[x] = dd;
+            depth[x] = _work_focal * _work_baseline / dd;
+        }
+    }
+}
+
+/* #########################################################################
+                              triangulation
+   ######################################################################### */
+void Stereo_Depth::build_cloud(){
+    float scale = 1.0f / (float)(1 << _level);
+    Size full(_width << _level, _height << _level);
+    float f = (float) _calib->focal_px(full) * scale;
+    float cx = (float) _calib->cx(full) * scale;
+    float cy = (float) _calib->cy(full) * scale;
+    float inv_f = 1.0f / f;
+
+    _points.clear();
+    _colors.clear();
+    _points.reserve(_width*_height*3);
+    _colors.reserve(_width*_height*3);
+    for (int y = 0; y < _height; y++){
+        const float * depth = _depth.ptr<float>(y);
+        const uchar * bgr = _color_left.ptr<uchar>(y);
+        for (int x = 0; x < _width; x++){
+            float z = depth[x];
+            if (z <= 0.0f)
+                continue;
+            _points.push_back((x - cx) * z * inv_f);
+            _points.push_back((y - cy) * z * inv_f);
+            _points.push_back(z);
+            _colors.push_back(bgr[3*x+2]);
+            _colors.push_back(bgr[3*x+1]);
+            _colors.push_back(bgr[3*x]);
+        }
+    }
+}
+
+void Stereo_Depth::get_depth_colored(Mat& out, float max_depth_m){
+    out.create(_height, _width, CV_8UC3);
+    for (int y = 0; y < _height; y++){
+        const float * depth = _depth.ptr<float>(y);
+        uchar * o = out.ptr<uchar>(y);
+        for (int x = 0; x < _width; x++){
+            float z = depth[x];
+            if (z <= 0.0f){
+                o[3*x] = o[3*x+1] = o[3*x+2] = 0;
+                continue;
+            }
+            // near = red, far = blue
+            float t = z / max_depth_m;
+            t = t > 1.0f ? 1.0f : t;
+            float r = 1.5f - fabs(4.0f*t - 1.0f);
+            float g = 1.5f - fabs(4.0f*t - 2.0f);
+            float b = 1.5f - fabs(4.0f*t - 3.0f);
+            o[3*x+2] = (uchar)(255.0f * (r < 0.0f ? 0.0f : (r > 1.0f ? 1.0f : r)));
+            o[3*x+1] = (uchar)(255.0f * (g < 0.0f ? 0.0f : (g > 1.0f ? 1.0f : g)));
+            o[3*x] = (uchar)(255.0f * (b < 0.0f ? 0.0f : (b > 1.0f ? 1.0f : b)));
+        }
+    }
+}
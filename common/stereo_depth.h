@@ -0,0 +1,113 @@
+/* #########################################################################
+        Stereo Depth -- census-transform block matching between the two
+            passthrough cameras, producing disparity, depth and a
+            colored point cloud.
+
+        Header.
+
+   ######################################################################### */
+
+#ifndef __XEN_STEREO_DEPTH_H
+#define __XEN_STEREO_DEPTH_H
+
+// Base system stuff
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <vector>
+#include <map>
+#include <string>
+
+#include "opencv/cv.h"
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include "camera_calibration.h"
+#include "thread_pool.h"
+#include "xen_utils.h"
+
+namespace xen_rift {
+
+    // timing for one working resolution
+    typedef struct _stereo_stats_t {
+        int width;
+        int height;
+        int frames;
+        double mean_ms;
+        double max_ms;
+        double last_ms;
+        // time between consecutive computes at this resolution
+        double mean_interval_ms;
+        double last_start_ms;
+    } stereo_stats_t;
+
+    class Stereo_Depth {
+        public:
+            // num_disparities: search range at the working resolution
+            //  (rounded up to a multiple of 4). window_radius: half size
+            //  of the aggregation window. level: pyramid level matching
+            //  runs at (0 = full res, 1 = half, ...).
+            Stereo_Depth(Stereo_Calibration * calib, int num_disparities = 48,
+                         int window_radius = 3, int level = 1);
+
+            // rectify + match + triangulate one BGR pair
+            void compute(const cv::Mat& left, const cv::Mat& right);
+
+            void set_level(int level);
+            int get_level() { return _level; }
+
+            // disparity in working-resolution pixels, <= 0 is invalid (CV_32FC1)
+            cv::Mat& get_disparity() { return _disparity; }
+            // metric depth along the optical axis, 0 where invalid (CV_32FC1)
+            cv::Mat& get_depth() { return _depth; }
+            // false-color depth for display (CV_8UC3, BGR)
+            void get_depth_colored(cv::Mat& out, float max_depth_m = 5.0f);
+
+            // point cloud in the left rectified camera frame (x right,
+            //  y down, z forward, metres), with RGB colors
+            int num_points() { return (int) _points.size() / 3; }
+            float * get_points() { return _points.empty() ? NULL : &_points[0]; }
+            unsigned char * get_colors() { return _colors.empty() ? NULL : &_colors[0]; }
+
+            // one line per resolution computed so far
+            std::string get_stats_string();
+            stereo_stats_t * get_current_stats();
+
+        protected:
+            static void census_band(void * self, int start, int end);
+            static void match_band(void * self, int start, int end);
+            void census_rows(int y0, int y1);
+            void match_rows(int y0, int y1);
+            void build_cloud();
+
+            Stereo_Calibration * _calib;
+            int _num_disparities;
+            int _window_radius;
+            int _level;
+            // census bits hamming cost can reach before a pixel is
+            //  thrown out, as a fraction of the 24 bits
+            float _max_mean_cost;
+
+            // working-resolution images
+            int _width;
+            int _height;
+            // rectified focal length at the working level, and baseline
+            float _work_focal;
+            float _work_baseline;
+            cv::Mat _gray[2];
+            cv::Mat _color_left;
+            std::vector<unsigned int> _census[2];
+
+            cv::Mat _disparity;
+            cv::Mat _depth;
+            std::vector<float> _points;
+            std::vector<unsigned char> _colors;
+
+            std::map<int, stereo_stats_t> _stats;
+
+        private:
+    };
+}
+
+#endif //__XEN_STEREO_DEPTH_H
@@ -0,0 +1,762 @@
+/* #########################################################################
+        Stereo Recording -- records the passthrough camera streams, with
+            capture timestamps, to a seekable file, and plays them back
+            as Capture_Sources in place of the real cameras.
+
+   ######################################################################### */
+
+#include "stereo_recording.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace xen_rift;
+using namespace cv;
+
+// how much of a recording is mapped at a time, at least; a 32 bit
+//  process has room for a few of these where it wouldn't for a whole
+//  recording
+static const uint64_t REPLAY_WINDOW = 32 * 1024 * 1024;
+
+static unsigned char clamp_byte(int v){
+    return (unsigned char) (v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+// BGR -> YUYV, BT.601 video range, chroma averaged over each pixel
+//  pair; an odd last column is dropped
+static void bgr_to_yuyv(const Mat& bgr, vector<unsigned char>& out){
+    int pairs = bgr.cols / 2;
+    out.resize((size_t) pairs * 4 * bgr.rows);
+    unsigned char * dst = out.empty() ? NULL : &out[0];
+    for (int y = 0; y < bgr.rows; y++){
+        const unsigned char * src = bgr.ptr<unsigned char>(y);
+        for (int x = 0; x < pairs; x++, src += 6, dst += 4){
+            int b0 = src[0], g0 = src[1], r0 = src[2];
+            int b1 = src[3], g1 = src[4], r1 = src[5];
+            int b = b0 + b1, g = g0 + g1, r = r0 + r1;
+            dst[0] = clamp_byte(((66*r0 + 129*g0 + 25*b0 + 128) >> 8) + 16);
+            dst[1] = clamp_byte(((-38*r - 74*g + 112*b + 256) >> 9) + 128);
+            dst[2] = clamp_byte(((66*r1 + 129*g1 + 25*b1 + 128) >> 8) + 16);
+            dst[3] = clamp_byte(((112*r - 94*g - 18*b + 256) >> 9) + 128);
+        }
+    }
+}
+
+static uint64_t rec_padded(uint64_t size){
+    return (size + XEN_REC_ALIGN - 1) & ~((uint64_t) XEN_REC_ALIGN - 1);
+}
+
+const char * xen_rift::rec_encoding_name(int encoding){
+    switch (encoding){
+        case REC_ENCODING_RAW_BGR: return "raw";
+        case REC_ENCODING_MJPEG: return "mjpeg";
+        case REC_ENCODING_DEPTH: return "depth";
+        case REC_ENCODING_YUYV: return "yuyv";
+        default: return "?";
+    }
+}
+
+/* #########################################################################
+
+                                Stereo_Recorder
+
+   ######################################################################### */
+Stereo_Recorder::Stereo_Recorder() :
+    _file(NULL),
+    _encoding(REC_ENCODING_RAW_BGR),
+    _jpeg_quality(90),
+    _max_queued(16),
+    _offset(0),
+    _stopping(false),
+    _dropped(0)
+{
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+}
+
+Stereo_Recorder::~Stereo_Recorder(){
+    close();
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+}
+
+bool Stereo_Recorder::open(const string& filename, int num_streams,
+                           rec_encoding_t encoding, int jpeg_quality, int max_queued){
+    if (_file)
+        close();
+    _file = fopen(filename.c_str(), "wb");
+    if (!_file){
+        printf("Stereo_Recorder: couldn't open %s for writing\n", filename.c_str());
+        return false;
+    }
+    _encoding = encoding;
+    _jpeg_quality = jpeg_quality;
+    _max_queued = max_queued > 0 ? max_queued : 1;
+    _index.clear();
+    _stream_seq.assign(num_streams, 0);
+    _stream_encoding.assign(num_streams, encoding);
+    _queue.clear();
+    _stopping = false;
+    _dropped = 0;
+
+    // index_offset stays 0 until close(), which marks the file as
+    //  finished
+    memset(&_header, 0, sizeof(_header));
+    memcpy(_header.magic, XEN_REC_MAGIC, 8);
+    _header.version = XEN_REC_VERSION;
+    _header.num_streams = num_streams;
+    _header.encoding = encoding;
+    fwrite(&_header, sizeof(_header), 1, _file);
+    _offset = sizeof(_header);
+
+    if (pthread_create(&_writer, NULL, &Stereo_Recorder::writer_main, this)){
+        printf("Stereo_Recorder: couldn't start writer thread\n");
+        fclose(_file);
+        _file = NULL;
+        return false;
+    }
+    printf("Recording to %s (%s)\n", filename.c_str(), rec_encoding_name(encoding));
+    return true;
+}
+
+void Stereo_Recorder::set_stream_encoding(int stream, rec_encoding_t encoding){
+    if (stream >= 0 && stream < (int) _stream_encoding.size())
+        _stream_encoding[stream] = encoding;
+}
+
+void Stereo_Recorder::close(){
+    if (!_file)
+        return;
+    pthread_mutex_lock(&_mutex);
+    _stopping = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+    pthread_join(_writer, NULL);
+
+    // index, then patch the header to point at it
+    if (!_index.empty())
+        fwrite(&_index[0], sizeof(rec_index_entry_t), _index.size(), _file);
+    _header.index_offset = _offset;
+    _header.frame_count = (uint32_t) _index.size();
+    fseek(_file, 0, SEEK_SET);
+    fwrite(&_header, sizeof(_header), 1, _file);
+    fclose(_file);
+    _file = NULL;
+    printf("Recording closed: %d frames written, %d dropped\n",
+        (int) _index.size(), _dropped);
+}
+
+bool Stereo_Recorder::write_frame(int stream, const Mat& image, double timestamp_ms,
+                                  uint32_t source_timestamp){
+    if (!_file || stream < 0 || stream >= (int) _header.num_streams || image.empty())
+        return false;
+    bool depth = _stream_encoding[stream] == REC_ENCODING_DEPTH;
+    if (depth != (image.type() == CV_16UC1))
+        return false;
+
+    pthread_mutex_lock(&_mutex);
+    bool full = (int) _queue.size() >= _max_queued;
+    if (full)
+        _dropped++;
+    pthread_mutex_unlock(&_mutex);
+    if (full)
+        return false;
+
+    // the capture reuses its buffer on the next grab, so copy now
+    rec_pending_t frame;
+    frame.stream = stream;
+    frame.timestamp_ms = timestamp_ms;
+    frame.source_timestamp = source_timestamp;
+    if (image.type() == CV_8UC3 || depth)
+        frame.image = image.clone();
+    else if (image.type() == CV_8UC1)
+        cvtColor(image, frame.image, CV_GRAY2BGR);
+    else
+        return false;
+
+    pthread_mutex_lock(&_mutex);
+    _queue.push_back(frame);
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+    return true;
+}
+
+int Stereo_Recorder::frames_written(){
+    pthread_mutex_lock(&_mutex);
+    int ret = (int) _index.size();
+    pthread_mutex_unlock(&_mutex);
+    return ret;
+}
+
+int Stereo_Recorder::frames_dropped(){
+    pthread_mutex_lock(&_mutex);
+    int ret = _dropped;
+    pthread_mutex_unlock(&_mutex);
+    return ret;
+}
+
+void * Stereo_Recorder::writer_main(void * self){
+    Stereo_Recorder * rec = (Stereo_Recorder *) self;
+    while (true){
+        pthread_mutex_lock(&rec->_mutex);
+        while (rec->_queue.empty() && !rec->_stopping)
+            pthread_cond_wait(&rec->_cond, &rec->_mutex);
+        // drain everything queued before stopping
+        if (rec->_queue.empty()){
+            pthread_mutex_unlock(&rec->_mutex);
+            break;
+        }
+        rec_pending_t frame = rec->_queue.front();
+        rec->_queue.pop_front();
+        pthread_mutex_unlock(&rec->_mutex);
+
+        rec->write_pending(frame);
+    }
+    return NULL;
+}
+
+void Stereo_Recorder::write_pending(rec_pending_t& frame){
+    rec_frame_header_t fh;
+    memset(&fh, 0, sizeof(fh));
+    fh.magic = XEN_REC_FRAME_MAGIC;
+    fh.stream = frame.stream;
+    fh.width = frame.image.cols;
+    fh.height = frame.image.rows;
+    fh.encoding = _stream_encoding[frame.stream];
+    fh.source_timestamp = frame.source_timestamp;
+    fh.timestamp_ms = frame.timestamp_ms;
+    fh.seq = _stream_seq[frame.stream]++;
+
+    const unsigned char * payload;
+    if (fh.encoding == REC_ENCODING_DEPTH){
+        // clone() left it continuous
+        fh.size = (uint32_t) depth_encode(frame.image.ptr<unsigned short>(0),
+            frame.image.cols, frame.image.rows, _encode_buf);
+        payload = &_encode_buf[0];
+        fh.step = 0;
+    } else if (fh.encoding == REC_ENCODING_MJPEG){
+        vector<int> params;
+        params.push_back(CV_IMWRITE_JPEG_QUALITY);
+        params.push_back(_jpeg_quality);
+        if (!imencode(".jpg", frame.image, _encode_buf, params) || _encode_buf.empty()){
+            printf("Stereo_Recorder: jpeg encode failed, skipping frame\n");
+            return;
+        }
+        payload = &_encode_buf[0];
+        fh.size = (uint32_t) _encode_buf.size();
+        fh.step = 0;
+    } else if (fh.encoding == REC_ENCODING_YUYV){
+        if (frame.image.cols < 2){
+            printf("Stereo_Recorder: frame too narrow for yuyv, skipping frame\n");
+            return;
+        }
+        bgr_to_yuyv(frame.image, _encode_buf);
+        payload = &_encode_buf[0];
+        fh.width = frame.image.cols & ~1;
+        fh.step = fh.width * 2;
+        fh.size = fh.step * fh.height;
+    } else {
+        // clone() left it continuous
+        payload = frame.image.data;
+        fh.step = (uint32_t) frame.image.step;
+        fh.size = fh.step * fh.height;
+    }
+
+    static const unsigned char zeros[XEN_REC_ALIGN] = {0};
+    uint64_t padding = rec_padded(fh.size) - fh.size;
+    fwrite(&fh, sizeof(fh), 1, _file);
+    fwrite(payload, 1, fh.size, _file);
+    if (padding)
+        fwrite(zeros, 1, (size_t) padding, _file);
+
+    rec_index_entry_t entry;
+    entry.offset = _offset;
+    entry.timestamp_ms = fh.timestamp_ms;
+    entry.stream = fh.stream;
+    entry.size = fh.size;
+    _offset += sizeof(fh) + fh.size + padding;
+
+    pthread_mutex_lock(&_mutex);
+    _index.push_back(entry);
+    pthread_mutex_unlock(&_mutex);
+}
+
+/* #########################################################################
+
+                                Stereo_Replay
+
+   ######################################################################### */
+Stereo_Replay::Stereo_Replay() :
+    _size(0),
+#ifdef _WIN32
+    _file_handle(INVALID_HANDLE_VALUE),
+    _mapping_handle(NULL),
+#else
+    _fd(-1),
+#endif
+    _view_clock(0),
+    _first_ms(0.0),
+    _duration_ms(0.0),
+    _start_ms(-1.0)
+{
+    memset(&_header, 0, sizeof(_header));
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    _map_granularity = info.dwAllocationGranularity;
+#else
+    _map_granularity = (size_t) sysconf(_SC_PAGESIZE);
+#endif
+    pthread_mutex_init(&_view_mutex, NULL);
+}
+
+Stereo_Replay::~Stereo_Replay(){
+    close();
+    pthread_mutex_destroy(&_view_mutex);
+}
+
+bool Stereo_Replay::open(const string& filename){
+    close();
+    if (!map_file(filename))
+        return false;
+
+    unsigned char * head = _size < sizeof(_header) ? NULL :
+        map_at(0, 1, 0, sizeof(_header));
+    if (!head){
+        printf("Stereo_Replay: %s is too short to be a recording\n", filename.c_str());
+        close();
+        return false;
+    }
+    memcpy(&_header, head, sizeof(_header));
+    if (memcmp(_header.magic, XEN_REC_MAGIC, 8) != 0 || _header.version != XEN_REC_VERSION){
+        printf("Stereo_Replay: %s is not a recording this build can read\n", filename.c_str());
+        close();
+        return false;
+    }
+    _stream_frames.assign(_header.num_streams, vector<rec_index_entry_t>());
+    _stream_encodings.assign(_header.num_streams, -1);
+    rec_view_t empty;
+    memset(&empty, 0, sizeof(empty));
+    _views.resize(1 + 2 * _header.num_streams, empty);
+
+    uint64_t index_bytes = (uint64_t) _header.frame_count * sizeof(rec_index_entry_t);
+    unsigned char * index = NULL;
+    if (_header.index_offset >= sizeof(_header) &&
+            _header.index_offset + index_bytes <= _size)
+        index = map_at(0, 1, _header.index_offset, (size_t) index_bytes);
+    if (index){
+        // add_frame maps the frames' headers through the same view
+        vector<rec_index_entry_t> entries(_header.frame_count);
+        if (!entries.empty())
+            memcpy(&entries[0], index, (size_t) index_bytes);
+        for (size_t i = 0; i < entries.size(); i++)
+            add_frame(entries[i].offset);
+    } else {
+        rebuild_index();
+    }
+
+    // playback span: first to last timestamp over all streams, plus one
+    //  frame so a loop doesn't show the last and first frames together
+    double first = 0, last = 0;
+    bool any = false;
+    int most_frames = 0;
+    for (int s = 0; s < num_streams(); s++){
+        int n = (int) _stream_frames[s].size();
+        if (n == 0)
+            continue;
+        double t0 = frame_timestamp(s, 0);
+        double t1 = frame_timestamp(s, n-1);
+        if (!any || t0 < first) first = t0;
+        if (!any || t1 > last) last = t1;
+        any = true;
+        if (n > most_frames) most_frames = n;
+    }
+    _first_ms = first;
+    _duration_ms = last - first;
+    if (most_frames > 1)
+        _duration_ms += _duration_ms / (most_frames - 1);
+    _start_ms = -1.0;
+
+    printf("Replaying %s: %d streams,", filename.c_str(), num_streams());
+    for (int s = 0; s < num_streams(); s++)
+        printf(" %d", num_frames(s));
+    printf(" frames, %.1f s,", _duration_ms / 1000.0);
+    for (int s = 0; s < num_streams(); s++)
+        printf("%s%s", s ? "/" : " ", rec_encoding_name(stream_encoding(s)));
+    printf("\n");
+    return true;
+}
+
+void Stereo_Replay::close(){
+    unmap_file();
+    _stream_frames.clear();
+    _stream_encodings.clear();
+    memset(&_header, 0, sizeof(_header));
+}
+
+int Stereo_Replay::num_frames(int stream){
+    if (stream < 0 || stream >= num_streams())
+        return 0;
+    return (int) _stream_frames[stream].size();
+}
+
+rec_frame_header_t * Stereo_Replay::get_frame(int stream, int i, unsigned char ** payload){
+    if (i < 0 || i >= num_frames(stream))
+        return NULL;
+    const rec_index_entry_t& entry = _stream_frames[stream][i];
+    unsigned char * frame = map_at(1 + 2 * stream, 2, entry.offset,
+        sizeof(rec_frame_header_t) + entry.size);
+    if (!frame)
+        return NULL;
+    *payload = frame + sizeof(rec_frame_header_t);
+    return (rec_frame_header_t *) frame;
+}
+
+double Stereo_Replay::frame_timestamp(int stream, int i){
+    if (i < 0 || i >= num_frames(stream))
+        return 0.0;
+    return _stream_frames[stream][i].timestamp_ms;
+}
+
+rec_encoding_t Stereo_Replay::stream_encoding(int stream){
+    if (stream < 0 || stream >= num_streams() || _stream_encodings[stream] < 0)
+        return encoding();
+    return (rec_encoding_t) _stream_encodings[stream];
+}
+
+int Stereo_Replay::find_frame(int stream, double timestamp_ms){
+    // timestamps only go up within a stream
+    int lo = 0, hi = num_frames(stream) - 1, found = -1;
+    while (lo <= hi){
+        int mid = lo + (hi - lo) / 2;
+        if (frame_timestamp(stream, mid) <= timestamp_ms){
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+double Stereo_Replay::playback_start_ms(){
+    if (_start_ms < 0)
+        _start_ms = get_time_ms();
+    return _start_ms;
+}
+
+void Stereo_Replay::add_frame(uint64_t offset){
+    // anything that doesn't fit in the file is dropped, so get_frame
+    //  can trust what's listed
+    if (offset + sizeof(rec_frame_header_t) > _size)
+        return;
+    rec_frame_header_t * fh = (rec_frame_header_t *) map_at(0, 1, offset,
+        sizeof(rec_frame_header_t));
+    if (!fh || fh->magic != XEN_REC_FRAME_MAGIC || fh->stream >= _header.num_streams ||
+            offset + sizeof(rec_frame_header_t) + fh->size > _size)
+        return;
+    if (fh->encoding == REC_ENCODING_RAW_BGR &&
+            ((uint64_t) fh->step * fh->height > fh->size || fh->step < fh->width*3))
+        return;
+    if (fh->encoding == REC_ENCODING_YUYV &&
+            ((uint64_t) fh->step * fh->height > fh->size || fh->step < fh->width*2 ||
+             fh->width % 2))
+        return;
+    rec_index_entry_t entry;
+    entry.offset = offset;
+    entry.timestamp_ms = fh->timestamp_ms;
+    entry.stream = fh->stream;
+    entry.size = fh->size;
+    if (_stream_frames[fh->stream].empty())
+        _stream_encodings[fh->stream] = (int) fh->encoding;
+    _stream_frames[fh->stream].push_back(entry);
+}
+
+void Stereo_Replay::rebuild_index(){
+    uint64_t offset = sizeof(_header);
+    int found = 0;
+    while (offset + sizeof(rec_frame_header_t) <= _size){
+        rec_frame_header_t * fh = (rec_frame_header_t *) map_at(0, 1, offset,
+            sizeof(rec_frame_header_t));
+        if (!fh || fh->magic != XEN_REC_FRAME_MAGIC)
+            break;
+        uint64_t next = offset + sizeof(rec_frame_header_t) + rec_padded(fh->size);
+        // truncated last frame from a recording that didn't close
+        if (offset + sizeof(rec_frame_header_t) + fh->size > _size)
+            break;
+        add_frame(offset);
+        found++;
+        offset = next;
+    }
+    printf("Stereo_Replay: no index, recovered %d frames by scanning\n", found);
+}
+
+unsigned char * Stereo_Replay::map_at(int first_view, int num_views, uint64_t offset,
+                                      size_t size){
+    if (offset + size > _size || first_view + num_views > (int) _views.size())
+        return NULL;
+    pthread_mutex_lock(&_view_mutex);
+    rec_view_t * view = NULL;
+    for (int v = first_view; v < first_view + num_views && !view; v++){
+        rec_view_t& candidate = _views[v];
+        if (candidate.data && offset >= candidate.offset &&
+                offset + size <= candidate.offset + candidate.size)
+            view = &candidate;
+    }
+    if (!view){
+        // the least recently used (unmapped ones never were)
+        view = &_views[first_view];
+        for (int v = first_view + 1; v < first_view + num_views; v++)
+            if (_views[v].used < view->used)
+                view = &_views[v];
+        unmap_view(*view);
+        // a window from the allocation granularity below, at least
+        //  REPLAY_WINDOW long so frames read in order mostly land in
+        //  the one already mapped
+        uint64_t base = offset - offset % _map_granularity;
+        uint64_t end = offset + size;
+        if (end < base + REPLAY_WINDOW)
+            end = base + REPLAY_WINDOW;
+        if (end > _size)
+            end = _size;
+        size_t view_size = (size_t) (end - base);
+        void * data = NULL;
+    #ifdef _WIN32
+        if (_mapping_handle)
+            data = MapViewOfFile(_mapping_handle, FILE_MAP_READ, (DWORD) (base >> 32),
+                                 (DWORD) (base & 0xFFFFFFFF), view_size);
+    #else
+        if (_fd >= 0){
+            data = mmap(NULL, view_size, PROT_READ, MAP_PRIVATE, _fd, (off_t) base);
+            if (data == MAP_FAILED)
+                data = NULL;
+            else
+                // frames are read front to back
+                madvise(data, view_size, MADV_SEQUENTIAL);
+        }
+    #endif
+        if (!data){
+            printf("Stereo_Replay: couldn't map %.0f MB at %.0f MB\n",
+                view_size / (1024.0*1024.0), base / (1024.0*1024.0));
+            pthread_mutex_unlock(&_view_mutex);
+            return NULL;
+        }
+        view->data = (unsigned char *) data;
+        view->offset = base;
+        view->size = view_size;
+    }
+    view->used = ++_view_clock;
+    unsigned char * ret = view->data + (size_t) (offset - view->offset);
+    pthread_mutex_unlock(&_view_mutex);
+    return ret;
+}
+
+void Stereo_Replay::unmap_view(rec_view_t& view){
+    if (view.data){
+    #ifdef _WIN32
+        UnmapViewOfFile(view.data);
+    #else
+        munmap(view.data, view.size);
+    #endif
+    }
+    memset(&view, 0, sizeof(view));
+}
+
+bool Stereo_Replay::map_file(const string& filename){
+#ifdef _WIN32
+    _file_handle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (_file_handle == INVALID_HANDLE_VALUE){
+        printf("Stereo_Replay: couldn't open %s\n", filename.c_str());
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(_file_handle, &size) || size.QuadPart == 0){
+        printf("Stereo_Replay: %s is empty\n", filename.c_str());
+        unmap_file();
+        return false;
+    }
+    _mapping_handle = CreateFileMapping(_file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!_mapping_handle){
+        printf("Stereo_Replay: couldn't map %s\n", filename.c_str());
+        unmap_file();
+        return false;
+    }
+    _size = (uint64_t) size.QuadPart;
+#else
+    _fd = ::open(filename.c_str(), O_RDONLY);
+    if (_fd < 0){
+        printf("Stereo_Replay: couldn't open %s\n", filename.c_str());
+        return false;
+    }
+    struct stat st;
+    if (fstat(_fd, &st) != 0 || st.st_size == 0){
+        printf("Stereo_Replay: %s is empty\n", filename.c_str());
+        unmap_file();
+        return false;
+    }
+    _size = (uint64_t) st.st_size;
+#endif
+    // just the one for the header until it says how many streams
+    rec_view_t empty;
+    memset(&empty, 0, sizeof(empty));
+    _views.assign(1, empty);
+    _view_clock = 0;
+    return true;
+}
+
+void Stereo_Replay::unmap_file(){
+    for (size_t v = 0; v < _views.size(); v++)
+        unmap_view(_views[v]);
+    _views.clear();
+#ifdef _WIN32
+    if (_mapping_handle)
+        CloseHandle(_mapping_handle);
+    if (_file_handle != INVALID_HANDLE_VALUE)
+        CloseHandle(_file_handle);
+    _mapping_handle = NULL;
+    _file_handle = INVALID_HANDLE_VALUE;
+#else
+    if (_fd >= 0)
+        ::close(_fd);
+    _fd = -1;
+#endif
+    _size = 0;
+}
+
+/* #########################################################################
+
+                            Replay_Capture_Source
+
+   ######################################################################### */
+Replay_Capture_Source::Replay_Capture_Source(Stereo_Replay * replay, int stream,
+                                             bool realtime, bool loop) :
+    _replay(replay),
+    _stream(stream),
+    _realtime(realtime),
+    _loop(loop),
+    _current(-1),
+    _decoded_valid(false),
+    _timestamp_ms(0.0)
+{
+}
+
+bool Replay_Capture_Source::is_open(){
+    return _replay && _replay->is_open() && _replay->num_frames(_stream) > 0;
+}
+
+bool Replay_Capture_Source::grab(){
+    if (!is_open())
+        return false;
+    int n = _replay->num_frames(_stream);
+
+    if (!_realtime){
+        int next = _current + 1;
+        if (next >= n){
+            if (!_loop)
+                return false;
+            next = 0;
+        }
+        _current = next;
+        _decoded_valid = false;
+        _timestamp_ms = get_time_ms();
+        return true;
+    }
+
+    // where the shared clock says playback is, in recorded time
+    double now = get_time_ms();
+    double elapsed = now - _replay->playback_start_ms();
+    double duration = _replay->duration_ms();
+    if (_loop && duration > 0)
+        elapsed = fmod(elapsed, duration);
+    double target = _replay->first_timestamp_ms() + elapsed;
+
+    // newest frame at or before target; start over from the top if
+    //  the clock wrapped behind us
+    int i = _current;
+    if (i < 0 || _replay->frame_timestamp(_stream, i) > target)
+        i = 0;
+    while (i + 1 < n && _replay->frame_timestamp(_stream, i + 1) <= target)
+        i++;
+    double frame_ms = _replay->frame_timestamp(_stream, i);
+    if (frame_ms > target || i == _current)
+        return false;
+
+    _current = i;
+    _decoded_valid = false;
+    // as stale as it was when it was recorded
+    _timestamp_ms = now - (target - frame_ms);
+    return true;
+}
+
+bool Replay_Capture_Source::retrieve(Mat& out){
+    if (_current < 0 || !is_open())
+        return false;
+    unsigned char * payload;
+    rec_frame_header_t * fh = _replay->get_frame(_stream, _current, &payload);
+    if (!fh)
+        return false;
+
+    if (fh->encoding == REC_ENCODING_RAW_BGR){
+        // straight out of the mapping, no copy
+        out = Mat(fh->height, fh->width, CV_8UC3, payload, fh->step);
+        return true;
+    }
+
+    if (!_decoded_valid && fh->encoding == REC_ENCODING_DEPTH){
+        // a Kinect recording's depth, shown as gray: near is dark
+        _depth.create(fh->height, fh->width, CV_16UC1);
+        if (!depth_decode(payload, fh->size, _depth.ptr<unsigned short>(0), fh->width,
+                          fh->height)){
+            printf("Replay_Capture_Source: couldn't decode frame %d of stream %d\n",
+                _current, _stream);
+            return false;
+        }
+        Mat gray;
+        _depth.convertTo(gray, CV_8U, 255.0 / 2047.0);
+        cvtColor(gray, _decoded, CV_GRAY2BGR);
+        _decoded_valid = true;
+    } else if (!_decoded_valid && fh->encoding == REC_ENCODING_YUYV){
+        Mat yuyv(fh->height, fh->width, CV_8UC2, payload, fh->step);
+        cvtColor(yuyv, _decoded, CV_YUV2BGR_YUYV);
+        _decoded_valid = true;
+    } else if (!_decoded_valid){
+        Mat encoded(1, fh->size, CV_8UC1, payload);
+        _decoded = imdecode(encoded, CV_LOAD_IMAGE_COLOR);
+        if (_decoded.empty()){
+            printf("Replay_Capture_Source: couldn't decode frame %d of stream %d\n",
+                _current, _stream);
+            return false;
+        }
+        _decoded_valid = true;
+    }
+    out = _decoded;
+    return true;
+}
+
+bool Replay_Capture_Source::retrieve_raw(raw_frame_t& out){
+    if (_current < 0 || !is_open())
+        return false;
+    unsigned char * payload;
+    rec_frame_header_t * fh = _replay->get_frame(_stream, _current, &payload);
+    // no raw form of depth that a camera would hand out
+    if (!fh || fh->encoding == REC_ENCODING_DEPTH)
+        return false;
+    if (fh->encoding == REC_ENCODING_RAW_BGR)
+        out.format = PIXEL_FORMAT_BGR;
+    else if (fh->encoding == REC_ENCODING_YUYV)
+        out.format = PIXEL_FORMAT_YUYV;
+    else
+        out.format = PIXEL_FORMAT_MJPEG;
+    out.width = fh->width;
+    out.height = fh->height;
+    out.stride = out.format == PIXEL_FORMAT_MJPEG ? 0 : fh->step;
+    out.data = payload;
+    out.size = fh->size;
+    return true;
+}
@@ -0,0 +1,281 @@
+/* #########################################################################
+        Stereo Recording -- records the passthrough camera streams, with
+            capture timestamps, to a seekable file, and plays them back
+            as Capture_Sources in place of the real cameras.
+
+        File layout (little endian):
+            rec_file_header_t
+            { rec_frame_header_t, payload padded to 16 bytes } per frame
+            rec_index_entry_t per frame, at header.index_offset
+        index_offset stays 0 until the recorder is closed cleanly; the
+        player rebuilds the index by walking the frames when it's missing.
+        Each stream can have its own encoding; Kinect sessions go in as
+        a depth stream and an RGB one (see Kinect_Source).
+
+        Header.
+
+   ######################################################################### */
+
+#ifndef __XEN_STEREO_RECORDING_H
+#define __XEN_STEREO_RECORDING_H
+
+// Base system stuff
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+//pthread for the writer thread
+#include <pthread.h>
+
+#include "opencv/cv.h"
+#include "opencv2/highgui/highgui.hpp"
+
+#include "capture_source.h"
+#include "depth_codec.h"
+#include "xen_utils.h"
+
+namespace xen_rift {
+
+    #define XEN_REC_MAGIC "XENSREC1"
+    #define XEN_REC_VERSION 1
+    #define XEN_REC_FRAME_MAGIC 0x4d415246 // "FRAM"
+    #define XEN_REC_ALIGN 16
+
+    typedef enum _rec_encoding_t {
+        REC_ENCODING_RAW_BGR = 0,
+        REC_ENCODING_MJPEG = 1,
+        // 16 bit depth, through depth_encode()
+        REC_ENCODING_DEPTH = 2,
+        // packed 4:2:2 (Y0 U Y1 V), BT.601 video range, the way a
+        //  webcam sends it; replays hand it out raw for the YUV texture
+        REC_ENCODING_YUYV = 3
+    } rec_encoding_t;
+
+    const char * rec_encoding_name(int encoding);
+
+    #pragma pack(push, 1)
+    typedef struct _rec_file_header_t {
+        char magic[8];
+        uint32_t version;
+        uint32_t num_streams;
+        uint32_t encoding;
+        uint32_t frame_count;
+        // offset of the index; 0 if the recording wasn't closed
+        uint64_t index_offset;
+        uint8_t reserved[32];
+    } rec_file_header_t;
+
+    typedef struct _rec_frame_header_t {
+        uint32_t magic;
+        uint32_t stream;
+        uint32_t width;
+        uint32_t height;
+        // bytes per row of a raw payload
+        uint32_t step;
+        uint32_t encoding;
+        // payload bytes, before padding
+        uint32_t size;
+        // the source's own stamp for the frame, if it has one (the
+        //  Kinect's); 0 otherwise
+        uint32_t source_timestamp;
+        // capture time, in the recording machine's get_time_ms()
+        double timestamp_ms;
+        // frame number within its stream
+        uint64_t seq;
+    } rec_frame_header_t;
+
+    typedef struct _rec_index_entry_t {
+        // of the frame header
+        uint64_t offset;
+        double timestamp_ms;
+        uint32_t stream;
+        uint32_t size;
+    } rec_index_entry_t;
+    #pragma pack(pop)
+
+    // a frame waiting for the writer thread
+    typedef struct _rec_pending_t {
+        int stream;
+        double timestamp_ms;
+        uint32_t source_timestamp;
+        cv::Mat image;
+    } rec_pending_t;
+
+    class Stereo_Recorder {
+        public:
+            Stereo_Recorder();
+            ~Stereo_Recorder();
+
+            // Starts a new recording. Frames are encoded and written on a
+            //  background thread; at most max_queued frames wait for it
+            //  before write_frame starts dropping.
+            bool open(const std::string& filename, int num_streams = 2,
+                      rec_encoding_t encoding = REC_ENCODING_RAW_BGR,
+                      int jpeg_quality = 90, int max_queued = 16);
+            // Flushes the queue, writes the index and finishes the header.
+            void close();
+            bool is_open() { return _file != NULL; }
+            // One stream's encoding, if not open()'s; set it before the
+            //  stream's first frame. REC_ENCODING_DEPTH streams take
+            //  CV_16UC1 frames.
+            void set_stream_encoding(int stream, rec_encoding_t encoding);
+
+            // Queues a copy of a BGR frame (or depth, for a depth
+            //  stream). Returns false if it was dropped. Thread safe.
+            bool write_frame(int stream, const cv::Mat& image, double timestamp_ms,
+                             uint32_t source_timestamp = 0);
+
+            int frames_written();
+            int frames_dropped();
+
+        protected:
+            static void * writer_main(void * self);
+            void write_pending(rec_pending_t& frame);
+
+            FILE * _file;
+            rec_file_header_t _header;
+            rec_encoding_t _encoding;
+            int _jpeg_quality;
+            int _max_queued;
+            uint64_t _offset;
+            std::vector<rec_index_entry_t> _index;
+            std::vector<uint64_t> _stream_seq;
+            std::vector<rec_encoding_t> _stream_encoding;
+            std::vector<uchar> _encode_buf;
+
+            pthread_t _writer;
+            pthread_mutex_t _mutex;
+            pthread_cond_t _cond;
+            std::deque<rec_pending_t> _queue;
+            bool _stopping;
+            int _dropped;
+
+        private:
+    };
+
+    class Stereo_Replay {
+        public:
+            Stereo_Replay();
+            ~Stereo_Replay();
+
+            // Opens a recording, read only. It's mapped into memory a
+            //  window at a time, so recordings bigger than a 32 bit
+            //  address space play too. Raw frames are handed out as
+            //  views straight into the mapping.
+            bool open(const std::string& filename);
+            void close();
+            bool is_open() { return _size > 0; }
+
+            int num_streams() { return (int) _stream_frames.size(); }
+            int num_frames(int stream);
+            rec_encoding_t encoding() { return (rec_encoding_t) _header.encoding; }
+            // of its first frame; open()'s encoding if it has none
+            rec_encoding_t stream_encoding(int stream);
+            // recorded times of the first frame and the span of the file
+            double first_timestamp_ms() { return _first_ms; }
+            double duration_ms() { return _duration_ms; }
+
+            // Frame i of a stream; payload points into the mapping.
+            //  Both stay good while the stream's next get_frame()s land
+            //  in the same or the previous window of the file, which
+            //  for frames read in order is dozens of frames.
+            rec_frame_header_t * get_frame(int stream, int i, unsigned char ** payload);
+            // without mapping anything
+            double frame_timestamp(int stream, int i);
+            // Seeking: the newest frame of a stream recorded at or
+            //  before timestamp_ms, by binary search of the index; -1
+            //  if it's before the stream's first
+            int find_frame(int stream, double timestamp_ms);
+
+            // Shared playback clock, so every stream paces against the
+            //  same start. Starts on first call.
+            double playback_start_ms();
+
+        protected:
+            // a mapped window of the file
+            typedef struct _rec_view_t {
+                unsigned char * data;
+                uint64_t offset;
+                size_t size;
+                // last handed out, by _view_clock
+                unsigned long used;
+            } rec_view_t;
+
+            bool map_file(const std::string& filename);
+            void unmap_file();
+            // size bytes of the file from offset, through whichever of
+            //  num_views views from first_view covers them, or by
+            //  remapping the least recently used; NULL if they're past
+            //  the end or won't map
+            unsigned char * map_at(int first_view, int num_views, uint64_t offset, size_t size);
+            void unmap_view(rec_view_t& view);
+            // walks the frames when the index is missing or truncated
+            void rebuild_index();
+            void add_frame(uint64_t offset);
+
+            uint64_t _size;
+        #ifdef _WIN32
+            HANDLE _file_handle;
+            HANDLE _mapping_handle;
+        #else
+            int _fd;
+        #endif
+            size_t _map_granularity;
+            // two a stream, then one for the header, index and walking
+            //  the frames
+            std::vector<rec_view_t> _views;
+            unsigned long _view_clock;
+            pthread_mutex_t _view_mutex;
+            rec_file_header_t _header;
+            // by stream, where each frame is and when it was recorded
+            std::vector< std::vector<rec_index_entry_t> > _stream_frames;
+            // of each stream's first frame, -1 if it has none
+            std::vector<int> _stream_encodings;
+            double _first_ms;
+            double _duration_ms;
+            double _start_ms;
+
+        private:
+    };
+
+    // one stream of a Stereo_Replay, standing in for a camera
+    class Replay_Capture_Source : public Capture_Source {
+        public:
+            // realtime: frames come out at their recorded rate against the
+            //  replay's shared clock; otherwise every grab advances one
+            //  frame, as fast as the caller asks. loop wraps at the end.
+            Replay_Capture_Source(Stereo_Replay * replay, int stream,
+                                  bool realtime = true, bool loop = true);
+            bool grab();
+            bool retrieve(cv::Mat& out);
+            bool retrieve_raw(raw_frame_t& out);
+            double timestamp_ms() { return _timestamp_ms; }
+            bool is_open();
+
+        protected:
+            Stereo_Replay * _replay;
+            int _stream;
+            bool _realtime;
+            bool _loop;
+            // frame retrieve hands out, -1 before the first grab
+            int _current;
+            // _current has been decoded into _decoded
+            bool _decoded_valid;
+            cv::Mat _decoded;
+            cv::Mat _depth;
+            double _timestamp_ms;
+
+        private:
+    };
+}
+
+#endif //__XEN_STEREO_RECORDING_H
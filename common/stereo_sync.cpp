@@ -0,0 +1,266 @@
+/* #########################################################################
+        Stereo Sync -- grabs the left and right cameras on threads of
+            their own, stamping each frame as it arrives, and pairs
+            them up by timestamp so both eyes see (nearly) the same
+            moment.
+
+   ######################################################################### */
+
+#include "stereo_sync.h"
+
+using namespace std;
+using namespace xen_rift;
+using namespace cv;
+
+/* #########################################################################
+
+                            Synced_Capture_Source
+
+   ######################################################################### */
+Synced_Capture_Source::Synced_Capture_Source(Stereo_Synchronizer * sync, int stream) :
+    _sync(sync),
+    _stream(stream),
+    _seen_seq(0),
+    _bgr_seq(0)
+{
+}
+
+bool Synced_Capture_Source::grab(){
+    if (_seen_seq == _sync->_pair_seq)
+        return false;
+    _seen_seq = _sync->_pair_seq;
+    return true;
+}
+
+bool Synced_Capture_Source::retrieve(Mat& out){
+    sync_frame_t& frame = _sync->_current[_stream];
+    if (frame.image.empty())
+        return false;
+    if (frame.format == PIXEL_FORMAT_BGR){
+        out = frame.image;
+        return true;
+    }
+    // converted once per pair, however many times it's asked for
+    if (_bgr_seq != _sync->_pair_seq || _bgr.empty()){
+        cvtColor(frame.image, _bgr, CV_YUV2BGR_YUYV);
+        _bgr_seq = _sync->_pair_seq;
+    }
+    out = _bgr;
+    return true;
+}
+
+bool Synced_Capture_Source::retrieve_raw(raw_frame_t& out){
+    sync_frame_t& frame = _sync->_current[_stream];
+    if (frame.image.empty())
+        return false;
+    out.format = frame.format;
+    out.width = frame.image.cols;
+    out.height = frame.image.rows;
+    out.stride = (int) frame.image.step;
+    out.data = frame.image.data;
+    out.size = frame.image.step * frame.image.rows;
+    return true;
+}
+
+double Synced_Capture_Source::timestamp_ms(){
+    return _sync->_current[_stream].timestamp_ms;
+}
+
+bool Synced_Capture_Source::is_open(){
+    return _sync->_sources[_stream]->is_open();
+}
+
+void Synced_Capture_Source::set_exposure(int exposure){
+    _sync->request_exposure(_stream, exposure);
+}
+
+/* #########################################################################
+
+                             Stereo_Synchronizer
+
+   ######################################################################### */
+Stereo_Synchronizer::Stereo_Synchronizer(Capture_Source * left, Capture_Source * right,
+                                         double max_skew_ms, int max_queued,
+                                         bool owns_sources) :
+    _max_skew_ms(max_skew_ms),
+    _max_queued(max_queued > 0 ? max_queued : 1),
+    _owns_sources(owns_sources),
+    _stopping(false),
+    _pair_seq(0),
+    _skew_total_ms(0.0)
+{
+    _sources[0] = left;
+    _sources[1] = right;
+    memset(&_stats, 0, sizeof(_stats));
+    pthread_mutex_init(&_mutex, NULL);
+    for (int i = 0; i < 2; i++){
+        _views[i] = new Synced_Capture_Source(this, i);
+        _exposure_pending[i] = false;
+        _exposure[i] = 0;
+        _current[i].format = PIXEL_FORMAT_BGR;
+        _current[i].timestamp_ms = 0.0;
+        _thread_args[i].sync = this;
+        _thread_args[i].stream = i;
+        _thread_running[i] = false;
+        if (!_sources[i])
+            continue;
+        if (pthread_create(&_threads[i], NULL, &Stereo_Synchronizer::capture_main,
+                           &_thread_args[i]))
+            printf("Stereo_Synchronizer: couldn't start capture thread %d\n", i);
+        else
+            _thread_running[i] = true;
+    }
+}
+
+Stereo_Synchronizer::~Stereo_Synchronizer(){
+    pthread_mutex_lock(&_mutex);
+    _stopping = true;
+    pthread_mutex_unlock(&_mutex);
+    for (int i = 0; i < 2; i++){
+        if (_thread_running[i])
+            pthread_join(_threads[i], NULL);
+        delete _views[i];
+        if (_owns_sources)
+            delete _sources[i];
+    }
+    pthread_mutex_destroy(&_mutex);
+}
+
+bool Stereo_Synchronizer::next_pair(){
+    bool found = false;
+    double skew = 0.0;
+    pthread_mutex_lock(&_mutex);
+    // Both queues are in capture order. Whichever front frame is too
+    //  far behind the other's can never pair (everything after it on
+    //  the other side is later still), so it goes; a pair in
+    //  tolerance is taken, and we keep going in case a newer one is
+    //  waiting behind it.
+    while (!_queues[0].empty() && !_queues[1].empty()){
+        double d = _queues[0].front().timestamp_ms - _queues[1].front().timestamp_ms;
+        if (d > _max_skew_ms){
+            _queues[1].pop_front();
+            _stats.dropped[1]++;
+        } else if (d < -_max_skew_ms){
+            _queues[0].pop_front();
+            _stats.dropped[0]++;
+        } else {
+            if (found)
+                _stats.stale++;
+            _current[0] = _queues[0].front();
+            _current[1] = _queues[1].front();
+            _queues[0].pop_front();
+            _queues[1].pop_front();
+            skew = fabs(d);
+            found = true;
+        }
+    }
+    if (found){
+        _pair_seq++;
+        _stats.pairs++;
+        _stats.last_skew_ms = skew;
+        _skew_total_ms += skew;
+        _stats.mean_skew_ms = _skew_total_ms / _stats.pairs;
+        if (skew > _stats.max_skew_ms)
+            _stats.max_skew_ms = skew;
+    } else {
+        _stats.held++;
+    }
+    pthread_mutex_unlock(&_mutex);
+    return found;
+}
+
+void Stereo_Synchronizer::set_max_skew_ms(double max_skew_ms){
+    pthread_mutex_lock(&_mutex);
+    _max_skew_ms = max_skew_ms;
+    pthread_mutex_unlock(&_mutex);
+}
+
+stereo_sync_stats_t Stereo_Synchronizer::get_stats(){
+    pthread_mutex_lock(&_mutex);
+    stereo_sync_stats_t ret = _stats;
+    pthread_mutex_unlock(&_mutex);
+    return ret;
+}
+
+void Stereo_Synchronizer::reset_stats(){
+    pthread_mutex_lock(&_mutex);
+    memset(&_stats, 0, sizeof(_stats));
+    _skew_total_ms = 0.0;
+    pthread_mutex_unlock(&_mutex);
+}
+
+void Stereo_Synchronizer::request_exposure(int stream, int exposure){
+    pthread_mutex_lock(&_mutex);
+    _exposure[stream] = exposure;
+    _exposure_pending[stream] = true;
+    pthread_mutex_unlock(&_mutex);
+}
+
+void * Stereo_Synchronizer::capture_main(void * arg){
+    capture_thread_arg_t * args = (capture_thread_arg_t *) arg;
+    args->sync->capture_loop(args->stream);
+    return NULL;
+}
+
+void Stereo_Synchronizer::capture_loop(int stream){
+    Capture_Source * source = _sources[stream];
+    while (true){
+        pthread_mutex_lock(&_mutex);
+        bool stopping = _stopping;
+        bool set_exposure = _exposure_pending[stream];
+        int exposure = _exposure[stream];
+        _exposure_pending[stream] = false;
+        pthread_mutex_unlock(&_mutex);
+        if (stopping)
+            break;
+        if (set_exposure)
+            source->set_exposure(exposure);
+
+        // blocking sources wait in here for the next frame, so the
+        //  stamp they give it is close to when it really arrived
+        if (!source->grab()){
+            sleep_ms(1);
+            continue;
+        }
+        sync_frame_t frame;
+        if (!copy_frame(source, frame))
+            continue;
+
+        pthread_mutex_lock(&_mutex);
+        _queues[stream].push_back(frame);
+        // the other side has stalled; don't pile up frames for it
+        while ((int) _queues[stream].size() > _max_queued){
+            _queues[stream].pop_front();
+            _stats.dropped[stream]++;
+        }
+        pthread_mutex_unlock(&_mutex);
+    }
+}
+
+bool Stereo_Synchronizer::copy_frame(Capture_Source * source, sync_frame_t& out){
+    // the source reuses its buffers on the next grab, so everything
+    //  gets copied; raw if it's uncompressed, to leave the color
+    //  conversion to whoever (if anyone) needs BGR
+    raw_frame_t raw;
+    if (source->retrieve_raw(raw) && raw.stride > 0){
+        int type = -1;
+        if (raw.format == PIXEL_FORMAT_BGR)
+            type = CV_8UC3;
+        else if (raw.format == PIXEL_FORMAT_YUYV)
+            type = CV_8UC2;
+        if (type >= 0){
+            Mat view(raw.height, raw.width, type, (void *) raw.data, raw.stride);
+            out.image = view.clone();
+            out.format = raw.format;
+            out.timestamp_ms = source->timestamp_ms();
+            return true;
+        }
+    }
+    Mat bgr;
+    if (!source->retrieve(bgr) || bgr.empty())
+        return false;
+    out.image = bgr.clone();
+    out.format = PIXEL_FORMAT_BGR;
+    out.timestamp_ms = source->timestamp_ms();
+    return true;
+}
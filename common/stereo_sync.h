@@ -0,0 +1,148 @@
+/* #########################################################################
+        Stereo Sync -- grabs the left and right cameras on threads of
+            their own, stamping each frame as it arrives, and pairs
+            them up by timestamp so both eyes see (nearly) the same
+            moment.
+
+        Header.
+
+   ######################################################################### */
+
+#ifndef __XEN_STEREO_SYNC_H
+#define __XEN_STEREO_SYNC_H
+
+// Base system stuff
+#include <stdio.h>
+#include <stdlib.h>
+#include <deque>
+
+//pthread for the capture threads
+#include <pthread.h>
+
+#include "opencv/cv.h"
+#include "opencv2/highgui/highgui.hpp"
+
+#include "capture_source.h"
+#include "xen_utils.h"
+
+namespace xen_rift {
+
+    // a frame copied out of its source by a capture thread
+    typedef struct _sync_frame_t {
+        // BGR: CV_8UC3. YUYV: CV_8UC2.
+        cv::Mat image;
+        pixel_format_t format;
+        double timestamp_ms;
+    } sync_frame_t;
+
+    typedef struct _stereo_sync_stats_t {
+        // pairs handed out
+        unsigned long pairs;
+        // frames thrown away because nothing on the other side came
+        //  within tolerance, or the queue filled, per stream
+        unsigned long dropped[2];
+        // in-tolerance pairs skipped because a newer one was waiting
+        unsigned long stale;
+        // next_pair calls that had nothing new, so the last pair held
+        unsigned long held;
+        // |left - right| capture time of the pairs handed out
+        double last_skew_ms;
+        double mean_skew_ms;
+        double max_skew_ms;
+    } stereo_sync_stats_t;
+
+    class Stereo_Synchronizer;
+
+    // One side of the current pair, looking like any other capture
+    //  source. grab() is true once the synchronizer has moved to a
+    //  pair this stream hasn't shown yet.
+    class Synced_Capture_Source : public Capture_Source {
+        public:
+            Synced_Capture_Source(Stereo_Synchronizer * sync, int stream);
+            bool grab();
+            bool retrieve(cv::Mat& out);
+            bool retrieve_raw(raw_frame_t& out);
+            double timestamp_ms();
+            bool is_open();
+            // applied by the capture thread, between grabs
+            void set_exposure(int exposure);
+
+        protected:
+            Stereo_Synchronizer * _sync;
+            int _stream;
+            unsigned long _seen_seq;
+            cv::Mat _bgr;
+            unsigned long _bgr_seq;
+
+        private:
+    };
+
+    class Stereo_Synchronizer {
+        public:
+            // Starts capturing from both sources. From here on only the
+            //  capture threads touch them; go through stream() instead.
+            //  They're deleted with the synchronizer if owns_sources,
+            //  otherwise just left alone once its threads have stopped.
+            //  max_skew_ms under half a frame period can starve
+            //  free-running (unsynced) cameras of pairs.
+            Stereo_Synchronizer(Capture_Source * left, Capture_Source * right,
+                                double max_skew_ms = 20.0, int max_queued = 4,
+                                bool owns_sources = true);
+            ~Stereo_Synchronizer();
+
+            // Moves to the newest left/right pair captured within
+            //  max_skew_ms of each other that hasn't been handed out.
+            //  False if there is none; the current pair stays.
+            bool next_pair();
+            // 0 left, 1 right; owned by the synchronizer
+            Capture_Source * stream(int i) { return _views[i]; }
+            // the camera behind a stream; only its thread-safe accessors
+            //  may be used while capturing
+            Capture_Source * source(int i) { return _sources[i]; }
+
+            void set_max_skew_ms(double max_skew_ms);
+            stereo_sync_stats_t get_stats();
+            void reset_stats();
+
+        protected:
+            friend class Synced_Capture_Source;
+
+            typedef struct _capture_thread_arg_t {
+                Stereo_Synchronizer * sync;
+                int stream;
+            } capture_thread_arg_t;
+
+            static void * capture_main(void * arg);
+            void capture_loop(int stream);
+            // copies the frame just grabbed out of the source
+            bool copy_frame(Capture_Source * source, sync_frame_t& out);
+            void request_exposure(int stream, int exposure);
+
+            Capture_Source * _sources[2];
+            Synced_Capture_Source * _views[2];
+            double _max_skew_ms;
+            int _max_queued;
+            bool _owns_sources;
+
+            pthread_t _threads[2];
+            bool _thread_running[2];
+            capture_thread_arg_t _thread_args[2];
+            pthread_mutex_t _mutex;
+            bool _stopping;
+            std::deque<sync_frame_t> _queues[2];
+            // exposure for the capture thread to set, or none
+            bool _exposure_pending[2];
+            int _exposure[2];
+
+            // main thread only
+            sync_frame_t _current[2];
+            // bumped every time next_pair moves on
+            unsigned long _pair_seq;
+            stereo_sync_stats_t _stats;
+            double _skew_total_ms;
+
+        private:
+    };
+}
+
+#endif //__XEN_STEREO_SYNC_H
@@ -0,0 +1,186 @@
+/* #########################################################################
+        Thread Pool -- fixed set of pthread workers for splitting image
+            work into row bands.
+
+        Workers sleep on a condition variable between jobs. A job is just
+        a function pointer + argument and an item count; it's cut into
+        contiguous bands which workers (and the calling thread) pull off
+        a shared counter until none are left.
+
+   ######################################################################### */
+
+#include "thread_pool.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace xen_rift;
+
+Thread_Pool::Thread_Pool(int num_workers) :
+    _stopping(false),
+    _func(NULL),
+    _arg(NULL),
+    _n(0),
+    _band_size(0),
+    _num_bands(0),
+    _next_band(0),
+    _done_bands(0),
+    _generation(0)
+{
+    if (num_workers <= 0)
+        num_workers = get_num_cores() - 1;
+    if (num_workers < 0)
+        num_workers = 0;
+    _num_workers = num_workers;
+
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_mutex_init(&_call_mutex, NULL);
+    pthread_cond_init(&_work_cond, NULL);
+    pthread_cond_init(&_done_cond, NULL);
+    pthread_key_create(&_worker_key, NULL);
+
+    _workers = new pthread_t[_num_workers > 0 ? _num_workers : 1];
+    for (int i = 0; i < _num_workers; i++){
+        if (pthread_create(&_workers[i], NULL, worker_main, this)){
+            printf("Thread_Pool: couldn't start worker %d\n", i);
+            _num_workers = i;
+            break;
+        }
+    }
+}
+
+Thread_Pool::~Thread_Pool(){
+    pthread_mutex_lock(&_mutex);
+    _stopping = true;
+    pthread_cond_broadcast(&_work_cond);
+    pthread_mutex_unlock(&_mutex);
+    for (int i = 0; i < _num_workers; i++)
+        pthread_join(_workers[i], NULL);
+    delete [] _workers;
+
+    pthread_key_delete(_worker_key);
+    pthread_cond_destroy(&_done_cond);
+    pthread_cond_destroy(&_work_cond);
+    pthread_mutex_destroy(&_call_mutex);
+    pthread_mutex_destroy(&_mutex);
+}
+
+void * Thread_Pool::worker_main(void * arg){
+    Thread_Pool * pool = (Thread_Pool *) arg;
+    pthread_setspecific(pool->_worker_key, pool);
+
+    unsigned long seen_generation = 0;
+    pthread_mutex_lock(&pool->_mutex);
+    while (true){
+        while (!pool->_stopping && pool->_generation == seen_generation)
+            pthread_cond_wait(&pool->_work_cond, &pool->_mutex);
+        if (pool->_stopping)
+            break;
+        seen_generation = pool->_generation;
+        pthread_mutex_unlock(&pool->_mutex);
+        pool->run_bands();
+        pthread_mutex_lock(&pool->_mutex);
+    }
+    pthread_mutex_unlock(&pool->_mutex);
+    return NULL;
+}
+
+void Thread_Pool::run_bands(){
+    while (true){
+        pthread_mutex_lock(&_mutex);
+        if (_next_band >= _num_bands){
+            pthread_mutex_unlock(&_mutex);
+            return;
+        }
+        int band = _next_band++;
+        band_func_t func = _func;
+        void * arg = _arg;
+        int start = band * _band_size;
+        int end = start + _band_size;
+        if (end > _n)
+            end = _n;
+        pthread_mutex_unlock(&_mutex);
+
+        func(arg, start, end);
+
+        pthread_mutex_lock(&_mutex);
+        _done_bands++;
+        if (_done_bands == _num_bands)
+            pthread_cond_broadcast(&_done_cond);
+        pthread_mutex_unlock(&_mutex);
+    }
+}
+
+void Thread_Pool::parallel_for(int n, band_func_t func, void * arg, int min_band){
+    if (n <= 0)
+        return;
+    if (min_band < 1)
+        min_band = 1;
+
+    // nested call from inside a band, or nothing to spread over:
+    //  just do it here.
+    if (_num_workers == 0 || n <= min_band || pthread_getspecific(_worker_key) != NULL){
+        func(arg, 0, n);
+        return;
+    }
+
+    pthread_mutex_lock(&_call_mutex);
+    pthread_setspecific(_worker_key, this);
+
+    // a few bands per thread so uneven rows even out
+    int threads = num_threads();
+    int num_bands = threads * 4;
+    int band_size = (n + num_bands - 1) / num_bands;
+    if (band_size < min_band)
+        band_size = min_band;
+    num_bands = (n + band_size - 1) / band_size;
+
+    pthread_mutex_lock(&_mutex);
+    _func = func;
+    _arg = arg;
+    _n = n;
+    _band_size = band_size;
+    _num_bands = num_bands;
+    _next_band = 0;
+    _done_bands = 0;
+    _generation++;
+    pthread_cond_broadcast(&_work_cond);
+    pthread_mutex_unlock(&_mutex);
+
+    run_bands();
+
+    pthread_mutex_lock(&_mutex);
+    while (_done_bands < _num_bands)
+        pthread_cond_wait(&_done_cond, &_mutex);
+    pthread_mutex_unlock(&_mutex);
+
+    pthread_setspecific(_worker_key, NULL);
+    pthread_mutex_unlock(&_call_mutex);
+}
+
+int xen_rift::get_num_cores(){
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int) info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int) n : 1;
+#endif
+}
+
+static Thread_Pool * shared_pool = NULL;
+// the render, fusion and batch threads can all be first to ask
+static pthread_once_t shared_pool_once = PTHREAD_ONCE_INIT;
+static void create_shared_pool(){
+    shared_pool = new Thread_Pool();
+}
+
+Thread_Pool * xen_rift::get_shared_thread_pool(){
+    pthread_once(&shared_pool_once, &create_shared_pool);
+    return shared_pool;
+}
@@ -0,0 +1,77 @@
+/* #########################################################################
+        Thread Pool -- fixed set of pthread workers for splitting image
+            work into row bands.
+
+        Header.
+
+   ######################################################################### */
+
+#ifndef __XEN_THREAD_POOL_H
+#define __XEN_THREAD_POOL_H
+
+// Base system stuff
+#include <stdio.h>
+#include <stdlib.h>
+
+//pthread for the workers
+#include <pthread.h>
+
+namespace xen_rift {
+
+    // work callback: process items [start, end) of a parallel_for
+    typedef void (*band_func_t)(void * arg, int start, int end);
+
+    class Thread_Pool {
+        public:
+            // num_workers == 0 picks one worker per core, less the caller
+            Thread_Pool(int num_workers = 0);
+            ~Thread_Pool();
+
+            // Splits [0, n) into contiguous bands of at least min_band
+            // items and runs func over them on the workers and the
+            // calling thread. Blocks until every band is done. Safe to
+            // call from inside a band (it runs inline in that case).
+            void parallel_for(int n, band_func_t func, void * arg, int min_band = 1);
+
+            // total threads that take part in a parallel_for
+            int num_threads() { return _num_workers + 1; }
+
+        protected:
+            static void * worker_main(void * pool);
+            // grabs and runs bands until the current job runs out
+            void run_bands();
+
+            int _num_workers;
+            pthread_t * _workers;
+            bool _stopping;
+
+            // current job
+            band_func_t _func;
+            void * _arg;
+            int _n;
+            int _band_size;
+            int _num_bands;
+            int _next_band;
+            int _done_bands;
+            unsigned long _generation;
+
+            pthread_mutex_t _mutex;
+            pthread_cond_t _work_cond;
+            pthread_cond_t _done_cond;
+            // one parallel_for at a time from outside the pool
+            pthread_mutex_t _call_mutex;
+            // set on our own workers so nested calls run inline
+            pthread_key_t _worker_key;
+
+        private:
+    };
+
+    // number of hardware threads on this machine
+    int get_num_cores();
+
+    // lazily-created pool shared by the image processing helpers;
+    //  safe to call from any thread
+    Thread_Pool * get_shared_thread_pool();
+}
+
+#endif //__XEN_THREAD_POOL_H
@@ -0,0 +1,649 @@
+/* #########################################################################
+        TSDF Volume -- truncated signed distance model of whatever a
+            depth camera has seen, stored sparsely: only the voxel
+            blocks near an observed surface exist, found through a
+            hash of their coordinates.
+
+        Each voxel keeps a running weighted average of its distance to
+        the nearest surface along the camera's line of sight (capped
+        at the truncation distance), in the manner of KinectFusion.
+        A frame allocates the blocks within the truncation band of
+        each depth reading, then updates just those blocks, spread
+        over the shared thread pool. Raycasting keeps to the box the
+        blocks lie in, skips empty space in it a half block at a time,
+        and steps by the distance field inside blocks. Meshes are surface nets: one vertex per cell the surface
+        crosses, joined up across every voxel edge it crosses, built
+        only for blocks that changed (and their neighbours, whose
+        meshes share voxels with them).
+
+        Much reference to:
+            Newcombe et al., "KinectFusion: Real-time dense surface
+                mapping and tracking", ISMAR 2011
+            Niessner et al., "Real-time 3D reconstruction at scale
+                using voxel hashing", SIGGRAPH Asia 2013
+
+   ######################################################################### */
+
+#include "tsdf_volume.h"
+
+using namespace std;
+using namespace xen_rift;
+using namespace cv;
+using namespace Eigen;
+
+// raycasts look this far along each ray, in meters
+static const float RAY_NEAR = 0.3f;
+static const float RAY_FAR = 5.0f;
+// depth readings past this aren't integrated: too noisy to be worth it
+static const float MAX_DEPTH = 4.0f;
+// integrate() allocates blocks for every this-many'th pixel each way
+static const int ALLOCATE_STRIDE = 2;
+
+tsdf_camera_t xen_rift::kinect_depth_camera(int divisor){
+    if (divisor < 1)
+        divisor = 1;
+    // as Depth_To_Xyz's defaults
+    tsdf_camera_t cam;
+    cam.fx = 594.21f / divisor;
+    cam.fy = 591.04f / divisor;
+    cam.cx = 339.5f / divisor;
+    cam.cy = 242.7f / divisor;
+    cam.width = 640 / divisor;
+    cam.height = 480 / divisor;
+    return cam;
+}
+
+static inline int floor_div(int a, int b){
+    return a >= 0 ? a / b : (a - b + 1) / b;
+}
+
+static inline int voxel_index(int x, int y, int z){
+    return x + TSDF_BLOCK_SIZE * (y + TSDF_BLOCK_SIZE * z);
+}
+
+static inline unsigned int block_hash(int x, int y, int z){
+    return ((unsigned int) x * 73856093u) ^ ((unsigned int) y * 19349663u) ^
+           ((unsigned int) z * 83492791u);
+}
+
+Tsdf_Volume::Tsdf_Volume(float voxel_size, float truncation, float max_weight) :
+    _voxel_size(voxel_size),
+    _truncation(truncation),
+    _max_weight(max_weight),
+    _pool(NULL),
+    _table(4096, -1),
+    _frame(0),
+    _job_depth(NULL),
+    _job_cam(NULL),
+    _job_points(NULL),
+    _job_normals(NULL),
+    _job_meshes(NULL)
+{
+    reset();
+}
+
+Tsdf_Volume::~Tsdf_Volume(){
+    reset();
+}
+
+void Tsdf_Volume::reset(){
+    for (size_t i = 0; i < _blocks.size(); i++)
+        delete _blocks[i];
+    _blocks.clear();
+    _table.assign(4096, -1);
+    for (int i = 0; i < 3; i++){
+        _bounds_min[i] = INT_MAX;
+        _bounds_max[i] = INT_MIN;
+    }
+}
+
+/* #########################################################################
+
+                                 block hash
+
+   ######################################################################### */
+int Tsdf_Volume::find_block(int x, int y, int z){
+    unsigned int mask = (unsigned int) _table.size() - 1;
+    unsigned int slot = block_hash(x, y, z) & mask;
+    while (true){
+        int i = _table[slot];
+        if (i < 0)
+            return -1;
+        tsdf_block_t * b = _blocks[i];
+        if (b->x == x && b->y == y && b->z == z)
+            return i;
+        slot = (slot + 1) & mask;
+    }
+}
+
+int Tsdf_Volume::allocate_block(int x, int y, int z){
+    int i = find_block(x, y, z);
+    if (i >= 0)
+        return i;
+    // keep it at most half full, so probes stay short
+    if ((_blocks.size() + 1) * 2 > _table.size())
+        grow_table();
+    tsdf_block_t * b = new tsdf_block_t;
+    b->x = x;
+    b->y = y;
+    b->z = z;
+    memset(b->voxels, 0, sizeof(b->voxels));
+    b->dirty = false;
+    b->frame = 0;
+    int coords[3] = {x, y, z};
+    for (int k = 0; k < 3; k++){
+        if (coords[k] < _bounds_min[k])
+            _bounds_min[k] = coords[k];
+        if (coords[k] > _bounds_max[k])
+            _bounds_max[k] = coords[k];
+    }
+    i = (int) _blocks.size();
+    _blocks.push_back(b);
+    unsigned int mask = (unsigned int) _table.size() - 1;
+    unsigned int slot = block_hash(x, y, z) & mask;
+    while (_table[slot] >= 0)
+        slot = (slot + 1) & mask;
+    _table[slot] = i;
+    return i;
+}
+
+void Tsdf_Volume::grow_table(){
+    _table.assign(_table.size() * 2, -1);
+    unsigned int mask = (unsigned int) _table.size() - 1;
+    for (size_t i = 0; i < _blocks.size(); i++){
+        tsdf_block_t * b = _blocks[i];
+        unsigned int slot = block_hash(b->x, b->y, b->z) & mask;
+        while (_table[slot] >= 0)
+            slot = (slot + 1) & mask;
+        _table[slot] = (int) i;
+    }
+}
+
+bool Tsdf_Volume::sample(float px, float py, float pz, float& sdf){
+    // voxel centres sit at (g + 0.5) * voxel_size
+    float gx = px / _voxel_size - 0.5f;
+    float gy = py / _voxel_size - 0.5f;
+    float gz = pz / _voxel_size - 0.5f;
+    int x0 = (int) floorf(gx), y0 = (int) floorf(gy), z0 = (int) floorf(gz);
+    float fx = gx - x0, fy = gy - y0, fz = gz - z0;
+
+    const tsdf_voxel_t * c[8];
+    int bx = floor_div(x0, TSDF_BLOCK_SIZE);
+    int by = floor_div(y0, TSDF_BLOCK_SIZE);
+    int bz = floor_div(z0, TSDF_BLOCK_SIZE);
+    int lx = x0 - bx * TSDF_BLOCK_SIZE;
+    int ly = y0 - by * TSDF_BLOCK_SIZE;
+    int lz = z0 - bz * TSDF_BLOCK_SIZE;
+    if (lx < TSDF_BLOCK_SIZE - 1 && ly < TSDF_BLOCK_SIZE - 1 && lz < TSDF_BLOCK_SIZE - 1){
+        // all eight in one block: one lookup
+        int i = find_block(bx, by, bz);
+        if (i < 0)
+            return false;
+        const tsdf_voxel_t * v = _blocks[i]->voxels;
+        for (int k = 0; k < 8; k++)
+            c[k] = &v[voxel_index(lx + (k & 1), ly + ((k >> 1) & 1), lz + (k >> 2))];
+    } else {
+        // straddling blocks: look each one up once
+        tsdf_block_t * blocks[8];
+        for (int k = 0; k < 8; k++){
+            int dx = (k & 1) && lx == TSDF_BLOCK_SIZE - 1;
+            int dy = ((k >> 1) & 1) && ly == TSDF_BLOCK_SIZE - 1;
+            int dz = (k >> 2) && lz == TSDF_BLOCK_SIZE - 1;
+            int same = dx + 2*dy + 4*dz;
+            if (same < k){
+                blocks[k] = blocks[same];
+            } else {
+                int i = find_block(bx + dx, by + dy, bz + dz);
+                if (i < 0)
+                    return false;
+                blocks[k] = _blocks[i];
+            }
+            c[k] = &blocks[k]->voxels[voxel_index(
+                (lx + (k & 1)) - dx * TSDF_BLOCK_SIZE,
+                (ly + ((k >> 1) & 1)) - dy * TSDF_BLOCK_SIZE,
+                (lz + (k >> 2)) - dz * TSDF_BLOCK_SIZE)];
+        }
+    }
+    for (int k = 0; k < 8; k++){
+        if (c[k]->weight <= 0.0f)
+            return false;
+    }
+    float x00 = c[0]->sdf + fx * (c[1]->sdf - c[0]->sdf);
+    float x10 = c[2]->sdf + fx * (c[3]->sdf - c[2]->sdf);
+    float x01 = c[4]->sdf + fx * (c[5]->sdf - c[4]->sdf);
+    float x11 = c[6]->sdf + fx * (c[7]->sdf - c[6]->sdf);
+    float y0v = x00 + fy * (x10 - x00);
+    float y1v = x01 + fy * (x11 - x01);
+    sdf = y0v + fz * (y1v - y0v);
+    return true;
+}
+
+bool Tsdf_Volume::gradient(float px, float py, float pz, float * n){
+    float h = _voxel_size;
+    float a, b;
+    if (!sample(px + h, py, pz, a) || !sample(px - h, py, pz, b))
+        return false;
+    n[0] = a - b;
+    if (!sample(px, py + h, pz, a) || !sample(px, py - h, pz, b))
+        return false;
+    n[1] = a - b;
+    if (!sample(px, py, pz + h, a) || !sample(px, py, pz - h, b))
+        return false;
+    n[2] = a - b;
+    float len = sqrtf(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+    if (len <= 0.0f)
+        return false;
+    n[0] /= len;
+    n[1] /= len;
+    n[2] /= len;
+    return true;
+}
+
+/* #########################################################################
+
+                                 integrate
+
+   ######################################################################### */
+void Tsdf_Volume::integrate(const Mat& depth, const tsdf_camera_t& cam, const Matrix4f& pose){
+    if (depth.empty() || depth.type() != CV_32FC1)
+        return;
+    _frame++;
+    Matrix3f r = pose.block<3,3>(0,0);
+    Vector3f t = pose.block<3,1>(0,3);
+    float block_len = _voxel_size * TSDF_BLOCK_SIZE;
+
+    // every block within the truncation band of a reading; a band is
+    //  shorter than a block, so a few samples along it find them all
+    _job_blocks.clear();
+    int steps = (int) ceilf(2.0f * _truncation / (0.5f * block_len)) + 1;
+    for (int v = 0; v < depth.rows; v += ALLOCATE_STRIDE){
+        const float * row = depth.ptr<float>(v);
+        for (int u = 0; u < depth.cols; u += ALLOCATE_STRIDE){
+            float d = row[u];
+            if (d <= 0.0f || d > MAX_DEPTH)
+                continue;
+            Vector3f ray((u - cam.cx) / cam.fx, -(v - cam.cy) / cam.fy, -1.0f);
+            Vector3f near_point = r * (ray * (d - _truncation)) + t;
+            Vector3f far_point = r * (ray * (d + _truncation)) + t;
+            for (int s = 0; s < steps; s++){
+                Vector3f p = near_point + (far_point - near_point) * ((float) s / (steps - 1));
+                int i = allocate_block((int) floorf(p.x() / block_len),
+                                       (int) floorf(p.y() / block_len),
+                                       (int) floorf(p.z() / block_len));
+                if (_blocks[i]->frame != _frame){
+                    _blocks[i]->frame = _frame;
+                    _job_blocks.push_back(i);
+                }
+            }
+        }
+    }
+
+    // world to camera, for projecting voxels
+    _job_rotation = r.transpose();
+    _job_translation = -(_job_rotation * t);
+    _job_depth = &depth;
+    _job_cam = &cam;
+    pool()->parallel_for((int) _job_blocks.size(), integrate_band, this, 8);
+}
+
+void Tsdf_Volume::integrate_band(void * self, int start, int end){
+    Tsdf_Volume * volume = (Tsdf_Volume *) self;
+    for (int i = start; i < end; i++)
+        volume->integrate_block(volume->_blocks[volume->_job_blocks[i]]);
+}
+
+void Tsdf_Volume::integrate_block(tsdf_block_t * block){
+    const Mat& depth = *_job_depth;
+    const tsdf_camera_t& cam = *_job_cam;
+    const Matrix3f& r = _job_rotation;
+    const Vector3f& t = _job_translation;
+    bool changed = false;
+    for (int z = 0; z < TSDF_BLOCK_SIZE; z++){
+        for (int y = 0; y < TSDF_BLOCK_SIZE; y++){
+            for (int x = 0; x < TSDF_BLOCK_SIZE; x++){
+                Vector3f p((block->x * TSDF_BLOCK_SIZE + x + 0.5f) * _voxel_size,
+                           (block->y * TSDF_BLOCK_SIZE + y + 0.5f) * _voxel_size,
+                           (block->z * TSDF_BLOCK_SIZE + z + 0.5f) * _voxel_size);
+                Vector3f pc = r * p + t;
+                float d = -pc.z();
+                if (d <= 0.0f)
+                    continue;
+                int u = (int) (cam.cx + cam.fx * pc.x() / d + 0.5f);
+                int v = (int) (cam.cy - cam.fy * pc.y() / d + 0.5f);
+                if (u < 0 || v < 0 || u >= depth.cols || v >= depth.rows)
+                    continue;
+                float measured = depth.at<float>(v, u);
+                if (measured <= 0.0f || measured > MAX_DEPTH)
+                    continue;
+                float sdf = measured - d;
+                // well behind the surface: no telling what's there
+                if (sdf < -_truncation)
+                    continue;
+                float tsdf = sdf > _truncation ? 1.0f : sdf / _truncation;
+                tsdf_voxel_t& voxel = block->voxels[voxel_index(x, y, z)];
+                voxel.sdf = (voxel.sdf * voxel.weight + tsdf) / (voxel.weight + 1.0f);
+                if (voxel.weight < _max_weight)
+                    voxel.weight += 1.0f;
+                changed = true;
+            }
+        }
+    }
+    if (changed)
+        block->dirty = true;
+}
+
+/* #########################################################################
+
+                                  raycast
+
+   ######################################################################### */
+void Tsdf_Volume::raycast(const tsdf_camera_t& cam, const Matrix4f& pose, Mat& points,
+                          Mat& normals){
+    points.create(cam.height, cam.width, CV_32FC3);
+    normals.create(cam.height, cam.width, CV_32FC3);
+    _job_rotation = pose.block<3,3>(0,0);
+    _job_translation = pose.block<3,1>(0,3);
+    _job_cam = &cam;
+    _job_points = &points;
+    _job_normals = &normals;
+    pool()->parallel_for(cam.height, raycast_band, this, 4);
+}
+
+void Tsdf_Volume::raycast_band(void * self, int start, int end){
+    for (int v = start; v < end; v++)
+        ((Tsdf_Volume *) self)->raycast_row(v);
+}
+
+void Tsdf_Volume::raycast_row(int v){
+    const tsdf_camera_t& cam = *_job_cam;
+    float * points = _job_points->ptr<float>(v);
+    float * normals = _job_normals->ptr<float>(v);
+    const Vector3f& origin = _job_translation;
+    float block_len = _voxel_size * TSDF_BLOCK_SIZE;
+    for (int u = 0; u < cam.width; u++){
+        float * point = points + 3*u;
+        float * normal = normals + 3*u;
+        point[0] = point[1] = point[2] = 0.0f;
+        normal[0] = normal[1] = normal[2] = 0.0f;
+
+        Vector3f dir = _job_rotation * Vector3f((u - cam.cx) / cam.fx,
+                                                -(v - cam.cy) / cam.fy, -1.0f).normalized();
+        // only the stretch of ray inside the blocks' bounds can hit
+        float t = RAY_NEAR, t_far = RAY_FAR;
+        for (int i = 0; i < 3 && t < t_far; i++){
+            float lo = _bounds_min[i] * block_len, hi = (_bounds_max[i] + 1) * block_len;
+            if (fabs(dir[i]) < 1e-6f){
+                if (origin[i] < lo || origin[i] > hi)
+                    t_far = 0.0f;
+                continue;
+            }
+            float t0 = (lo - origin[i]) / dir[i], t1 = (hi - origin[i]) / dir[i];
+            if (t0 > t1){
+                float tmp = t0;
+                t0 = t1;
+                t1 = tmp;
+            }
+            if (t0 > t)
+                t = t0;
+            if (t1 < t_far)
+                t_far = t1;
+        }
+        float last_t = 0.0f, last_sdf = 0.0f;
+        bool have_last = false;
+        while (t < t_far){
+            Vector3f p = origin + dir * t;
+            if (find_block((int) floorf(p.x() / block_len), (int) floorf(p.y() / block_len),
+                           (int) floorf(p.z() / block_len)) < 0){
+                // nothing was ever near here
+                have_last = false;
+                t += 0.5f * block_len;
+                continue;
+            }
+            float sdf;
+            if (!sample(p.x(), p.y(), p.z(), sdf)){
+                have_last = false;
+                t += _voxel_size;
+                continue;
+            }
+            if (have_last && last_sdf > 0.0f && sdf <= 0.0f){
+                // crossed the surface front to back: interpolate to it
+                float hit = last_t + (t - last_t) * last_sdf / (last_sdf - sdf);
+                Vector3f q = origin + dir * hit;
+                if (gradient(q.x(), q.y(), q.z(), normal)){
+                    point[0] = q.x();
+                    point[1] = q.y();
+                    point[2] = q.z();
+                }
+                break;
+            }
+            // inside something, coming out of the back of it
+            if (have_last && last_sdf < 0.0f && sdf > 0.0f)
+                break;
+            last_sdf = sdf;
+            last_t = t;
+            have_last = true;
+            // the field says how far the surface can be, give or take
+            float step = 0.8f * sdf * _truncation;
+            t += step > _voxel_size ? step : _voxel_size;
+        }
+    }
+}
+
+/* #########################################################################
+
+                               mesh extraction
+
+   ######################################################################### */
+void Tsdf_Volume::extract_meshes(vector<tsdf_mesh_t>& out){
+    // a block's mesh reaches a voxel into each neighbour, so changes
+    //  spread to them
+    vector<int> changed;
+    for (size_t i = 0; i < _blocks.size(); i++){
+        if (_blocks[i]->dirty)
+            changed.push_back((int) i);
+    }
+    for (size_t c = 0; c < changed.size(); c++){
+        tsdf_block_t * b = _blocks[changed[c]];
+        for (int dz = -1; dz <= 1; dz++)
+            for (int dy = -1; dy <= 1; dy++)
+                for (int dx = -1; dx <= 1; dx++){
+                    int n = find_block(b->x + dx, b->y + dy, b->z + dz);
+                    if (n >= 0)
+                        _blocks[n]->dirty = true;
+                }
+    }
+    _job_blocks.clear();
+    for (size_t i = 0; i < _blocks.size(); i++){
+        if (_blocks[i]->dirty){
+            _job_blocks.push_back((int) i);
+            _blocks[i]->dirty = false;
+        }
+    }
+    out.resize(_job_blocks.size());
+    _job_meshes = &out;
+    pool()->parallel_for((int) _job_blocks.size(), mesh_band, this, 4);
+}
+
+void Tsdf_Volume::mesh_band(void * self, int start, int end){
+    Tsdf_Volume * volume = (Tsdf_Volume *) self;
+    for (int i = start; i < end; i++){
+        tsdf_mesh_t& mesh = (*volume->_job_meshes)[i];
+        mesh.block = volume->_job_blocks[i];
+        volume->mesh_block(mesh.block, mesh.vertices);
+    }
+}
+
+// local grid mesh_block works in: the block's voxels plus one more on
+//  the low side and two on the high side
+#define MESH_GRID (TSDF_BLOCK_SIZE + 3)
+#define MESH_CELLS (TSDF_BLOCK_SIZE + 1)
+
+static inline int grid_index(int x, int y, int z){
+    // x, y, z from -1
+    return (x + 1) + MESH_GRID * ((y + 1) + MESH_GRID * (z + 1));
+}
+
+static inline int cell_index(int x, int y, int z){
+    return (x + 1) + MESH_CELLS * ((y + 1) + MESH_CELLS * (z + 1));
+}
+
+// one shaded triangle into out; a, b, c in world space, wound so the
+//  face is toward outward
+static void emit_triangle(vector<float>& out, const float * a, const float * b,
+                          const float * c, const float * outward){
+    float e1[3] = {b[0]-a[0], b[1]-a[1], b[2]-a[2]};
+    float e2[3] = {c[0]-a[0], c[1]-a[1], c[2]-a[2]};
+    float n[3] = {e1[1]*e2[2] - e1[2]*e2[1], e1[2]*e2[0] - e1[0]*e2[2],
+                  e1[0]*e2[1] - e1[1]*e2[0]};
+    float len = sqrtf(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+    if (len <= 0.0f)
+        return;
+    const float * corners[3] = {a, b, c};
+    if (n[0]*outward[0] + n[1]*outward[1] + n[2]*outward[2] < 0.0f){
+        corners[1] = c;
+        corners[2] = b;
+        len = -len;
+    }
+    // fixed light from above and to one side; enough to see shape by
+    static const float light[3] = {0.3f, 0.8f, 0.52f};
+    float lambert = (n[0]*light[0] + n[1]*light[1] + n[2]*light[2]) / len;
+    float shade = 0.25f + 0.75f * (lambert > 0.0f ? lambert : 0.0f);
+    for (int k = 0; k < 3; k++){
+        out.push_back(corners[k][0]);
+        out.push_back(corners[k][1]);
+        out.push_back(corners[k][2]);
+        out.push_back(shade);
+        out.push_back(shade);
+        out.push_back(shade);
+    }
+}
+
+void Tsdf_Volume::mesh_block(int index, vector<float>& out){
+    out.clear();
+    tsdf_block_t * block = _blocks[index];
+
+    // copy in the voxels this mesh touches, from up to 27 blocks
+    float sdf[MESH_GRID*MESH_GRID*MESH_GRID];
+    bool seen[MESH_GRID*MESH_GRID*MESH_GRID];
+    tsdf_block_t * near_blocks[27];
+    for (int dz = -1; dz <= 1; dz++)
+        for (int dy = -1; dy <= 1; dy++)
+            for (int dx = -1; dx <= 1; dx++){
+                int n = find_block(block->x + dx, block->y + dy, block->z + dz);
+                near_blocks[(dx+1) + 3*((dy+1) + 3*(dz+1))] = n >= 0 ? _blocks[n] : NULL;
+            }
+    for (int z = -1; z <= TSDF_BLOCK_SIZE + 1; z++){
+        for (int y = -1; y <= TSDF_BLOCK_SIZE + 1; y++){
+            for (int x = -1; x <= TSDF_BLOCK_SIZE + 1; x++){
+                int bx = floor_div(x, TSDF_BLOCK_SIZE);
+                int by = floor_div(y, TSDF_BLOCK_SIZE);
+                int bz = floor_div(z, TSDF_BLOCK_SIZE);
+                tsdf_block_t * b = near_blocks[(bx+1) + 3*((by+1) + 3*(bz+1))];
+                int g = grid_index(x, y, z);
+                seen[g] = false;
+                if (!b)
+                    continue;
+                const tsdf_voxel_t& v = b->voxels[voxel_index(x - bx * TSDF_BLOCK_SIZE,
+                    y - by * TSDF_BLOCK_SIZE, z - bz * TSDF_BLOCK_SIZE)];
+                seen[g] = v.weight > 0.0f;
+                sdf[g] = v.sdf;
+            }
+        }
+    }
+
+    // a vertex for every cell the surface passes through: the mean of
+    //  where it crosses the cell's edges. Cells are named by their low
+    //  corner; the ones at -1 belong to neighbours, but this block's
+    //  faces need them.
+    static const int corner_offsets[8][3] = {
+        {0,0,0}, {1,0,0}, {0,1,0}, {1,1,0}, {0,0,1}, {1,0,1}, {0,1,1}, {1,1,1}
+    };
+    static const int cell_edges[12][2] = {
+        {0,1}, {2,3}, {4,5}, {6,7}, {0,2}, {1,3}, {4,6}, {5,7}, {0,4}, {1,5}, {2,6}, {3,7}
+    };
+    float cell_vertex[MESH_CELLS*MESH_CELLS*MESH_CELLS][3];
+    bool has_vertex[MESH_CELLS*MESH_CELLS*MESH_CELLS];
+    float origin[3] = {(float) block->x * TSDF_BLOCK_SIZE, (float) block->y * TSDF_BLOCK_SIZE,
+                       (float) block->z * TSDF_BLOCK_SIZE};
+    for (int z = -1; z < TSDF_BLOCK_SIZE; z++){
+        for (int y = -1; y < TSDF_BLOCK_SIZE; y++){
+            for (int x = -1; x < TSDF_BLOCK_SIZE; x++){
+                int c = cell_index(x, y, z);
+                has_vertex[c] = false;
+                float values[8];
+                bool all_seen = true;
+                int inside = 0;
+                for (int k = 0; k < 8; k++){
+                    int g = grid_index(x + corner_offsets[k][0], y + corner_offsets[k][1],
+                                       z + corner_offsets[k][2]);
+                    all_seen = all_seen && seen[g];
+                    values[k] = sdf[g];
+                    if (sdf[g] < 0.0f)
+                        inside++;
+                }
+                if (!all_seen || inside == 0 || inside == 8)
+                    continue;
+                float sum[3] = {0.0f, 0.0f, 0.0f};
+                int crossings = 0;
+                for (int e = 0; e < 12; e++){
+                    float a = values[cell_edges[e][0]], b = values[cell_edges[e][1]];
+                    if ((a < 0.0f) == (b < 0.0f))
+                        continue;
+                    float f = a / (a - b);
+                    const int * ca = corner_offsets[cell_edges[e][0]];
+                    const int * cb = corner_offsets[cell_edges[e][1]];
+                    for (int i = 0; i < 3; i++)
+                        sum[i] += ca[i] + f * (cb[i] - ca[i]);
+                    crossings++;
+                }
+                // voxel (i, j, k)'s centre is at (i + 0.5) voxels
+                float local[3] = {(float) x, (float) y, (float) z};
+                for (int i = 0; i < 3; i++)
+                    cell_vertex[c][i] = (origin[i] + local[i] + sum[i] / crossings + 0.5f)
+                                        * _voxel_size;
+                has_vertex[c] = true;
+            }
+        }
+    }
+
+    // a quad across every voxel edge the surface crosses, joining the
+    //  four cells around it. Each edge belongs to the block its low
+    //  voxel is in, so no face is made twice.
+    for (int z = 0; z < TSDF_BLOCK_SIZE; z++){
+        for (int y = 0; y < TSDF_BLOCK_SIZE; y++){
+            for (int x = 0; x < TSDF_BLOCK_SIZE; x++){
+                int g0 = grid_index(x, y, z);
+                if (!seen[g0])
+                    continue;
+                for (int axis = 0; axis < 3; axis++){
+                    int d[3] = {0, 0, 0};
+                    d[axis] = 1;
+                    int g1 = grid_index(x + d[0], y + d[1], z + d[2]);
+                    if (!seen[g1] || (sdf[g0] < 0.0f) == (sdf[g1] < 0.0f))
+                        continue;
+                    // the other two axes pick the four cells
+                    int a1 = (axis + 1) % 3, a2 = (axis + 2) % 3;
+                    int quad[4];
+                    bool complete = true;
+                    for (int k = 0; k < 4; k++){
+                        int p[3] = {x, y, z};
+                        p[a1] -= (k == 1 || k == 2) ? 1 : 0;
+                        p[a2] -= (k >= 2) ? 1 : 0;
+                        quad[k] = cell_index(p[0], p[1], p[2]);
+                        complete = complete && has_vertex[quad[k]];
+                    }
+                    if (!complete)
+                        continue;
+                    // faces point out of the surface, toward the
+                    //  positive end of the edge
+                    float outward[3] = {0.0f, 0.0f, 0.0f};
+                    outward[axis] = sdf[g0] > 0.0f ? -1.0f : 1.0f;
+                    emit_triangle(out, cell_vertex[quad[0]], cell_vertex[quad[1]],
+                                  cell_vertex[quad[2]], outward);
+                    emit_triangle(out, cell_vertex[quad[0]], cell_vertex[quad[2]],
+                                  cell_vertex[quad[3]], outward);
+                }
+            }
+        }
+    }
+}
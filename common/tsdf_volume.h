@@ -0,0 +1,150 @@
+/* #########################################################################
+        TSDF Volume -- truncated signed distance model of whatever a
+            depth camera has seen, stored sparsely: only the voxel
+            blocks near an observed surface exist, found through a
+            hash of their coordinates.
+
+        Header.
+
+   ######################################################################### */
+
+#ifndef __XEN_TSDF_VOLUME_H
+#define __XEN_TSDF_VOLUME_H
+
+// Base system stuff
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <vector>
+
+#include "opencv/cv.h"
+
+#include "Eigen/Dense"
+#include "Eigen/Geometry"
+
+#include "xen_utils.h"
+#include "thread_pool.h"
+
+namespace xen_rift {
+
+    // voxels along each side of a block
+    #define TSDF_BLOCK_SIZE 8
+    #define TSDF_BLOCK_VOXELS (TSDF_BLOCK_SIZE*TSDF_BLOCK_SIZE*TSDF_BLOCK_SIZE)
+
+    // Pinhole depth camera, in the convention Depth_To_Xyz and
+    //  Kinect_Point_Cloud use: x right, y up, looking down -z.
+    typedef struct _tsdf_camera_t {
+        float fx, fy, cx, cy;
+        int width, height;
+    } tsdf_camera_t;
+
+    // the Kinect's depth camera at 640x480 / divisor
+    tsdf_camera_t kinect_depth_camera(int divisor = 1);
+
+    typedef struct _tsdf_voxel_t {
+        // distance to the surface over the truncation distance, in
+        //  [-1, 1]; positive in front
+        float sdf;
+        // observations averaged in; 0 is never seen
+        float weight;
+    } tsdf_voxel_t;
+
+    typedef struct _tsdf_block_t {
+        // in blocks
+        int x, y, z;
+        tsdf_voxel_t voxels[TSDF_BLOCK_VOXELS];
+        // changed since its mesh was last extracted
+        bool dirty;
+        // last integrate() that touched it
+        unsigned long frame;
+    } tsdf_block_t;
+
+    // One block's surface: triangles, six floats a vertex (x y z,
+    //  then an r g b shade), in world coordinates
+    typedef struct _tsdf_mesh_t {
+        int block;
+        std::vector<float> vertices;
+    } tsdf_mesh_t;
+
+    class Tsdf_Volume {
+        public:
+            // voxel_size and truncation in meters. max_weight caps the
+            //  running average, so the model can still follow changes.
+            Tsdf_Volume(float voxel_size = 0.01f, float truncation = 0.03f,
+                        float max_weight = 64.0f);
+            ~Tsdf_Volume();
+            void reset();
+            // Workers integrate(), raycast() and extract_meshes() split
+            //  their work over; NULL (the default) is the shared pool.
+            void set_thread_pool(Thread_Pool * pool) { _pool = pool; }
+
+            // Folds in a depth frame: CV_32FC1, meters straight out
+            //  from the camera, 0 for no reading. pose takes camera
+            //  coordinates to world.
+            void integrate(const cv::Mat& depth, const tsdf_camera_t& cam,
+                           const Eigen::Matrix4f& pose);
+            // The model's surface as cam would see it from pose: world
+            //  space points and normals, CV_32FC3. A zero normal is a
+            //  pixel whose ray hit nothing.
+            void raycast(const tsdf_camera_t& cam, const Eigen::Matrix4f& pose,
+                         cv::Mat& points, cv::Mat& normals);
+            // Meshes of every block integrate() has changed since the
+            //  last call (empty ones included, for blocks whose
+            //  surface went away).
+            void extract_meshes(std::vector<tsdf_mesh_t>& out);
+
+            int num_blocks() { return (int) _blocks.size(); }
+            float voxel_size() { return _voxel_size; }
+            float truncation() { return _truncation; }
+
+        protected:
+            // index into _blocks, or -1
+            int find_block(int x, int y, int z);
+            int allocate_block(int x, int y, int z);
+            void grow_table();
+            // Trilinear sdf at a world point; false unless all eight
+            //  voxels around it have been seen
+            bool sample(float px, float py, float pz, float& sdf);
+            // sdf gradient at a world point, normalized; false if any
+            //  of it is unseen
+            bool gradient(float px, float py, float pz, float * n);
+
+            static void integrate_band(void * self, int start, int end);
+            void integrate_block(tsdf_block_t * block);
+            static void raycast_band(void * self, int start, int end);
+            void raycast_row(int v);
+            static void mesh_band(void * self, int start, int end);
+            void mesh_block(int block, std::vector<float>& out);
+
+            Thread_Pool * pool() { return _pool ? _pool : get_shared_thread_pool(); }
+
+            float _voxel_size;
+            float _truncation;
+            float _max_weight;
+            Thread_Pool * _pool;
+            std::vector<tsdf_block_t *> _blocks;
+            // open addressing, linear probing; block indices, -1 free
+            std::vector<int> _table;
+            unsigned long _frame;
+            // every block lies within these, inclusive; rays are
+            //  clipped to them
+            int _bounds_min[3];
+            int _bounds_max[3];
+
+            // the job a parallel_for is working on
+            const cv::Mat * _job_depth;
+            const tsdf_camera_t * _job_cam;
+            Eigen::Matrix3f _job_rotation;
+            Eigen::Vector3f _job_translation;
+            std::vector<int> _job_blocks;
+            cv::Mat * _job_points;
+            cv::Mat * _job_normals;
+            std::vector<tsdf_mesh_t> * _job_meshes;
+
+        private:
+    };
+}
+
+#endif //__XEN_TSDF_VOLUME_H
@@ -132,6 +132,30 @@ unsigned long xen_rift::get_elapsed(int index){
     return elapsed;
 }
 
+double xen_rift::get_time_ms(){
+#ifdef _WIN32
+    LARGE_INTEGER freq, li;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&li);
+    return ((double)li.QuadPart) * 1000.0 / ((double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+void xen_rift::sleep_ms(int ms){
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+#endif
+}
+
 //--------------------------------------------------------------------------
 // Prints an info log regarding the creation of a vertex or fragment shader
 //  CS179 2013 Caltech
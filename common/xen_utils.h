@@ -43,6 +43,11 @@ namespace xen_rift {
     #define NUM_GET_ELAPSED_INDICES 100
     int init_get_elapsed( void );
     unsigned long get_elapsed(int index);
+    // absolute high-res time in ms from an arbitrary epoch. Unlike
+    //  get_elapsed, keeps no shared state, so any thread can call it.
+    double get_time_ms( void );
+    // gives up the cpu for about ms; for polling threads
+    void sleep_ms(int ms);
 
     // print log wrt a shader
     void printShaderInfoLog(GLuint obj);
@@ -0,0 +1,179 @@
+/* #########################################################################
+        YUV Texture -- camera frames kept in their native YUV layout on
+            the GPU, converted to RGB by a fragment shader as they're
+            drawn, plus the PBO streaming textures they're uploaded
+            through.
+
+   ######################################################################### */
+
+#include "yuv_texture.h"
+#include "remap_texture.h"
+
+using namespace std;
+using namespace xen_rift;
+
+static int bytes_per_pixel(GLenum format, GLenum type){
+    int size = type == GL_UNSIGNED_SHORT ? 2 : 1;
+    switch (format){
+        case GL_LUMINANCE: return size;
+        case GL_LUMINANCE_ALPHA: return 2 * size;
+        case GL_RGB:
+        case GL_BGR: return 3 * size;
+        default: return 4 * size;
+    }
+}
+
+/* #########################################################################
+
+                                Stream_Texture
+
+   ######################################################################### */
+Stream_Texture::Stream_Texture() :
+    _texture(0),
+    _pbo(0),
+    _width(0),
+    _height(0),
+    _format(GL_LUMINANCE),
+    _type(GL_UNSIGNED_BYTE),
+    _row_bytes(0),
+    _mapped(false)
+{
+}
+
+Stream_Texture::~Stream_Texture(){
+    // GL context may be gone at exit; textures die with it
+}
+
+void Stream_Texture::init(){
+    glGenTextures(1, &_texture);
+    glBindTexture(GL_TEXTURE_2D, _texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glGenBuffers(1, &_pbo);
+}
+
+unsigned char * Stream_Texture::map(int width, int height, GLenum format, GLenum type){
+    if (!_texture)
+        init();
+    if (width != _width || height != _height || format != _format || type != _type){
+        // (re)allocate storage; contents come with the unmap
+        _width = width;
+        _height = height;
+        _format = format;
+        _type = type;
+        _row_bytes = width * bytes_per_pixel(format, type);
+        glBindTexture(GL_TEXTURE_2D, _texture);
+        GLint internal = format == GL_BGR ? GL_RGB : format;
+        if (type == GL_UNSIGNED_SHORT && format == GL_LUMINANCE)
+            internal = GL_LUMINANCE16;
+        glTexImage2D(GL_TEXTURE_2D, 0, internal, width, height, 0, format, type, NULL);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _pbo);
+    // orphan the old storage: if the GPU is still reading last frame's,
+    //  the driver hands us fresh memory instead of making us wait
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, _row_bytes * _height, NULL, GL_STREAM_DRAW);
+    unsigned char * ptr = (unsigned char *) glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+    if (!ptr){
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        return NULL;
+    }
+    _mapped = true;
+    return ptr;
+}
+
+void Stream_Texture::unmap(){
+    if (!_mapped)
+        return;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _pbo);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    glBindTexture(GL_TEXTURE_2D, _texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    // source is the bound PBO, at offset 0
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, _width, _height, _format, _type, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    _mapped = false;
+}
+
+void Stream_Texture::upload(const unsigned char * data, int width, int height,
+                            int stride, GLenum format, GLenum type){
+    unsigned char * dst = map(width, height, format, type);
+    if (!dst)
+        return;
+    if (stride == _row_bytes){
+        memcpy(dst, data, _row_bytes * height);
+    } else {
+        for (int y = 0; y < height; y++)
+            memcpy(dst + y * _row_bytes, data + y * stride, _row_bytes);
+    }
+    unmap();
+}
+
+/* #########################################################################
+
+                              Yuv_Frame_Texture
+
+   ######################################################################### */
+GLuint Yuv_Frame_Texture::_program = 0;
+bool Yuv_Frame_Texture::_program_failed = false;
+
+Yuv_Frame_Texture::Yuv_Frame_Texture() :
+    _width(0),
+    _height(0)
+{
+}
+
+bool Yuv_Frame_Texture::upload(const raw_frame_t& frame){
+    if (frame.format != PIXEL_FORMAT_YUYV)
+        return false;
+    // Y0 U Y1 V as r g b a. Two bytes a pixel, against three for BGR.
+    _pairs.upload(frame.data, frame.width / 2, frame.height, frame.stride, GL_RGBA);
+    _width = frame.width;
+    _height = frame.height;
+    return true;
+}
+
+bool Yuv_Frame_Texture::build_program(){
+    if (_program)
+        return true;
+    if (_program_failed)
+        return false;
+    GLuint vshader, fshader;
+    load_shaders("../resources/shaders/yuv_passthrough.vert", &vshader,
+                 "../resources/shaders/yuv_passthrough.frag", &fshader);
+    _program = glCreateProgram();
+    glAttachShader(_program, vshader);
+    glAttachShader(_program, fshader);
+    glLinkProgram(_program);
+    GLint linked = 0;
+    glGetProgramiv(_program, GL_LINK_STATUS, &linked);
+    if (!linked){
+        printf("Yuv_Frame_Texture: couldn't link the YUV shaders\n");
+        glDeleteProgram(_program);
+        _program = 0;
+        _program_failed = true;
+        return false;
+    }
+    return true;
+}
+
+void Yuv_Frame_Texture::begin(Remap_Texture * remap){
+    if (!build_program() || !has_frame())
+        return;
+    glUseProgram(_program);
+    bool rectify = remap && remap->valid();
+    if (rectify)
+        remap->bind();
+    glUniform1i(glGetUniformLocation(_program, "remap"), REMAP_TEXTURE_UNIT);
+    glUniform1i(glGetUniformLocation(_program, "rectify"), rectify);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, _pairs.texture());
+    glUniform1i(glGetUniformLocation(_program, "pairs"), 0);
+    glUniform2f(glGetUniformLocation(_program, "size"), (float) _width, (float) _height);
+}
+
+void Yuv_Frame_Texture::end(){
+    glUseProgram(0);
+}
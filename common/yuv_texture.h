@@ -0,0 +1,98 @@
+/* #########################################################################
+        YUV Texture -- camera frames kept in their native YUV layout on
+            the GPU, converted to RGB by a fragment shader as they're
+            drawn, plus the PBO streaming textures they're uploaded
+            through.
+
+        Header.
+
+   ######################################################################### */
+
+#ifndef __XEN_YUV_TEXTURE_H
+#define __XEN_YUV_TEXTURE_H
+
+// Base system stuff
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/GL/glew.h"
+#include "../include/gl_helper.h"
+#include <gl/gl.h>
+
+#include "capture_source.h"
+#include "xen_utils.h"
+
+namespace xen_rift {
+
+    class Remap_Texture;
+
+    // A texture rewritten from the CPU every frame. Uploads go through
+    //  a pixel buffer object, so the copy into GL memory doesn't wait
+    //  for the GPU to finish with the last frame.
+    class Stream_Texture {
+        public:
+            Stream_Texture();
+            ~Stream_Texture();
+
+            // Pointer to write width x height pixels of format
+            //  (GL_LUMINANCE, GL_LUMINANCE_ALPHA, GL_RGB, GL_RGBA or
+            //  GL_BGR) into, rows tightly packed. NULL on failure. Must
+            //  be followed by unmap(). type GL_UNSIGNED_SHORT (with
+            //  GL_LUMINANCE) keeps all 16 bits, for depth.
+            unsigned char * map(int width, int height, GLenum format,
+                                GLenum type = GL_UNSIGNED_BYTE);
+            // hands what was written to the texture
+            void unmap();
+            // map, copy rows of stride bytes, unmap
+            void upload(const unsigned char * data, int width, int height,
+                        int stride, GLenum format, GLenum type = GL_UNSIGNED_BYTE);
+
+            GLuint texture() { return _texture; }
+            int width() { return _width; }
+            int height() { return _height; }
+
+        protected:
+            void init();
+
+            GLuint _texture;
+            GLuint _pbo;
+            int _width;
+            int _height;
+            GLenum _format;
+            GLenum _type;
+            int _row_bytes;
+            bool _mapped;
+
+        private:
+    };
+
+    class Yuv_Frame_Texture {
+        public:
+            Yuv_Frame_Texture();
+
+            // PIXEL_FORMAT_YUYV only; false for anything else
+            bool upload(const raw_frame_t& frame);
+            bool has_frame() { return _width > 0; }
+
+            // Binds the frame and the conversion shader; draw the quad
+            //  with texcoords 0..1, then end(). With remap, the frame
+            //  is looked up through it as it's converted.
+            void begin(Remap_Texture * remap = NULL);
+            void end();
+
+        protected:
+            // shared by every instance; built on first use
+            static bool build_program();
+            static GLuint _program;
+            static bool _program_failed;
+
+            // one RGBA texel per pixel pair
+            Stream_Texture _pairs;
+            int _width;
+            int _height;
+
+        private:
+    };
+}
+
+#endif //__XEN_YUV_TEXTURE_H
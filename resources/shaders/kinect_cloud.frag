@@ -0,0 +1,12 @@
+// Kinect point cloud; see common/kinect_cloud.h.
+#version 120
+
+uniform sampler2D rgb;
+uniform bool has_rgb;
+
+void main(){
+    if (has_rgb)
+        gl_FragColor = vec4(texture2D(rgb, gl_TexCoord[0].xy).rgb, 1.0);
+    else
+        gl_FragColor = vec4(1.0);
+}
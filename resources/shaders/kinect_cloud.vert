@@ -0,0 +1,26 @@
+// Kinect point cloud; see common/kinect_cloud.h. One vertex per depth
+//  pixel, its (u, v) in gl_Vertex.xy; the depth texture has the rest.
+#version 120
+
+uniform sampler2D depth;
+uniform vec2 size;
+// raw (u, v, depth, 1) to meters, and meters to RGB pixels; both
+//  projective
+uniform mat4 depth_to_metric;
+uniform mat4 metric_to_rgb;
+
+void main(){
+    vec2 uv = gl_Vertex.xy;
+    // 16 bit texture, normalized
+    float d = texture2DLod(depth, (uv + 0.5) / size, 0.0).r * 65535.0;
+    if (d >= 2047.0){
+        // no reading: outside the clip volume, so it's dropped
+        gl_Position = vec4(0.0, 0.0, 2.0, 1.0);
+        return;
+    }
+    vec4 p = depth_to_metric * vec4(uv, d, 1.0);
+    p /= p.w;
+    vec4 c = metric_to_rgb * p;
+    gl_TexCoord[0] = vec4(c.xy / (c.w * size), 0.0, 1.0);
+    gl_Position = gl_ModelViewProjectionMatrix * p;
+}
@@ -0,0 +1,23 @@
+// Camera frame through an undistort / rectify lookup; see
+//  common/remap_texture.h. remap holds, per output pixel, the
+//  texcoords (r, a) of the image pixel it comes from.
+#version 120
+
+uniform sampler2D image;
+uniform sampler2D remap;
+// multiply by the vertex color (GL_MODULATE) rather than replace it
+uniform bool modulate;
+
+void main(){
+    vec2 uv = texture2D(remap, gl_TexCoord[0].st).ra;
+    // rectification leaves corners with nothing to show
+    if (uv.x < 0.0 || uv.x > 1.0 || uv.y < 0.0 || uv.y > 1.0){
+        gl_FragColor = modulate ? vec4(0.0) : vec4(0.0, 0.0, 0.0, gl_Color.a);
+        return;
+    }
+    vec4 texel = texture2D(image, uv);
+    if (modulate)
+        gl_FragColor = texel * gl_Color;
+    else
+        gl_FragColor = vec4(texel.rgb, gl_Color.a);
+}
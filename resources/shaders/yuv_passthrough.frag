@@ -0,0 +1,42 @@
+// YUV -> RGB for camera frames, BT.601 limited range, which is what
+//  webcams send. The frame is YUYV: pairs is width/2 x height RGBA,
+//  one texel per pixel pair (r = Y0, g = U, b = Y1, a = V).
+#version 120
+
+uniform sampler2D pairs;
+// frame size in pixels
+uniform vec2 size;
+// undistort / rectify lookup, if rectify; see common/remap_texture.h
+uniform sampler2D remap;
+uniform bool rectify;
+
+void main(){
+    vec2 uv = gl_TexCoord[0].st;
+    if (rectify){
+        uv = texture2D(remap, uv).ra;
+        if (uv.x < 0.0 || uv.x > 1.0 || uv.y < 0.0 || uv.y > 1.0){
+            gl_FragColor = vec4(0.0, 0.0, 0.0, 1.0);
+            return;
+        }
+    }
+    // Linear filtering across a pixel pair would mix Y0 with Y1, so
+    //  take the two texels around us at their centres and blend the
+    //  luma ourselves.
+    float px = uv.x * size.x - 0.5;
+    float x0 = floor(px);
+    float f = px - x0;
+    float num_pairs = size.x * 0.5;
+    vec4 a = texture2D(pairs, vec2((floor(x0 * 0.5) + 0.5) / num_pairs, uv.y));
+    vec4 b = texture2D(pairs, vec2((floor((x0 + 1.0) * 0.5) + 0.5) / num_pairs, uv.y));
+    float ya = mod(x0, 2.0) < 0.5 ? a.r : a.b;
+    float yb = mod(x0 + 1.0, 2.0) < 0.5 ? b.r : b.b;
+    float y = mix(ya, yb, f);
+    // chroma is shared per pair; filtering it is what we want
+    vec2 c = texture2D(pairs, uv).ga;
+    y = 1.1644 * (y - 0.0627);
+    c -= 0.5;
+    gl_FragColor = vec4(y + 1.5960 * c.y,
+                        y - 0.3918 * c.x - 0.8130 * c.y,
+                        y + 2.0172 * c.x,
+                        1.0);
+}
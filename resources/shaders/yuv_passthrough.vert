@@ -0,0 +1,9 @@
+// Passthrough quad for camera frames drawn by a shader; see
+//  common/yuv_texture.h and common/remap_texture.h. Fixed function
+//  transform, texcoords as given.
+#version 120
+
+void main(){
+    gl_TexCoord[0] = gl_MultiTexCoord0;
+    gl_Position = ftransform();
+}
@@ -19,13 +19,31 @@
 #include "../common/rift.h"
 #include "../common/textbox_3d.h"
 #include "../common/xen_utils.h"
+#include "../common/reichardt.h"
+#include "../common/camera_calibration.h"
+#include "../common/stereo_depth.h"
+#include "../common/capture_source.h"
+#include "../common/stereo_recording.h"
+#include "../common/thread_pool.h"
+#include "../common/yuv_texture.h"
+#include "../common/remap_texture.h"
+#include "../common/kinect_cloud.h"
+#include "../common/kinect.h"
+#include "../common/kinect_fusion.h"
+#include "../common/kinect_manager.h"
+#include "../common/point_octree.h"
+#include "../common/mjpeg_decode.h"
+#include "../common/stereo_sync.h"
+#include "../common/camera_pool.h"
+#include "../common/frame_governor.h"
+#include "../common/feature_tracker.h"
+#include "../common/latency.h"
 
 // handy image loading
 #include "../include/SOIL.h"
 
 // kinect
 #include "libfreenect.h"
-#include "libfreenect_sync.h"
 
 using namespace std;
 using namespace OVR;
@@ -48,33 +66,131 @@ double currFrameRate = 0;
 //Rift
 Rift * rift_manager;
 
-//opencv image capture
-CvCapture* l_capture;
+//camera frames: live webcams, or streams of a -replay recording
+Capture_Source* l_capture;
 int l_capture_num = 0;
-CvCapture* r_capture;
+Capture_Source* r_capture;
 int r_capture_num = 1;
+// Cameras are opened, and the last few kept open, on the pool's
+//  thread. The keys only change want_*_capture_num; the eyes switch
+//  over at the first display pass the pool has both ready for.
+Camera_Pool * camera_pool = NULL;
+int want_l_capture_num = 0;
+int want_r_capture_num = 1;
+bool cameras_current = false;
+// the pool's handles behind l_capture / r_capture (NULL right when
+//  both eyes are on one camera)
+Capture_Source * l_source = NULL;
+Capture_Source * r_source = NULL;
 int exposure_num = -5;
-
-GLuint ipl_convert_texture;
+//-record / -replay
+Stereo_Recorder * recorder = NULL;
+Stereo_Replay * replay = NULL;
+bool replay_realtime = true;
+// -mjpeg WxH: cameras send jpegs at this size (0: uncompressed 640x480).
+//  An MJPEG replay's jpegs are decoded on a thread per stream and
+//  shrunk by -decode_scale. Live cameras' aren't: OpenCV's capture
+//  decodes them inside grab/retrieve and never hands the jpeg out.
+int mjpeg_width = 0;
+int mjpeg_height = 0;
+int decode_scale = 1;
+// Left and right get captured on threads of their own and paired by
+//  timestamp; l_capture / r_capture are then its views of the pair.
+//  -no_sync turns it off, -sync_skew sets the pairing tolerance.
+Stereo_Synchronizer * stereo_sync = NULL;
+bool sync_cameras = true;
+double sync_skew_ms = 20.0;
+
+// processed-frame cache, keyed by camera number
+map<int, camera_cache_t> camera_caches;
 float render_dist = 1.5;
+// swing camera quads by how far the head's turned since their frame
+//  was captured, so they stay put in the world rather than the face
+bool timewarp = true;
+// rotation draw_passthrough_quad applies, set per eye by render_core
+GLfloat passthrough_warp[16] = {1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1};
 bool draw_main_image = true;
 bool black_and_white = false;
 bool apply_threshold = false;
 bool apply_sobel = false;
 bool apply_canny_contours = false;
 bool apply_features = false;
+feature_detector_t feature_detector = FEATURE_DETECTOR_STAR;
+bool feature_tracking = false;
 bool apply_reichardt = false;
 int threshold_val = 100;
 int canny_thresh = 100;
 RNG rng(12345);
+// cost of the last Reichardt update, for the HUD
+double reichardt_ms = 0.0;
+// and of the last feature detection / LK track step
+double feature_detect_ms = 0.0;
+double feature_track_ms = 0.0;
+// Turns canny, features and sobel down (smaller, less often, off) when
+//  camera processing runs over -filter_budget ms a display pass, and
+//  back up when there's room. 'G' toggles it.
+Frame_Governor * frame_governor;
+double filter_budget_ms = 8.0;
+// camera processing so far this display pass
+double frame_work_ms = 0.0;
+
+// capture-to-EndFrame age of every frame shown, by stage
+Latency_Tracker * latency_tracker;
+// blinks a patch of the view for a camera to watch; see 'L'
+Blink_Latency_Probe * blink_probe;
+
+// stereo depth between the left and right cameras
+typedef enum _stereo_modes {
+    STEREO_OFF=0,
+    STEREO_POINT_CLOUD=1,
+    STEREO_DEPTH_MAP=2,
+    NUM_STEREO_MODES=3
+} stereo_modes;
+int stereo_mode = STEREO_OFF;
+Stereo_Calibration * stereo_calib;
+// undistort / rectify each eye's camera in the shader that draws it,
+//  through the calibration's lookup (left, right)
+bool rectify_cameras = true;
+Remap_Texture * eye_remap[2];
+Stereo_Depth * stereo_depth;
+// grab_seq of each camera the depth was last computed from
+unsigned long stereo_seq[2] = {0, 0};
+GLuint stereo_depth_texture;
+bool stereo_has_output = false;
+int stereo_computes = 0;
 
 // basic kinect support
 bool show_kinect = false;
-GLuint gl_rgb_tex;
-unsigned int indices[480][640];
-float xyz[480][640][3];
-short *depth = 0;
-char *rgb = 0;
+// opens the kinect and streams from it off the render thread
+Kinect_Stream * kinect_stream;
+Kinect_Point_Cloud * kinect_cloud;
+// with -kinects 2 or more, runs them all and draws their merged cloud
+//  in place of kinect_stream and kinect_cloud
+Kinect_Manager * kinect_manager = NULL;
+// room model built up from the kinect's depth, drawn in place of the
+//  cloud while it's on
+Kinect_Fusion * kinect_fusion = NULL;
+// cleans up depth before anything sees it, guided by the latest RGB
+Depth_Filter_Thread * depth_filter;
+bool filter_kinect = false;
+Mat kinect_rgb;
+Mat kinect_filtered;
+// Kinect scans accumulated over a session: collected by the builder
+//  a couple of times a second, then built into octree_file and drawn
+//  from it by point_octree
+Point_Octree_Builder * octree_builder = NULL;
+Point_Octree * point_octree = NULL;
+bool show_octree = true;
+string octree_file("kinect_scan.xoct");
+double octree_last_scan_ms = 0.0;
+const double OCTREE_SCAN_INTERVAL_MS = 500.0;
+// single kinect scans, to world points; with fusion on, the frames it
+//  tracked and their poses
+Mat octree_depth;
+unsigned long octree_fusion_seq = 0;
+Depth_To_Xyz * octree_to_xyz = NULL;
+kinect_xyz_t octree_xyz;
+vector<float> octree_points;
 Textbox_3D * textbox_kinect;
 Eigen::Vector3f textbox_kinect_pos(1.0, -1.0, -2.0);
 
@@ -97,6 +213,47 @@ void initOpenGL(int w, int h, void*d);
 void glut_display();
 // and shared between eyes rendering core
 void render_core();
+// adds a kinect depth frame to the scan, if it's time for another
+void add_octree_scan(const Mat& depth);
+// grab a new frame from each distinct camera in use
+void grab_camera_frames();
+// stamps EndFrame on frames uploaded this pass and records them
+void finish_frame_latency(double end_frame_ms);
+// hands the frame governor this pass's processing time and which of
+//  its filters are on
+void govern_filters();
+// how the governed filters run for a camera's frame seq
+void governed_plan(unsigned long seq, filter_plan_t& plan);
+// recompute stereo depth if both cameras have new frames
+void update_stereo_depth();
+// draw whatever stereo output is on
+void draw_stereo_depth();
+// processed-frame cache helpers
+filter_config_t current_filter_config();
+camera_cache_t * get_camera_cache(int cam_num);
+Capture_Source * capture_for_num(int cam_num);
+// opens a camera number on whatever we're getting frames from
+Capture_Source * open_capture(int cam_num);
+// same, as the camera pool's opener
+Capture_Source * pool_open_capture(void * arg, int cam_num);
+// asks the pool for a new pair of camera numbers
+void want_cameras(int l_num, int r_num);
+// moves l_capture / r_capture to the wanted camera numbers if the pool
+//  has them; false while it's still opening them
+bool open_cameras();
+void close_cameras();
+void process_camera_frame(int cam_num, filter_config_t& config, camera_cache_t * cache);
+// filter chain, shared by every consumer of camera frames
+//  luma, if given, is the frame's gray and saves converting it again;
+//  keypoints, if given, are drawn instead of running the detector;
+//  plan, if given, says how the governed stages run, with memory
+//  holding their results between frames
+void apply_filters(Mat& frame, filter_config_t& config, RNG& color_rng,
+                   filter_timing_t * timing = NULL, const Mat * luma = NULL,
+                   const vector<KeyPoint> * keypoints = NULL,
+                   const filter_plan_t * plan = NULL, filter_memory_t * memory = NULL);
+// headless: filter video files / recordings as fast as possible
+int run_batch(int argc, char* argv[]);
 // GLUT idle callback -- launches a CUDA analysis cycle
 void glut_idle();
 //GLUT resize callback
@@ -117,15 +274,18 @@ double get_elapsed();
 
 //convenience conversion
 void ConvertMatToTexture(Mat * image, GLuint texture);
-// for manipulating kinect depth data
-void LoadVertexMatrix();
-void LoadRGBMatrix();
+// draws a texture on the passthrough quad at render_dist
+void draw_passthrough_quad(GLuint texture, GLint env_mode);
+// same, looked up through remap if there is one
+void draw_camera_quad(GLuint texture, GLint env_mode, Remap_Texture * remap);
+// points passthrough_warp at this eye's camera frame's capture pose
+void update_passthrough_warp(camera_cache_t * cache);
 
 /* #########################################################################
     
                                     MAIN
                                     
-        -Parses cmdline args (none right now)
+        -Parses cmdline args (recording / replay of the cameras)
         -Initializes OpenGL and log file
         -%TODO some setup stuff!
         -Registers callback funcs with GLUT
@@ -135,13 +295,81 @@ void LoadRGBMatrix();
 
 int main(int argc, char* argv[]) {    
 
+    // headless batch processing skips everything below
+    if (argc > 1 && strcmp(argv[1], "-batch") == 0)
+        return run_batch(argc - 2, argv + 2);
+    // as does timing the kinect depth conversion, compression,
+    //  meshing and filtering
+    if (argc > 1 && strcmp(argv[1], "-bench_kinect") == 0){
+        benchmark_depth_to_xyz(argc > 2 ? atoi(argv[2]) : 200);
+        benchmark_depth_codec(argc > 2 ? atoi(argv[2]) : 200);
+        benchmark_kinect_mesh(argc > 2 ? atoi(argv[2]) : 200);
+        benchmark_depth_filter(argc > 2 ? atoi(argv[2]) : 200);
+        benchmark_point_octree();
+        return 0;
+    }
+
     //Deal with cmd-line args
     //printf("argc = %d, argv[0] = %s, argv[1] = %s\n",argc, argv[0], argv[1]);
     bool use_hydra = true;
     bool verbose = false;
+    char * record_file = NULL;
+    rec_encoding_t record_encoding = REC_ENCODING_RAW_BGR;
+    char * replay_file = NULL;
+    char * kinect_record_file = NULL;
+    // device i replays the i'th
+    vector<char *> kinect_replay_files;
+    int num_kinects = 0;
+    char * kinect_extrinsics_file = NULL;
     for (int i = 1; i < argc; i++) { //Iterate over argv[] to get the parameters stored inside.
-        printf("Usage: nothing\n");
-        return 0;
+        if (strcmp(argv[i], "-record") == 0 && i+1 < argc){
+            record_file = argv[++i];
+        } else if (strcmp(argv[i], "-record_mjpeg") == 0 && i+1 < argc){
+            record_file = argv[++i];
+            record_encoding = REC_ENCODING_MJPEG;
+        } else if (strcmp(argv[i], "-record_yuyv") == 0 && i+1 < argc){
+            record_file = argv[++i];
+            record_encoding = REC_ENCODING_YUYV;
+        } else if (strcmp(argv[i], "-replay") == 0 && i+1 < argc){
+            replay_file = argv[++i];
+        } else if (strcmp(argv[i], "-replay_fast") == 0){
+            replay_realtime = false;
+        } else if (strcmp(argv[i], "-kinect_record") == 0 && i+1 < argc){
+            kinect_record_file = argv[++i];
+        } else if (strcmp(argv[i], "-kinect_replay") == 0 && i+1 < argc){
+            kinect_replay_files.push_back(argv[++i]);
+        } else if (strcmp(argv[i], "-kinects") == 0 && i+1 < argc){
+            num_kinects = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-kinect_extrinsics") == 0 && i+1 < argc){
+            kinect_extrinsics_file = argv[++i];
+        } else if (strcmp(argv[i], "-octree") == 0 && i+1 < argc){
+            octree_file = argv[++i];
+        } else if (strcmp(argv[i], "-mjpeg") == 0 && i+1 < argc &&
+                   sscanf(argv[i+1], "%dx%d", &mjpeg_width, &mjpeg_height) == 2){
+            i++;
+        } else if (strcmp(argv[i], "-decode_scale") == 0 && i+1 < argc){
+            decode_scale = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-no_sync") == 0){
+            sync_cameras = false;
+        } else if (strcmp(argv[i], "-sync_skew") == 0 && i+1 < argc){
+            sync_skew_ms = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-filter_budget") == 0 && i+1 < argc){
+            filter_budget_ms = atof(argv[++i]);
+        } else {
+            printf("Usage: webcam_feedthrough [-record <file> | -record_mjpeg <file> |\n"
+                   "                           -record_yuyv <file>]\n"
+                   "                          [-replay <file> [-replay_fast]]\n"
+                   "                          [-kinect_record <file> | -kinect_replay <file>]\n"
+                   "                          [-kinects <n> [-kinect_extrinsics <file>]\n"
+                   "                           [-kinect_replay <file>]...]\n"
+                   "                          [-octree <file>]\n"
+                   "                          [-mjpeg <w>x<h>] [-decode_scale <1|2|4|8>]\n"
+                   "                          [-no_sync | -sync_skew <ms>]\n"
+                   "                          [-filter_budget <ms>]\n"
+                   "       webcam_feedthrough -batch ... (no args for its usage)\n"
+                   "       webcam_feedthrough -bench_kinect [frames]\n");
+            return 0;
+        }
     }
     
     printf("Initializing... ");
@@ -179,22 +407,61 @@ int main(int argc, char* argv[]) {
 
     printf("On to cam capture\n");
     
-    //opencv capture
-    l_capture = cvCaptureFromCAM(l_capture_num); 
-    r_capture = cvCaptureFromCAM(r_capture_num); 
-    cvSetCaptureProperty(l_capture, CV_CAP_PROP_EXPOSURE, exposure_num);
-    cvSetCaptureProperty(r_capture, CV_CAP_PROP_EXPOSURE, exposure_num);
+    if (replay_file){
+        replay = new Stereo_Replay();
+        if (!replay->open(replay_file))
+            return -1;
+    }
+    camera_pool = new Camera_Pool(&pool_open_capture, NULL, 2);
+    want_cameras(l_capture_num, r_capture_num);
+    // and see what else is plugged in, for quick switching later
+    camera_pool->enumerate(4);
+    if (record_file){
+        recorder = new Stereo_Recorder();
+        recorder->open(record_file, 2, record_encoding);
+    }
 
-    //cvSetCaptureProperty(l_capture, CV_CAP_PROP_FOURCC, CV_FOURCC('M', 'J', 'P', 'G'));
-    //cvSetCaptureProperty(r_capture, CV_CAP_PROP_FOURCC, CV_FOURCC('M', 'J', 'P', 'G'));
+    // stereo depth; uncalibrated defaults if there's no calibration
+    stereo_calib = new Stereo_Calibration();
+    stereo_calib->load("../resources/stereo_calib.yml");
+    stereo_depth = new Stereo_Depth(stereo_calib);
+    eye_remap[0] = new Remap_Texture();
+    eye_remap[1] = new Remap_Texture();
+    kinect_cloud = new Kinect_Point_Cloud();
+    kinect_stream = new Kinect_Stream(0);
+    depth_filter = new Depth_Filter_Thread();
+    if (num_kinects < (int) kinect_replay_files.size())
+        num_kinects = (int) kinect_replay_files.size();
+    if (num_kinects > 1){
+        kinect_manager = new Kinect_Manager(num_kinects);
+        if (kinect_extrinsics_file && !kinect_manager->load_extrinsics(kinect_extrinsics_file))
+            printf("Couldn't load kinect extrinsics from %s\n", kinect_extrinsics_file);
+        for (int i = 0; i < (int) kinect_replay_files.size(); i++)
+            kinect_manager->set_replay(i, kinect_replay_files[i]);
+        if (kinect_record_file)
+            printf("-kinect_record is for a single kinect; ignored\n");
+    } else {
+        if (!kinect_replay_files.empty())
+            kinect_stream->set_replay(kinect_replay_files[0]);
+        if (kinect_record_file)
+            kinect_stream->set_record(kinect_record_file);
+    }
 
-    cvSetCaptureProperty(l_capture, CV_CAP_PROP_FRAME_WIDTH, 640);
-    cvSetCaptureProperty(r_capture, CV_CAP_PROP_FRAME_WIDTH, 640);
-    cvSetCaptureProperty(l_capture, CV_CAP_PROP_FRAME_HEIGHT, 480);
-    cvSetCaptureProperty(r_capture, CV_CAP_PROP_FRAME_HEIGHT, 480);
+    // a scan from last time, if there is one
+    point_octree = new Point_Octree();
+    FILE * octree_check = fopen(octree_file.c_str(), "rb");
+    if (octree_check){
+        fclose(octree_check);
+        point_octree->open(octree_file);
+    }
 
-    cvSetCaptureProperty(l_capture, CV_CAP_PROP_FPS, 30);
-    cvSetCaptureProperty(r_capture, CV_CAP_PROP_FPS, 30);
+    latency_tracker = new Latency_Tracker();
+    // in governed_filters order, cheapest to lose first
+    frame_governor = new Frame_Governor(filter_budget_ms);
+    frame_governor->add_task("canny", 0);
+    frame_governor->add_task("features", 1);
+    frame_governor->add_task("sobel", 2);
+    blink_probe = new Blink_Latency_Probe();
 
     //fps textbox
     Eigen::Vector3f tmpdir = -1.0*textbox_fps_pos;
@@ -272,10 +539,8 @@ void initOpenGL(int w, int h, void*d = NULL) {
 
     glEnable( GL_NORMALIZE );
 
-    glGenTextures(1,&ipl_convert_texture);
-
     glEnable(GL_DEPTH_TEST);
-    glGenTextures(1, &gl_rgb_tex);
+    glGenTextures(1, &stereo_depth_texture);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
@@ -308,40 +573,60 @@ void glut_display(){
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     // grab kinect if we're doing that
-    if (show_kinect){
-        uint32_t ts;
-        if (freenect_sync_get_depth((void**)&depth, &ts, 0, FREENECT_DEPTH_11BIT) < 0){
-            printf("Derp\n");
-            show_kinect = false;
-        } else {
-            if (freenect_sync_get_video((void**)&rgb, &ts, 0, FREENECT_VIDEO_RGB) < 0){
-                //show_kinect = false;
-                ;
-            } else {
-                rgb = (char *) malloc(sizeof(char) * 640*480*3);
-                int i,j;
-                int tot = 0;
-                for (i = 0; i < 480; i++) {
-                    for (j = 0; j < 640; j++) {
-                        xyz[i][j][0] = 2.*((float)j)/640.-1.0;
-                        xyz[i][j][1] = 2.*((float)i)/480.-1.0;
-                        if (depth[i*640+j] >= 2047)
-                            xyz[i][j][2] = 10000.0;
-                        else{
-                            tot++;
-                            xyz[i][j][2] = -1.0*((float)depth[i*640+j])/2048.;
-                        }
-                        indices[i][j] = i*640+j;
-                        //rgb[3*(i*640+j)] = 50;
-                        //rgb[3*(i*640+j)+1] = 50;
-                        //rgb[3*(i*640+j)+2] = 50;
-                    }
-                }
-                printf("tot %d\n", tot);
-            }
+    if (show_kinect && kinect_manager){
+        // merges whatever the device threads have lined up since last
+        //  pass; never waits
+        if (kinect_manager->update() && octree_builder && octree_builder->collecting() &&
+                get_time_ms() - octree_last_scan_ms > OCTREE_SCAN_INTERVAL_MS){
+            // already in world coordinates
+            const vector<float>& points = kinect_manager->points();
+            if (!points.empty())
+                octree_builder->add(&points[0], (int) points.size() / 3);
+            octree_last_scan_ms = get_time_ms();
         }
-        
+    } else if (show_kinect){
+        // whatever's arrived since last pass, if anything; never waits.
+        //  The frames share the device's buffers and go straight into
+        //  the point cloud's PBOs.
+        kinect_stream->poll();
+        Mat kinect_frame;
+        // video first, so the depth filter is guided by the newest
+        if (kinect_stream->get_video(kinect_frame)){
+            kinect_cloud->upload_rgb(kinect_frame.data);
+            kinect_rgb = kinect_frame;
+        }
+        // filtering happens on its own thread: a frame handed over here
+        //  comes back on some later pass, so with the filter on, what's
+        //  drawn is the newest it's finished
+        bool new_depth = kinect_stream->get_depth(kinect_frame);
+        if (new_depth && filter_kinect){
+            depth_filter->submit((const unsigned short *) kinect_frame.data,
+                kinect_rgb.empty() ? NULL : kinect_rgb.data);
+            new_depth = false;
+        }
+        if (filter_kinect && depth_filter->get(kinect_filtered)){
+            kinect_frame = kinect_filtered;
+            new_depth = true;
+        }
+        if (new_depth){
+            kinect_cloud->upload_depth((const unsigned short *) kinect_frame.data);
+            if (kinect_fusion)
+                kinect_fusion->submit_depth(kinect_frame);
+            if (octree_builder && octree_builder->collecting())
+                add_octree_scan(kinect_frame);
+        }
+    }
+    // a scan 'O' finished building: draw it from here on
+    if (octree_builder && !octree_builder->collecting() && !octree_builder->building()){
+        if (octree_builder->built() && point_octree->open(octree_file))
+            show_octree = true;
+        else
+            printf("Scan into %s didn't build; not drawing it\n", octree_file.c_str());
+        delete octree_builder;
+        octree_builder = NULL;
     }
+    if (show_octree)
+        point_octree->begin_frame();
     // and get player location -- roundabout in case I want to add something
     // useful here in the future...
     Eigen::Vector3f curr_translation(0.0, 0.0, 0.0);
@@ -349,8 +634,14 @@ void glut_display(){
 
     Vector3f curr_t_vec(curr_translation.x(), curr_translation.y(), curr_translation.z());
     Vector3f curr_r_vec(0.0f, curr_rotation.y()*M_PI/180.0, 0.0f);
+    // one grab per camera per display pass; eyes share the result
+    grab_camera_frames();
+    update_stereo_depth();
+    blink_probe->begin_frame();
     // Go do Rift rendering! not using eye offset
     rift_manager->render(curr_t_vec, curr_r_vec, render_core);
+    finish_frame_latency(rift_manager->last_end_frame_ms());
+    govern_filters();
 
     double curr = get_framerate();
     if (currFrameRate != 0.0f)
@@ -358,15 +649,52 @@ void glut_display(){
     else
         currFrameRate = curr;
 
-    char tmp[100];
-    sprintf(tmp, "FPS: %0.3f", currFrameRate);
+    char tmp[256];
+    int tmplen = sprintf(tmp, "FPS: %0.3f", currFrameRate);
+    if (apply_reichardt)
+        tmplen += sprintf(tmp+tmplen, " R: %0.1fms", reichardt_ms);
+    if (apply_features && feature_tracking)
+        tmplen += sprintf(tmp+tmplen, " %s: d %0.1f t %0.1fms",
+            feature_detector_name(feature_detector), feature_detect_ms, feature_track_ms);
+    else if (apply_features)
+        tmplen += sprintf(tmp+tmplen, " %s: %0.1fms",
+            feature_detector_name(feature_detector), feature_detect_ms);
+    if (stereo_mode != STEREO_OFF && stereo_depth->get_current_stats())
+        tmplen += sprintf(tmp+tmplen, " S: %0.1fms", stereo_depth->get_current_stats()->mean_ms);
+    Mjpeg_Decode_Source * decoder = dynamic_cast<Mjpeg_Decode_Source *>(
+        stereo_sync ? stereo_sync->source(0) : l_capture);
+    if (decoder)
+        tmplen += sprintf(tmp+tmplen, " D: %0.1fms", decoder->decode_ms());
+    if (stereo_sync){
+        stereo_sync_stats_t sync_stats = stereo_sync->get_stats();
+        tmplen += sprintf(tmp+tmplen, " Sk: %0.1fms", sync_stats.mean_skew_ms);
+    }
+    if (frame_governor->degradation() > 0)
+        tmplen += sprintf(tmp+tmplen, " G: %s", frame_governor->summary().c_str());
+    if (latency_tracker->total().count() > 0)
+        tmplen += sprintf(tmp+tmplen, " L: %0.0f/%0.0fms",
+            latency_tracker->total().percentile(50), latency_tracker->total().percentile(99));
     textbox_fps->set_text(string(tmp));
 
-    if (show_kinect)
-        sprintf(tmp, "K: ON");
-    else
-        sprintf(tmp, "K: OFF");
-    textbox_kinect->set_text(string(tmp));
+    string kinect_status;
+    if (kinect_manager)
+        kinect_status = kinect_manager->status();
+    else {
+        kinect_status = kinect_stream->status();
+        if (kinect_fusion)
+            kinect_status += " " + kinect_fusion->status();
+        else if (!kinect_cloud->status().empty())
+            kinect_status += " " + kinect_cloud->status();
+    }
+    if (octree_builder)
+        kinect_status += " " + octree_builder->status();
+    else if (show_octree && point_octree->is_open())
+        kinect_status += " " + point_octree->status();
+    if (filter_kinect && !kinect_manager){
+        sprintf(tmp, " Fl: %0.1fms", depth_filter->filter_ms());
+        kinect_status += tmp;
+    }
+    textbox_kinect->set_text(kinect_status);
 
     //output useful framerate and status info:
     // printf ("framerate: %3.1f / %4.1f\n", curr, currFrameRate);
@@ -386,116 +714,69 @@ void render_core(){
     glDisable(GL_LIGHTING);
     glEnable(GL_DEPTH_TEST);
 
-    //capture webcam frame
-    IplImage* frame_ipl = NULL;
-    get_elapsed(GET_ELAPSED_PERF);
-    if (draw_main_image){
-        if (rift_manager->which_eye()=='r')
-            frame_ipl = cvRetrieveFrame( r_capture );
-        else
-            frame_ipl = cvRetrieveFrame( l_capture );
+    // look up (and if stale, refresh) the processed frame for the
+    // camera this eye is showing
+    int cam_num = (rift_manager->which_eye()=='r') ? r_capture_num : l_capture_num;
+    camera_cache_t * cache = get_camera_cache(cam_num);
+    filter_config_t config = current_filter_config();
+    if (!cache->processed_valid || cache->processed_seq != cache->grab_seq ||
+            cache->processed_config != config){
+        double start = get_time_ms();
+        process_camera_frame(cam_num, config, cache);
+        frame_work_ms += get_time_ms() - start;
+    }
+    update_passthrough_warp(cache);
+
+    // calibration's camera 0 is the left one
+    Remap_Texture * remap = NULL;
+    if (rectify_cameras && stereo_calib->is_calibrated() && cache->has_output){
+        remap = eye_remap[rift_manager->which_eye() == 'r' ? 1 : 0];
+        if (!remap->update(stereo_calib, rift_manager->which_eye() == 'r' ? 1 : 0,
+                           cv::Size(cache->output_width, cache->output_height)))
+            remap = NULL;
     }
-    printf("Took %d\n", get_elapsed(GET_ELAPSED_PERF));
-    // I suspect that frame_ipl should be freed but 
-    //  the leak is small enough not to matter if it exists at all.
-    //  %TODO
-    if ( !frame_ipl ) {
-        printf( "ERROR: frame is null...\n" );
-    } else {
-        Mat frame(frame_ipl);
-        vector<KeyPoint> keypoints;
-        vector<vector<Point> > contours;
-        vector<Vec4i> hierarchy;
-        Mat gray = Mat(frame.size(),IPL_DEPTH_8U,1);
-        Mat gray2 = Mat(frame.size(),IPL_DEPTH_8U,1);
-        if (apply_features){
-            StarFeatureDetector detector;
-            detector.detect(frame, keypoints);
-        }
-
-        if (black_and_white || apply_threshold || apply_sobel || apply_canny_contours){
-            cvtColor(frame, gray, CV_BGR2GRAY);
-        }
-
-        if (apply_canny_contours){
-            Mat canny_output;
-            /// Detect edges using canny
-            Canny( gray, canny_output, canny_thresh, canny_thresh*2, 3 );
-            /// Find contours
-            findContours( canny_output, contours, hierarchy, 
-                CV_RETR_TREE, CV_CHAIN_APPROX_SIMPLE, Point(0, 0) );
-        }
-        if (apply_threshold){
-            threshold( gray, gray2, threshold_val, 255, THRESH_BINARY );
-        } else if (apply_sobel){
-            Mat grad_x, grad_y;
-            Mat abs_grad_x, abs_grad_y;
-            // blur first
-            GaussianBlur( gray, gray, cv::Size(3,3), 0, 0, BORDER_DEFAULT );
-            // Gradient X
-            Sobel( gray, grad_x, CV_16S, 1, 0, 3, 1, 0, BORDER_DEFAULT );
-            convertScaleAbs( grad_x, abs_grad_x );
-            // Gradient Y
-            Sobel( gray, grad_y, CV_16S, 0, 1, 3, 1, 0, BORDER_DEFAULT );
-            convertScaleAbs( grad_y, abs_grad_y );
-            addWeighted( abs_grad_x, 0.5, abs_grad_y, 0.5, 0, gray2 );
-        }
 
-        // if not drawing main image, then clear it out.
-        if (!draw_main_image)
-            frame = Mat(frame.size(), frame.type());
-
-        if (apply_threshold)
-            cvtColor(gray2, frame, CV_GRAY2BGR);
-        else if (black_and_white)
-            cvtColor(gray, frame, CV_GRAY2BGR);
-        else if (apply_sobel){
-            Mat tmpgray;
-            cvtColor(gray2, tmpgray, CV_GRAY2BGR);
-            addWeighted( tmpgray, 0.5, frame, 0.5, 0, frame );
-        }
+    if (cache->has_output && cache->output_yuv){
+        cache->yuv->begin(remap);
+        draw_passthrough_quad(0, GL_REPLACE);
+        cache->yuv->end();
+    } else if (cache->has_output && cache->output_stream){
+        draw_camera_quad(cache->stream->texture(), GL_DECAL, remap);
+    } else if (cache->has_output){
+        // decal is undefined for luminance textures
+        draw_camera_quad(cache->texture, cache->output_luma ? GL_REPLACE : GL_DECAL, remap);
+    }
 
-        if (apply_reichardt){
-            // calculate optic flow across image using reichardt detector
-            // framework
-            
-        }
+    // motion magnitude goes on top, additively, tinted green
+    if (cache->has_overlay){
+        glDisable(GL_DEPTH_TEST);
+        glBlendFunc(GL_ONE, GL_ONE);
+        glColor4f(0.3f, 1.0f, 0.4f, 1.0f);
+        draw_camera_quad(cache->overlay_texture, GL_MODULATE, remap);
+        glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glEnable(GL_DEPTH_TEST);
+    }
 
-        if (apply_features)
-            // Add results to image and save.
-            cv::drawKeypoints(frame, keypoints, frame);
-        if (apply_canny_contours){
-            /// Draw contours
-            for( int i = 0; i< contours.size(); i++ ){
-                Scalar color = Scalar( rng.uniform(0, 255), rng.uniform(0,255), rng.uniform(0,255) );
-                drawContours( frame, contours, i, color, 2, 8, hierarchy, 0, Point() );
-            }
-        }
+    draw_stereo_depth();
 
-        if (draw_main_image || apply_features || apply_canny_contours ||
-                apply_sobel || apply_threshold || black_and_white ) {
-            ConvertMatToTexture(&frame, ipl_convert_texture);
-            glEnable(GL_TEXTURE_2D);
-            glBindTexture(GL_TEXTURE_2D, ipl_convert_texture);
-            glPushMatrix();
-            glLoadIdentity();
-            glTranslatef(0.0, 0.0, -1.0*render_dist);
-            glBegin(GL_POLYGON);
-            glTexCoord2f(0, 0);
-            glVertex3f(-1, 1, 0);
-            
-            glTexCoord2f(0, 1);
-            glVertex3f(-1, -1, 0);
-            
-            glTexCoord2f(1, 1);
-            glVertex3f(1, -1, 0);
-            
-            glTexCoord2f(1, 0);
-            glVertex3f(1, 1, 0);
-            glEnd();
-            glDisable(GL_TEXTURE_2D);
-            glPopMatrix();
-        }
+    // latency probe's patch goes over everything, flat white or black
+    if (blink_probe->active()){
+        glDisable(GL_DEPTH_TEST);
+        float level = blink_probe->lit() ? 1.0f : 0.0f;
+        glColor4f(level, level, level, 1.0f);
+        glPushMatrix();
+        glLoadIdentity();
+        glTranslatef(0.0, 0.0, -1.0*render_dist);
+        glBegin(GL_POLYGON);
+        glVertex3f(-0.5, 0.5, 0);
+        glVertex3f(-0.5, -0.5, 0);
+        glVertex3f(0.5, -0.5, 0);
+        glVertex3f(0.5, 0.5, 0);
+        glEnd();
+        glPopMatrix();
+        glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+        glEnable(GL_DEPTH_TEST);
     }
 
     // and textboxs
@@ -509,47 +790,1034 @@ void render_core(){
     }
 
     // and kinect if we're doing it
-    if (show_kinect){
-        printf("here\n");
+    kinect_state_t kinect_state = kinect_stream->state();
+    if (show_kinect && kinect_manager){
+        glDisable(GL_LIGHTING);
+        kinect_manager->draw(2.0f);
+    } else if (show_kinect && (kinect_state == KINECT_STREAMING || kinect_state == KINECT_STALLED)){
         glDisable(GL_LIGHTING);
+        if (kinect_fusion)
+            kinect_fusion->draw();
+        else
+            kinect_cloud->draw(2.0f);
+    }
 
-        glPushMatrix();
-        glTranslatef(0,0,-0.5);
+    // and the accumulated scan, streamed from disk
+    if (show_octree && point_octree->is_open()){
+        glDisable(GL_LIGHTING);
+        point_octree->draw(2.0f);
+    }
+}
 
-        // Set the projection from the XYZ to the texture image
-        glMatrixMode(GL_TEXTURE);
-        glPushMatrix();
-        glLoadIdentity();
-        glScalef(1.0f,1.0f,1.0f);
-        //LoadRGBMatrix();
-        //LoadVertexMatrix();
-        glMatrixMode(GL_MODELVIEW);
+/* #########################################################################
+    
+                              camera frame cache
+        Frames are grabbed once per display pass per distinct camera,
+        then filtered and uploaded at most once per (camera, frame,
+        filter config). Both eyes looking at the same camera -- or a
+        camera that hasn't produced a new frame -- reuse the texture.
 
-        glPointSize(1);
+   ######################################################################### */
+filter_config_t current_filter_config(){
+    filter_config_t config;
+    config.draw_main_image = draw_main_image;
+    config.black_and_white = black_and_white;
+    config.apply_threshold = apply_threshold;
+    config.apply_sobel = apply_sobel;
+    config.apply_canny_contours = apply_canny_contours;
+    config.apply_features = apply_features;
+    config.apply_reichardt = apply_reichardt;
+    config.threshold_val = threshold_val;
+    config.canny_thresh = canny_thresh;
+    config.feature_detector = feature_detector;
+    config.feature_tracking = feature_tracking;
+    return config;
+}
 
-        glEnableClientState(GL_VERTEX_ARRAY);
-        glVertexPointer(3, GL_FLOAT, 0, xyz);
-        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-        glTexCoordPointer(3, GL_FLOAT, 0, xyz);
+camera_cache_t * get_camera_cache(int cam_num){
+    map<int, camera_cache_t>::iterator it = camera_caches.find(cam_num);
+    if (it != camera_caches.end())
+        return &(it->second);
+    camera_cache_t cache;
+    cache.grab_seq = 0;
+    cache.processed_seq = 0;
+    cache.processed_config = current_filter_config();
+    cache.processed_valid = false;
+    cache.has_output = false;
+    cache.output_width = cache.output_height = 0;
+    glGenTextures(1, &cache.texture);
+    cache.output_luma = false;
+    cache.output_yuv = false;
+    cache.yuv = new Yuv_Frame_Texture();
+    cache.output_stream = false;
+    cache.stream = new Stream_Texture();
+    cache.reichardt = NULL;
+    cache.tracker = NULL;
+    cache.filter_memory = NULL;
+    cache.has_overlay = false;
+    glGenTextures(1, &cache.overlay_texture);
+    memset(&cache.latency, 0, sizeof(cache.latency));
+    cache.latency_pending = false;
+    cache.capture_orientation = orientation_identity();
+    cache.has_capture_orientation = false;
+    camera_caches[cam_num] = cache;
+    return &camera_caches[cam_num];
+}
 
-        glEnable(GL_TEXTURE_2D);
-        glBindTexture(GL_TEXTURE_2D, gl_rgb_tex);
-        glTexImage2D(GL_TEXTURE_2D, 0, 3, 640, 480, 0, GL_RGB, GL_UNSIGNED_BYTE, rgb);
+// which capture handle currently serves a camera number; if both eyes
+// are on the same camera the left handle is the one that gets grabbed
+Capture_Source * capture_for_num(int cam_num){
+    if (cam_num == l_capture_num)
+        return l_capture;
+    return r_capture;
+}
 
-        glPointSize(2.0f);
-        glDrawElements(GL_POINTS, 640*480, GL_UNSIGNED_INT, indices);
-        glDisable(GL_TEXTURE_2D);
+// with a replay loaded, camera numbers pick its streams instead
+Capture_Source * open_capture(int cam_num){
+    if (replay){
+        int stream = cam_num % replay->num_streams();
+        Capture_Source * source = new Replay_Capture_Source(replay, stream, replay_realtime);
+        // a -record_mjpeg recording's jpegs get decoded off the render
+        //  thread, one thread a stream, as a camera's would
+        if (replay->stream_encoding(stream) == REC_ENCODING_MJPEG)
+            return new Mjpeg_Decode_Source(source, decode_scale);
+        return source;
+    }
+    if (mjpeg_width > 0){
+        if (decode_scale > 1)
+            printf("-decode_scale only applies to replays; camera %d decodes at full size\n",
+                cam_num);
+        return new Cv_Capture_Source(cam_num, mjpeg_width, mjpeg_height, 30, exposure_num, true);
+    }
+    return new Cv_Capture_Source(cam_num, 640, 480, 30, exposure_num);
+}
+
+// runs on the pool's thread
+Capture_Source * pool_open_capture(void * arg, int cam_num){
+    return open_capture(cam_num);
+}
+
+static void stop_stereo_sync(){
+    if (!stereo_sync)
+        return;
+    stereo_sync_stats_t st = stereo_sync->get_stats();
+    printf("Stereo sync: %lu pairs, skew mean %0.1fms max %0.1fms, dropped %lu/%lu, "
+           "%lu stale, %lu held\n", st.pairs, st.mean_skew_ms, st.max_skew_ms,
+           st.dropped[0], st.dropped[1], st.stale, st.held);
+    // l_capture / r_capture are its views; the sources stay ours
+    delete stereo_sync;
+    stereo_sync = NULL;
+}
+
+void close_cameras(){
+    stop_stereo_sync();
+    if (l_source)
+        camera_pool->release(l_capture_num);
+    if (r_source)
+        camera_pool->release(r_capture_num);
+    l_source = r_source = NULL;
+    l_capture = r_capture = NULL;
+}
+
+// whether the pair we're showing already holds cam_num
+static bool have_camera(int cam_num){
+    return (cam_num == l_capture_num && l_source) || (cam_num == r_capture_num && r_source);
+}
+
+// cam_num for the pair being set up: the handle the current pair has,
+//  or the pool's
+static Capture_Source * take_camera(int cam_num){
+    Capture_Source * ret;
+    if (cam_num == l_capture_num && l_source){
+        ret = l_source;
+        l_source = NULL;
+    } else if (cam_num == r_capture_num && r_source){
+        ret = r_source;
+        r_source = NULL;
+    } else if (camera_pool->state(cam_num) == CAMERA_READY){
+        ret = camera_pool->acquire(cam_num);
+    } else {
+        // didn't open; this eye goes without
+        ret = NULL;
+    }
+    return ret;
+}
+
+void want_cameras(int l_num, int r_num){
+    // stop holding open whatever we were waiting on before
+    if (want_l_capture_num != l_num && want_l_capture_num != r_num &&
+            !have_camera(want_l_capture_num))
+        camera_pool->cancel(want_l_capture_num);
+    if (want_r_capture_num != l_num && want_r_capture_num != r_num &&
+            !have_camera(want_r_capture_num))
+        camera_pool->cancel(want_r_capture_num);
+    want_l_capture_num = l_num;
+    want_r_capture_num = r_num;
+    camera_pool->request(l_num);
+    camera_pool->request(r_num);
+    cameras_current = false;
+}
+
+bool open_cameras(){
+    int * want[2] = {&want_l_capture_num, &want_r_capture_num};
+    int current[2] = {l_capture_num, r_capture_num};
+    bool waiting = false;
+    for (int i = 0; i < 2; i++){
+        int cam_num = *want[i];
+        if (have_camera(cam_num))
+            continue;
+        camera_state_t state = camera_pool->state(cam_num);
+        if (state == CAMERA_FAILED){
+            // keep what this eye had, if it had anything
+            if (cam_num != current[i] && have_camera(current[i])){
+                printf("Camera %d didn't open; staying on %d\n", cam_num, current[i]);
+                *want[i] = current[i];
+            } else {
+                printf("Camera %d didn't open\n", cam_num);
+            }
+        } else if (state != CAMERA_READY){
+            waiting = true;
+        }
+    }
+    if (waiting)
+        return false;
+    if (want_l_capture_num == l_capture_num && want_r_capture_num == r_capture_num &&
+            (l_source || r_source))
+        return true;
+
+    stop_stereo_sync();
+    Capture_Source * left = take_camera(want_l_capture_num);
+    Capture_Source * right = want_r_capture_num != want_l_capture_num ?
+        take_camera(want_r_capture_num) : NULL;
+    // whatever the old pair had that the new one doesn't goes back
+    if (l_source)
+        camera_pool->release(l_capture_num);
+    if (r_source)
+        camera_pool->release(r_capture_num);
+    l_source = left;
+    r_source = right;
+    l_capture_num = want_l_capture_num;
+    r_capture_num = want_r_capture_num;
+
+    // fast replay hands out a frame per display pass, so there's
+    //  nothing to pair by time
+    if (sync_cameras && left && right && !(replay && !replay_realtime)){
+        stereo_sync = new Stereo_Synchronizer(left, right, sync_skew_ms, 4, false);
+        l_capture = stereo_sync->stream(0);
+        r_capture = stereo_sync->stream(1);
+    } else {
+        l_capture = left;
+        r_capture = right ? right : left;
+    }
+    // no right camera: both eyes show the left, so say so, or the
+    //  right eye's cache and stereo pairing go looking for a camera
+    //  that isn't there
+    if (!right)
+        want_r_capture_num = r_capture_num = l_capture_num;
+    printf("Cameras %d / %d\n", l_capture_num, r_capture_num);
+    return true;
+}
+
+// hands the frame just grabbed to the recorder, as stream 0 (left) or
+//  1 (right)
+static void record_frame(int stream, Capture_Source * capture){
+    Mat frame;
+    if (recorder && capture->retrieve(frame))
+        recorder->write_frame(stream, frame, capture->timestamp_ms());
+}
+
+// a new frame for the cache: stamps from the last one are dropped,
+//  shown or not
+static void frame_grabbed(camera_cache_t * cache, Capture_Source * capture){
+    cache->grab_seq++;
+    memset(&cache->latency, 0, sizeof(cache->latency));
+    cache->latency_pending = false;
+    double now = get_time_ms();
+    cache->latency.stamp_ms[LATENCY_STAGE_GRAB] = now;
+    // replays stamp in recorded time, not ours; only trust capture
+    //  stamps that could be from this clock
+    double captured = capture->timestamp_ms();
+    if (captured > 0.0 && captured <= now && now - captured < 5000.0)
+        cache->latency.stamp_ms[LATENCY_STAGE_CAPTURE] = captured;
+    else
+        captured = now;
+    cache->has_capture_orientation = rift_manager->head_orientation_at(captured,
+        cache->capture_orientation);
+}
+
+// the frame's in its texture; the first upload of a grab is the one
+//  that counts
+static void frame_uploaded(camera_cache_t * cache){
+    if (cache->latency.stamp_ms[LATENCY_STAGE_UPLOAD] > 0.0)
+        return;
+    cache->latency.stamp_ms[LATENCY_STAGE_UPLOAD] = get_time_ms();
+    cache->latency_pending = true;
+}
+
+void grab_camera_frames(){
+    if (!cameras_current)
+        cameras_current = open_cameras();
+    // moves both views on together, or not at all
+    if (stereo_sync)
+        stereo_sync->next_pair();
+    if (l_capture && l_capture->grab()){
+        frame_grabbed(get_camera_cache(l_capture_num), l_capture);
+        record_frame(0, l_capture);
+    }
+    if (r_capture_num != l_capture_num && r_capture && r_capture->grab()){
+        frame_grabbed(get_camera_cache(r_capture_num), r_capture);
+        record_frame(1, r_capture);
+    }
+}
+
+// EndFrame has returned with this pass's eyes in it: every frame
+//  uploaded since is on the display
+void finish_frame_latency(double end_frame_ms){
+    for (map<int, camera_cache_t>::iterator it = camera_caches.begin();
+            it != camera_caches.end(); it++){
+        camera_cache_t& cache = it->second;
+        if (!cache.latency_pending)
+            continue;
+        cache.latency.stamp_ms[LATENCY_STAGE_END_FRAME] = end_frame_ms;
+        latency_tracker->add_frame(cache.latency);
+        cache.latency_pending = false;
+    }
+    blink_probe->frame_shown(end_frame_ms);
+}
+
+// The Y of a YUYV frame, stretched from video range (16-235) to full
+//  so it thresholds the same as gray from BGR does
+static bool luma_from_raw(const raw_frame_t& raw, Mat& luma){
+    if (raw.format != PIXEL_FORMAT_YUYV)
+        return false;
+    Mat yuyv(raw.height, raw.width, CV_8UC2, (void *) raw.data, raw.stride);
+    Mat y;
+    cvtColor(yuyv, y, CV_YUV2GRAY_YUYV);
+    y.convertTo(luma, CV_8U, 255.0 / 219.0, -16.0 * 255.0 / 219.0);
+    return true;
+}
+
+void process_camera_frame(int cam_num, filter_config_t& config, camera_cache_t * cache){
+    cache->processed_seq = cache->grab_seq;
+    cache->processed_config = config;
+    cache->processed_valid = true;
+    cache->has_output = false;
+    cache->output_luma = false;
+    cache->output_yuv = false;
+    cache->output_stream = false;
+    cache->has_overlay = false;
+    // motion detector state goes stale while it's off; re-prime later
+    if (!config.apply_reichardt && cache->reichardt)
+        cache->reichardt->reset();
+    bool tracking = config.apply_features && config.feature_tracking;
+    if (!tracking && cache->tracker)
+        cache->tracker->reset();
+
+    if (!(config.draw_main_image || config.apply_features || config.apply_canny_contours ||
+            config.apply_sobel || config.apply_threshold || config.black_and_white ||
+            config.apply_reichardt))
+        return;
+
+    Capture_Source * capture = capture_for_num(cam_num);
+    if (!capture){
+        printf( "ERROR: frame is null...\n" );
+        return;
+    }
+    bool drawing_filters = config.black_and_white || config.apply_threshold ||
+        config.apply_sobel || config.apply_canny_contours || config.apply_features;
+
+    // Sources that hand out YUYV (-record_yuyv replays) can mostly skip
+    //  BGR: the plain image goes to the GPU as is, and the gray filters
+    //  only want luma.
+    raw_frame_t raw;
+    bool have_yuv = capture->retrieve_raw(raw) && raw.format == PIXEL_FORMAT_YUYV;
+    Mat luma;
+    if (have_yuv && (drawing_filters || config.apply_reichardt))
+        luma_from_raw(raw, luma);
+
+    // gray for the stateful detectors, which see the raw image before
+    //  any filter draws on it, each grabbed frame exactly once
+    bool probing = blink_probe->active() && cam_num == l_capture_num;
+    Mat gray;
+    if (config.apply_reichardt || tracking || probing){
+        gray = luma;
+        if (gray.empty()){
+            Mat source;
+            if (capture->retrieve(source))
+                cvtColor(source, gray, CV_BGR2GRAY);
+        }
+    }
+
+    if (probing)
+        blink_probe->observe(gray);
+
+    if (config.apply_reichardt && !gray.empty()){
+        // calculate optic flow across image using reichardt detector
+        // framework.
+        if (!cache->reichardt)
+            cache->reichardt = new Reichardt_Array();
+        cache->reichardt->update(gray, cache->grab_seq);
+        reichardt_ms = cache->reichardt->last_update_ms();
+        if (cache->reichardt->has_output()){
+            ConvertMatToTexture(&cache->reichardt->get_magnitude(), cache->overlay_texture);
+            cache->has_overlay = true;
+        }
+    }
+
+    const vector<KeyPoint> * tracked = NULL;
+    if (tracking && !gray.empty()){
+        if (!cache->tracker)
+            cache->tracker = new Feature_Tracker((feature_detector_t) config.feature_detector);
+        cache->tracker->set_detector((feature_detector_t) config.feature_detector);
+        cache->tracker->update(gray, cache->grab_seq);
+        feature_detect_ms = cache->tracker->last_detect_ms();
+        feature_track_ms = cache->tracker->last_track_ms();
+        tracked = &cache->tracker->get_keypoints();
+    }
+
+    if (have_yuv && config.draw_main_image && !drawing_filters){
+        cache->yuv->upload(raw);
+        frame_uploaded(cache);
+        cache->output_width = raw.width;
+        cache->output_height = raw.height;
+        cache->output_yuv = true;
+        cache->has_output = true;
+        return;
+    }
+    if (have_yuv && !config.apply_features && !config.apply_canny_contours &&
+            (config.apply_threshold || config.black_and_white)){
+        // whole output is gray; same result apply_filters would give
+        Mat out;
+        if (config.apply_threshold)
+            threshold(luma, out, config.threshold_val, 255, THRESH_BINARY);
+        else if (config.apply_sobel)
+            GaussianBlur(luma, out, cv::Size(3,3), 0, 0, BORDER_DEFAULT);
+        else
+            out = luma;
+        cache->latency.stamp_ms[LATENCY_STAGE_FILTER] = get_time_ms();
+        ConvertMatToTexture(&out, cache->texture);
+        frame_uploaded(cache);
+        cache->output_width = out.cols;
+        cache->output_height = out.rows;
+        cache->output_luma = true;
+        cache->has_output = true;
+        return;
+    }
+    //retrieve the frame grabbed this pass
+    Mat source;
+    if ( !capture->retrieve(source) ) {
+        printf( "ERROR: frame is null...\n" );
+        return;
+    }
+
+    if (config.draw_main_image && !drawing_filters && source.type() == CV_8UC3){
+        // nothing to draw on it: straight into the streaming texture
+        cache->stream->upload(source.data, source.cols, source.rows, (int) source.step, GL_BGR);
+        frame_uploaded(cache);
+        cache->output_width = source.cols;
+        cache->output_height = source.rows;
+        cache->output_stream = true;
+        cache->has_output = true;
+        return;
+    }
+
+    // source belongs to the capture (or is a read-only replay mapping);
+    //  only pay for a copy if a filter is going to draw on it
+    Mat frame;
+    if (config.draw_main_image && drawing_filters)
+        source.copyTo(frame);
+    else
+        frame = source;
+    filter_plan_t plan;
+    governed_plan(cache->grab_seq, plan);
+    if (!cache->filter_memory){
+        cache->filter_memory = new filter_memory_t();
+        cache->filter_memory->has_contours = false;
+        cache->filter_memory->has_keypoints = false;
+    }
+    filter_timing_t timing;
+    apply_filters(frame, config, rng, &timing, luma.empty() ? NULL : &luma, tracked,
+                  &plan, cache->filter_memory);
+    if (config.apply_features && !tracked)
+        feature_detect_ms = timing.stage_ms[FILTER_STAGE_FEATURES];
+    // what the governed stages cost, when they actually ran
+    if (config.apply_canny_contours && plan.enabled[GOVERNED_CANNY] && plan.run[GOVERNED_CANNY])
+        frame_governor->report(GOVERNED_CANNY, timing.stage_ms[FILTER_STAGE_CANNY]);
+    if (config.apply_features && !tracked && plan.enabled[GOVERNED_FEATURES] &&
+            plan.run[GOVERNED_FEATURES])
+        frame_governor->report(GOVERNED_FEATURES, timing.stage_ms[FILTER_STAGE_FEATURES]);
+    if (config.apply_sobel && !config.apply_threshold && plan.enabled[GOVERNED_SOBEL] &&
+            plan.run[GOVERNED_SOBEL])
+        frame_governor->report(GOVERNED_SOBEL, timing.stage_ms[FILTER_STAGE_THRESHOLD_SOBEL]);
+    cache->latency.stamp_ms[LATENCY_STAGE_FILTER] = get_time_ms();
+    ConvertMatToTexture(&frame, cache->texture);
+    frame_uploaded(cache);
+    cache->output_width = frame.cols;
+    cache->output_height = frame.rows;
+    cache->has_output = true;
+}
+
+/* #########################################################################
+    
+                                 kinect scan
+        With one Kinect and fusion on, the scan takes the frames fusion
+        tracked, each through its own pose, so a scan walked round the
+        room lines up; frames it couldn't track are left out, as they
+        have no pose to put them anywhere. Without fusion, frames are
+        in the Kinect's own frame. Every other pixel each way is
+        plenty, as frames overlap heavily.
+
+   ######################################################################### */
+void add_octree_scan(const Mat& depth){
+    if (get_time_ms() - octree_last_scan_ms < OCTREE_SCAN_INTERVAL_MS)
+        return;
+    Eigen::Matrix4f pose = Eigen::Matrix4f::Identity();
+    const Mat * scan = &depth;
+    if (kinect_fusion){
+        // nothing newly tracked yet: try again next frame
+        if (!kinect_fusion->tracked_frame(octree_depth, pose, octree_fusion_seq))
+            return;
+        scan = &octree_depth;
+    }
+    octree_last_scan_ms = get_time_ms();
+    if (!octree_to_xyz)
+        octree_to_xyz = new Depth_To_Xyz();
+    octree_to_xyz->convert((const unsigned short *) scan->data, octree_xyz);
+    octree_points.clear();
+    for (int v = 0; v < octree_xyz.z.rows; v += 2){
+        const float * xs = octree_xyz.x.ptr<float>(v);
+        const float * ys = octree_xyz.y.ptr<float>(v);
+        const float * zs = octree_xyz.z.ptr<float>(v);
+        for (int u = 0; u < octree_xyz.z.cols; u += 2){
+            if (zs[u] == 0.0f)
+                continue;
+            Eigen::Vector4f p = pose * Eigen::Vector4f(xs[u], ys[u], zs[u], 1.0f);
+            octree_points.push_back(p.x());
+            octree_points.push_back(p.y());
+            octree_points.push_back(p.z());
+        }
+    }
+    if (!octree_points.empty())
+        octree_builder->add(&octree_points[0], (int) octree_points.size() / 3);
+}
+
+/* #########################################################################
+    
+                               frame governor
+        Camera processing gets filter_budget_ms a display pass. The
+        governor sees what it actually took and what each expensive
+        filter cost, and picks how they run next time.
+
+   ######################################################################### */
+void govern_filters(){
+    filter_config_t config = current_filter_config();
+    // tracked features are already cheap, and not the detector's doing
+    frame_governor->set_wanted(GOVERNED_CANNY, config.apply_canny_contours);
+    frame_governor->set_wanted(GOVERNED_FEATURES,
+        config.apply_features && !config.feature_tracking);
+    frame_governor->set_wanted(GOVERNED_SOBEL, config.apply_sobel && !config.apply_threshold);
+    frame_governor->end_frame(frame_work_ms);
+    frame_work_ms = 0.0;
+}
+
+void governed_plan(unsigned long seq, filter_plan_t& plan){
+    for (int i = 0; i < NUM_GOVERNED_FILTERS; i++){
+        plan.downscale[i] = frame_governor->downscale(i);
+        plan.run[i] = frame_governor->should_run(i, seq);
+        plan.enabled[i] = frame_governor->level(i) != GOVERNOR_OFF;
+    }
+}
 
-        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+/* #########################################################################
+    
+                              stereo depth
+        Disparity between the two cameras' frames of this display pass,
+        drawn as a point cloud or as a false-color depth overlay.
+
+   ######################################################################### */
+void update_stereo_depth(){
+    if (stereo_mode == STEREO_OFF || l_capture_num == r_capture_num ||
+            !l_capture || !r_capture)
+        return;
+    unsigned long l_seq = get_camera_cache(l_capture_num)->grab_seq;
+    unsigned long r_seq = get_camera_cache(r_capture_num)->grab_seq;
+    if (l_seq == stereo_seq[0] && r_seq == stereo_seq[1])
+        return;
+
+    Mat left, right;
+    if (!l_capture->retrieve(left) || !r_capture->retrieve(right))
+        return;
+    stereo_seq[0] = l_seq;
+    stereo_seq[1] = r_seq;
+    stereo_depth->compute(left, right);
+    stereo_has_output = true;
+
+    if (stereo_mode == STEREO_DEPTH_MAP){
+        Mat colored;
+        stereo_depth->get_depth_colored(colored);
+        ConvertMatToTexture(&colored, stereo_depth_texture);
+    }
+
+    stereo_computes++;
+    if (stereo_computes % 300 == 0)
+        printf("Stereo depth:\n%s", stereo_depth->get_stats_string().c_str());
+}
+
+void draw_stereo_depth(){
+    if (stereo_mode == STEREO_OFF || !stereo_has_output)
+        return;
+
+    if (stereo_mode == STEREO_DEPTH_MAP){
+        glDisable(GL_DEPTH_TEST);
+        glColor4f(1.0f, 1.0f, 1.0f, 0.6f);
+        draw_passthrough_quad(stereo_depth_texture, GL_MODULATE);
+        glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+        glEnable(GL_DEPTH_TEST);
+    } else if (stereo_mode == STEREO_POINT_CLOUD && stereo_depth->num_points() > 0){
+        // cloud is in the left camera's frame (x right, y down, z
+        //  forward); head-locked like the passthrough quad, but offset
+        //  per eye so it actually reads as 3D
+        ovrVector3f adj = rift_manager->which_eye_view_adjust();
+        glPushMatrix();
+        glLoadIdentity();
+        glTranslatef(adj.x, adj.y, adj.z);
+        glScalef(1.0f, -1.0f, -1.0f);
+
+        glPointSize(2.0f);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_COLOR_ARRAY);
+        glVertexPointer(3, GL_FLOAT, 0, stereo_depth->get_points());
+        glColorPointer(3, GL_UNSIGNED_BYTE, 0, stereo_depth->get_colors());
+        glDrawArrays(GL_POINTS, 0, stereo_depth->num_points());
+        glDisableClientState(GL_COLOR_ARRAY);
         glDisableClientState(GL_VERTEX_ARRAY);
+        glPointSize(1.0f);
 
-        glMatrixMode(GL_TEXTURE);
-        glPopMatrix();
-        glMatrixMode(GL_MODELVIEW);
         glPopMatrix();
     }
 }
 
+// charges the time since stage_start to a stage, and starts the next
+static void filter_stage_done(filter_timing_t * timing, int stage, double& stage_start){
+    if (!timing)
+        return;
+    double now = get_time_ms();
+    timing->stage_ms[stage] += now - stage_start;
+    stage_start = now;
+}
+
+/* #########################################################################
+    
+                                apply_filters
+        Runs the configured filter chain over a BGR frame, in place.
+        Contour colors come from color_rng, so concurrent callers each
+        bring their own. If timing is given, per-stage ms go in it;
+        if luma is, it stands in for converting frame to gray, and if
+        tracked keypoints are, they're drawn in place of detecting.
+        A plan (from the frame governor) can shrink, skip or switch
+        off canny, features and sobel; skipped ones reuse what's in
+        memory from the last frame they ran.
+
+   ######################################################################### */
+// image shrunk for a governed stage; just in if it isn't
+static Mat governed_input(const Mat& in, const filter_plan_t * plan, int stage){
+    if (!plan || plan->downscale[stage] <= 1)
+        return in;
+    Mat small;
+    double f = 1.0 / plan->downscale[stage];
+    resize(in, small, cv::Size(), f, f, INTER_AREA);
+    return small;
+}
+
+void apply_filters(Mat& frame, filter_config_t& config, RNG& color_rng,
+                   filter_timing_t * timing, const Mat * luma,
+                   const vector<KeyPoint> * tracked,
+                   const filter_plan_t * plan, filter_memory_t * memory){
+    vector<KeyPoint> keypoints;
+    vector<vector<Point> > contours;
+    vector<Vec4i> hierarchy;
+    Mat gray = Mat(frame.size(),IPL_DEPTH_8U,1);
+    Mat gray2 = Mat(frame.size(),IPL_DEPTH_8U,1);
+    double stage_start = timing ? get_time_ms() : 0;
+    if (timing)
+        memset(timing, 0, sizeof(filter_timing_t));
+    // no plan: everything, full size, every frame
+    bool apply_features = config.apply_features &&
+        (!plan || plan->enabled[GOVERNED_FEATURES]);
+    bool apply_canny = config.apply_canny_contours &&
+        (!plan || plan->enabled[GOVERNED_CANNY]);
+    bool apply_sobel = config.apply_sobel && !config.apply_threshold &&
+        (!plan || plan->enabled[GOVERNED_SOBEL]);
+
+    if (apply_features){
+        if (tracked){
+            keypoints = *tracked;
+        } else if (plan && !plan->run[GOVERNED_FEATURES] && memory && memory->has_keypoints){
+            keypoints = memory->keypoints;
+        } else {
+            detect_features((feature_detector_t) config.feature_detector,
+                governed_input(frame, plan, GOVERNED_FEATURES), keypoints);
+            int scale = plan ? plan->downscale[GOVERNED_FEATURES] : 1;
+            for (size_t i = 0; scale > 1 && i < keypoints.size(); i++){
+                keypoints[i].pt *= (float) scale;
+                keypoints[i].size *= scale;
+            }
+            if (memory){
+                memory->keypoints = keypoints;
+                memory->has_keypoints = true;
+            }
+        }
+    }
+    filter_stage_done(timing, FILTER_STAGE_FEATURES, stage_start);
+
+    if (config.black_and_white || config.apply_threshold || apply_sobel || apply_canny){
+        // copied, not shared: the sobel blur works on gray in place
+        if (luma)
+            luma->copyTo(gray);
+        else
+            cvtColor(frame, gray, CV_BGR2GRAY);
+    }
+    filter_stage_done(timing, FILTER_STAGE_GRAY, stage_start);
+
+    if (apply_canny){
+        if (plan && !plan->run[GOVERNED_CANNY] && memory && memory->has_contours){
+            contours = memory->contours;
+            hierarchy = memory->hierarchy;
+        } else {
+            Mat canny_output;
+            /// Detect edges using canny
+            Canny( governed_input(gray, plan, GOVERNED_CANNY), canny_output,
+                config.canny_thresh, config.canny_thresh*2, 3 );
+            /// Find contours
+            findContours( canny_output, contours, hierarchy, 
+                CV_RETR_TREE, CV_CHAIN_APPROX_SIMPLE, Point(0, 0) );
+            int scale = plan ? plan->downscale[GOVERNED_CANNY] : 1;
+            for (size_t i = 0; scale > 1 && i < contours.size(); i++){
+                for (size_t j = 0; j < contours[i].size(); j++)
+                    contours[i][j] *= scale;
+            }
+            if (memory){
+                memory->contours = contours;
+                memory->hierarchy = hierarchy;
+                memory->has_contours = true;
+            }
+        }
+    }
+    filter_stage_done(timing, FILTER_STAGE_CANNY, stage_start);
+    if (config.apply_threshold){
+        threshold( gray, gray2, config.threshold_val, 255, THRESH_BINARY );
+    } else if (apply_sobel && plan && !plan->run[GOVERNED_SOBEL] && memory &&
+            memory->sobel.size() == frame.size()){
+        gray2 = memory->sobel;
+    } else if (apply_sobel){
+        Mat grad_x, grad_y;
+        Mat abs_grad_x, abs_grad_y;
+        Mat blurred;
+        if (plan && plan->downscale[GOVERNED_SOBEL] > 1){
+            blurred = governed_input(gray, plan, GOVERNED_SOBEL);
+        } else {
+            // in place, as b&w has always shown it blurred with sobel on
+            blurred = gray;
+        }
+        // blur first
+        GaussianBlur( blurred, blurred, cv::Size(3,3), 0, 0, BORDER_DEFAULT );
+        // Gradient X
+        Sobel( blurred, grad_x, CV_16S, 1, 0, 3, 1, 0, BORDER_DEFAULT );
+        convertScaleAbs( grad_x, abs_grad_x );
+        // Gradient Y
+        Sobel( blurred, grad_y, CV_16S, 0, 1, 3, 1, 0, BORDER_DEFAULT );
+        convertScaleAbs( grad_y, abs_grad_y );
+        if (blurred.size() != frame.size()){
+            Mat small;
+            addWeighted( abs_grad_x, 0.5, abs_grad_y, 0.5, 0, small );
+            resize(small, gray2, frame.size(), 0, 0, INTER_LINEAR);
+        } else {
+            addWeighted( abs_grad_x, 0.5, abs_grad_y, 0.5, 0, gray2 );
+        }
+        if (memory)
+            memory->sobel = gray2.clone();
+    }
+    filter_stage_done(timing, FILTER_STAGE_THRESHOLD_SOBEL, stage_start);
+
+    // if not drawing main image, then clear it out.
+    if (!config.draw_main_image)
+        frame = Mat::zeros(frame.size(), frame.type());
+
+    if (config.apply_threshold)
+        cvtColor(gray2, frame, CV_GRAY2BGR);
+    else if (config.black_and_white)
+        cvtColor(gray, frame, CV_GRAY2BGR);
+    else if (apply_sobel){
+        Mat tmpgray;
+        cvtColor(gray2, tmpgray, CV_GRAY2BGR);
+        addWeighted( tmpgray, 0.5, frame, 0.5, 0, frame );
+    }
+    filter_stage_done(timing, FILTER_STAGE_COMPOSE, stage_start);
+
+    if (apply_features)
+        // Add results to image and save.
+        cv::drawKeypoints(frame, keypoints, frame);
+    if (apply_canny){
+        /// Draw contours
+        for( int i = 0; i< contours.size(); i++ ){
+            Scalar color = Scalar( color_rng.uniform(0, 255), color_rng.uniform(0,255), color_rng.uniform(0,255) );
+            drawContours( frame, contours, i, color, 2, 8, hierarchy, 0, Point() );
+        }
+    }
+    filter_stage_done(timing, FILTER_STAGE_DRAW, stage_start);
+}
+
+/* #########################################################################
+    
+                                batch mode
+        Headless: runs the filter chain over every frame of some video
+        files / recordings, several frames at once on a thread pool,
+        and reports where the time went. Usage in run_batch.
+
+   ######################################################################### */
+static const char * filter_stage_names[NUM_FILTER_STAGES] = {
+    "features", "gray", "canny", "thresh/sobel", "compose", "draw"
+};
+
+// one chunk of decoded frames, filtered in place by batch_band
+typedef struct _batch_job_t {
+    vector<Mat> * frames;
+    vector<filter_timing_t> * timings;
+    vector<double> * frame_ms;
+    filter_config_t * config;
+    // index of frames[0] in its sequence
+    int first_frame;
+} batch_job_t;
+
+static void batch_band(void * arg, int start, int end){
+    batch_job_t * job = (batch_job_t *) arg;
+    for (int i = start; i < end; i++){
+        // seeded by frame, so output doesn't depend on which thread
+        //  got the frame
+        RNG color_rng(12345 + job->first_frame + i);
+        double t0 = get_time_ms();
+        apply_filters((*job->frames)[i], *job->config, color_rng, &(*job->timings)[i]);
+        (*job->frame_ms)[i] = get_time_ms() - t0;
+    }
+}
+
+static void batch_sequence(Capture_Source * source, filter_config_t& config,
+                           Thread_Pool * pool, int chunk, const char * out_file,
+                           batch_stats_t& stats){
+    vector<Mat> frames(chunk);
+    vector<filter_timing_t> timings(chunk);
+    vector<double> frame_ms(chunk);
+    VideoWriter writer;
+    int frame_num = 0;
+
+    while (true){
+        // decode is sequential; the capture backends aren't thread safe
+        double t0 = get_time_ms();
+        int n = 0;
+        Mat frame;
+        while (n < chunk && source->grab() && source->retrieve(frame)){
+            // the source owns (or maps read only) what it hands out
+            frame.copyTo(frames[n]);
+            n++;
+        }
+        stats.decode_ms += get_time_ms() - t0;
+        if (n == 0)
+            break;
+
+        batch_job_t job;
+        job.frames = &frames;
+        job.timings = &timings;
+        job.frame_ms = &frame_ms;
+        job.config = &config;
+        job.first_frame = frame_num;
+        t0 = get_time_ms();
+        if (pool)
+            pool->parallel_for(n, batch_band, &job, 1);
+        else
+            batch_band(&job, 0, n);
+        stats.filter_wall_ms += get_time_ms() - t0;
+
+        for (int i = 0; i < n; i++){
+            for (int s = 0; s < NUM_FILTER_STAGES; s++){
+                stats.stage_total_ms[s] += timings[i].stage_ms[s];
+                if (timings[i].stage_ms[s] > stats.stage_max_ms[s])
+                    stats.stage_max_ms[s] = timings[i].stage_ms[s];
+            }
+            stats.frame_total_ms += frame_ms[i];
+            if (frame_ms[i] > stats.frame_max_ms)
+                stats.frame_max_ms = frame_ms[i];
+        }
+
+        if (out_file){
+            t0 = get_time_ms();
+            if (!writer.isOpened() &&
+                    !writer.open(out_file, CV_FOURCC('M','J','P','G'), 30, frames[0].size())){
+                printf("Batch: couldn't open %s for writing\n", out_file);
+                out_file = NULL;
+            }
+            for (int i = 0; out_file && i < n; i++)
+                writer.write(frames[i]);
+            stats.write_ms += get_time_ms() - t0;
+        }
+        frame_num += n;
+    }
+    stats.frames += frame_num;
+    stats.sequences++;
+}
+
+static void print_batch_report(FILE * f, batch_stats_t& stats){
+    int frames = stats.frames > 0 ? stats.frames : 1;
+    fprintf(f, "Batch: %d frames in %d sequences, %d threads, %d frames in flight\n",
+        stats.frames, stats.sequences, stats.threads, stats.chunk);
+    fprintf(f, "  total     %9.1f ms  %7.1f fps\n", stats.wall_ms,
+        stats.frames * 1000.0 / (stats.wall_ms > 0 ? stats.wall_ms : 1));
+    fprintf(f, "  decode    %9.1f ms  %7.3f ms/frame\n", stats.decode_ms,
+        stats.decode_ms / frames);
+    fprintf(f, "  filter    %9.1f ms  %7.3f ms/frame wall, %7.1f fps\n",
+        stats.filter_wall_ms, stats.filter_wall_ms / frames,
+        stats.frames * 1000.0 / (stats.filter_wall_ms > 0 ? stats.filter_wall_ms : 1));
+    fprintf(f, "  write     %9.1f ms  %7.3f ms/frame\n", stats.write_ms,
+        stats.write_ms / frames);
+    fprintf(f, "  per frame, on one thread:      mean ms    max ms   share\n");
+    for (int s = 0; s < NUM_FILTER_STAGES; s++){
+        fprintf(f, "    %-14s %16.3f %9.3f %6.1f%%\n", filter_stage_names[s],
+            stats.stage_total_ms[s] / frames, stats.stage_max_ms[s],
+            stats.frame_total_ms > 0 ? 100.0 * stats.stage_total_ms[s] / stats.frame_total_ms : 0.0);
+    }
+    fprintf(f, "    %-14s %16.3f %9.3f\n", "whole chain",
+        stats.frame_total_ms / frames, stats.frame_max_ms);
+}
+
+static bool parse_batch_filters(const char * list, filter_config_t& config){
+    string all(list);
+    size_t pos = 0;
+    while (pos <= all.size()){
+        size_t comma = all.find(',', pos);
+        if (comma == string::npos)
+            comma = all.size();
+        string name = all.substr(pos, comma - pos);
+        if (name == "bw") config.black_and_white = true;
+        else if (name == "threshold") config.apply_threshold = true;
+        else if (name == "sobel") config.apply_sobel = true;
+        else if (name == "canny") config.apply_canny_contours = true;
+        else if (name == "features") config.apply_features = true;
+        else if (name == "fast" || name == "orb"){
+            config.apply_features = true;
+            config.feature_detector = name == "fast" ? FEATURE_DETECTOR_FAST : FEATURE_DETECTOR_ORB;
+        }
+        else if (name == "noimage") config.draw_main_image = false;
+        else if (!name.empty()){
+            printf("Batch: unknown filter %s\n", name.c_str());
+            return false;
+        }
+        pos = comma + 1;
+    }
+    return true;
+}
+
+int run_batch(int argc, char* argv[]){
+    filter_config_t config = current_filter_config();
+    // the motion detector needs frames in order, one at a time
+    config.apply_reichardt = false;
+    char * out_prefix = NULL;
+    int num_threads = 0;
+    int chunk = 0;
+    vector<string> inputs;
+    for (int i = 0; i < argc; i++){
+        if (strcmp(argv[i], "-out") == 0 && i+1 < argc)
+            out_prefix = argv[++i];
+        else if (strcmp(argv[i], "-filters") == 0 && i+1 < argc){
+            if (!parse_batch_filters(argv[++i], config))
+                return -1;
+        } else if (strcmp(argv[i], "-threshold") == 0 && i+1 < argc)
+            config.threshold_val = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-canny") == 0 && i+1 < argc)
+            config.canny_thresh = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-threads") == 0 && i+1 < argc)
+            num_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-chunk") == 0 && i+1 < argc)
+            chunk = atoi(argv[++i]);
+        else if (argv[i][0] != '-')
+            inputs.push_back(argv[i]);
+        else {
+            printf("Batch: unknown option %s\n", argv[i]);
+            inputs.clear();
+            break;
+        }
+    }
+    if (inputs.empty()){
+        printf("Usage: webcam_feedthrough -batch [options] <video or .rec> ...\n"
+               "    -out <prefix>      write <prefix>_<n>.avi per sequence, and\n"
+               "                       <prefix>_timing.txt\n"
+               "    -filters <list>    comma separated: bw,threshold,sobel,canny,\n"
+               "                       features,fast,orb,noimage (features is STAR)\n"
+               "    -threshold <n>     threshold value (default %d)\n"
+               "    -canny <n>         canny threshold (default %d)\n"
+               "    -threads <n>       worker threads, 0 = every core (default)\n"
+               "    -chunk <n>         frames decoded per batch (default 4 per thread)\n",
+               threshold_val, canny_thresh);
+        return 0;
+    }
+
+    if (num_threads <= 0)
+        num_threads = get_num_cores();
+    Thread_Pool * pool = num_threads > 1 ? new Thread_Pool(num_threads - 1) : NULL;
+    if (chunk <= 0)
+        chunk = 4 * num_threads;
+
+    batch_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.threads = num_threads;
+    stats.chunk = chunk;
+    double start = get_time_ms();
+    char suffix[32];
+    string out_file;
+    for (int i = 0; i < (int) inputs.size(); i++){
+        const string& name = inputs[i];
+        // recordings hold one sequence per camera stream
+        bool is_rec = name.size() > 4 && name.compare(name.size() - 4, 4, ".rec") == 0;
+        Stereo_Replay file_replay;
+        int num_sequences = 1;
+        if (is_rec){
+            if (!file_replay.open(name))
+                continue;
+            num_sequences = file_replay.num_streams();
+        }
+        for (int seq = 0; seq < num_sequences; seq++){
+            Capture_Source * source;
+            if (is_rec)
+                source = new Replay_Capture_Source(&file_replay, seq, false, false);
+            else
+                source = new Video_File_Source(name);
+            if (source->is_open()){
+                if (out_prefix){
+                    sprintf(suffix, "_%d.avi", stats.sequences);
+                    out_file = string(out_prefix) + suffix;
+                }
+                printf("Batch: %s", name.c_str());
+                if (is_rec)
+                    printf(" stream %d", seq);
+                printf("\n");
+                batch_sequence(source, config, pool, chunk, out_prefix ? out_file.c_str() : NULL, stats);
+            }
+            delete source;
+        }
+    }
+    stats.wall_ms = get_time_ms() - start;
+    delete pool;
+
+    print_batch_report(stdout, stats);
+    if (out_prefix){
+        out_file = string(out_prefix) + "_timing.txt";
+        FILE * f = fopen(out_file.c_str(), "w");
+        if (f){
+            print_batch_report(f, stats);
+            fclose(f);
+        }
+    }
+    return 0;
+}
+
 /* #########################################################################
     
                                 glut_idle
@@ -618,6 +1886,14 @@ void normal_key_handler(unsigned char key, int x, int y) {
         case 'f':
             apply_features = !apply_features;
             break;
+        case 'F':
+            feature_detector = (feature_detector_t) ((feature_detector + 1) % NUM_FEATURE_DETECTORS);
+            printf("Feature detector %s\n", feature_detector_name(feature_detector));
+            break;
+        case 'T':
+            feature_tracking = !feature_tracking;
+            printf("Feature tracking %s\n", feature_tracking ? "on" : "off");
+            break;
         case 'r':
             apply_reichardt = !apply_reichardt;
             break;
@@ -642,45 +1918,156 @@ void normal_key_handler(unsigned char key, int x, int y) {
             printf("Canny threshold val %d\n", canny_thresh);
             break;
         case '<':
-            if (l_capture_num > 0)
-                l_capture_num-=1;
-            l_capture = cvCaptureFromCAM(l_capture_num); 
-            cvSetCaptureProperty(l_capture, CV_CAP_PROP_EXPOSURE, exposure_num);
-            printf("Capture num %d\n", l_capture_num);
+            if (want_l_capture_num > 0)
+                want_cameras(want_l_capture_num - 1, want_r_capture_num);
+            printf("Capture num %d\n", want_l_capture_num);
             break;
         case '>':
-            l_capture_num++;
-            l_capture = cvCaptureFromCAM(l_capture_num); 
-            cvSetCaptureProperty(l_capture, CV_CAP_PROP_EXPOSURE, exposure_num);
-            printf("Capture num %d\n", l_capture_num);
+            want_cameras(want_l_capture_num + 1, want_r_capture_num);
+            printf("Capture num %d\n", want_l_capture_num);
             break;
         case ',':
-            if (r_capture_num > 0)
-                r_capture_num-=1;
-            r_capture = cvCaptureFromCAM(r_capture_num); 
-            cvSetCaptureProperty(r_capture, CV_CAP_PROP_EXPOSURE, exposure_num);
-            printf("Capture num %d\n", r_capture_num);
+            if (want_r_capture_num > 0)
+                want_cameras(want_l_capture_num, want_r_capture_num - 1);
+            printf("Capture num %d\n", want_r_capture_num);
             break;
         case '.':
-            r_capture_num++;
-            r_capture = cvCaptureFromCAM(r_capture_num); 
-            cvSetCaptureProperty(r_capture, CV_CAP_PROP_EXPOSURE, exposure_num);
-            printf("Capture num %d\n", r_capture_num);
+            want_cameras(want_l_capture_num, want_r_capture_num + 1);
+            printf("Capture num %d\n", want_r_capture_num);
             break;
         case '(':
             exposure_num--;
-            cvSetCaptureProperty(l_capture, CV_CAP_PROP_EXPOSURE, exposure_num);
-            cvSetCaptureProperty(r_capture, CV_CAP_PROP_EXPOSURE, exposure_num);
+            if (l_capture)
+                l_capture->set_exposure(exposure_num);
+            if (r_capture && r_capture != l_capture)
+                r_capture->set_exposure(exposure_num);
             printf("Exposure num: %d\n", exposure_num);
             break;
         case ')':
             exposure_num++;
-            cvSetCaptureProperty(l_capture, CV_CAP_PROP_EXPOSURE, exposure_num);
-            cvSetCaptureProperty(r_capture, CV_CAP_PROP_EXPOSURE, exposure_num);
+            if (l_capture)
+                l_capture->set_exposure(exposure_num);
+            if (r_capture && r_capture != l_capture)
+                r_capture->set_exposure(exposure_num);
             printf("Exposure num: %d\n", exposure_num);
+            break;
 
         case 'k':
             show_kinect = !show_kinect;
+            if (kinect_manager){
+                if (show_kinect)
+                    kinect_manager->start();
+                else
+                    kinect_manager->stop();
+            } else if (show_kinect)
+                kinect_stream->start();
+            else
+                kinect_stream->stop();
+            break;
+        case 'K':
+            // fusion tracks one Kinect's stream; the manager's merge has
+            //  no single one to give it
+            if (kinect_manager){
+                printf("Kinect fusion only runs with a single kinect\n");
+                break;
+            }
+            if (kinect_fusion){
+                delete kinect_fusion;
+                kinect_fusion = NULL;
+                printf("Kinect fusion off\n");
+            } else {
+                kinect_fusion = new Kinect_Fusion();
+                printf("Kinect fusion on%s\n", show_kinect ? "" : " (k to start the kinect)");
+            }
+            break;
+        case 'M':
+            // points, mesh, decimated mesh
+            kinect_cloud->set_mode((kinect_cloud_mode_t) ((kinect_cloud->mode() + 1) % 3));
+            printf("Kinect drawn as %s\n",
+                kinect_cloud->mode() == KINECT_CLOUD_POINTS ? "points" :
+                kinect_cloud->mode() == KINECT_CLOUD_MESH ? "a mesh" : "a decimated mesh");
+            break;
+        case 'N':
+            if (kinect_manager){
+                printf("Kinect depth filtering only runs with a single kinect\n");
+                break;
+            }
+            filter_kinect = !filter_kinect;
+            // a stale average would blend into whatever's there now
+            depth_filter->reset();
+            printf("Kinect depth filtering %s\n", filter_kinect ? "on" : "off");
+            break;
+        case 'O':
+            // start scanning the room, or finish and draw the scan
+            if (!octree_builder){
+                // the file's about to be rewritten
+                point_octree->close();
+                octree_builder = new Point_Octree_Builder();
+                if (octree_builder->begin(octree_file)){
+                    printf("Scanning into %s%s\n", octree_file.c_str(),
+                        show_kinect ? "" : " (k to start the kinect)");
+                } else {
+                    delete octree_builder;
+                    octree_builder = NULL;
+                }
+            } else if (octree_builder->collecting()){
+                // built off the GL thread; glut_display opens it once
+                //  it's done
+                printf("Building %s...\n", octree_file.c_str());
+                octree_builder->finish_async();
+            } else {
+                printf("Still building %s\n", octree_file.c_str());
+            }
+            break;
+        case 'o':
+            show_octree = !show_octree;
+            printf("Scan %s\n", show_octree ? "shown" : "hidden");
+            break;
+        case 'J':
+            if (kinect_fusion){
+                kinect_fusion->reset();
+                printf("Kinect fusion model reset\n");
+            }
+            break;
+        case 'u':
+            rectify_cameras = !rectify_cameras;
+            printf("Rectify cameras %s%s\n", rectify_cameras ? "on" : "off",
+                stereo_calib->is_calibrated() ? "" : " (no calibration loaded)");
+            break;
+        case 'G':
+            frame_governor->set_enabled(!frame_governor->enabled());
+            printf("Frame governor %s (%0.1fms budget)\n",
+                frame_governor->enabled() ? "on" : "off", frame_governor->budget_ms());
+            break;
+        case 'W':
+            timewarp = !timewarp;
+            printf("Timewarp %s\n", timewarp ? "on" : "off");
+            break;
+        case 'l':
+            printf("Frame latency:\n%s", latency_tracker->report().c_str());
+            printf("Blink latency: %s, %d missed\n",
+                blink_probe->results().summary("glass to glass").c_str(),
+                blink_probe->misses());
+            latency_tracker->clear();
+            break;
+        case 'L':
+            if (blink_probe->active())
+                blink_probe->stop();
+            else
+                blink_probe->start();
+            printf("Blink latency probe %s\n", blink_probe->active() ? "on" : "off");
+            break;
+        case 'd':
+            stereo_mode = (stereo_mode + 1) % NUM_STEREO_MODES;
+            stereo_has_output = false;
+            stereo_seq[0] = stereo_seq[1] = 0;
+            printf("Stereo mode %d\n", stereo_mode);
+            break;
+        case 'D':
+            stereo_depth->set_level((stereo_depth->get_level() + 1) % 3);
+            stereo_seq[0] = stereo_seq[1] = 0;
+            printf("Stereo level %d\n%s", stereo_depth->get_level(),
+                stereo_depth->get_stats_string().c_str());
             break;
         case 'q':
             z_pos += 5.0;
@@ -765,8 +2152,32 @@ void motion(int x, int y){
    ######################################################################### */    
 void cleanup(){
     printf("Exiting...\n");
-    cvReleaseCapture( &l_capture );
-    cvReleaseCapture( &r_capture );
+    // finishes the file's index, so do it first
+    if (recorder)
+        recorder->close();
+    close_cameras();
+    // closes the warm ones too
+    delete camera_pool;
+    // closes the kinect, if it's open
+    delete kinect_stream;
+    // joins the device threads, which close theirs
+    delete kinect_manager;
+    delete kinect_fusion;
+    delete depth_filter;
+    // throws away an unfinished scan's spill
+    delete octree_builder;
+    delete point_octree;
+    delete octree_to_xyz;
+    delete replay;
+    for (map<int, camera_cache_t>::iterator it = camera_caches.begin();
+            it != camera_caches.end(); it++){
+        delete it->second.yuv;
+        delete it->second.stream;
+        delete it->second.tracker;
+        delete it->second.reichardt;
+        delete it->second.filter_memory;
+    }
+    printf("Frame latency:\n%s", latency_tracker->report().c_str());
 }
 
 
@@ -805,45 +2216,90 @@ void ConvertMatToTexture(Mat * image, GLuint texture)
   glTexEnvf(GL_TEXTURE_ENV,GL_TEXTURE_ENV_MODE,GL_DECAL);
   glTexParameterf(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR);
   glTexParameterf(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
-  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, (image->step & 3) ? 1 : 4);
   //glTexParameterf(GL_TEXTURE_2D,GL_TEXTURE_WRAP_S,GL_REPEAT);
   //glTexParameterf(GL_TEXTURE_2D,GL_TEXTURE_WRAP_T,GL_REPEAT);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image->size().width,
-    image->size().height,0, GL_BGR, GL_UNSIGNED_BYTE, image->ptr());
+  if (image->channels() == 1)
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, image->size().width,
+      image->size().height,0, GL_LUMINANCE, GL_UNSIGNED_BYTE, image->ptr());
+  else
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image->size().width,
+      image->size().height,0, GL_BGR, GL_UNSIGNED_BYTE, image->ptr());
   //gluBuild2DMipmaps(GL_TEXTURE_2D,3,image.size().width,image.size().height,
   //                  GL_BGR,GL_UNSIGNED_BYTE,image.ptr());
 }
 
-// Do the projection from u,v,depth to X,Y,Z directly in an opengl matrix
-// These numbers come from a combination of the ros kinect_node wiki, and
-// nicolas burrus' posts.
-//  -- freenect examples
-void LoadVertexMatrix()
-{
-    float fx = 594.21f;
-    float fy = 591.04f;
-    float a = -0.0030711f;
-    float b = 3.3309495f;
-    float cx = 339.5f;
-    float cy = 242.7f;
-    GLfloat mat[16] = {
-        1/fx,     0,  0, 0,
-        0,    -1/fy,  0, 0,
-        0,       0,  0, a,
-        -cx/fx, cy/fy, -1, b
-    };
-    glMultMatrixf(mat);
-}
-// This matrix comes from a combination of nicolas burrus's calibration post
-// and some python code I haven't documented yet.
-//  -- freenect examples
-void LoadRGBMatrix()
-{
-    float mat[16] = {
-        5.34866271e+02,   3.89654806e+00,   0.00000000e+00,   1.74704200e-02,
-        -4.70724694e+00,  -5.28843603e+02,   0.00000000e+00,  -1.22753400e-02,
-        -3.19670762e+02,  -2.60999685e+02,   0.00000000e+00,  -9.99772000e-01,
-        -6.98445586e+00,   3.31139785e+00,   0.00000000e+00,   1.09167360e-02
-    };
-    glMultMatrixf(mat);
+/* #########################################################################
+    
+                             draw_passthrough_quad
+                                            
+        -Draws a texture on the head-locked quad at render_dist.
+   ######################################################################### */   
+void draw_passthrough_quad(GLuint texture, GLint env_mode){
+    glEnable(GL_TEXTURE_2D);
+    // 0: whatever's already bound (e.g. by a Yuv_Frame_Texture)
+    if (texture)
+        glBindTexture(GL_TEXTURE_2D, texture);
+    glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, env_mode);
+    glPushMatrix();
+    glLoadIdentity();
+    glMultMatrixf(passthrough_warp);
+    glTranslatef(0.0, 0.0, -1.0*render_dist);
+    glBegin(GL_POLYGON);
+    glTexCoord2f(0, 0);
+    glVertex3f(-1, 1, 0);
+    
+    glTexCoord2f(0, 1);
+    glVertex3f(-1, -1, 0);
+    
+    glTexCoord2f(1, 1);
+    glVertex3f(1, -1, 0);
+    
+    glTexCoord2f(1, 0);
+    glVertex3f(1, 1, 0);
+    glEnd();
+    glDisable(GL_TEXTURE_2D);
+    glPopMatrix();
+}
+
+/* #########################################################################
+    
+                               draw_camera_quad
+                                            
+        -draw_passthrough_quad for camera images, undistorted and
+            rectified on the way through remap's lookup if it's given.
+   ######################################################################### */   
+void draw_camera_quad(GLuint texture, GLint env_mode, Remap_Texture * remap){
+    if (!remap){
+        draw_passthrough_quad(texture, env_mode);
+        return;
+    }
+    remap->begin(texture, env_mode == GL_MODULATE);
+    draw_passthrough_quad(0, env_mode);
+    remap->end();
+}
+
+/* #########################################################################
+    
+                            update_passthrough_warp
+                                            
+        -The quad is head-locked, so a frame captured with the head
+            pointing one way and shown with it pointing another is
+            off by the turn in between. Rotating the quad by that turn
+            (capture pose, into the pose this eye is drawn for) puts
+            it back where it belongs; the rotation's all that's
+            corrected, which is most of what the eye notices.
+   ######################################################################### */   
+void update_passthrough_warp(camera_cache_t * cache){
+    orientation_t delta = orientation_identity();
+    if (timewarp && cache->has_capture_orientation){
+        // display^-1 * capture, as a GL matrix: quat_to_matrix gives
+        //  the inverse of the rotation it's handed
+        delta = orientation_delta(cache->capture_orientation,
+                                  rift_manager->which_eye_orientation());
+        // tracking glitch, or a frame from long ago: leave it be
+        if (orientation_angle(delta) > 30.0f * M_PI / 180.0f)
+            delta = orientation_identity();
+    }
+    quat_to_matrix(&delta.x, passthrough_warp);
 }
\ No newline at end of file
@@ -10,6 +10,8 @@
 #include <time.h>
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include <map>
+#include <vector>
 
 // OpenGL and friends
 #include "../include/GL/glew.h"
@@ -24,8 +26,159 @@
 #include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/highgui/highgui.hpp"
 
+#include "../common/latency.h"
+#include "../common/head_pose.h"
+
 namespace xen_rift {
 
+    class Reichardt_Array;
+    class Feature_Tracker;
+    class Yuv_Frame_Texture;
+    class Stream_Texture;
+    class Remap_Texture;
+
+    // Snapshot of every toggle / threshold that changes what the filter
+    // chain produces for a frame. Part of the processing cache key.
+    typedef struct _filter_config_t {
+        bool draw_main_image;
+        bool black_and_white;
+        bool apply_threshold;
+        bool apply_sobel;
+        bool apply_canny_contours;
+        bool apply_features;
+        bool apply_reichardt;
+        int threshold_val;
+        int canny_thresh;
+        // a feature_detector_t
+        int feature_detector;
+        // detect now and then, track with LK in between
+        bool feature_tracking;
+
+        bool operator==(const struct _filter_config_t& o) const {
+            return draw_main_image == o.draw_main_image &&
+                   black_and_white == o.black_and_white &&
+                   apply_threshold == o.apply_threshold &&
+                   apply_sobel == o.apply_sobel &&
+                   apply_canny_contours == o.apply_canny_contours &&
+                   apply_features == o.apply_features &&
+                   apply_reichardt == o.apply_reichardt &&
+                   threshold_val == o.threshold_val &&
+                   canny_thresh == o.canny_thresh &&
+                   feature_detector == o.feature_detector &&
+                   feature_tracking == o.feature_tracking;
+        }
+        bool operator!=(const struct _filter_config_t& o) const {
+            return !(*this == o);
+        }
+    } filter_config_t;
+
+    // Stages of the filter chain, for timing it
+    typedef enum _filter_stages {
+        FILTER_STAGE_FEATURES=0,
+        FILTER_STAGE_GRAY=1,
+        FILTER_STAGE_CANNY=2,
+        FILTER_STAGE_THRESHOLD_SOBEL=3,
+        FILTER_STAGE_COMPOSE=4,
+        FILTER_STAGE_DRAW=5,
+        NUM_FILTER_STAGES=6
+    } filter_stages;
+
+    // ms spent in each stage by one run of the filter chain
+    typedef struct _filter_timing_t {
+        double stage_ms[NUM_FILTER_STAGES];
+    } filter_timing_t;
+
+    // The expensive stages the frame governor can turn down; also
+    //  their task ids with it, so in the order they're added
+    typedef enum _governed_filters {
+        GOVERNED_CANNY=0,
+        GOVERNED_FEATURES=1,
+        GOVERNED_SOBEL=2,
+        NUM_GOVERNED_FILTERS=3
+    } governed_filters;
+
+    // How to run each governed stage for one frame
+    typedef struct _filter_plan_t {
+        // work on the image shrunk by this much
+        int downscale[NUM_GOVERNED_FILTERS];
+        // false: reuse the stage's last result, from filter_memory_t
+        bool run[NUM_GOVERNED_FILTERS];
+        // false: skip the stage entirely
+        bool enabled[NUM_GOVERNED_FILTERS];
+    } filter_plan_t;
+
+    // A camera's last results from the governed stages, in full
+    //  resolution coordinates, for frames that skip running them
+    typedef struct _filter_memory_t {
+        std::vector<std::vector<cv::Point> > contours;
+        std::vector<cv::Vec4i> hierarchy;
+        bool has_contours;
+        std::vector<cv::KeyPoint> keypoints;
+        bool has_keypoints;
+        cv::Mat sobel;
+    } filter_memory_t;
+
+    // totals over a batch run
+    typedef struct _batch_stats_t {
+        int frames;
+        int sequences;
+        int threads;
+        // frames decoded and filtered together
+        int chunk;
+        double wall_ms;
+        double decode_ms;
+        // wall time spent filtering, all threads together
+        double filter_wall_ms;
+        double write_ms;
+        // per-thread time, summed over frames
+        double stage_total_ms[NUM_FILTER_STAGES];
+        double stage_max_ms[NUM_FILTER_STAGES];
+        double frame_total_ms;
+        double frame_max_ms;
+    } batch_stats_t;
+
+    // Per-camera processing cache. A camera's frame is grabbed once per
+    // display pass (bumping grab_seq); the first eye to draw it runs the
+    // filter chain and uploads the result into texture, and any later
+    // draw with the same (camera, grab_seq, config) just rebinds it.
+    typedef struct _camera_cache_t {
+        unsigned long grab_seq;
+        unsigned long processed_seq;
+        filter_config_t processed_config;
+        bool processed_valid;
+        // false if the last processing pass had nothing to show
+        bool has_output;
+        // size of the frame it came from, in pixels
+        int output_width;
+        int output_height;
+        GLuint texture;
+        // texture holds a single luma channel rather than BGR
+        bool output_luma;
+        // unfiltered frames skip the CPU entirely: the camera's YUV
+        //  goes up as is and the shader converts it
+        bool output_yuv;
+        Yuv_Frame_Texture * yuv;
+        // unfiltered BGR frames, through a PBO rather than a fresh
+        //  glTexImage2D every frame
+        bool output_stream;
+        Stream_Texture * stream;
+        // motion layer: stateful, so it lives with its camera
+        Reichardt_Array * reichardt;
+        // feature tracking state, likewise
+        Feature_Tracker * tracker;
+        // last results of filters the governor has slowed down
+        filter_memory_t * filter_memory;
+        bool has_overlay;
+        GLuint overlay_texture;
+        // stage stamps of the frame last grabbed; pending once it's
+        //  uploaded, until the EndFrame that shows it is stamped too
+        frame_latency_t latency;
+        bool latency_pending;
+        // where the head was pointing as that frame was captured
+        orientation_t capture_orientation;
+        bool has_capture_orientation;
+    } camera_cache_t;
+
 };
 
 #endif //__WEBCAM_FEEDTHROUGH_H
\ No newline at end of file